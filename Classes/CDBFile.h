@@ -25,7 +25,7 @@
 
 #import <Foundation/Foundation.h>
 #import "cdb.h"
-@class CDBEnumerator;
+@class CDBEnumerator, CDBStackReader;
 
 /** @file */
 // @{
@@ -146,6 +146,56 @@ NSString* CDBToNSString( CDBData );
     a tag byte, without having to copy the tag and value into a temporary buffer. */
 - (BOOL) addValuePointers: (const CDBData[])values count: (unsigned)count forKey: (CDBData)key;
 
+/** Copies a run of records from an open CDBReader, from file offset start up to end.
+    This has the same effect as adding each of them with addValuePointer:forKey:, but the
+    data is copied from file to file (see cdb_make_copy_range), so unchanged records are
+    cheap to carry over into a new file. The offsets must be at record boundaries, such as
+    the recordStart and recordEnd properties of a CDBEnumerator. */
+- (BOOL) copyRecordsFrom: (CDBReader*)reader start: (cdbo_t)start end: (cdbo_t)end;
+
+/** Writes a tombstone for the key: when the file is used as a layer of a CDBStackReader,
+    the key appears deleted, whatever values the older layers have for it.
+    (Plain CDBReaders see an empty value.) */
+- (BOOL) addTombstoneForKey: (CDBData)key;
+
+/** Writes the records in effect in a CDBStackReader, so that the new file reads the same as
+    the whole stack (see cdb_make_merge). Runs of records are copied as by
+    -copyRecordsFrom:start:end:, while records hidden by newer layers are left out.
+    Tombstones are kept only if keepTombstones is YES, which is needed when the new file is to
+    replace the newest layers of a longer stack, on top of older ones that still have the keys. */
+- (BOOL) mergeStack: (CDBStackReader*)stack keepTombstones: (BOOL)keepTombstones;
+
+@end
+
+
+
+/** Read-only access to a stack of CDB files: a base file with any number of smaller files
+    written on top of it, each holding the keys changed since the one below.
+    A key's value comes from the newest file that has the key, unless it's a tombstone there
+    (see -[CDBWriter addTombstoneForKey:]), in which case the key is deleted. */
+@interface CDBStackReader : NSObject
+{
+    @private
+    NSArray *_readers;
+    const struct cdb **_layers;
+    struct cdb_stack _stack;
+}
+
+/** Creates a CDBStackReader on an array of open CDBReaders, oldest first.
+    The readers must stay open as long as the CDBStackReader is in use. */
+- (id) initWithReaders: (NSArray*)readers;
+
+/** The CDBReaders, oldest first. */
+@property (readonly) NSArray *readers;
+
+/** Returns a pointer to the value associated with the key in the newest file having it,
+    or bytes=NULL and length=0 if there is none or the key has been deleted. */
+- (CDBData) valuePointerForKey: (CDBData)key;
+
+/** Returns an enumerator that will return all of the keys that aren't deleted, each with
+    its value from the newest file having it, in unspecified order. */
+- (CDBEnumerator*) keyEnumerator;
+
 @end
 
 
@@ -157,8 +207,10 @@ NSString* CDBToNSString( CDBData );
     @private
     CDBReader *_db;
     struct cdb *_cdb;
-    unsigned int _seq;
+    cdbo_t _seq, _recordStart;
     CDBData _key, _value;
+    CDBStackReader *_stack;
+    struct cdb_stack_seq _stackSeq;
 }
 
 /** Standard NSEnumerator method; returns the next key copied into an NSData object. */
@@ -182,4 +234,14 @@ NSString* CDBToNSString( CDBData );
     Before the first call to -next or -nextObject, this will point to NULL. */
 @property (readonly) CDBData valuePointer;
 
+/** The file offsets of the start of the current record and of the one after it,
+    for use with -[CDBWriter copyRecordsFrom:start:end:].
+    Records are enumerated in file order, so consecutive records form a contiguous run. */
+@property (readonly) cdbo_t recordStart, recordEnd;
+
+/** The CDBReader that the current record is in: for a CDBStackReader's enumerator, this is
+    the one of its readers that the record comes from. Records of the same reader with
+    adjacent offsets can be copied together. */
+@property (readonly) CDBReader *reader;
+
 @end
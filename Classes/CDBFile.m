@@ -77,6 +77,11 @@ NSString* CDBToNSString( CDBData d )
 
 @interface CDBEnumerator ()
 - (id) initWithCDBReader: (CDBReader*)db;
+- (id) initWithCDBStackReader: (CDBStackReader*)stack;
+@end
+
+@interface CDBStackReader ()
+- (struct cdb_stack*)_stack;
 @end
 
 
@@ -216,10 +221,11 @@ NSString* CDBToNSString( CDBData d )
     NSParameterAssert(key.bytes!=NULL);
     NSAssert(cdb_fileno(&_cdb)>0, @"File is not open");
     CDBData result;
-    int found = cdb_find(&_cdb,key.bytes,(unsigned)key.length);
+    struct cdb_kv kv;
+    int found = cdb_find_r(&_cdb,key.bytes,(unsigned)key.length,&kv);
     if( found > 0 ) {
-        result.bytes = cdb_getdata(&_cdb);
-        result.length = cdb_datalen(&_cdb);
+        result.bytes = cdb_get(&_cdb,kv.cdb_vlen,kv.cdb_vpos);
+        result.length = kv.cdb_vlen;
     } else {
         result.bytes = NULL;
         result.length = 0;
@@ -301,6 +307,110 @@ NSString* CDBToNSString( CDBData d )
     }
 }
 
+- (BOOL) copyRecordsFrom: (CDBReader*)reader start: (cdbo_t)start end: (cdbo_t)end
+{
+    NSAssert(_cdbmake.cdb_fd>0, @"CDBWriter is not open");
+    if( start==end )
+        return YES;
+    NSAssert(reader.isOpen, @"CDBReader is not open");
+    if( cdb_make_copy_range(&_cdbmake, reader._cdb, start, end) == 0 )
+        return YES;
+    else {
+        [self _setErrno: errno];
+        return NO;
+    }
+}
+
+- (BOOL) addTombstoneForKey: (CDBData)key
+{
+    NSParameterAssert(key.bytes!=NULL);
+    NSAssert(_cdbmake.cdb_fd>0, @"CDBWriter is not open");
+    if( cdb_make_tombstone(&_cdbmake, key.bytes, (unsigned)key.length) == 0 )
+        return YES;
+    else {
+        [self _setErrno: errno];
+        return NO;
+    }
+}
+
+- (BOOL) mergeStack: (CDBStackReader*)stack keepTombstones: (BOOL)keepTombstones
+{
+    NSParameterAssert(stack!=nil);
+    NSAssert(_cdbmake.cdb_fd>0, @"CDBWriter is not open");
+    if( cdb_make_merge(&_cdbmake, stack._stack, keepTombstones) == 0 )
+        return YES;
+    else {
+        [self _setErrno: errno];
+        return NO;
+    }
+}
+
+
+@end
+
+
+
+
+@implementation CDBStackReader
+
+
+- (id) initWithReaders: (NSArray*)readers
+{
+    self = [super init];
+    if (self != nil) {
+        _readers = [readers copy];
+        _layers = malloc(MAX(_readers.count,1) * sizeof(*_layers));
+        NSUInteger i = 0;
+        for( CDBReader *reader in _readers ) {
+            NSAssert(reader.isOpen, @"CDBReader is not open");
+            _layers[i++] = reader._cdb;
+        }
+        cdb_stack_init(&_stack, _layers, (unsigned)i);
+    }
+    return self;
+}
+
+- (void) dealloc
+{
+    free(_layers);
+    [_readers release];
+    [super dealloc];
+}
+
+- (void) finalize
+{
+    free(_layers);
+    [super finalize];
+}
+
+
+@synthesize readers=_readers;
+
+
+- (CDBData) valuePointerForKey: (CDBData)key
+{
+    NSParameterAssert(key.bytes!=NULL);
+    CDBData result = {NULL,0};
+    struct cdb_kv kv;
+    const struct cdb *layer;
+    if( cdb_stack_find(&_stack,key.bytes,(unsigned)key.length,&kv,&layer) > 0 ) {
+        result.bytes = cdb_get(layer,kv.cdb_vlen,kv.cdb_vpos);
+        result.length = kv.cdb_vlen;
+    }
+    return result;
+}
+
+
+- (CDBEnumerator*) keyEnumerator
+{
+    return [[[CDBEnumerator alloc] initWithCDBStackReader: self] autorelease];
+}
+
+- (struct cdb_stack*)_stack
+{
+    return &_stack;
+}
+
 
 @end
 
@@ -322,30 +432,52 @@ NSString* CDBToNSString( CDBData d )
     return self;
 }
 
+- (id) initWithCDBStackReader: (CDBStackReader*)stack
+{
+    self = [super init];
+    if (self != nil) {
+        cdb_stack_seqinit(&_stackSeq,stack._stack);
+        _stack = [stack retain];
+    }
+    return self;
+}
+
 - (void) dealloc
 {
     [_db release];
+    [_stack release];
     [super dealloc];
 }
 
 - (BOOL) next
 {
-    if( ! _db )
+    struct cdb_kv kv;
+    int found;
+    if( _stack ) {
+        const struct cdb *layer;
+        found = cdb_stack_seqnext(&_stackSeq,_stack._stack,&kv,&layer);
+        _cdb = (struct cdb*)layer;
+    } else if( _db ) {
+        NSAssert(cdb_fileno(_cdb)>0, @"CDBReader was closed");
+        found = cdb_seqnext_r(&_seq,_cdb,&kv);
+    } else
         return NO;
-    NSAssert(cdb_fileno(_cdb)>0, @"CDBReader was closed");
-    if( cdb_seqnext(&_seq,_cdb) <= 0 ) {
+    if( found <= 0 ) {
         // EOF:
         [_db release];
         _db = nil;
+        [_stack release];
+        _stack = nil;
         _cdb = NULL;
         _value.bytes = _key.bytes = NULL;
         _value.length = _key.length = 0;
         return NO;
     }
-    _value.bytes = cdb_getdata(_cdb);
-    _value.length = cdb_datalen(_cdb);
-    _key.bytes = cdb_getkey(_cdb);
-    _key.length = cdb_keylen(_cdb);
+    _value.bytes = cdb_get(_cdb,kv.cdb_vlen,kv.cdb_vpos);
+    _value.length = kv.cdb_vlen;
+    _key.bytes = cdb_get(_cdb,kv.cdb_klen,kv.cdb_kpos);
+    _key.length = kv.cdb_klen;
+    _recordStart = kv.cdb_kpos - 8;
     return YES;
 }
 
@@ -365,5 +497,22 @@ NSString* CDBToNSString( CDBData d )
     return _key;
 }
 
+- (cdbo_t) recordStart
+{
+    return _recordStart;
+}
+
+- (cdbo_t) recordEnd
+{
+    return _stack ? _stackSeq.cdb_pos : _seq;
+}
+
+- (CDBReader*) reader
+{
+    if( _stack )
+        return [_stack.readers objectAtIndex: _stackSeq.cdb_layer];
+    return _db;
+}
+
 
 @end
@@ -35,6 +35,7 @@ static void CDBFileTest(void)
     NSLog(@"--- Starting CDBFileTest ---");
     NSString * const kDir = @"/Applications/TextEdit.app";
     NSString * const kTempFile = @"/tmp/TextEdit.cdb";
+    NSString * const kCopyFile = @"/tmp/TextEdit-copy.cdb";
     
     NSLog(@"Writing a CDB file...");
     CDBWriter *writer = [[CDBWriter alloc] initWithFile: kTempFile];
@@ -86,6 +87,36 @@ static void CDBFileTest(void)
         }
         [pool drain];
     }
+
+    NSLog(@"Copying the CDB, every other record with copyRecordsFrom:...");
+    CDBWriter *copier = [[CDBWriter alloc] initWithFile: kCopyFile];
+    NSCAssert1( [copier open], @"Failed to open writer: %@", copier.error );
+    CDBEnumerator *e = [reader keyEnumerator];
+    for( n=0; [e next]; n++ ) {
+        BOOL ok;
+        if( n % 2 )
+            ok = [copier copyRecordsFrom: reader start: e.recordStart end: e.recordEnd];
+        else
+            ok = [copier addValuePointer: e.valuePointer forKey: e.keyPointer];
+        NSCAssert1(ok, @"copy failed: %@",copier.error);
+    }
+    NSCAssert1([copier close], @"close failed: %@",copier.error);
+    [copier release];
+
+    NSLog(@"Verifying the copy...");
+    CDBReader *copy = [[CDBReader alloc] initWithFile: kCopyFile];
+    NSCAssert1( [copy open], @"Failed to open reader: %@", copy.error );
+    e = [reader keyEnumerator];
+    while( [e next] ) {
+        CDBData contents = e.valuePointer;
+        CDBData copiedContents = [copy valuePointerForKey: e.keyPointer];
+        NSCAssert2( copiedContents.length == contents.length, @"Expected %u bytes but read %u",
+                  contents.length,copiedContents.length);
+        NSCAssert( memcmp(copiedContents.bytes,contents.bytes,contents.length)==0, @"Copied contents differ");
+    }
+    NSCAssert1([copy close], @"close failed: %@",copy.error);
+    [copy release];
+
     NSCAssert1([reader close], @"close failed: %@",reader.error);
     [reader release];
     NSLog(@"+++ CDBFileTest passed +++");
@@ -137,11 +168,14 @@ static void CDBStoreUpdateTest(void)
     NSLog(@"--- Starting CDBStoreUpdateTest ---");
     NSError *error;
     CDBStore *store = nil;
+    int pass,i;
     unlink("/tmp/test_updates.cdb");
+    for( NSString *name in [[NSFileManager defaultManager] contentsOfDirectoryAtPath: @"/tmp" error: NULL] )
+        if( [name hasPrefix: @"test_updates.cdb."] )
+            unlink([[@"/tmp" stringByAppendingPathComponent: name] fileSystemRepresentation]);
     
     NSMutableDictionary *shadow = [NSMutableDictionary dictionary];
     
-    int pass,i;
     for( pass=0; pass<16; pass++ ) {
         if( ! store ) {
             NSLog(@"Opening store");
@@ -155,6 +189,13 @@ static void CDBStoreUpdateTest(void)
         NSLog(@"Starting pass #%i",pass);
         for( i=0; i < 100; i++ ) {
             NSString *key = [NSString stringWithFormat: @"%u", random()%400];
+            if( i%10 == 9 ) {
+                // Deleted keys get tombstones in the layer files
+                [shadow removeObjectForKey: key];
+                [store setObject: nil forKey: key];
+                NSCAssert([store objectForKey: key]==nil, @"Deleted key still has a value");
+                continue;
+            }
             NSString *value = [NSString stringWithFormat: @"I am the value of key %@ on pass #%i, with random number %u",
                      key,pass,random()];
             [shadow setObject: value forKey: key];
@@ -162,10 +203,19 @@ static void CDBStoreUpdateTest(void)
             NSCAssert([[store objectForKey: key] isEqual: [shadow objectForKey: key]], @"Unexpected value");
         }
         NSCAssert1([store save: &error],@"Save failed: %@",error);
+        // Let background compaction finish, checking the store meanwhile:
+        while( store.isCompacting ) {
+            NSCAssert( [store.allKeysAndValues isEqual: shadow], @"Contents don't match during compaction");
+            [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+                                     beforeDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]];
+        }
+        NSCAssert2(store.layerCount < 2*store.compactionWidth, @"%u layers after pass #%i",
+                   (unsigned)store.layerCount,pass);
         if( pass%4 == 3 ) {
             NSLog(@"Verifying store contents");
             NSCAssert2( [store.allKeysAndValues isEqual: shadow], @"Contents don't match:\nstore = %@\nshadow = %@",
                                                                 store.allKeysAndValues,shadow);
+            NSCAssert(store.bytesRewritten > 0, @"Layers were never compacted");
             NSLog(@"Closing store");
             [store close];
             [store release];
@@ -176,12 +226,147 @@ static void CDBStoreUpdateTest(void)
 }
 
 
+static void CDBStoreLogTest(void)
+{
+    NSLog(@"--- Starting CDBStoreLogTest ---");
+    NSError *error;
+    int pass,i,appends=0,folds=0;
+    for( NSString *name in [[NSFileManager defaultManager] contentsOfDirectoryAtPath: @"/tmp" error: NULL] )
+        if( [name hasPrefix: @"test_log.cdb"] )
+            unlink([[@"/tmp" stringByAppendingPathComponent: name] fileSystemRepresentation]);
+    
+    NSMutableDictionary *shadow = [NSMutableDictionary dictionary];
+    CDBStore *store = [[CDBStringKeyStore alloc] initWithFile: @"/tmp/test_log.cdb"];
+    NSCAssert1( [store open: &error], @"Couldn't open store: %@",error );
+    for( i=0; i<1000; i++ ) {
+        NSString *key = [NSString stringWithFormat: @"%i", i];
+        NSString *value = [NSString stringWithFormat: @"Original value of key %@",key];
+        [shadow setObject: value forKey: key];
+        [store setObject: value forKey: key];
+    }
+    NSCAssert1([store save: &error],@"Save failed: %@",error);
+    
+    for( pass=0; pass<100; pass++ ) {
+        // A few changes at a time are appended to the log, until it gets too big:
+        unsigned long long logSize = store.logSize;
+        NSUInteger layerCount = store.layerCount;
+        for( i=0; i<3; i++ ) {
+            NSString *key = [NSString stringWithFormat: @"%u", random()%1200];
+            NSString *value = nil;
+            if( i != 2 )
+                value = [NSString stringWithFormat: @"Value of key %@ on pass #%i",key,pass];
+            if( value )
+                [shadow setObject: value forKey: key];
+            else
+                [shadow removeObjectForKey: key];
+            [store setObject: value forKey: key];
+        }
+        NSCAssert(store.hasChanges, @"No changes to save");
+        NSCAssert1([store save: &error],@"Save failed: %@",error);
+        NSCAssert(!store.hasChanges && !store.changedKeys, @"Logged changes still unsaved");
+        if( store.logSize > logSize ) {
+            NSCAssert(store.layerCount == layerCount, @"Logged changes were written to a layer");
+            appends++;
+        } else {
+            NSCAssert(store.logSize == 0 && store.layerCount == layerCount+1, @"Log not folded");
+            folds++;
+        }
+        while( store.isCompacting )
+            [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+                                     beforeDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]];
+        
+        if( pass%10 == 9 ) {
+            // Logged changes are replayed, and a torn append at the end is dropped:
+            logSize = store.logSize;
+            [store close];
+            [store release];
+            FILE *log = fopen("/tmp/test_log.cdb.log","a");
+            if( log ) {
+                fwrite("\0\0\1\0garbage",1,11,log);
+                fclose(log);
+            }
+            store = [[CDBStringKeyStore alloc] initWithFile: @"/tmp/test_log.cdb"];
+            NSCAssert1( [store open: &error], @"Couldn't open store: %@",error );
+            NSCAssert(store.logSize == logSize, @"Torn log batch not dropped");
+            NSCAssert(!store.hasChanges, @"Replayed changes count as unsaved");
+            NSCAssert2( [store.allKeysAndValues isEqual: shadow], @"Contents don't match:\nstore = %@\nshadow = %@",
+                       store.allKeysAndValues,shadow);
+        }
+    }
+    NSCAssert2(folds > 0 && appends > 10*folds, @"%i saves appended to the log, %i folded it",
+               appends,folds);
+    [store close];
+    [store release];
+    NSLog(@"--- CDBStoreLogTest Passed ---");
+}
+
+
+static void CDBStoreFoldedLogTest(void)
+{
+    NSLog(@"--- Starting CDBStoreFoldedLogTest ---");
+    NSError *error;
+    int i;
+    for( NSString *name in [[NSFileManager defaultManager] contentsOfDirectoryAtPath: @"/tmp" error: NULL] )
+        if( [name hasPrefix: @"test_folded.cdb"] )
+            unlink([[@"/tmp" stringByAppendingPathComponent: name] fileSystemRepresentation]);
+    
+    CDBStore *store = [[CDBStringKeyStore alloc] initWithFile: @"/tmp/test_folded.cdb"];
+    NSCAssert1( [store open: &error], @"Couldn't open store: %@",error );
+    for( i=0; i<1000; i++ )
+        [store setObject: [NSString stringWithFormat: @"Original value of key %i",i]
+                  forKey: [NSString stringWithFormat: @"%i",i]];
+    NSCAssert1([store save: &error],@"Save failed: %@",error);
+    
+    // Log a change, and keep the log as it is then:
+    [store setObject: @"logged" forKey: @"7"];
+    NSCAssert1([store save: &error],@"Save failed: %@",error);
+    NSCAssert(store.logSize > 0, @"Change not logged");
+    NSData *log = [NSData dataWithContentsOfFile: @"/tmp/test_folded.cdb.log"];
+    NSCAssert(log.length > 0, @"No log file");
+    
+    // Fold a newer value into a layer, which empties the log:
+    [store setObject: @"folded" forKey: @"7"];
+    store.logRatio = 1000000;
+    NSCAssert1([store save: &error],@"Save failed: %@",error);
+    NSCAssert(store.logSize == 0 && store.layerCount == 1, @"Log not folded");
+    while( store.isCompacting )
+        [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+                                 beforeDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]];
+    [store close];
+    [store release];
+    
+    // As if a crash had come before the log was emptied, the folded batch is not replayed:
+    NSCAssert([log writeToFile: @"/tmp/test_folded.cdb.log" atomically: NO], @"Couldn't restore log");
+    store = [[CDBStringKeyStore alloc] initWithFile: @"/tmp/test_folded.cdb"];
+    NSCAssert1( [store open: &error], @"Couldn't open store: %@",error );
+    NSCAssert1([[store objectForKey: @"7"] isEqual: @"folded"], @"Folded value lost: %@",
+               [store objectForKey: @"7"]);
+    NSCAssert(store.logSize == 0 && !store.hasChanges, @"Folded batch kept");
+    
+    // Changes logged after that are replayed as usual:
+    [store setObject: @"logged again" forKey: @"8"];
+    NSCAssert1([store save: &error],@"Save failed: %@",error);
+    NSCAssert(store.logSize > 0, @"Change not logged");
+    [store close];
+    [store release];
+    store = [[CDBStringKeyStore alloc] initWithFile: @"/tmp/test_folded.cdb"];
+    NSCAssert1( [store open: &error], @"Couldn't open store: %@",error );
+    NSCAssert([[store objectForKey: @"8"] isEqual: @"logged again"]
+              && [[store objectForKey: @"7"] isEqual: @"folded"], @"Logged change not replayed");
+    [store close];
+    [store release];
+    NSLog(@"--- CDBStoreFoldedLogTest Passed ---");
+}
+
+
 int main( int argc, const char **argv )
 {
     NSAutoreleasePool *pool = [NSAutoreleasePool new];
     CDBFileTest();
     CDBStoreTest();
     CDBStoreUpdateTest();
+    CDBStoreLogTest();
+    CDBStoreFoldedLogTest();
     [pool drain];
     return 0;
 }
\ No newline at end of file
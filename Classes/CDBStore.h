@@ -53,17 +53,47 @@
     then written. After this completes successfully, the original file is atomically replaced
     with the new file. This guarantees that the file always exists and is valid; if anything
     goes wrong while saving, or the system crashes, the worst that happens is that the latest
-    changes are lost. */
+    changes are lost.
+ 
+    Rewriting the whole file costs time in proportion to the size of the store, however small
+    the changes. So once the file exists, a save usually writes just the changed keys to a
+    small "layer" file next to it (the file's path with ".1", ".2"... appended), with
+    tombstones for deleted keys, and the store reads the file and its layers as a stack (see
+    CDBStackReader.)
+ 
+    Every layer adds a little to the cost of a lookup, so after a save the newest layers of
+    similar size are merged into one on a background thread (named for the saves merged, as
+    in ".5-8"), or into the file itself once the layers add up to a good part of its size.
+    Unchanged runs of records are copied from file to file as they are. The merged file is
+    swapped in on the store's own thread, between lookups, so that they never wait for a
+    compaction; this needs that thread to run its run loop, as autosave does. The layers are
+    only folded into the file by a save if compaction can't keep up.
+ 
+    Even a layer file is a lot to write for a save of a few changes, so a save normally just
+    appends the keys changed since the last one to a change log next to the file (its path with
+    ".log" appended), in one write followed by one fsync: however many changes were made in
+    between, they cost one sequential append. Logged values are replayed into the cache by
+    -open:, and stay there, so the log is kept small: once it would grow past a fraction of
+    the size of the file and its layers (see logRatio), the save writes all the logged changes
+    to a layer instead, and empties the log. */
 
 @interface CDBStore : NSObject
 {
     @private
     NSString *_path;
     CDBReader *_reader;
+    NSMutableArray *_layers;
+    CDBStackReader *_stack;
     NSMutableDictionary *_cache;
-    NSMutableSet *_changedEncodedKeys;
+    NSMutableSet *_changedEncodedKeys, *_loggedEncodedKeys;
     NSTimeInterval _autosaveInterval;
-    BOOL _isOpen, _savingSoon;
+    NSUInteger _nextSave, _generation;
+    NSUInteger _compactionRatio, _compactionWidth;
+    unsigned long long _bytesWritten, _bytesRewritten;
+    int _logFD;
+    unsigned long long _logSize;
+    NSUInteger _logRatio;
+    BOOL _isOpen, _savingSoon, _compacting;
 }
 
 /** Creates a CDBStore that will read from the given file, which must be in CDB format.
@@ -138,13 +168,16 @@
 /** Does the store contain any unsaved changes? */
 @property (readonly) BOOL hasChanges;
 
-/** The set of keys whose values have been added, changed or deleted since the last save. */
+/** The set of keys whose values have been added, changed or deleted since the last save.
+    (Changes saved to the change log are not in it, even though they aren't in a CDB file yet.) */
 @property (readonly) NSSet* changedKeys;
 
 /** Saves the store to its file, if any changes have been made.
     If the file didn't originally exist, this will create it.
-    The file is saved atomically, by creating a new copy and swapping it in.
-    (This is safer, but slower, than a typical database's save-in-place.) */
+    The changes are saved atomically, by appending them to the change log, or by writing them
+    to a new layer file once the log is big enough, or, the first time or if there are too
+    many layers, by creating a new copy of the whole file and swapping it in. (This is safer,
+    but slower, than a typical database's save-in-place.) */
 - (BOOL) save: (NSError**)outError;
 
 /** The time interval after which the store will automatically save changes.
@@ -157,6 +190,41 @@
 - (void) saveSoon;
 
 
+/** @name Compaction and the change log */
+// @{
+
+/** The number of layer files currently on top of the file. */
+@property (readonly) NSUInteger layerCount;
+
+/** Is a compaction running in the background? */
+@property (readonly) BOOL isCompacting;
+
+/** Total size of the files written, and of the changes logged, by -save: so far. */
+@property (readonly) unsigned long long bytesWritten;
+
+/** Total size of the files written by compaction so far. Divided by bytesWritten, this is the
+    write amplification that the compaction policy costs. */
+@property (readonly) unsigned long long bytesRewritten;
+
+/** How many layers of similar size make a compaction. Lower values keep lookups faster, at
+    the cost of rewriting the same records more often. Defaults to 4; values below 2 disable
+    compaction. */
+@property NSUInteger compactionWidth;
+
+/** How much bigger than the one above it a layer (or the file) may be, to count as of similar
+    size. Defaults to 2. */
+@property NSUInteger compactionRatio;
+
+/** How many times smaller than the file and its layers together the change log is kept.
+    Defaults to 8; 0 disables the log, so that every save writes a layer file. */
+@property NSUInteger logRatio;
+
+/** The size of the change log. */
+@property (readonly) unsigned long long logSize;
+
+// }@
+
+
 /** @name For subclasses to override */
 // @{
 
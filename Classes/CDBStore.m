@@ -24,6 +24,9 @@
  */
 
 #import "CDBStore.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 
 #ifndef LogTo
@@ -45,7 +48,7 @@
     BOOL _returnKeys;
 }
 - (id) initWithStore: (CDBStore*)store 
-              reader: (CDBReader*)reader
+               stack: (CDBStackReader*)stack
          changedKeys: (NSSet*)changedEncodedKeys
           returnKeys: (BOOL)returnKeys;
 @end
@@ -57,6 +60,16 @@
 
 static id kDeletedValueMarker;
 
+// Number of layer files on top of the file before a save folds them all back into it;
+// compaction normally keeps the stack well below this
+static const NSUInteger kMaxLayers = 32;
+
+// Default compaction policy: merge at least 4 layers, each at most twice the size of the next
+static const NSUInteger kDefaultCompactionRatio = 2, kDefaultCompactionWidth = 4;
+
+// Default size of the change log, relative to the file and its layers: at most an eighth
+static const NSUInteger kDefaultLogRatio = 8;
+
 + (void) initialize
 {
     // Create a guaranteed-unique object to use as a placeholder value in _cache
@@ -73,6 +86,10 @@ static id kDeletedValueMarker;
     if (self != nil) {
         _path = [name copy];
         _cache = [[NSMutableDictionary alloc] init];
+        _compactionRatio = kDefaultCompactionRatio;
+        _compactionWidth = kDefaultCompactionWidth;
+        _logRatio = kDefaultLogRatio;
+        _logFD = -1;
     }
     return self;
 }
@@ -81,7 +98,10 @@ static id kDeletedValueMarker;
 {
     [_cache release];
     [_changedEncodedKeys release];
+    [_loggedEncodedKeys release];
     [_path release];
+    [_stack release];
+    [_layers release];
     [_reader release];
     [super dealloc];
 }
@@ -90,6 +110,130 @@ static id kDeletedValueMarker;
 @synthesize file=_path;
 
 
+// Layer files are named after the file, with the number of the save that wrote them, or the
+// numbers of the first and last of the saves merged into them: "<file>.5", "<file>.1-4".
+- (NSString*) _layerPath: (NSRange)saves
+{
+    if( saves.length == 1 )
+        return [_path stringByAppendingFormat: @".%lu", (unsigned long)saves.location];
+    else
+        return [_path stringByAppendingFormat: @".%lu-%lu", (unsigned long)saves.location,
+                                               (unsigned long)NSMaxRange(saves)-1];
+}
+
+// Parses the name of a layer file into the range of saves it holds; NO if it isn't one.
+- (BOOL) _parseLayerName: (NSString*)name saves: (NSRange*)outSaves
+{
+    NSString *prefix = [_path.lastPathComponent stringByAppendingString: @"."];
+    if( ! [name hasPrefix: prefix] )
+        return NO;
+    NSScanner *scanner = [NSScanner scannerWithString: [name substringFromIndex: prefix.length]];
+    [scanner setCharactersToBeSkipped: nil];
+    long long first, last;
+    if( ! [scanner scanLongLong: &first] || first < 1 )
+        return NO;
+    last = first;
+    if( [scanner scanString: @"-" intoString: NULL]
+            && (! [scanner scanLongLong: &last] || last <= first) )
+        return NO;
+    if( ! [scanner isAtEnd] )
+        return NO;
+    *outSaves = NSMakeRange((NSUInteger)first, (NSUInteger)(last-first+1));
+    return YES;
+}
+
+// Orders layers by their first save, a merged one before those it was merged from.
+static NSInteger compareLayers( id a, id b, void *context )
+{
+    NSRange ra = [a rangeValue], rb = [b rangeValue];
+    if( ra.location != rb.location )
+        return ra.location < rb.location ? NSOrderedAscending : NSOrderedDescending;
+    if( ra.length != rb.length )
+        return ra.length > rb.length ? NSOrderedAscending : NSOrderedDescending;
+    return NSOrderedSame;
+}
+
+static unsigned long long fileSize( CDBFile *file )
+{
+    struct stat st;
+    return fstat(file.fileDescriptor, &st) == 0 ? (unsigned long long)st.st_size : 0;
+}
+
+// Makes a file, or the entries of a directory, durable.
+static BOOL syncPath( NSString *path )
+{
+    int fd = open(path.fileSystemRepresentation, O_RDONLY);
+    if( fd < 0 )
+        return NO;
+    BOOL ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// Makes the directory entry of a file just created or renamed durable.
+static BOOL syncParent( NSString *path )
+{
+    NSString *dir = [path stringByDeletingLastPathComponent];
+    return syncPath(dir.length ? dir : @".");
+}
+
+
+// Opens the layer files written on top of the file, and the stack of them all.
+- (BOOL) _openLayers: (NSError**)outError
+{
+    _layers = [[NSMutableArray alloc] init];
+    _nextSave = 1;
+    if( ! _reader.isOpen )
+        return YES;
+    
+    NSString *dir = [_path stringByDeletingLastPathComponent];
+    NSArray *names = [[NSFileManager defaultManager] contentsOfDirectoryAtPath: (dir.length ? dir : @".")
+                                                                         error: outError];
+    if( ! names )
+        return NO;
+    NSMutableArray *layerSaves = [NSMutableArray array];
+    for( NSString *name in names ) {
+        NSRange saves;
+        if( [self _parseLayerName: name saves: &saves] )
+            [layerSaves addObject: [NSValue valueWithRange: saves]];
+    }
+    [layerSaves sortUsingFunction: compareLayers context: NULL];
+    
+    for( NSValue *value in layerSaves ) {
+        NSRange saves = value.rangeValue;
+        NSString *layerPath = [self _layerPath: saves];
+        if( saves.location < _nextSave ) {
+            // Merged into the layer before: a crash during compaction left it behind
+            unlink(layerPath.fileSystemRepresentation);
+            continue;
+        }
+        CDBReader *layer = [[CDBReader alloc] initWithFile: layerPath];
+        BOOL ok = [layer open];
+        if( ok )
+            [_layers addObject: layer];
+        else if( outError )
+            *outError = layer.error;
+        [layer release];
+        if( ! ok )
+            return NO;
+        _nextSave = NSMaxRange(saves);
+    }
+    _stack = [[CDBStackReader alloc] initWithReaders:
+                [[NSArray arrayWithObject: _reader] arrayByAddingObjectsFromArray: _layers]];
+    return YES;
+}
+
+- (void) _closeLayers
+{
+    [_stack release];
+    _stack = nil;
+    for( CDBReader *layer in _layers )
+        [layer close];
+    [_layers release];
+    _layers = nil;
+}
+
+
 - (BOOL) open: (NSError**)outError
 {
     if( !_isOpen ) {
@@ -104,6 +248,12 @@ static id kDeletedValueMarker;
                     return NO;
                 }
             }
+            if( ! [self _openLayers: outError] || ! [self _openLog: outError] ) {
+                [self _closeLog];
+                [self _closeLayers];
+                [_reader close];
+                return NO;
+            }
         }
         _isOpen = YES;
     }
@@ -139,6 +289,9 @@ static id kDeletedValueMarker;
 - (BOOL) close
 {
     BOOL ok = !_isOpen || [self save: nil];     // Save any pending changes
+    _generation++;                              // Any compaction going on is of no use now
+    [self _closeLog];
+    [self _closeLayers];
     [_reader close];
     [_reader release];
     _reader = nil;
@@ -166,10 +319,10 @@ static id kDeletedValueMarker;
     }
     
     // Look up key in file, if file exists:
-    if( ! _reader.isOpen )
+    if( ! _stack )
         return nil;
     if( ! data.bytes ) {
-        data = [_reader valuePointerForKey: [self encodeKey: key]];
+        data = [_stack valuePointerForKey: [self encodeKey: key]];
         if( ! data.bytes )
             return nil;
     }
@@ -196,7 +349,7 @@ static id kDeletedValueMarker;
 - (NSEnumerator*) keyEnumerator
 {
     return [[[CDBStoreEnumerator alloc] initWithStore: self
-                                               reader: _reader
+                                                stack: _stack
                                           changedKeys: _changedEncodedKeys
                                            returnKeys: YES]
                 autorelease];
@@ -206,7 +359,7 @@ static id kDeletedValueMarker;
 - (NSEnumerator*) objectEnumerator
 {
     return [[[CDBStoreEnumerator alloc] initWithStore: self
-                                               reader: _reader
+                                                stack: _stack
                                           changedKeys: _changedEncodedKeys
                                            returnKeys: NO]
             autorelease];
@@ -248,6 +401,7 @@ static id kDeletedValueMarker;
         LogTo(CDB,@"setObject: %@<%p> forKey: %@",[object class],object,key);
         [_cache setObject: object forKey: key];
         [_changedEncodedKeys addObject: encodedKey];
+        [_loggedEncodedKeys removeObject: encodedKey];
     }
 }
 
@@ -257,6 +411,7 @@ static id kDeletedValueMarker;
     NSData *encodedKey = CDBToNSData([self encodeKey: key]);
     NSAssert2(encodedKey, @"Key %@<%p> is not encodable",[key class],key);
     [_changedEncodedKeys addObject: encodedKey];
+    [_loggedEncodedKeys removeObject: encodedKey];
 }
 
 
@@ -295,18 +450,23 @@ static id kDeletedValueMarker;
 #pragma mark SAVING:
 
 
+// The logged keys are changed keys too, whose values are in the log but not in the file yet.
 - (BOOL) hasChanges
 {
-    return _changedEncodedKeys != nil;
+    for( NSData *encodedKey in _changedEncodedKeys )
+        if( ! [_loggedEncodedKeys containsObject: encodedKey] )
+            return YES;
+    return NO;
 }
 
 - (NSSet*) changedKeys
 {
-    if( ! _changedEncodedKeys )
+    if( ! self.hasChanges )
         return nil;
     NSMutableSet *keys = [NSMutableSet setWithCapacity: _changedEncodedKeys.count];
     for( NSData *encodedKey in _changedEncodedKeys )
-        [keys addObject: [self decodeKey: CDBFromNSData(encodedKey)]];
+        if( ! [_loggedEncodedKeys containsObject: encodedKey] )
+            [keys addObject: [self decodeKey: CDBFromNSData(encodedKey)]];
     return keys;
 }
 
@@ -336,20 +496,90 @@ static id kDeletedValueMarker;
 }
 
 
-- (BOOL) save: (NSError**)outError
+// Writes the changed keys to a new layer file on top of the existing ones.
+- (BOOL) _saveLayer: (NSError**)outError
 {
-    _savingSoon = NO;
-    if( ! _changedEncodedKeys || ! _isOpen )
-        return YES;
+    BOOL ok = YES;
+    NSString *layerPath = [self _layerPath: NSMakeRange(_nextSave,1)];
+    NSString *tempPath = [layerPath stringByAppendingString: @"~temp"];
+    CDBWriter *writer = [[CDBWriter alloc] initWithFile: tempPath];
+    if( ! [writer open] ) {
+        *outError = writer.error;
+        [writer release];
+        return NO;
+    }
     
-    LogTo(CDB,@"Saving %@",self.file);
-    NSError *tempError;
-    if( ! outError )
-        outError = &tempError;
+    @try{
+        for( NSData *encodedKey in _changedEncodedKeys ) {
+            CDBData keyBytes = CDBFromNSData(encodedKey);
+            if( [self isDeletedKey: [self decodeKey: keyBytes]] ) {
+                // Hide the older value, if there is one:
+                if( [_stack valuePointerForKey: keyBytes].bytes )
+                    ok = [writer addTombstoneForKey: keyBytes];
+            } else
+                ok = [self _writeEncodedKey: encodedKey toFile: writer];
+            if( ! ok )
+                break;
+        }
+        ok = [writer close] && ok;
+    }@catch( NSException *x ) {
+        Warn(@"CDBStore save failed: %@",x);
+        [writer close];
+        ok = NO;
+    }
+
+    *outError = writer.error;
+    [writer release];
+    
+    // The layer and its name have to be on disk before the log can be emptied:
+    if( ok && ! syncPath(tempPath) ) {
+        ok = NO;
+        *outError = [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil];
+    }
+    if( ok && rename(tempPath.fileSystemRepresentation, layerPath.fileSystemRepresentation) != 0 ) {
+        ok = NO;
+        *outError = [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil];
+    }
+    if( ok && ! syncParent(layerPath) ) {
+        *outError = [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil];
+        unlink(layerPath.fileSystemRepresentation);
+        return NO;
+    }
+    
+    if( ok ) {
+        // The layer is in place, and its number taken, even if it can't be opened; then the log
+        // stays, and the batches numbered below it are covered by it.
+        _nextSave++;
+        // Add the layer to the stack, and clear internal change state:
+        CDBReader *layer = [[CDBReader alloc] initWithFile: layerPath];
+        ok = [layer open];
+        if( ok ) {
+            _bytesWritten += fileSize(layer);
+            [_layers addObject: layer];
+            [_stack release];
+            _stack = [[CDBStackReader alloc] initWithReaders:
+                        [[NSArray arrayWithObject: _reader] arrayByAddingObjectsFromArray: _layers]];
+            [_changedEncodedKeys release];
+            _changedEncodedKeys = nil;
+            [_loggedEncodedKeys removeAllObjects];
+        } else
+            *outError = layer.error;
+        [layer release];
+    } else {
+        // Failed -- at least clean up the temp file
+        [[NSFileManager defaultManager] removeItemAtPath: tempPath error: nil];
+    }
+    return ok;
+}
+
 
+// Writes the whole store to a new file, folding the layers into it, and swaps it in.
+- (BOOL) _saveFile: (NSError**)outError
+{
     // Open temporary file to write to:
     BOOL ok = YES;
     NSString *tempPath = [self.file stringByAppendingString: @"~temp"];
+    _generation++;      // The layers being compacted, if any, are going away
     //TODO: Choose a unique filename instead, in a hidden temporary directory on the same filesystem.
     CDBWriter *writer = [[CDBWriter alloc] initWithFile: tempPath];
     if( ! [writer open] ) {
@@ -359,25 +589,38 @@ static id kDeletedValueMarker;
     }
     
     @try{
-        if( _reader.isOpen ) {
-            // Write existing values from file, whether or not they were cached or changed:
-            CDBEnumerator *e = [_reader keyEnumerator];
+        if( _stack ) {
+            // Write existing values from the file and its layers, whether or not they were
+            // cached or changed:
+            CDBEnumerator *e = [_stack keyEnumerator];
             NSMutableData *encodedKeyData = [NSMutableData data];
+            CDBReader *runReader = nil;
+            cdbo_t runStart = 0, runEnd = 0;
             while( [e next] ) {
                 CDBData keyBytes = e.keyPointer;
                 [encodedKeyData replaceBytesInRange: NSMakeRange(0,encodedKeyData.length)
                                           withBytes: keyBytes.bytes 
                                              length: keyBytes.length];
                 if( [_changedEncodedKeys containsObject: encodedKeyData] ) {
-                    // Externalize changed object:
-                    ok = [self _writeEncodedKey: encodedKeyData toFile: writer];
+                    // Copy the unmodified records before this one, then externalize changed object:
+                    ok = [writer copyRecordsFrom: runReader start: runStart end: runEnd]
+                        && [self _writeEncodedKey: encodedKeyData toFile: writer];
                     [_changedEncodedKeys removeObject: encodedKeyData];
+                    runStart = runEnd;
                 } else {
-                    // Just pass unmodified value through directly from old file:
-                    ok = [writer addValuePointer: e.valuePointer forKey: keyBytes];
+                    // Unmodified value: it will be copied from its file along with its neighbors,
+                    // unless records in between were skipped, as changed or hidden by a layer
+                    if( e.reader != runReader || e.recordStart != runEnd ) {
+                        ok = [writer copyRecordsFrom: runReader start: runStart end: runEnd];
+                        runReader = e.reader;
+                        runStart = e.recordStart;
+                    }
+                    runEnd = e.recordEnd;
                 }
                 if( ! ok ) break;
             }
+            if( ok )
+                ok = [writer copyRecordsFrom: runReader start: runStart end: runEnd];
         }
         
         // Write objects for newly-added keys:
@@ -396,6 +639,28 @@ static id kDeletedValueMarker;
 
     *outError = writer.error;
     [writer release];
+    if( ok && ! syncPath(tempPath) ) {
+        ok = NO;
+        *outError = [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil];
+    }
+    
+    // The new file has everything the layers had. Move them aside first, newest first: a
+    // crash before the file is replaced then leaves the store as it was at an earlier save,
+    // rather than older layers on top of newer values.
+    NSArray *layerPaths = [_layers valueForKey: @"file"];
+    NSUInteger nLayers = layerPaths.count, n = nLayers;
+    if( ok && nLayers > 0 ) {
+        [self _closeLayers];
+        for( ; n > 0; n-- ) {
+            NSString *layerPath = [layerPaths objectAtIndex: n-1];
+            if( rename(layerPath.fileSystemRepresentation,
+                       [layerPath stringByAppendingString: @"~old"].fileSystemRepresentation) != 0 ) {
+                ok = NO;
+                *outError = [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil];
+                break;
+            }
+        }
+    }
     
     // Replace old file with new:
     if( ok && rename(tempPath.fileSystemRepresentation, self.file.fileSystemRepresentation) != 0 ) {
@@ -403,18 +668,98 @@ static id kDeletedValueMarker;
         ok = NO;
         *outError = [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil];
     }
+    // The renames have to be on disk before the old layers or the log go. If they can't be
+    // synced, the save fails, so the log stays, but the new file is in place already:
+    NSError *syncError = nil;
+    if( ok && ! syncParent(self.file) )
+        syncError = [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil];
+    
+    // Remove the old layers, or put them back if the file wasn't replaced:
+    for( NSUInteger i = nLayers; i > n; i-- ) {
+        NSString *layerPath = [layerPaths objectAtIndex: i-1];
+        NSString *oldPath = [layerPath stringByAppendingString: @"~old"];
+        if( ! ok )
+            rename(oldPath.fileSystemRepresentation, layerPath.fileSystemRepresentation);
+        else if( ! syncError )
+            unlink(oldPath.fileSystemRepresentation);
+    }
     
     if( ok ) {
         // Re-open, and clear internal change state:
+        [self _closeLayers];
         [_reader close];
         [_changedEncodedKeys release];
         _changedEncodedKeys = nil;
+        [_loggedEncodedKeys removeAllObjects];
         ok =_isOpen = [_reader open];
         if( ! ok )
             *outError = _reader.error;
+        else {
+            _bytesWritten += fileSize(_reader);
+            ok = [self _openLayers: outError];
+        }
+        if( ok && syncError ) {
+            ok = NO;
+            *outError = syncError;
+        }
     } else {
         // Failed -- at least clean up the temp file
         [[NSFileManager defaultManager] removeItemAtPath: tempPath error: nil];
+        if( ! _layers )
+            [self _openLayers: nil];
+    }
+    return ok;
+}
+
+
+- (BOOL) save: (NSError**)outError
+{
+    _savingSoon = NO;
+    if( ! self.hasChanges || ! _isOpen )
+        return YES;
+    
+    LogTo(CDB,@"Saving %@",self.file);
+    NSError *tempError;
+    if( ! outError )
+        outError = &tempError;
+
+    // Append the changes to the log, unless that makes it too big; then they all go to a file,
+    // with the ones logged before:
+    BOOL ok = YES;
+    NSData *batch = nil;
+    if( _stack && _logRatio > 0 ) {
+        unsigned long long limit = 0;
+        for( CDBReader *reader in _stack.readers )
+            limit += fileSize(reader);
+        limit /= _logRatio;
+        if( _logSize < limit ) {
+            NSMutableSet *keys = [[_changedEncodedKeys mutableCopy] autorelease];
+            [keys minusSet: _loggedEncodedKeys];
+            batch = [self _logBatch: keys];
+            if( _logSize + batch.length <= limit ) {
+                ok = [self _appendToLog: batch error: outError];
+                if( ok )
+                    [_loggedEncodedKeys unionSet: keys];
+            } else
+                batch = nil;
+        }
+    }
+    if( ! batch ) {
+        // Logged changes are folded into a layer even if there are too many already, since the
+        // layer's number is what tells the batches it covers; the layers go into the file after.
+        if( _stack && (_layers.count < kMaxLayers || _logSize > 0) ) {
+            ok = [self _saveLayer: outError];
+            if( ok && _logSize > 0 )
+                ok = [self _emptyLog: outError];
+            if( ok && _layers.count >= kMaxLayers )
+                ok = [self _saveFile: outError];
+            else if( ok )
+                [self _compactIfNeeded];
+        } else {
+            ok = [self _saveFile: outError];
+            if( ok && _logSize > 0 )
+                ok = [self _emptyLog: outError];
+        }
     }
     
     if( ! ok )
@@ -433,6 +778,430 @@ static id kDeletedValueMarker;
 }
 
 
+#pragma mark -
+#pragma mark CHANGE LOG:
+
+
+// The change log is a series of batches, one per save: the length of the batch's body and its
+// cdb_hash, then the body: the number of the layer the batch will be folded into, and the
+// records, each the lengths of its key and its value, the key, and the value as in the file
+// (the tag byte and the encoded object), an empty value meaning a deleted key.
+// A batch torn by a crash in the middle of an append doesn't check out, and is dropped. A batch
+// numbered below the newest layer was folded into it already, and the log only wasn't emptied
+// before a crash: replaying it would bring back older values.
+
+- (NSString*) _logPath
+{
+    return [_path stringByAppendingString: @".log"];
+}
+
+static void appendLength( NSMutableData *data, NSUInteger length )
+{
+    unsigned char buf[4];
+    cdb_pack((unsigned)length, buf);
+    [data appendBytes: buf length: 4];
+}
+
+
+// Applies the records of a batch to the cache, as changed and logged keys. A batch which doesn't
+// decode is not applied at all, like a torn one.
+- (BOOL) _replayBatch: (const UInt8*)pos length: (size_t)length
+{
+    const UInt8 *end = pos + length;
+    BOOL ok = YES;
+    NSAutoreleasePool *pool = [NSAutoreleasePool new];
+    @try{
+        NSMutableArray *keys = [NSMutableArray array], *objects = [NSMutableArray array];
+        NSMutableArray *encodedKeys = [NSMutableArray array];
+        while( ok && pos < end ) {
+            if( end - pos < 8 ) {
+                ok = NO;
+                break;
+            }
+            size_t klen = cdb_unpack(pos), vlen = cdb_unpack(pos+4);
+            pos += 8;
+            if( klen > (size_t)(end - pos) || vlen > (size_t)(end - pos) - klen ) {
+                ok = NO;
+                break;
+            }
+            CDBData keyBytes = {pos, klen};
+            id key = [self decodeKey: keyBytes];
+            id object = kDeletedValueMarker;
+            if( vlen > 0 )
+                object = [self decodeObject: (CDBData){pos+klen+1, vlen-1} tag: pos[klen]];
+            if( key && object ) {
+                [keys addObject: key];
+                [objects addObject: object];
+                [encodedKeys addObject: CDBToNSData(keyBytes)];
+            } else {
+                Warn(@"CDBStore: Couldn't decode logged value of key %@",key);
+                ok = NO;
+            }
+            pos += klen + vlen;
+        }
+        if( ok ) {
+            NSUInteger i, n = keys.count;
+            for( i=0; i<n; i++ )
+                [_cache setObject: [objects objectAtIndex: i] forKey: [keys objectAtIndex: i]];
+            [_changedEncodedKeys addObjectsFromArray: encodedKeys];
+            [_loggedEncodedKeys addObjectsFromArray: encodedKeys];
+        }
+    }@catch( NSException *x ) {
+        // Unarchiving a corrupt object raises
+        Warn(@"CDBStore: Couldn't decode logged changes: %@",x);
+        ok = NO;
+    }@finally{
+        [pool drain];
+    }
+    return ok;
+}
+
+
+// Opens the change log, if there is one, and replays it into the cache.
+- (BOOL) _openLog: (NSError**)outError
+{
+    _loggedEncodedKeys = [[NSMutableSet alloc] init];
+    _logSize = 0;
+    NSString *logPath = [self _logPath];
+    _logFD = open(logPath.fileSystemRepresentation, O_RDWR | O_APPEND);
+    if( _logFD < 0 ) {
+        if( errno == ENOENT )
+            return YES;
+        if( outError )
+            *outError = [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil];
+        return NO;
+    }
+    NSData *log = [NSData dataWithContentsOfFile: logPath options: NSMappedRead error: outError];
+    if( ! log )
+        return NO;
+    
+    if( log.length > 0 && ! _changedEncodedKeys )
+        _changedEncodedKeys = [[NSMutableSet alloc] init];
+    const UInt8 *start = log.bytes, *pos = start, *end = start + log.length;
+    NSUInteger folded = 0, replayed = 0;
+    while( end - pos >= 8 ) {
+        size_t length = cdb_unpack(pos);
+        const UInt8 *body = pos + 8;
+        if( length < 4 || length > (size_t)(end - body)
+                || cdb_hash(body,(unsigned)length) != cdb_unpack(pos+4) )
+            break;
+        NSUInteger save = cdb_unpack(body);
+        if( save < _nextSave )
+            folded++;
+        else if( [self _replayBatch: body+4 length: length-4] ) {
+            replayed++;
+            _nextSave = save;           // The layer these go into covers them all
+        } else
+            break;
+        pos = body + length;
+    }
+    _logSize = pos - start;
+    if( folded > 0 && replayed == 0 ) {
+        LogTo(CDB,@"Dropping %u batches of %@ folded before a crash",(unsigned)folded,logPath);
+        _logSize = 0;
+    }
+    if( _logSize < log.length ) {
+        if( _logSize > 0 || folded == 0 )
+            Warn(@"CDBStore: Dropping %lu bytes of unfinished changes at the end of %@",
+                 (unsigned long)(log.length - _logSize), logPath);
+        if( ftruncate(_logFD, (off_t)_logSize) != 0 ) {
+            if( outError )
+                *outError = [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil];
+            return NO;
+        }
+    }
+    LogTo(CDB,@"Replayed %u logged changes from %@",(unsigned)_loggedEncodedKeys.count,logPath);
+    return YES;
+}
+
+- (void) _closeLog
+{
+    if( _logFD >= 0 )
+        close(_logFD);
+    _logFD = -1;
+    _logSize = 0;
+    [_loggedEncodedKeys release];
+    _loggedEncodedKeys = nil;
+}
+
+
+// Encodes the current values of the keys as a batch for the log.
+- (NSData*) _logBatch: (NSSet*)encodedKeys
+{
+    NSMutableData *batch = [NSMutableData dataWithLength: 8];
+    appendLength(batch, _nextSave);
+    for( NSData *encodedKey in encodedKeys ) {
+        NSAutoreleasePool *pool = [NSAutoreleasePool new];
+        @try{
+            id key = [self decodeKey: CDBFromNSData(encodedKey)];
+            id object = [_cache objectForKey: key];
+            if( object == kDeletedValueMarker ) {
+                appendLength(batch, encodedKey.length);
+                appendLength(batch, 0);
+                [batch appendData: encodedKey];
+            } else if( object ) {
+                UInt8 tag;
+                NSData *objectData = [self encodeObject: object tag: &tag];
+                NSAssert1(objectData,@"CDBStore failed to encode object for key %@",key);
+                appendLength(batch, encodedKey.length);
+                appendLength(batch, objectData.length + 1);
+                [batch appendData: encodedKey];
+                [batch appendBytes: &tag length: 1];
+                [batch appendData: objectData];
+            }
+        }@finally{
+            [pool drain];
+        }
+    }
+    UInt8 *header = batch.mutableBytes;
+    cdb_pack((unsigned)(batch.length - 8), header);
+    cdb_pack(cdb_hash(header + 8, (unsigned)(batch.length - 8)), header + 4);
+    return batch;
+}
+
+
+// Appends a batch to the log, and syncs it: all the changes of a save are committed at once.
+- (BOOL) _appendToLog: (NSData*)batch error: (NSError**)outError
+{
+    if( _logFD < 0 ) {
+        // A new log, whose directory entry has to be on disk too:
+        _logFD = open([self _logPath].fileSystemRepresentation, O_RDWR | O_CREAT | O_APPEND, 0644);
+        if( _logFD < 0 || ! syncParent([self _logPath]) ) {
+            *outError = [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil];
+            if( _logFD >= 0 )
+                close(_logFD);
+            _logFD = -1;
+            return NO;
+        }
+    }
+    const UInt8 *bytes = batch.bytes;
+    size_t left = batch.length;
+    ssize_t n = 0;
+    while( left > 0 && (n = write(_logFD, bytes, left)) > 0 ) {
+        bytes += n;
+        left -= n;
+    }
+    if( left > 0 || fsync(_logFD) != 0 ) {
+        *outError = [NSError errorWithDomain: NSPOSIXErrorDomain code: (n == 0 ? EIO : errno)
+                                    userInfo: nil];
+        ftruncate(_logFD, (off_t)_logSize);     // Or the next batch would be dropped with it
+        return NO;
+    }
+    _logSize += batch.length;
+    _bytesWritten += batch.length;
+    LogTo(CDB,@"Logged %u bytes of changes to %@",(unsigned)batch.length,[self _logPath]);
+    return YES;
+}
+
+
+// Empties the log, once its changes have been saved to a file, which the save has synced
+// along with its directory entry. If that fails, the log is removed anyway: replaying changes
+// saved to a file since would undo them.
+- (BOOL) _emptyLog: (NSError**)outError
+{
+    BOOL ok = ftruncate(_logFD, 0) == 0 && fsync(_logFD) == 0;
+    if( ! ok ) {
+        *outError = [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil];
+        close(_logFD);
+        _logFD = -1;
+        unlink([self _logPath].fileSystemRepresentation);
+    }
+    _logSize = 0;
+    return ok;
+}
+
+
+@synthesize logRatio=_logRatio, logSize=_logSize;
+
+
+#pragma mark -
+#pragma mark COMPACTION:
+
+
+@synthesize compactionRatio=_compactionRatio, compactionWidth=_compactionWidth,
+            bytesWritten=_bytesWritten, bytesRewritten=_bytesRewritten, isCompacting=_compacting;
+
+- (NSUInteger) layerCount
+{
+    return _layers.count;
+}
+
+
+// The size-tiered policy: picks the newest files of the stack, going down while each one is at
+// most compactionRatio times the size of the one above it, if there are compactionWidth of
+// them; or just the newest compactionWidth, if the stack is getting too tall anyway.
+// Returns the index in the stack of the oldest file to merge (0 being the file itself), or
+// NSNotFound.
+- (NSUInteger) _filesToCompact
+{
+    NSArray *readers = _stack.readers;
+    NSUInteger n = readers.count, first = n-1;
+    if( _compactionWidth < 2 || n < 2 )
+        return NSNotFound;
+    unsigned long long size = fileSize([readers objectAtIndex: first]);
+    while( first > 0 ) {
+        unsigned long long older = fileSize([readers objectAtIndex: first-1]);
+        if( older > size * _compactionRatio )
+            break;
+        size = older;
+        first--;
+    }
+    if( n - first >= _compactionWidth )
+        return first;
+    else if( _layers.count >= kMaxLayers/2 )
+        return n - MIN(n,_compactionWidth);
+    else
+        return NSNotFound;
+}
+
+
+// Starts merging the newest files of the stack into one on a background thread, if the
+// policy says so. Lookups go on using the current stack until the merged file is swapped in.
+- (void) _compactIfNeeded
+{
+    if( _compacting || ! _stack )
+        return;
+    NSUInteger first = [self _filesToCompact];
+    if( first == NSNotFound )
+        return;
+    NSArray *readers = _stack.readers;
+    NSArray *paths = [[readers subarrayWithRange: NSMakeRange(first,readers.count-first)]
+                            valueForKey: @"file"];
+    NSString *target;
+    if( first == 0 )
+        target = _path;
+    else {
+        NSRange oldest, newest;
+        [self _parseLayerName: [[paths objectAtIndex: 0] lastPathComponent] saves: &oldest];
+        [self _parseLayerName: [paths.lastObject lastPathComponent] saves: &newest];
+        target = [self _layerPath: NSUnionRange(oldest,newest)];
+    }
+    // Tombstones are still needed if there are older files below the merged one:
+    NSDictionary *job = [NSDictionary dictionaryWithObjectsAndKeys:
+                            paths, @"paths",
+                            target, @"target",
+                            [target stringByAppendingString: @"~compact"], @"temp",
+                            [NSNumber numberWithBool: first>0], @"tombstones",
+                            [NSNumber numberWithUnsignedInteger: _generation], @"generation",
+                            [NSThread currentThread], @"thread",
+                            nil];
+    LogTo(CDB,@"Compacting %u files into %@",(unsigned)paths.count,target);
+    _compacting = YES;
+    [NSThread detachNewThreadSelector: @selector(_compact:) toTarget: self withObject: job];
+}
+
+
+// Runs on a background thread, with readers of its own on the files being merged, so that
+// the store can go on using (and saving) meanwhile.
+- (void) _compact: (NSDictionary*)job
+{
+    NSAutoreleasePool *pool = [NSAutoreleasePool new];
+    NSMutableDictionary *result = [[job mutableCopy] autorelease];
+    NSMutableArray *readers = [NSMutableArray array];
+    NSError *error = nil;
+    BOOL ok = YES;
+    for( NSString *path in [job objectForKey: @"paths"] ) {
+        CDBReader *reader = [[[CDBReader alloc] initWithFile: path] autorelease];
+        ok = [reader open];
+        if( ! ok ) {
+            error = reader.error;
+            break;
+        }
+        [readers addObject: reader];
+    }
+    if( ok ) {
+        CDBStackReader *stack = [[CDBStackReader alloc] initWithReaders: readers];
+        CDBWriter *writer = [[CDBWriter alloc] initWithFile: [job objectForKey: @"temp"]];
+        ok = [writer open] && [writer mergeStack: stack
+                                  keepTombstones: [[job objectForKey: @"tombstones"] boolValue]];
+        ok = [writer close] && ok;
+        if( ! ok )
+            error = writer.error;
+        else if( ! syncPath([job objectForKey: @"temp"]) ) {
+            // The merged file has to be on disk before it replaces the ones it was made from
+            ok = NO;
+            error = [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil];
+        }
+        [writer release];
+        [stack release];
+    }
+    for( CDBReader *reader in readers )
+        [reader close];
+    
+    [result setObject: [NSNumber numberWithBool: ok] forKey: @"ok"];
+    if( error )
+        [result setObject: error forKey: @"error"];
+    [self performSelector: @selector(_compacted:) onThread: [job objectForKey: @"thread"]
+               withObject: result waitUntilDone: NO];
+    [pool drain];
+}
+
+
+// Called back on the store's thread once a compaction is done, to swap the merged file in
+// for the ones it was made from. The old stack is just released, not closed, so enumerators
+// still using it go on working.
+- (void) _compacted: (NSDictionary*)result
+{
+    _compacting = NO;
+    NSArray *paths = [result objectForKey: @"paths"];
+    NSString *target = [result objectForKey: @"target"], *tempPath = [result objectForKey: @"temp"];
+    BOOL ok = [[result objectForKey: @"ok"] boolValue];
+    if( ! ok )
+        Warn(@"CDBStore: Compaction failed: %@",[result objectForKey: @"error"]);
+    else if( ! _isOpen || [[result objectForKey: @"generation"] unsignedIntegerValue] != _generation )
+        ok = NO;        // Closed, or folded into a new file, meanwhile
+    else if( rename(tempPath.fileSystemRepresentation, target.fileSystemRepresentation) != 0 ) {
+        Warn(@"CDBStore: Compaction failed: %@",
+             [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil]);
+        ok = NO;
+    }
+    if( ! ok ) {
+        unlink(tempPath.fileSystemRepresentation);
+        return;
+    }
+    
+    // The merged file is in place; the ones it was made from are redundant, once the rename
+    // is on disk. (If a crash comes first, layers are left behind, which either are named
+    // within the merged layer's range or were merged into the file: reading them again on top
+    // of it changes nothing.)
+    if( ! syncParent(target) )
+        Warn(@"CDBStore: Couldn't sync directory of %@: %@",target,
+             [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil]);
+    else
+        for( NSString *path in paths )
+            if( ! [path isEqualToString: _path] )
+                unlink(path.fileSystemRepresentation);
+    
+    CDBReader *merged = [[CDBReader alloc] initWithFile: target];
+    if( [merged open] ) {
+        _bytesRewritten += fileSize(merged);
+        NSMutableArray *layers = [NSMutableArray array];
+        BOOL isFile = [target isEqualToString: _path], inserted = isFile;
+        for( CDBReader *layer in _layers ) {
+            if( ! [paths containsObject: layer.file] )
+                [layers addObject: layer];
+            else if( ! inserted ) {
+                [layers addObject: merged];
+                inserted = YES;
+            }
+        }
+        if( isFile ) {
+            [_reader release];
+            _reader = [merged retain];
+        }
+        [_layers setArray: layers];
+        CDBStackReader *stack = [[CDBStackReader alloc] initWithReaders:
+                [[NSArray arrayWithObject: _reader] arrayByAddingObjectsFromArray: _layers]];
+        [_stack release];
+        _stack = stack;
+    } else
+        Warn(@"CDBStore: Couldn't open compacted file: %@",merged.error);
+    [merged release];
+    
+    [self _compactIfNeeded];
+}
+
+
 #pragma mark -
 #pragma mark ENCODING/DECODING HOOKS:
 
@@ -526,15 +1295,14 @@ static id kDeletedValueMarker;
 @implementation CDBStoreEnumerator
 
 - (id) initWithStore: (CDBStore*)store 
-              reader: (CDBReader*)reader
+               stack: (CDBStackReader*)stack
          changedKeys: (NSSet*)changedEncodedKeys
           returnKeys: (BOOL)returnKeys;
 {
     self = [super init];
     if( self ) {
         _store = store;
-        if( reader.isOpen )
-            _fileEnumerator = [reader.keyEnumerator retain];
+        _fileEnumerator = [stack.keyEnumerator retain];
         _changedEncodedKeys = [changedEncodedKeys mutableCopy];
         _returnKeys = returnKeys;
     }
@@ -11,10 +11,12 @@
 #include <string.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/stat.h>   /* jpa: Added this to resolve a warning */
-#include "cdb.h"
+#include "cdb_int.h"	/* for 64-bit format definitions */
 
 #ifndef EPROTO
 # define EPROTO EINVAL
@@ -38,6 +40,17 @@ static char *progname;
 #define F_WARNDUP	0x0100
 #define F_ERRDUP	0x0200
 #define F_MAP		0x1000	/* map format (or else CDB native format) */
+#define F_64BIT		0x2000	/* create 64-bit format file */
+#define F_BUCKETS	0x4000	/* create file with bucketed index */
+#define F_MPH		0x8000	/* create file with perfect hash index */
+#define F_FILTER	0x10000	/* create file with negative lookup filter */
+#define F_ORDER		0x20000	/* create file with ordered key index */
+#define F_MMAP		0x40000	/* write the file through mmap */
+#define F_STREAM	0x80000	/* write the file sequentially, no temp file */
+#define F_SYNC		0x100000 /* make the file durable before rename */
+#define F_NOSYNC	0x200000 /* F_SYNC, but the file can't be synced */
+
+#define BUFSIZE		(1024*1024)	/* default write buffer of -c */
 
 /* Silly defines just to suppress silly compiler warnings.
  * The thing is, trivial routines like strlen(), fgets() etc expects
@@ -125,6 +138,39 @@ static int qmode(char *dbname, const char *key, int num, int flags)
   return found ? 0 : 100;
 }
 
+/* several keys: look them up in one go, print first value of each */
+static int qmode_batch(char *dbname, char **keys, int nkeys, int flags)
+{
+  struct cdb c;
+  struct cdb_iovec *kv;
+  struct cdb_kv *res;
+  int r, i;
+
+  r = open(dbname, O_RDONLY);
+  if (r < 0 || cdb_init(&c, r) != 0)
+    error(errno, "unable to open database `%s'", dbname);
+
+  kv = (struct cdb_iovec*)malloc(nkeys * sizeof(*kv));
+  res = (struct cdb_kv*)malloc(nkeys * sizeof(*res));
+  if (!kv || !res)
+    error(ENOMEM, "unable to allocate memory");
+  for (i = 0; i < nkeys; ++i) {
+    kv[i].cdb_iov_base = keys[i];
+    kv[i].cdb_iov_len = strlen(keys[i]);
+  }
+  if ((r = cdb_find_batch(&c, kv, nkeys, res)) < 0)
+    error(errno, "cdb_find_batch");
+  for (i = 0; i < nkeys; ++i) {
+    if (!res[i].cdb_kpos)
+      continue;
+    if (fwrite(cdb_get(&c, res[i].cdb_vlen, res[i].cdb_vpos), 1,
+               res[i].cdb_vlen, stdout) != res[i].cdb_vlen)
+      return -1;
+    if (flags & F_MAP) putchar('\n');
+  }
+  return r == nkeys ? 0 : 100;
+}
+
 static void
 fget(FILE *f, unsigned char *b, unsigned len, unsigned *posp, unsigned limit)
 {
@@ -153,6 +199,52 @@ fcpy(FILE *fi, FILE *fo, unsigned len, unsigned *posp, unsigned limit)
   return 0;
 }
 
+/* 64-bit format keeps its layout at the end of file, so it can't be
+ * read sequentially like the classic one; map it (stdin should be a
+ * regular file for this to work). */
+static void
+xopen(struct cdb *cdbp, FILE *f, const char *dbname)
+{
+  if (cdb_init(cdbp, fileno(f)) != 0)
+    error(errno, "unable to open database `%s'", dbname);
+}
+
+/* print a record of a mapped file in dump (or list) format */
+static int
+dumprec(const struct cdb *cdbp, const struct cdb_kv *kv, char mode, int flags)
+{
+  if (!(flags & F_MAP))
+    if (printf(mode == 'd' ? "+%u,%u:" : "+%u:",
+               kv->cdb_klen, kv->cdb_vlen) < 0) return -1;
+  if (fwrite(cdb_get(cdbp, kv->cdb_klen, kv->cdb_kpos), 1, kv->cdb_klen,
+             stdout) != kv->cdb_klen) return -1;
+  if (mode == 'd') {
+    if (fputs(flags & F_MAP ? " " : "->", stdout) < 0)
+      return -1;
+    if (fwrite(cdb_get(cdbp, kv->cdb_vlen, kv->cdb_vpos), 1, kv->cdb_vlen,
+               stdout) != kv->cdb_vlen) return -1;
+  }
+  return putc('\n', stdout) < 0 ? -1 : 0;
+}
+
+static int
+dmode_x(struct cdb *cdbp, char mode, int flags)
+{
+  struct cdb_kv kv;
+  cdbo_t pos;
+  int r;
+  cdb_seqinit(&pos, cdbp);
+  while((r = cdb_seqnext_r(&pos, cdbp, &kv)) > 0)
+    if (dumprec(cdbp, &kv, mode, flags) < 0)
+      return -1;
+  if (r < 0)
+    error(EPROTO, "invalid cdb file format");
+  if (!(flags & F_MAP))
+    if (putc('\n', stdout) < 0)
+      return -1;
+  return 0;
+}
+
 static int
 dmode(char *dbname, char mode, int flags)
 {
@@ -165,6 +257,11 @@ dmode(char *dbname, char mode, int flags)
     error(errno, "open %s", dbname);
   allocbuf(2048);
   fget(f, buf, 2048, &pos, 2048);
+  if (_cdb_isx(buf)) {
+    struct cdb c;
+    xopen(&c, f, dbname);
+    return dmode_x(&c, mode, flags);
+  }
   eod = cdb_unpack(buf);
   while(pos < eod) {
     fget(f, buf, 8, &pos, eod);
@@ -189,17 +286,52 @@ dmode(char *dbname, char mode, int flags)
   return 0;
 }
 
+/* all records with keys starting with prefix, in key order and in
+ * dump format */
+static int pmode(char *dbname, const char *prefix, int flags)
+{
+  struct cdb c;
+  struct cdb_range cr;
+  struct cdb_kv kv;
+  int r, found = 0;
+
+  r = open(dbname, O_RDONLY);
+  if (r < 0 || cdb_init(&c, r) != 0)
+    error(errno, "unable to open database `%s'", dbname);
+  if (cdb_prefix_init(&cr, &c, prefix, strlen(prefix)) < 0) {
+    if (errno == ENOENT)
+      error(0, "no ordered key index in `%s'", dbname);
+    error(errno, "%s", prefix);
+  }
+  while((r = cdb_prefix_next(&cr, &kv)) > 0) {
+    ++found;
+    if (dumprec(&c, &kv, 'd', flags) < 0)
+      error(errno, "unable to write");
+  }
+  if (r < 0)
+    error(errno, "%s", prefix);
+  if (!(flags & F_MAP) && found)
+    putchar('\n');
+  return found ? 0 : 100;
+}
+
 static int smode(char *dbname) {
   FILE *f;
   unsigned pos, eod;
   unsigned cnt = 0;
-  unsigned kmin = 0, kmax = 0, ktot = 0;
-  unsigned vmin = 0, vmax = 0, vtot = 0;
+  unsigned kmin = 0, kmax = 0;
+  unsigned vmin = 0, vmax = 0;
+  cdbo_t ktot = 0, vtot = 0;
   unsigned hmin = 0, hmax = 0, htot = 0, hcnt = 0;
 #define NDIST 11
+#define NFPTEST 1000000
   unsigned dist[NDIST];
   unsigned char toc[2048];
   unsigned k;
+  struct cdb c;			/* 64-bit format is read via mmap */
+  cdbo_t xpos = 2048;		/* current position in 64-bit file */
+  cdbo_t tcnt = 0;		/* tombstones seen */
+  int x;
 
   if (strcmp(dbname, "-") == 0)
     f = stdin;
@@ -211,14 +343,37 @@ static int smode(char *dbname) {
 
   allocbuf(2048);
 
+  if ((x = _cdb_isx(toc)) != 0)
+    xopen(&c, f, dbname);
+
   eod = cdb_unpack(toc);
-  while(pos < eod) {
+  for(;;) {
     unsigned klen, vlen;
-    fget(f, buf, 8, &pos, eod);
-    klen = cdb_unpack(buf);
-    vlen = cdb_unpack(buf + 4);
-    fcpy(f, NULL, klen, &pos, eod);
-    fcpy(f, NULL, vlen, &pos, eod);
+    if (x) {
+      cdbo_t rpos = xpos;
+      int r = cdb_seqnext64(&xpos, &c);
+      if (r < 0) error(EPROTO, "invalid cdb file format");
+      if (!r) break;
+      klen = cdb_keylen(&c);
+      vlen = cdb_datalen(&c);
+      /* tombstones are listed in file order, and have empty values */
+      if (tcnt < c.cdb_tcnt &&
+          _cdb_unpack64(c.cdb_tomb + CDBX_THDR + tcnt * 8) == rpos) {
+        if (vlen) error(EPROTO, "invalid cdb tombstones");
+        ++tcnt;
+      }
+      if (c.cdb_filter &&
+          !_cdb_fcheck(&c, cdb_hash(cdb_getkey(&c), klen)))
+        error(EPROTO, "invalid cdb filter");
+    }
+    else {
+      if (pos >= eod) break;
+      fget(f, buf, 8, &pos, eod);
+      klen = cdb_unpack(buf);
+      vlen = cdb_unpack(buf + 4);
+      fcpy(f, NULL, klen, &pos, eod);
+      fcpy(f, NULL, vlen, &pos, eod);
+    }
     ++cnt;
     ktot += klen;
     if (!kmin || kmin > klen) kmin = klen;
@@ -228,43 +383,181 @@ static int smode(char *dbname) {
     if (vmax < vlen) vmax = vlen;
     vlen += klen;
   }
-  if (pos != eod) error(EPROTO, "invalid cdb file format");
+  if (x ? xpos != c.cdb_dend : pos != eod)
+    error(EPROTO, "invalid cdb file format");
+  if (x && tcnt != c.cdb_tcnt)
+    error(EPROTO, "invalid cdb tombstones");
+
+  if (x && c.cdb_order) {
+    /* every record once, each key with its prefix, in key order */
+    struct cdb_range cr;
+    struct cdb_kv kv, pkv;
+    const unsigned char *ent = c.cdb_order + CDBX_OHDR;
+    unsigned i = 0, l;
+    int r;
+    if (c.cdb_ocnt != cnt) error(EPROTO, "invalid cdb ordered index");
+    cdb_range_init(&cr, &c, NULL, 0, NULL, 0);
+    while((r = cdb_range_next(&cr, &kv)) > 0) {
+      const unsigned char *kp = c.cdb_mem + kv.cdb_kpos;
+      for (l = 0; l < 8; ++l)
+        if (ent[l] != (l < kv.cdb_klen ? kp[l] : 0))
+          error(EPROTO, "invalid cdb ordered index");
+      if (i++) {
+        l = pkv.cdb_klen < kv.cdb_klen ? pkv.cdb_klen : kv.cdb_klen;
+        r = memcmp(c.cdb_mem + pkv.cdb_kpos, kp, l);
+        if (r > 0 || (!r && pkv.cdb_klen > kv.cdb_klen))
+          error(EPROTO, "invalid cdb ordered index");
+      }
+      pkv = kv;
+      ent += CDBX_OENT;
+    }
+    if (r < 0) error(EPROTO, "invalid cdb ordered index");
+  }
 
   for (k = 0; k < NDIST; ++k)
     dist[k] = 0;
-  for (k = 0; k < 256; ++k) {
-    unsigned i = cdb_unpack(toc + (k << 3));
-    unsigned hlen = cdb_unpack(toc + (k << 3) + 4);
-    if (i != pos) error(EPROTO, "invalid cdb hash table");
-    if (!hlen) continue;
-    for (i = 0; i < hlen; ++i) {
-      unsigned h;
-      fget(f, buf, 8, &pos, 0xffffffff);
-      if (!cdb_unpack(buf + 4)) continue;
-      h = (cdb_unpack(buf) >> 8) % hlen;
-      if (h == i) h = 0;
+  if (x && c.cdb_mph) {
+    /* every record should be found in its own slot */
+    const unsigned char *slots = c.cdb_mph + CDBX_MHDR +
+      _cdb_pad8((cdbo_t)c.cdb_mnbkt * 2) +
+      _cdb_pad8((cdbo_t)(c.cdb_mtsize - c.cdb_mkeys) * 4);
+    unsigned i;
+    for (i = 0; i < c.cdb_mkeys; ++i) {
+      const unsigned char *sp = slots + (cdbo_t)i * CDBX_MSLOT;
+      cdbo_t rpos, h = 0;
+      const void *kp = NULL;
+      rpos = cdb_unpack(sp) | (cdbo_t)sp[4] << 32;
+      if (rpos <= c.cdb_dend - 8) {
+        k = cdb_unpack(c.cdb_mem + rpos);	/* key length */
+        kp = cdb_get(&c, k, rpos + 8);
+      }
+      if (kp) h = _cdb_hash64(kp, k);
+      if (!kp || _cdb_mslot(&c, h) != sp ||
+          _cdb_mslotfp(sp) != _cdb_mfp(h))
+        error(EPROTO, "invalid cdb perfect hash index");
+    }
+    if (c.cdb_mkeys != cnt) error(EPROTO, "invalid cdb perfect hash index");
+  }
+  else if (x && c.cdb_bkt) {
+    /* bucketed index: distances are in buckets, not in slots */
+    const unsigned char *bkt = c.cdb_bkt;
+    unsigned b, i, h, n, kcnt = 0;
+    hcnt = c.cdb_nbkt;
+    for (b = 0; b < c.cdb_nbkt; ++b, bkt += CDBX_BUCKET) {
+      n = bkt[CDBX_BCNT];
+      if (n > CDBX_BSLOTS) error(EPROTO, "invalid cdb bucket");
+      if (bkt[CDBX_BFLAGS] & CDBX_BMORE) ++htot;
+      if (!b || hmin > n) hmin = n;
+      if (hmax < n) hmax = n;
+      for (i = 0; i < n; ++i) {
+        cdbo_t rpos = _cdb_bpos(bkt, i);
+        const void *kp = NULL;
+        if (rpos <= c.cdb_dend - 8) {
+          h = cdb_unpack(c.cdb_mem + rpos);	/* key length */
+          kp = cdb_get(&c, h, rpos + 8);
+        }
+        if (!kp) error(EPROTO, "invalid cdb bucket");
+        h = cdb_hash(kp, h);
+        if (bkt[i] != _cdb_btag(h)) error(EPROTO, "invalid cdb bucket");
+        h = _cdb_bhome(h, c.cdb_nbkt);
+        h = h <= b ? b - h : c.cdb_nbkt - h + b;
+        ++dist[h >= NDIST ? NDIST - 1 : h];
+        ++kcnt;
+      }
+    }
+    if (kcnt != cnt) error(EPROTO, "invalid cdb bucket");
+  }
+  else {
+    for (k = 0; k < 256; ++k) {
+      const unsigned char *ht = NULL;
+      unsigned hlen, i;
+      if (x) {
+        const unsigned char *te = c.cdb_xtoc + k * CDBX_TOCENT;
+        hlen = cdb_unpack(te + 8);
+        if (_cdb_unpack64(te) != xpos ||
+            (hlen && !(ht = (const unsigned char*)
+                       cdb_get(&c, hlen * CDBX_SLOT, xpos))))
+          error(EPROTO, "invalid cdb hash table");
+        xpos += (cdbo_t)hlen * CDBX_SLOT;
+      }
       else {
-        if (h < i) h = i - h;
-        else h = hlen - h + i;
-        if (h >= NDIST) h = NDIST - 1;
+        i = cdb_unpack(toc + (k << 3));
+        hlen = cdb_unpack(toc + (k << 3) + 4);
+        if (i != pos) error(EPROTO, "invalid cdb hash table");
+      }
+      if (!hlen) continue;
+      for (i = 0; i < hlen; ++i) {
+        unsigned h;
+        if (x) {
+          if (!_cdb_unpack64(ht + i * CDBX_SLOT + 4)) continue;
+          h = (cdb_unpack(ht + i * CDBX_SLOT) >> 8) % hlen;
+        }
+        else {
+          fget(f, buf, 8, &pos, 0xffffffff);
+          if (!cdb_unpack(buf + 4)) continue;
+          h = (cdb_unpack(buf) >> 8) % hlen;
+        }
+        if (h == i) h = 0;
+        else {
+          if (h < i) h = i - h;
+          else h = hlen - h + i;
+          if (h >= NDIST) h = NDIST - 1;
+        }
+        ++dist[h];
       }
-      ++dist[h];
+      if (!hmin || hmin > hlen) hmin = hlen;
+      if (hmax < hlen) hmax = hlen;
+      htot += hlen;
+      ++hcnt;
     }
-    if (!hmin || hmin > hlen) hmin = hlen;
-    if (hmax < hlen) hmax = hlen;
-    htot += hlen;
-    ++hcnt;
   }
   printf("number of records: %u\n", cnt);
   printf("key min/avg/max length: %u/%u/%u\n",
-         kmin, cnt ? (ktot + cnt / 2) / cnt : 0, kmax);
+         kmin, cnt ? (unsigned)((ktot + cnt / 2) / cnt) : 0, kmax);
   printf("val min/avg/max length: %u/%u/%u\n",
-         vmin, cnt ? (vtot + cnt / 2) / cnt : 0, vmax);
-  printf("hash tables/entries/collisions: %u/%u/%u\n",
-         hcnt, htot, cnt - dist[0]);
-  printf("hash table min/avg/max length: %u/%u/%u\n",
-         hmin, hcnt ? (htot + hcnt / 2) / hcnt : 0, hmax);
-  printf("hash table distances:\n");
+         vmin, cnt ? (unsigned)((vtot + cnt / 2) / cnt) : 0, vmax);
+  if (x && c.cdb_filter) {
+    /* estimate false positive rate by checking random hash values */
+    unsigned h = 0, fp = 0, bits;
+    for (k = 0; k < NFPTEST; ++k) {
+      h = h * 1664525u + 1013904223u;
+      fp += _cdb_fcheck(&c, h);
+    }
+    bits = cnt ? (unsigned)((cdbo_t)c.cdb_fnblk * CDBX_FBLOCK * 800 / cnt) : 0;
+    printf("filter size: %.0f bytes, %u.%02u bits per key\n",
+           (double)c.cdb_fnblk * CDBX_FBLOCK + CDBX_FHDR,
+           bits / 100, bits % 100);
+    printf("filter false positive rate: %u.%02u%%\n",
+           (unsigned)((cdbo_t)fp * 10000 / NFPTEST / 100),
+           (unsigned)((cdbo_t)fp * 10000 / NFPTEST % 100));
+  }
+  if (x && c.cdb_order)
+    printf("ordered key index size: %.0f bytes\n",
+           (double)c.cdb_ocnt * CDBX_OENT + CDBX_OHDR);
+  if (x && c.cdb_mph) {
+    cdbo_t fbits = (CDBX_MHDR + _cdb_pad8((cdbo_t)c.cdb_mnbkt * 2) +
+                    _cdb_pad8((cdbo_t)(c.cdb_mtsize - c.cdb_mkeys) * 4)) * 800;
+    printf("perfect hash keys/positions/buckets: %u/%u/%u\n",
+           c.cdb_mkeys, c.cdb_mtsize, c.cdb_mnbkt);
+    printf("perfect hash function bits per key: %u.%02u\n",
+           (unsigned)(fbits / (cnt ? cnt : 1) / 100),
+           (unsigned)(fbits / (cnt ? cnt : 1) % 100));
+    return 0;
+  }
+  if (x && c.cdb_bkt) {
+    printf("buckets/overflowed/collisions: %u/%u/%u\n",
+           hcnt, htot, cnt - dist[0]);
+    printf("bucket min/avg/max fill: %u/%u/%u of %u\n",
+           hmin, (cnt + hcnt / 2) / hcnt, hmax, CDBX_BSLOTS);
+    printf("bucket distances:\n");
+  }
+  else {
+    printf("hash tables/entries/collisions: %u/%u/%u\n",
+           hcnt, htot, cnt - dist[0]);
+    printf("hash table min/avg/max length: %u/%u/%u\n",
+           hmin, hcnt ? (htot + hcnt / 2) / hcnt : 0, hmax);
+    printf("hash table distances:\n");
+  }
   for(k = 0; k < NDIST; ++k)
     printf(" %c%u: %6u %2u%%\n",
            k == NDIST - 1 ? '>' : 'd', k == NDIST - 1 ? k - 1 : k,
@@ -370,12 +663,34 @@ dofile(struct cdb_make *cdbmp, FILE *f, const char *fn, int flags)
     error(errno, "read error");
 }
 
+/* seconds since *tp, which is set to now */
+static double
+lap(struct timespec *tp)
+{
+  struct timespec t;
+  double d;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  d = (t.tv_sec - tp->tv_sec) + (t.tv_nsec - tp->tv_nsec) / 1e9;
+  *tp = t;
+  return d;
+}
+
 static int
-cmode(char *dbname, char *tmpname, int argc, char **argv, int flags, int perms)
+cmode(char *dbname, char *tmpname, int argc, char **argv, int flags, int perms,
+      int threads, unsigned bufsize, cdbo_t memlimit, const char *base)
 {
   struct cdb_make cdb;
-  int fd;
-  if (!tmpname) {
+  struct cdb bc;
+  int fd, sfd = -1, bfd = -1;
+  struct timespec ts;
+  double t[4];
+  struct stat st;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  if (base && ((bfd = open(base, O_RDONLY)) < 0 || cdb_init(&bc, bfd) != 0))
+    error(errno, "unable to open database `%s'", base);
+  if (flags & F_STREAM)
+    tmpname = dbname;
+  else if (!tmpname) {
     tmpname = (char*)malloc(strlen(dbname) + 5);
     if (!tmpname)
       error(ENOMEM, "unable to allocate memory");
@@ -392,12 +707,55 @@ cmode(char *dbname, char *tmpname, int argc, char **argv, int flags, int perms)
     tmpname = dbname;
   if (perms >= 0)
     umask(0);
-  unlink(tmpname);
-  fd = open(tmpname, O_RDWR|O_CREAT|O_EXCL|O_NOFOLLOW,
-            perms >= 0 ? perms : 0666);
+  if (flags & F_STREAM)
+    /* a pipe, a socket or whatever else, written as is */
+    fd = strcmp(dbname, "-") == 0 ? 1 :
+      open(dbname, O_WRONLY|O_CREAT|O_TRUNC, perms >= 0 ? perms : 0666);
+  else {
+    unlink(tmpname);
+    fd = open(tmpname, O_RDWR|O_CREAT|O_EXCL|O_NOFOLLOW,
+              perms >= 0 ? perms : 0666);
+  }
   if (fd < 0)
     error(errno, "unable to create %s", tmpname);
-  cdb_make_start(&cdb, fd);
+  if (cdb_make_start_ex(&cdb, fd, (flags & F_64BIT ? CDB_MAKE_64BIT : 0) |
+                                  (flags & F_BUCKETS ? CDB_MAKE_BUCKETS : 0) |
+                                  (flags & F_MPH ? CDB_MAKE_MPH : 0) |
+                                  (flags & F_FILTER ? CDB_MAKE_FILTER : 0) |
+                                  (flags & F_ORDER ? CDB_MAKE_ORDER : 0) |
+                                  (flags & F_MMAP ? CDB_MAKE_MMAP : 0) |
+                                  (flags & F_STREAM ? CDB_MAKE_STREAM : 0) |
+                                  (flags & F_SYNC ? CDB_MAKE_SYNC : 0)) != 0)
+    error(errno, "cdb_make_start");
+  cdb_make_threads(&cdb, threads);
+  if ((bufsize || !(flags & F_MMAP)) &&
+      cdb_make_bufsize(&cdb, bufsize ? bufsize : BUFSIZE) != 0)
+    error(errno, "unable to set buffer size");
+  if (memlimit) {
+    /* spill file next to the database, or in $TMPDIR when streaming,
+     * gone once closed */
+    const char *sdir = getenv("TMPDIR");
+    const char *sbase = !(flags & F_STREAM) ? tmpname :
+      sdir && *sdir ? sdir : "/tmp";
+    char *sname = (char*)malloc(strlen(sbase) + 17);
+    if (!sname)
+      error(ENOMEM, "unable to allocate memory");
+    strcat(strcpy(sname, sbase),
+           flags & F_STREAM ? "/cdb.spillXXXXXX" : ".spillXXXXXX");
+    if ((sfd = mkstemp(sname)) < 0)
+      error(errno, "unable to create %s", sname);
+    unlink(sname);
+    free(sname);
+    if (cdb_make_memlimit(&cdb, memlimit, sfd) != 0)
+      error(errno, "cdb_make_memlimit");
+  }
+  if (bfd >= 0) {
+    /* all the records of the base database go first, copied as is */
+    if (cdb_make_copy_range(&cdb, &bc, 2048, bc.cdb_dend) != 0)
+      error(errno, "unable to copy `%s'", base);
+    cdb_free(&bc);
+    close(bfd);
+  }
   allocbuf(4096);
   if (argc) {
     int i;
@@ -415,26 +773,69 @@ cmode(char *dbname, char *tmpname, int argc, char **argv, int flags, int perms)
   }
   else
     dofile(&cdb, stdin, "(stdin)", flags);
+  t[0] = lap(&ts);
   if (cdb_make_finish(&cdb) != 0)
     error(errno, "cdb_make_finish");
-  close(fd);
+  t[1] = lap(&ts);
+  /* nothing to sync when streaming to a pipe or a socket */
+  if (flags & F_SYNC && (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)))
+    flags = (flags & ~F_SYNC) | F_NOSYNC;
+  if (flags & F_SYNC && fdatasync(fd) != 0)
+    error(errno, "unable to sync %s", tmpname);
+  t[2] = lap(&ts);
+  if (fd != 1)
+    close(fd);
+  if (sfd >= 0)
+    close(sfd);
   if (tmpname != dbname)
     if (rename(tmpname, dbname) != 0)
       error(errno, "rename %s->%s", tmpname, dbname);
+  if ((flags & F_SYNC) && _cdb_syncdir(dbname) != 0)
+    error(errno, "unable to sync directory of %s", dbname);
+  t[3] = lap(&ts);
+  if (flags & (F_SYNC | F_NOSYNC))
+    fprintf(stderr, "%s: %s: write %.3fs, finish %.3fs, fdatasync %.3fs, "
+            "rename %.3fs\n", progname, dbname, t[0], t[1], t[2], t[3]);
   return 0;
 }
 
+/* size with an optional k, m or g suffix */
+static cdbo_t
+getsize(const char *arg, const char *what)
+{
+  char *ep = NULL;
+  cdbo_t l = strtoull(arg, &ep, 0);
+  unsigned shift = 0;
+  if (ep && (*ep == 'k' || *ep == 'K'))
+    shift = 10, ++ep;
+  else if (ep && (*ep == 'm' || *ep == 'M'))
+    shift = 20, ++ep;
+  else if (ep && (*ep == 'g' || *ep == 'G'))
+    shift = 30, ++ep;
+  if (!l || (ep && *ep) || l > (cdbo_t)-1 >> shift)
+    error(0, "invalid %s `%s'", what, arg);
+  return l << shift;
+}
+
 int main(int argc, char **argv)
 {
   int c;
   char mode = 0;
   char *tmpname = NULL;
+  char *outname = NULL;
+  char *base = NULL;
   int flags = 0;
   int num = 0;
   int r;
   int perms = -1;
-  extern char *optarg;
-  extern int optind;
+  int prefix = 0;
+  int threads = 0;
+  unsigned bufsize = 0;
+  cdbo_t memlimit = 0;
+  static const struct option lopts[] = {
+    { "prefix", 0, NULL, 256 },
+    { NULL, 0, NULL, 0 }
+  };
 
 #ifdef HAVE_PROGRAM_INVOCATION_SHORT_NAME
   argv[0] = progname;
@@ -448,7 +849,8 @@ int main(int argc, char **argv)
   if (argc <= 1)
     error(0, "no arguments given");
 
-  while((c = getopt(argc, argv, "qdlcsht:n:mwruep:0")) != EOF)
+  while((c = getopt_long(argc, argv, "qdlcsht:n:mwruep:0xbPFOj:MB:L:o:DC:",
+                         lopts, NULL)) != EOF)
     switch(c) {
     case 'q': case 'd':  case 'l': case 'c': case 's':
       if (mode && mode != c)
@@ -456,12 +858,22 @@ int main(int argc, char **argv)
       mode = c;
       break;
     case 't': tmpname = optarg; break;
+    case 'o': outname = optarg; break;
+    case 'C': base = optarg; break;
     case 'w': flags |= F_WARNDUP; break;
     case 'e': flags |= F_WARNDUP | F_ERRDUP; break;
     case 'r': flags = (flags & ~F_DUPMASK) | CDB_PUT_REPLACE; break;
     case 'u': flags = (flags & ~F_DUPMASK) | CDB_PUT_INSERT; break;
     case '0': flags = (flags & ~F_DUPMASK) | CDB_PUT_REPLACE0; break;
     case 'm': flags |= F_MAP; break;
+    case 'x': flags |= F_64BIT; break;
+    case 'b': flags |= F_BUCKETS; break;
+    case 'P': flags |= F_MPH; break;
+    case 'F': flags |= F_FILTER; break;
+    case 'O': flags |= F_ORDER; break;
+    case 'M': flags |= F_MMAP; break;
+    case 'D': flags |= F_SYNC; break;
+    case 256: prefix = 1; break;
     case 'p': {
       char *ep = NULL;
       perms = strtol(optarg, &ep, 0);
@@ -475,19 +887,37 @@ int main(int argc, char **argv)
         error(0, "invalid record number `%s'", optarg);
       break;
     }
+    case 'j': {
+      char *ep = NULL;
+      if ((threads = strtol(optarg, &ep, 0)) <= 0 || threads > 256 ||
+          (ep && *ep))
+        error(0, "invalid number of threads `%s'", optarg);
+      break;
+    }
+    case 'B': {
+      cdbo_t l = getsize(optarg, "buffer size");
+      if (l > 0x40000000)
+        error(0, "invalid buffer size `%s'", optarg);
+      bufsize = (unsigned)l;
+      break;
+    }
+    case 'L': memlimit = getsize(optarg, "memory limit"); break;
     case 'h':
 #define strify(x) _strify(x)
 #define _strify(x) #x
       printf("\
 %s: Constant DataBase (CDB) tool version " strify(TINYCDB_VERSION)
 ". Usage is:\n\
- query:  %s -q [-m] [-n recno|-a] cdbfile key\n\
+ query:  %s -q [-m] [-n recno|-a] cdbfile key [key...]\n\
+ prefix: %s -q --prefix [-m] cdbfile prefix\n\
  dump:   %s -d [-m] [cdbfile|-]\n\
  list:   %s -l [-m] [cdbfile|-]\n\
- create: %s -c [-m] [-wrue0] [-t tempfile|-] [-p perms] cdbfile [infile...]\n\
+ create: %s -c [-m] [-wrue0] [-x|-b|-P] [-F] [-O] [-j threads] [-M] [-B size] [-L limit] [-D] [-C basefile] [-t tempfile|-] [-p perms] cdbfile [infile...]\n\
+ stream: %s -c -o outfile|- [-m] [-b] [-F] [-B size] [-L limit] [-D] [-C basefile] [-p perms] [infile...]\n\
  stats:  %s -s [cdbfile|-]\n\
  help:   %s -h\n\
-", progname, progname, progname, progname, progname, progname, progname);
+", progname, progname, progname, progname, progname, progname, progname,
+         progname, progname);
       return 0;
 
     default:
@@ -499,14 +929,35 @@ int main(int argc, char **argv)
   switch(mode) {
     case 'q':
       if (argc < 2) error(0, "no database or key to query specified");
-      if (argc > 2) error(0, "extra arguments in command line");
-      r = qmode(argv[0], argv[1], num, flags);
+      if (prefix) {
+        if (argc > 2 || num)
+          error(0, "--prefix takes exactly one prefix and no -n");
+        r = pmode(argv[0], argv[1], flags);
+      }
+      else if (argc == 2)
+        r = qmode(argv[0], argv[1], num, flags);
+      else if (num)
+        error(0, "-n can't be used with several keys");
+      else
+        r = qmode_batch(argv[0], argv + 1, argc - 1, flags);
       break;
     case 'c':
-      if (!argc) error(0, "no database name specified");
+      if (!argc && !outname) error(0, "no database name specified");
       if ((flags & F_WARNDUP) && !(flags & F_DUPMASK))
         flags |= CDB_PUT_WARN;
-      r = cmode(argv[0], tmpname, argc - 1, argv + 1, flags, perms);
+      if (memlimit && (flags & F_DUPMASK))
+        error(0, "-L can't be used with duplicate checking");
+      if (memlimit && (flags & (F_BUCKETS | F_MPH | F_FILTER | F_ORDER)))
+        error(0, "-L can't be used with -b, -P, -F or -O");
+      if (!outname)
+        r = cmode(argv[0], tmpname, argc - 1, argv + 1, flags, perms,
+                  threads, bufsize, memlimit, base);
+      else if (flags & (F_DUPMASK | F_MPH | F_ORDER | F_MMAP))
+        error(0, "-o can't be used with -P, -O, -M or duplicate checking");
+      else
+        /* all the arguments are input files */
+        r = cmode(outname, NULL, argc, argv, flags | F_STREAM, perms,
+                  threads, bufsize, memlimit, base);
       break;
     case 'd':
     case 'l':
@@ -18,6 +18,7 @@ extern "C" {
 #endif
 
 typedef unsigned int cdbi_t; /* compatibility */
+typedef unsigned long long cdbo_t; /* file offset, 64 bits wide */
 
 /* common routines */
 unsigned cdb_hash(const void *buf, unsigned len);
@@ -27,14 +28,26 @@ void cdb_pack(unsigned num, unsigned char buf[4]);
 struct cdb {
   int cdb_fd;			/* file descriptor */
   /* private members */
-  unsigned cdb_fsize;		/* datafile size */
-  unsigned cdb_dend;		/* end of data ptr */
+  cdbo_t cdb_fsize;		/* datafile size */
+  cdbo_t cdb_dend;		/* end of data ptr */
   const unsigned char *cdb_mem; /* mmap'ed file memory */
-  unsigned cdb_vpos, cdb_vlen;	/* found data */
-  unsigned cdb_kpos, cdb_klen;	/* found key */
+  cdbo_t cdb_vpos; unsigned cdb_vlen;	/* found data */
+  cdbo_t cdb_kpos; unsigned cdb_klen;	/* found key */
+  const unsigned char *cdb_xtoc; /* 64-bit format toc, NULL if classic */
+  const unsigned char *cdb_bkt;	/* bucketed index, if any */
+  unsigned cdb_nbkt;		/* number of buckets */
+  const unsigned char *cdb_mph;	/* perfect hash index, if any */
+  cdbo_t cdb_mseed;		/* its header: seed, */
+  unsigned cdb_mkeys, cdb_mtsize, cdb_mnbkt; /* keys, table size, buckets */
+  const unsigned char *cdb_filter; /* negative lookup filter, if any */
+  unsigned cdb_fnblk;		/* number of its blocks */
+  const unsigned char *cdb_order; /* ordered key index, if any */
+  cdbo_t cdb_ocnt;		/* number of its entries */
+  const unsigned char *cdb_tomb; /* tombstone positions, if any */
+  cdbo_t cdb_tcnt;		/* number of tombstones */
 };
 
-#define CDB_STATIC_INIT {0,0,0,0,0,0,0,0}
+#define CDB_STATIC_INIT {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0}
 
 #define cdb_datapos(c) ((c)->cdb_vpos)
 #define cdb_datalen(c) ((c)->cdb_vlen)
@@ -43,16 +56,26 @@ struct cdb {
 #define cdb_fileno(c) ((c)->cdb_fd)
 
 int cdb_init(struct cdb *cdbp, int fd);
+int cdb_init_ex(struct cdb *cdbp, int fd, unsigned flags);
 void cdb_free(struct cdb *cdbp);
 
+/* cdb_init_ex() flags; the index is toc, hash tables and other sections
+ * after the data, that is, everything a lookup reads except the record */
+#define CDB_INIT_POPULATE 0x0001 /* read in the whole file at once */
+#define CDB_INIT_PREFAULT 0x0002 /* read in the index before returning */
+#define CDB_INIT_WILLNEED 0x0004 /* start reading the index in background */
+#define CDB_INIT_RANDOM	0x0008	/* no readahead for the data section */
+#define CDB_INIT_MLOCK	0x0010	/* lock the index in memory */
+#define CDB_INIT_HUGEPAGE 0x0020 /* use huge pages if possible */
+
 int cdb_read(const struct cdb *cdbp,
-             void *buf, unsigned len, unsigned pos);
+             void *buf, unsigned len, cdbo_t pos);
 #define cdb_readdata(cdbp, buf) \
         cdb_read((cdbp), (buf), cdb_datalen(cdbp), cdb_datapos(cdbp))
 #define cdb_readkey(cdbp, buf) \
         cdb_read((cdbp), (buf), cdb_keylen(cdbp), cdb_keypos(cdbp))
 
-const void *cdb_get(const struct cdb *cdbp, unsigned len, unsigned pos);
+const void *cdb_get(const struct cdb *cdbp, unsigned len, cdbo_t pos);
 #define cdb_getdata(cdbp) \
         cdb_get((cdbp), cdb_datalen(cdbp), cdb_datapos(cdbp))
 #define cdb_getkey(cdbp) \
@@ -60,21 +83,190 @@ const void *cdb_get(const struct cdb *cdbp, unsigned len, unsigned pos);
 
 int cdb_find(struct cdb *cdbp, const void *key, unsigned klen);
 
+/* position of a found record */
+struct cdb_kv {
+  cdbo_t cdb_kpos; unsigned cdb_klen;	/* key, cdb_kpos is 0 if not found */
+  cdbo_t cdb_vpos; unsigned cdb_vlen;	/* value */
+};
+
+struct cdb_iovec;
+int cdb_find_batch(const struct cdb *cdbp,
+                   const struct cdb_iovec *keys, unsigned nkeys,
+                   struct cdb_kv *res);
+
 struct cdb_find {
-  struct cdb *cdb_cdbp;
+  const struct cdb *cdb_cdbp;
   unsigned cdb_hval;
   const unsigned char *cdb_htp, *cdb_htab, *cdb_htend;
-  unsigned cdb_httodo;
+  cdbo_t cdb_httodo;
   const void *cdb_key;
   unsigned cdb_klen;
 };
 
-int cdb_findinit(struct cdb_find *cdbfp, struct cdb *cdbp,
+int cdb_findinit(struct cdb_find *cdbfp, const struct cdb *cdbp,
                  const void *key, unsigned klen);
 int cdb_findnext(struct cdb_find *cdbfp);
 
 #define cdb_seqinit(cptr, cdbp) ((*(cptr))=2048)
 int cdb_seqnext(unsigned *cptr, struct cdb *cdbp);
+/* the same with a 64-bit cursor, for files over 4 GiB */
+int cdb_seqnext64(cdbo_t *cptr, struct cdb *cdbp);
+
+/* reentrant versions of the above: struct cdb is not modified,
+ * record found is returned in *res instead */
+int cdb_find_r(const struct cdb *cdbp, const void *key, unsigned klen,
+               struct cdb_kv *res);
+int cdb_findnext_r(struct cdb_find *cdbfp, struct cdb_kv *res);
+int cdb_seqnext_r(cdbo_t *cptr, const struct cdb *cdbp, struct cdb_kv *res);
+
+/* records in key order, using ordered key index (CDB_MAKE_ORDER):
+ * keys from lo (inclusive, NULL for the first) up to hi (exclusive,
+ * NULL for the last), or keys starting with the given prefix */
+struct cdb_range {
+  const struct cdb *cdb_cdbp;
+  cdbo_t cdb_cur, cdb_end;	/* index entries left */
+};
+
+int cdb_range_init(struct cdb_range *cdbrp, const struct cdb *cdbp,
+                   const void *lo, unsigned lolen,
+                   const void *hi, unsigned hilen);
+int cdb_prefix_init(struct cdb_range *cdbrp, const struct cdb *cdbp,
+                    const void *prefix, unsigned plen);
+int cdb_range_next(struct cdb_range *cdbrp, struct cdb_kv *res);
+#define cdb_prefix_next(cdbrp, res) cdb_range_next((cdbrp), (res))
+
+/* stack of databases, a base and layers of changes made on top of it:
+ * a key is looked up in the newest layer having it, where a tombstone
+ * (see cdb_make_tombstone()) means the key has been deleted */
+struct cdb_stack {
+  const struct cdb *const *cdb_layers;	/* oldest first */
+  unsigned cdb_nlayers;
+};
+
+#define cdb_stack_init(stp, layers, n) \
+  ((stp)->cdb_layers = (layers), (stp)->cdb_nlayers = (n))
+
+/* cursor of a merged scan: records of all layers but the hidden ones */
+struct cdb_stack_seq {
+  unsigned cdb_layer;		/* current layer */
+  cdbo_t cdb_pos;		/* and position in it */
+};
+
+#define cdb_stack_seqinit(sp, stp) ((sp)->cdb_layer = 0, (sp)->cdb_pos = 2048)
+
+int cdb_tombstone(const struct cdb *cdbp, const struct cdb_kv *kv);
+int cdb_stack_find(const struct cdb_stack *stp,
+                   const void *key, unsigned klen,
+                   struct cdb_kv *res, const struct cdb **cdbpp);
+int cdb_stack_seqnext(struct cdb_stack_seq *sp, const struct cdb_stack *stp,
+                      struct cdb_kv *res, const struct cdb **cdbpp);
+
+/* sharded set: keys spread over 1 << bits databases by cdb_shard() of
+ * their hash, which doesn't depend on the toc byte; the databases are
+ * listed in a manifest, see cdb(3) */
+#define CDB_SHARD_MAXBITS 12
+#define cdb_shard(hval, bits) \
+  ((bits) ? ((((hval) >> 8) * 0x2545f491u) & 0xffffffffu) >> (32 - (bits)) : 0)
+
+struct cdb_shards {
+  unsigned cdb_bits;		/* log2 of the number of shards */
+  struct cdb *cdb_shard;	/* the shards */
+};
+
+#define cdb_shards_route(shp, hval) \
+  (&(shp)->cdb_shard[cdb_shard((hval), (shp)->cdb_bits)])
+
+int cdb_shards_open(struct cdb_shards *shp, const char *manifest,
+                    unsigned flags);
+void cdb_shards_close(struct cdb_shards *shp);
+int cdb_shards_find(const struct cdb_shards *shp,
+                    const void *key, unsigned klen,
+                    struct cdb_kv *res, const struct cdb **cdbpp);
+int cdb_shards_scan(const struct cdb_shards *shp, unsigned nthreads,
+                    int (*fn)(void *arg, const struct cdb *cdbp,
+                              const struct cdb_kv *kv),
+                    void *arg);
+
+/* a database replaced by renaming new files over it: a lookup uses the
+ * file which was current when it got it, see cdb(3) */
+struct cdb_live;
+struct cdb_live *cdb_live_open(const char *path, unsigned flags,
+                               unsigned interval);
+void cdb_live_close(struct cdb_live *lp);
+const struct cdb *cdb_live_get(struct cdb_live *lp);
+void cdb_live_put(struct cdb_live *lp, const struct cdb *cdbp);
+int cdb_live_reload(struct cdb_live *lp);
+
+/* pread-based reader: the same queries without mmap(2), reading the
+ * file as needed, optionally via a block cache shared by any number of
+ * readers and threads, see cdb(3) */
+struct cdb_cache;
+struct cdb_cache *cdb_cache_new(cdbo_t size, unsigned bsize, unsigned nshards);
+void cdb_cache_free(struct cdb_cache *cache);
+void cdb_cache_stats(struct cdb_cache *cache, cdbo_t *hits, cdbo_t *misses);
+
+struct cdb_pread {
+  int cdb_fd;			/* file descriptor */
+  /* private members */
+  cdbo_t cdb_fsize;		/* datafile size */
+  cdbo_t cdb_dend;		/* end of data ptr */
+  cdbo_t cdb_vpos; unsigned cdb_vlen;	/* found data */
+  cdbo_t cdb_kpos; unsigned cdb_klen;	/* found key */
+  unsigned char *cdb_toc;	/* toc, classic or 64-bit, if any */
+  unsigned cdb_x;		/* 64-bit format */
+  cdbo_t cdb_bkt;		/* bucketed index position, if any */
+  unsigned cdb_nbkt;		/* number of buckets */
+  cdbo_t cdb_mph;		/* perfect hash index position, if any */
+  cdbo_t cdb_mseed;		/* its header: seed, */
+  unsigned cdb_mkeys, cdb_mtsize, cdb_mnbkt; /* keys, table size, buckets */
+  struct cdb_cache *cdb_cache;	/* block cache, or NULL */
+  unsigned cdb_fid;		/* file id in the cache */
+};
+
+struct cdb_pread_find {
+  const struct cdb_pread *cdb_cdbp;
+  unsigned cdb_hval;
+  cdbo_t cdb_htab;		/* hash table or buckets position */
+  unsigned cdb_hn, cdb_hi;	/* its size and current slot or bucket */
+  cdbo_t cdb_httodo;
+  const void *cdb_key;
+  unsigned cdb_klen;
+};
+
+int cdb_pread_init(struct cdb_pread *cdbp, int fd, struct cdb_cache *cache);
+void cdb_pread_free(struct cdb_pread *cdbp);
+int cdb_pread_read(const struct cdb_pread *cdbp,
+                   void *buf, unsigned len, cdbo_t pos);
+#define cdb_pread_readdata(cdbp, buf) \
+        cdb_pread_read((cdbp), (buf), cdb_datalen(cdbp), cdb_datapos(cdbp))
+#define cdb_pread_readkey(cdbp, buf) \
+        cdb_pread_read((cdbp), (buf), cdb_keylen(cdbp), cdb_keypos(cdbp))
+int cdb_pread_find(struct cdb_pread *cdbp, const void *key, unsigned klen);
+int cdb_pread_find_r(const struct cdb_pread *cdbp,
+                     const void *key, unsigned klen, struct cdb_kv *res);
+int cdb_pread_findinit(struct cdb_pread_find *cdbfp,
+                       const struct cdb_pread *cdbp,
+                       const void *key, unsigned klen);
+int cdb_pread_findnext(struct cdb_pread_find *cdbfp);
+int cdb_pread_findnext_r(struct cdb_pread_find *cdbfp, struct cdb_kv *res);
+int cdb_pread_seqnext(cdbo_t *cptr, struct cdb_pread *cdbp);
+int cdb_pread_seqnext_r(cdbo_t *cptr, const struct cdb_pread *cdbp,
+                        struct cdb_kv *res);
+
+/* asynchronous lookups: many lookups in flight from one thread, with
+ * reads done via io_uring on Linux, see cdb(3) */
+struct cdb_async;
+#define CDB_ASYNC_NOURING 0x0001 /* do not use io_uring even if it works */
+struct cdb_async *
+cdb_async_new(const struct cdb_pread *cdbp, unsigned depth, unsigned vread,
+              unsigned flags,
+              void (*cb)(void *arg, int r, const struct cdb_kv *res,
+                         const void *val));
+int cdb_async_uring(const struct cdb_async *ap);
+int cdb_async_submit(struct cdb_async *ap, const void *key, unsigned klen,
+                     void *arg);
+int cdb_async_wait(struct cdb_async *ap, unsigned min);
+void cdb_async_free(struct cdb_async *ap);
 
 /* old simple interface */
 /* open file using standard routine, then: */
@@ -86,11 +278,20 @@ int cdb_bread(int fd, void *buf, int len);
 struct cdb_make {
   int cdb_fd;			/* file descriptor */
   /* private */
-  unsigned cdb_dpos;		/* data position so far */
-  unsigned cdb_rcnt;		/* record count so far */
+  cdbo_t cdb_dpos;		/* data position so far */
+  cdbo_t cdb_rcnt;		/* record count so far */
+  unsigned cdb_flags;		/* CDB_MAKE_xxx */
+  unsigned cdb_nthreads;	/* threads for cdb_make_finish() */
   unsigned char cdb_buf[4096];	/* write buffer */
   unsigned char *cdb_bpos;	/* current buf position */
+  unsigned char *cdb_wbuf;	/* buffer in use: cdb_buf, larger or mapped */
+  unsigned cdb_wsize;		/* its size */
   struct cdb_rl *cdb_rec[256];	/* list of arrays of record infos */
+  struct cdb_dx *cdb_dx;		/* key index for cdb_make_put() */
+  struct cdb_mw *cdb_mw;		/* shared state of writers */
+  struct cdb_spill *cdb_spill;	/* reclists spilled to a file */
+  struct cdb_tomb *cdb_tomb;	/* positions of tombstones */
+  cdbo_t cdb_wbpos, cdb_wbdone;	/* write-behind started and waited for */
 };
 
 enum cdb_put_mode {
@@ -114,7 +315,21 @@ struct cdb_iovec {
     unsigned cdb_iov_len;    /* Length. */
 };
 
+/* cdb_make_start_ex() flags */
+#define CDB_MAKE_64BIT	0x0001	/* always write 64-bit format */
+#define CDB_MAKE_BUCKETS 0x0002	/* 64-bit format with bucketed index */
+#define CDB_MAKE_MPH	0x0004	/* 64-bit format with perfect hash index */
+#define CDB_MAKE_FILTER	0x0008	/* 64-bit format with negative lookup filter */
+#define CDB_MAKE_ORDER	0x0010	/* 64-bit format with ordered key index */
+#define CDB_MAKE_MMAP	0x0020	/* write through a shared mapping of fd */
+#define CDB_MAKE_STREAM	0x0040	/* 64-bit format, written sequentially */
+#define CDB_MAKE_SYNC	0x0080	/* start writeback of data as it is written */
+
 int cdb_make_start(struct cdb_make *cdbmp, int fd);
+int cdb_make_start_ex(struct cdb_make *cdbmp, int fd, unsigned flags);
+void cdb_make_threads(struct cdb_make *cdbmp, unsigned nthreads);
+int cdb_make_bufsize(struct cdb_make *cdbmp, unsigned size);
+int cdb_make_memlimit(struct cdb_make *cdbmp, cdbo_t limit, int fd);
 int cdb_make_add(struct cdb_make *cdbmp,
                  const void *key, unsigned klen,
                  const void *val, unsigned vlen);
@@ -132,6 +347,39 @@ int cdb_make_put(struct cdb_make *cdbmp,
                  enum cdb_put_mode mode);
 int cdb_make_finish(struct cdb_make *cdbmp);
 
+/* record hiding the key in older layers of a struct cdb_stack */
+int cdb_make_tombstone(struct cdb_make *cdbmp,
+                       const void *key, unsigned klen);
+
+/* records pos..end of an existing database, copied as they are */
+int cdb_make_copy_range(struct cdb_make *cdbmp, const struct cdb *cdbp,
+                        cdbo_t pos, cdbo_t end);
+/* the records in effect in a stack, tombstones too if tombs is set */
+int cdb_make_merge(struct cdb_make *cdbmp, const struct cdb_stack *stp,
+                   int tombs);
+
+/* concurrent adding: one writer per thread */
+struct cdb_make_writer;
+struct cdb_make_writer *cdb_make_writer_new(struct cdb_make *cdbmp);
+int cdb_make_writer_add(struct cdb_make_writer *cdbwp,
+                        const void *key, unsigned klen,
+                        const void *val, unsigned vlen);
+int cdb_make_writer_addv(struct cdb_make_writer *cdbwp,
+                         const void *key, unsigned klen,
+                         const struct cdb_iovec *vals, unsigned nvals);
+int cdb_make_writer_done(struct cdb_make_writer *cdbwp);
+
+/* building a sharded set, from any number of threads */
+struct cdb_make_shards;
+struct cdb_make_shards *
+cdb_make_shards_new(const char *manifest, unsigned bits, unsigned flags);
+int cdb_make_shards_add(struct cdb_make_shards *smp,
+                        const void *key, unsigned klen,
+                        const void *val, unsigned vlen);
+int cdb_make_shards_finish(struct cdb_make_shards *smp, unsigned nthreads);
+int cdb_shards_replace(const char *manifest, unsigned shard,
+                       const char *file, unsigned flags);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -0,0 +1,628 @@
+/* cdb_async_* routines: many lookups in flight from one thread, for
+ * files mostly not in memory
+ *
+ * Every lookup is a small state machine doing the reads
+ * cdb_pread_find_r() does (see cdb_pread.c), one after another: a run
+ * of hash slots or a bucket, or a perfect hash pilot and slot, then the
+ * candidate records.  Reads of all the lookups in flight are given to
+ * the kernel at once via io_uring on Linux.  Elsewhere, or if io_uring
+ * can't be set up, they are done with pread(2) when completions are
+ * waited for; poll(2) can't help here since regular files are always
+ * "ready".  The block cache is not used.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "cdb_int.h"
+
+#ifdef __linux__
+# include <sys/syscall.h>
+# ifdef __NR_io_uring_setup
+#  define URING 1
+#  include <sys/mman.h>
+#  include <linux/io_uring.h>
+# endif
+#endif
+
+#define NRUN	8	/* hash slots to read at once */
+#define NIL	(~0u)
+
+/* what the read in progress is for */
+enum { S_SLOTS, S_HREC, S_BKT, S_BREC, S_PILOT, S_REMAP, S_MSLOT, S_MREC };
+
+struct areq {
+  unsigned state;
+  unsigned next;		/* free, done or read queue link */
+  void *arg;
+  unsigned char *buf;		/* the key, then the record read */
+  unsigned klen, bsize;
+  unsigned hval;
+  cdbo_t h, hs;			/* _cdb_hash64() and its seeded mix */
+  cdbo_t htab;			/* hash table position */
+  unsigned n, i, todo;		/* its size, current slot, slots left */
+  unsigned m, j;		/* slots in the run and next one, or
+				   bucket's candidates */
+  unsigned char blk[NRUN * CDBX_SLOT];	/* slots, bucket, pilot etc */
+  unsigned char *rbuf;		/* read in progress */
+  unsigned rlen, rdone;
+  cdbo_t rpos;
+  struct iovec iov;
+  int r, err;			/* result */
+  struct cdb_kv kv;
+  const void *val;
+};
+
+struct cdb_async {
+  const struct cdb_pread *cdbp;
+  unsigned depth, vread;
+  void (*cb)(void *arg, int r, const struct cdb_kv *res, const void *val);
+  struct areq *req;
+  unsigned nact;		/* lookups not reported yet */
+  unsigned free;		/* free list */
+  unsigned dhead, dtail, ndone;	/* done, to be reported */
+  unsigned qhead, qtail;	/* reads to do without io_uring */
+  cdbo_t pilots, remap, slots;	/* perfect hash index parts */
+  int ufd;			/* io_uring, or -1 */
+#ifdef URING
+  unsigned nsub;		/* reads queued but not submitted */
+  unsigned *sqtail, sqmask, *sqarray;
+  struct io_uring_sqe *sqes;
+  unsigned *cqhead, *cqtail, cqmask;
+  struct io_uring_cqe *cqes;
+  void *sqmem, *cqmem;
+  size_t sqlen, cqlen, sqelen;
+#endif
+};
+
+#ifdef URING
+
+static void
+auring_free(struct cdb_async *ap)
+{
+  if (ap->sqes)
+    munmap(ap->sqes, ap->sqelen);
+  if (ap->cqmem)
+    munmap(ap->cqmem, ap->cqlen);
+  if (ap->sqmem)
+    munmap(ap->sqmem, ap->sqlen);
+  close(ap->ufd);
+  ap->ufd = -1;
+}
+
+static int
+auring_init(struct cdb_async *ap)
+{
+  struct io_uring_params p;
+  unsigned char *sq, *cq;
+  void *m;
+
+  memset(&p, 0, sizeof(p));
+  if ((ap->ufd = (int)syscall(__NR_io_uring_setup, ap->depth, &p)) < 0)
+    return -1;
+  ap->sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ap->cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ap->sqlen < ap->cqlen)
+      ap->sqlen = ap->cqlen;
+    ap->cqlen = 0;
+  }
+  m = mmap(NULL, ap->sqlen, PROT_READ|PROT_WRITE, MAP_SHARED,
+           ap->ufd, IORING_OFF_SQ_RING);
+  if (m == MAP_FAILED)
+    goto err;
+  ap->sqmem = m;
+  sq = cq = (unsigned char *)m;
+  if (ap->cqlen) {
+    m = mmap(NULL, ap->cqlen, PROT_READ|PROT_WRITE, MAP_SHARED,
+             ap->ufd, IORING_OFF_CQ_RING);
+    if (m == MAP_FAILED)
+      goto err;
+    ap->cqmem = m;
+    cq = (unsigned char *)m;
+  }
+  ap->sqelen = p.sq_entries * sizeof(struct io_uring_sqe);
+  m = mmap(NULL, ap->sqelen, PROT_READ|PROT_WRITE, MAP_SHARED,
+           ap->ufd, IORING_OFF_SQES);
+  if (m == MAP_FAILED)
+    goto err;
+  ap->sqes = (struct io_uring_sqe *)m;
+  ap->sqtail = (unsigned *)(sq + p.sq_off.tail);
+  ap->sqmask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  ap->sqarray = (unsigned *)(sq + p.sq_off.array);
+  ap->cqhead = (unsigned *)(cq + p.cq_off.head);
+  ap->cqtail = (unsigned *)(cq + p.cq_off.tail);
+  ap->cqmask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  ap->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+
+err:
+  auring_free(ap);
+  return -1;
+}
+
+#endif /* URING */
+
+/* lookup is done with result r; it is reported by cdb_async_wait() */
+static void
+adone(struct cdb_async *ap, struct areq *rq, int r)
+{
+  unsigned i = (unsigned)(rq - ap->req);
+  rq->r = r;
+  rq->next = NIL;
+  if (ap->dhead == NIL)
+    ap->dhead = i;
+  else
+    ap->req[ap->dtail].next = i;
+  ap->dtail = i;
+  ++ap->ndone;
+}
+
+static void
+afail(struct cdb_async *ap, struct areq *rq, int err)
+{
+  rq->err = err;
+  adone(ap, rq, -1);
+}
+
+/* queue the rest of the read in progress */
+static void
+aqueue(struct cdb_async *ap, struct areq *rq)
+{
+  unsigned i = (unsigned)(rq - ap->req);
+#ifdef URING
+  if (ap->ufd >= 0) {
+    unsigned tail = *ap->sqtail, s = tail & ap->sqmask;
+    struct io_uring_sqe *sqe = &ap->sqes[s];
+    /* READV and not READ, which needs Linux 5.6 */
+    memset(sqe, 0, sizeof(*sqe));
+    rq->iov.iov_base = rq->rbuf + rq->rdone;
+    rq->iov.iov_len = rq->rlen - rq->rdone;
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = ap->cdbp->cdb_fd;
+    sqe->addr = (unsigned long)&rq->iov;
+    sqe->len = 1;
+    sqe->off = rq->rpos + rq->rdone;
+    sqe->user_data = i;
+    ap->sqarray[s] = s;
+    __atomic_store_n(ap->sqtail, tail + 1, __ATOMIC_RELEASE);
+    ++ap->nsub;
+    return;
+  }
+#endif
+  rq->next = NIL;
+  if (ap->qhead == NIL)
+    ap->qhead = i;
+  else
+    ap->req[ap->qtail].next = i;
+  ap->qtail = i;
+}
+
+static void
+aread(struct cdb_async *ap, struct areq *rq, unsigned state,
+      unsigned char *buf, unsigned len, cdbo_t pos)
+{
+  const struct cdb_pread *cdbp = ap->cdbp;
+  if (pos > cdbp->cdb_fsize || cdbp->cdb_fsize - pos < len) {
+    afail(ap, rq, EPROTO);
+    return;
+  }
+  rq->state = state;
+  rq->rbuf = buf;
+  rq->rlen = len;
+  rq->rdone = 0;
+  rq->rpos = pos;
+  aqueue(ap, rq);
+}
+
+/* read the lengths, the key and up to vread bytes of the value of the
+ * record at pos */
+static void
+arec(struct cdb_async *ap, struct areq *rq, unsigned state, cdbo_t pos)
+{
+  cdbo_t dend = ap->cdbp->cdb_dend;
+  unsigned n = 8 + rq->klen + ap->vread;
+  if (pos < 2048 || pos > dend - 8) {
+    afail(ap, rq, EPROTO);
+    return;
+  }
+  if (dend - pos < n)
+    n = (unsigned)(dend - pos);
+  aread(ap, rq, state, rq->buf + rq->klen, n, pos);
+}
+
+/* check the record read: see pr_match() */
+static int
+amatch(struct cdb_async *ap, struct areq *rq)
+{
+  const unsigned char *rec = rq->rbuf;
+  cdbo_t dend = ap->cdbp->cdb_dend, pos = rq->rpos + 8;
+  unsigned klen = rq->klen, vlen;
+
+  if (cdb_unpack(rec) != klen)
+    return 0;
+  if (rq->rlen < 8 + klen)
+    return rq->err = EPROTO, -1;
+  if (memcmp(rq->buf, rec + 8, klen) != 0)
+    return 0;
+  vlen = cdb_unpack(rec + 4);
+  if (dend < vlen || dend - vlen < pos + klen)
+    return rq->err = EPROTO, -1;
+  rq->kv.cdb_kpos = pos;
+  rq->kv.cdb_klen = klen;
+  rq->kv.cdb_vpos = pos + klen;
+  rq->kv.cdb_vlen = vlen;
+  rq->val = rq->rlen - 8 - klen >= vlen ? rec + 8 + klen : NULL;
+  return 1;
+}
+
+/* read the next run of hash slots */
+static void
+ahrun(struct cdb_async *ap, struct areq *rq)
+{
+  unsigned slot = ap->cdbp->cdb_x ? CDBX_SLOT : 8;
+  unsigned m = rq->n - rq->i < rq->todo ? rq->n - rq->i : rq->todo;
+  rq->m = m > NRUN ? NRUN : m;
+  rq->j = 0;
+  aread(ap, rq, S_SLOTS, rq->blk, rq->m * slot,
+        rq->htab + (cdbo_t)rq->i * slot);
+}
+
+/* go on with the slots read, see pr_find_h() */
+static void
+anext_h(struct cdb_async *ap, struct areq *rq)
+{
+  unsigned slot = ap->cdbp->cdb_x ? CDBX_SLOT : 8;
+  const unsigned char *sp;
+  cdbo_t pos;
+
+  while(rq->j < rq->m) {
+    sp = rq->blk + rq->j++ * slot;
+    pos = slot == 8 ? cdb_unpack(sp + 4) : _cdb_unpack64(sp + 4);
+    if (!pos) {
+      adone(ap, rq, 0);
+      return;
+    }
+    if (cdb_unpack(sp) == rq->hval) {
+      arec(ap, rq, S_HREC, pos);
+      return;
+    }
+  }
+  if (!(rq->todo -= rq->m)) {
+    adone(ap, rq, 0);
+    return;
+  }
+  if ((rq->i += rq->m) == rq->n)
+    rq->i = 0;
+  ahrun(ap, rq);
+}
+
+/* go on with the bucket read, see pr_find_b() */
+static void
+anext_b(struct cdb_async *ap, struct areq *rq)
+{
+  const struct cdb_pread *cdbp = ap->cdbp;
+  unsigned i;
+
+  if (rq->m) {
+    for (i = 0; !(rq->m & (1u << i)); ++i)
+      ;
+    rq->m &= ~(1u << i);
+    arec(ap, rq, S_BREC, _cdb_bpos(rq->blk, i));
+    return;
+  }
+  if (!(rq->blk[CDBX_BFLAGS] & CDBX_BMORE) || !--rq->todo) {
+    adone(ap, rq, 0);
+    return;
+  }
+  if (++rq->i == cdbp->cdb_nbkt)
+    rq->i = 0;
+  aread(ap, rq, S_BKT, rq->blk, CDBX_BUCKET,
+        cdbp->cdb_bkt + (cdbo_t)rq->i * CDBX_BUCKET);
+}
+
+/* the read in progress is complete, take the next step */
+static void
+astep(struct cdb_async *ap, struct areq *rq)
+{
+  const struct cdb_pread *cdbp = ap->cdbp;
+  const unsigned char *sp = rq->blk;
+  unsigned p;
+  int r;
+
+  switch(rq->state) {
+  case S_SLOTS:
+    anext_h(ap, rq);
+    break;
+  case S_HREC:
+    if ((r = amatch(ap, rq)) != 0)
+      adone(ap, rq, r);
+    else
+      anext_h(ap, rq);
+    break;
+  case S_BKT:
+    rq->m = _cdb_bmatch(rq->blk, _cdb_btag(rq->hval));
+    anext_b(ap, rq);
+    break;
+  case S_BREC:
+    if ((r = amatch(ap, rq)) != 0)
+      adone(ap, rq, r);
+    else
+      anext_b(ap, rq);
+    break;
+  case S_PILOT:
+    p = _cdb_mpos(rq->hs, sp[0] | (sp[1] << 8), cdbp->cdb_mtsize);
+    if (p >= cdbp->cdb_mkeys)
+      aread(ap, rq, S_REMAP, rq->blk, 4,
+            ap->remap + (cdbo_t)(p - cdbp->cdb_mkeys) * 4);
+    else
+      aread(ap, rq, S_MSLOT, rq->blk, CDBX_MSLOT,
+            ap->slots + (cdbo_t)p * CDBX_MSLOT);
+    break;
+  case S_REMAP:
+    if ((p = cdb_unpack(sp)) >= cdbp->cdb_mkeys)
+      afail(ap, rq, EPROTO);
+    else
+      aread(ap, rq, S_MSLOT, rq->blk, CDBX_MSLOT,
+            ap->slots + (cdbo_t)p * CDBX_MSLOT);
+    break;
+  case S_MSLOT:
+    if (_cdb_mslotfp(sp) != _cdb_mfp(rq->h))
+      adone(ap, rq, 0);
+    else
+      arec(ap, rq, S_MREC, cdb_unpack(sp) | (cdbo_t)sp[4] << 32);
+    break;
+  case S_MREC:
+    adone(ap, rq, amatch(ap, rq));
+    break;
+  }
+}
+
+/* res bytes (or -errno) of the read in progress have been read */
+static void
+acomplete(struct cdb_async *ap, struct areq *rq, long res)
+{
+  if (res <= 0)
+    afail(ap, rq, res < 0 ? (int)-res : EPROTO);
+  else if ((rq->rdone += (unsigned)res) < rq->rlen)
+    aqueue(ap, rq);
+  else
+    astep(ap, rq);
+}
+
+/* do queued reads and collect completed ones, waiting for at least one
+ * if wait is set */
+static int
+aio(struct cdb_async *ap, int wait)
+{
+#ifdef URING
+  if (ap->ufd >= 0) {
+    unsigned head, tail;
+    struct io_uring_cqe *cqe;
+    struct areq *rq;
+    int res;
+    if (ap->nsub || wait) {
+      int r = (int)syscall(__NR_io_uring_enter, ap->ufd, ap->nsub,
+                           wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+                           NULL, 0);
+      if (r < 0)
+        return errno == EINTR ? 0 : -1;
+      ap->nsub -= (unsigned)r;
+    }
+    head = *ap->cqhead;
+    while(head != (tail = __atomic_load_n(ap->cqtail, __ATOMIC_ACQUIRE)))
+      do {
+        cqe = &ap->cqes[head & ap->cqmask];
+        rq = &ap->req[cqe->user_data];
+        res = cqe->res;
+        __atomic_store_n(ap->cqhead, ++head, __ATOMIC_RELEASE);
+        acomplete(ap, rq, res);
+      } while(head != tail);
+    return 0;
+  }
+#endif
+  {
+    /* reads queued so far, but not the ones they lead to */
+    unsigned i = ap->qhead, last = ap->qtail;
+    struct areq *rq;
+    ssize_t l;
+    (void)wait;
+    if (i == NIL)
+      return 0;
+    ap->qhead = NIL;
+    for (;;) {
+      rq = &ap->req[i];
+      i = rq->next;
+      l = pread(ap->cdbp->cdb_fd, rq->rbuf + rq->rdone, rq->rlen - rq->rdone,
+                (off_t)(rq->rpos + rq->rdone));
+      if (l < 0 && errno == EINTR)
+        aqueue(ap, rq);
+      else
+        acomplete(ap, rq, l < 0 ? -(long)errno : (long)l);
+      if (rq == &ap->req[last])
+        break;
+    }
+  }
+  return 0;
+}
+
+/* report the lookups done */
+static unsigned
+areport(struct cdb_async *ap)
+{
+  struct areq *rq;
+  unsigned n = 0, i;
+  while((i = ap->dhead) != NIL) {
+    rq = &ap->req[i];
+    ap->dhead = rq->next;
+    --ap->ndone;
+    if (ap->cb) {
+      if (rq->r < 0)
+        errno = rq->err;
+      ap->cb(rq->arg, rq->r, rq->r > 0 ? &rq->kv : NULL,
+             rq->r > 0 ? rq->val : NULL);
+    }
+    rq->next = ap->free;
+    ap->free = i;
+    --ap->nact;
+    ++n;
+  }
+  return n;
+}
+
+struct cdb_async *
+cdb_async_new(const struct cdb_pread *cdbp, unsigned depth, unsigned vread,
+              unsigned flags,
+              void (*cb)(void *arg, int r, const struct cdb_kv *res,
+                         const void *val))
+{
+  struct cdb_async *ap;
+  unsigned i;
+
+  if (!depth)
+    depth = 64;
+  else if (depth > 4096)
+    depth = 4096;
+  if (vread > 0x10000000)
+    vread = 0x10000000;
+  if (!(ap = (struct cdb_async *)calloc(1, sizeof(*ap))) ||
+      !(ap->req = (struct areq *)calloc(depth, sizeof(struct areq)))) {
+    free(ap);
+    return errno = ENOMEM, (struct cdb_async *)NULL;
+  }
+  ap->cdbp = cdbp;
+  ap->depth = depth;
+  ap->vread = vread;
+  ap->cb = cb;
+  for (i = 0; i < depth; ++i)
+    ap->req[i].next = i + 1 < depth ? i + 1 : NIL;
+  ap->dhead = ap->qhead = NIL;
+  ap->pilots = cdbp->cdb_mph + CDBX_MHDR;
+  ap->remap = ap->pilots + _cdb_pad8((cdbo_t)cdbp->cdb_mnbkt * 2);
+  ap->slots = ap->remap +
+    _cdb_pad8((cdbo_t)(cdbp->cdb_mtsize - cdbp->cdb_mkeys) * 4);
+  ap->ufd = -1;
+#ifdef URING
+  if (!(flags & CDB_ASYNC_NOURING))
+    auring_init(ap);
+#else
+  (void)flags;
+#endif
+  return ap;
+}
+
+int
+cdb_async_uring(const struct cdb_async *ap)
+{
+  return ap->ufd >= 0;
+}
+
+int
+cdb_async_submit(struct cdb_async *ap, const void *key, unsigned klen,
+                 void *arg)
+{
+  const struct cdb_pread *cdbp = ap->cdbp;
+  struct areq *rq;
+  unsigned need;
+
+  if (ap->free == NIL)
+    return errno = EAGAIN, -1;
+  rq = &ap->req[ap->free];
+  if (klen >= cdbp->cdb_dend)
+    need = 0;		/* not there, nothing to read */
+  else if (klen > (0xffffffffu - 8 - ap->vread) / 2)
+    return errno = ENOMEM, -1;
+  else
+    need = 2 * klen + 8 + ap->vread;
+  if (rq->bsize < need) {
+    unsigned char *b = (unsigned char *)realloc(rq->buf, need);
+    if (!b)
+      return errno = ENOMEM, -1;
+    rq->buf = b;
+    rq->bsize = need;
+  }
+  ap->free = rq->next;
+  ++ap->nact;
+  rq->arg = arg;
+  rq->klen = klen;
+  if (!need) {
+    adone(ap, rq, 0);
+    return 0;
+  }
+  memcpy(rq->buf, key, klen);
+
+  if (cdbp->cdb_mph) {
+    if (!cdbp->cdb_mkeys) {
+      adone(ap, rq, 0);
+      return 0;
+    }
+    rq->h = _cdb_hash64(key, klen);
+    rq->hs = _cdb_mmix(rq->h ^ cdbp->cdb_mseed);
+    aread(ap, rq, S_PILOT, rq->blk, 2,
+          ap->pilots + (cdbo_t)_cdb_mbucket(rq->hs, cdbp->cdb_mnbkt) * 2);
+  }
+  else if (cdbp->cdb_bkt) {
+    rq->hval = cdb_hash(key, klen);
+    rq->i = _cdb_bhome(rq->hval, cdbp->cdb_nbkt);
+    rq->todo = cdbp->cdb_nbkt;
+    aread(ap, rq, S_BKT, rq->blk, CDBX_BUCKET,
+          cdbp->cdb_bkt + (cdbo_t)rq->i * CDBX_BUCKET);
+  }
+  else {
+    rq->hval = cdb_hash(key, klen);
+    if (_cdb_pread_htab(cdbp, rq->hval, &rq->htab, &rq->n) < 0)
+      afail(ap, rq, errno);
+    else if (!rq->n)
+      adone(ap, rq, 0);
+    else {
+      rq->i = (rq->hval >> 8) % rq->n;
+      rq->todo = rq->n;
+      ahrun(ap, rq);
+    }
+  }
+  return 0;
+}
+
+int
+cdb_async_wait(struct cdb_async *ap, unsigned min)
+{
+  unsigned n = 0;
+  if (min > ap->nact)
+    min = ap->nact;
+  for (;;) {
+    if (aio(ap, n + ap->ndone < min) < 0)
+      return -1;
+    n += areport(ap);
+    if (n >= min)
+      return (int)n;
+  }
+}
+
+/* lookups in flight are completed first, without the callback, since
+ * the kernel may still be reading into their buffers; if waiting for
+ * them fails, the buffers are leaked rather than freed under it */
+void
+cdb_async_free(struct cdb_async *ap)
+{
+  unsigned i;
+  if (!ap)
+    return;
+  ap->cb = NULL;
+  while(ap->nact)
+    if (cdb_async_wait(ap, ap->nact) < 0 && errno != EINTR)
+      break;
+#ifdef URING
+  if (ap->ufd >= 0)
+    auring_free(ap);
+#endif
+  if (ap->nact)
+    return;
+  for (i = 0; i < ap->depth; ++i)
+    free(ap->req[i].buf);
+  free(ap->req);
+  free(ap);
+}
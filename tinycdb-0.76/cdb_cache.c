@@ -0,0 +1,251 @@
+/* cdb_cache_new, cdb_cache_free and cdb_cache_stats routines:
+ * block cache for the pread-based reader, see cdb_pread.c
+ *
+ * The cache is split into shards, each with its own lock, blocks and
+ * hash chains, so that threads looking up different blocks rarely
+ * wait for each other.  A shard evicts blocks with the CLOCK algorithm:
+ * a hit sets the block's reference bit, and the clock hand clears the
+ * bits it passes, taking the first block which has it clear.  Blocks
+ * read in start with the bit clear, so a scan can't flush hot blocks.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cdb_int.h"
+
+#define NIL	(~0u)
+
+struct cdb_cshard {
+  pthread_mutex_t lock;
+  unsigned nblk, nused;		/* blocks allocated and in use */
+  unsigned hand;		/* CLOCK hand */
+  unsigned hmask;		/* hash chain heads - 1, power of 2 - 1 */
+  unsigned *head, *next;	/* hash chains, NIL-terminated */
+  cdbo_t *bno;			/* block number of every block */
+  unsigned *fid;		/* file id of every block */
+  unsigned char *ref;		/* reference bit of every block */
+  unsigned char *mem;		/* data of all blocks */
+  cdbo_t hits, misses;
+  char pad[64];			/* keep shards in different cache lines */
+};
+
+struct cdb_cache {
+  unsigned bsize;		/* block size */
+  unsigned nshards;		/* power of 2 */
+  pthread_mutex_t lock;		/* for nextfid */
+  unsigned nextfid;
+  struct cdb_cshard *shards;
+};
+
+#define cblkhash(fid, bno) _cdb_mmix((bno) ^ ((cdbo_t)(fid) << 40))
+
+struct cdb_cache *
+cdb_cache_new(cdbo_t size, unsigned bsize, unsigned nshards)
+{
+  struct cdb_cache *cache;
+  struct cdb_cshard *s;
+  unsigned i, n, h;
+  cdbo_t nblk;
+
+  if (!bsize)
+    bsize = 4096;
+  if (!nshards)
+    nshards = 16;
+  for (n = 1; n < nshards && n < 4096; n <<= 1)
+    ;
+  nshards = n;
+  nblk = size / bsize / nshards;
+  if (!nblk)
+    nblk = 1;
+  if (nblk > 0xffffffu || (size_t)(nblk * bsize) != nblk * bsize)
+    return errno = ENOMEM, (struct cdb_cache*)NULL;
+
+  if (!(cache = (struct cdb_cache*)calloc(1, sizeof(*cache))) ||
+      !(cache->shards = (struct cdb_cshard*)calloc(nshards, sizeof(*s)))) {
+    free(cache);
+    return errno = ENOMEM, (struct cdb_cache*)NULL;
+  }
+  cache->bsize = bsize;
+  cache->nshards = nshards;
+  cache->nextfid = 1;
+  pthread_mutex_init(&cache->lock, NULL);
+  for (h = 1; h < nblk; h <<= 1)
+    ;
+  for (i = 0; i < nshards; ++i) {
+    s = &cache->shards[i];
+    pthread_mutex_init(&s->lock, NULL);
+    s->nblk = (unsigned)nblk;
+    s->hmask = h - 1;
+    s->head = (unsigned*)malloc((size_t)h * sizeof(unsigned));
+    s->next = (unsigned*)malloc((size_t)nblk * sizeof(unsigned));
+    s->bno = (cdbo_t*)malloc((size_t)nblk * sizeof(cdbo_t));
+    s->fid = (unsigned*)malloc((size_t)nblk * sizeof(unsigned));
+    s->ref = (unsigned char*)calloc((size_t)nblk, 1);
+    s->mem = (unsigned char*)malloc((size_t)(nblk * bsize));
+    if (!s->head || !s->next || !s->bno || !s->fid || !s->ref || !s->mem) {
+      cache->nshards = i + 1;
+      cdb_cache_free(cache);
+      return errno = ENOMEM, (struct cdb_cache*)NULL;
+    }
+    memset(s->head, 0xff, (size_t)h * sizeof(unsigned));
+  }
+  return cache;
+}
+
+void
+cdb_cache_free(struct cdb_cache *cache)
+{
+  unsigned i;
+  struct cdb_cshard *s;
+  if (!cache)
+    return;
+  for (i = 0; i < cache->nshards; ++i) {
+    s = &cache->shards[i];
+    pthread_mutex_destroy(&s->lock);
+    free(s->head); free(s->next); free(s->bno); free(s->fid);
+    free(s->ref); free(s->mem);
+  }
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->shards);
+  free(cache);
+}
+
+void
+cdb_cache_stats(struct cdb_cache *cache, cdbo_t *hits, cdbo_t *misses)
+{
+  unsigned i;
+  struct cdb_cshard *s;
+  *hits = *misses = 0;
+  for (i = 0; i < cache->nshards; ++i) {
+    s = &cache->shards[i];
+    pthread_mutex_lock(&s->lock);
+    *hits += s->hits;
+    *misses += s->misses;
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+/* new file id, so that blocks of files closed and of files opened
+ * later never get mixed up */
+unsigned internal_function
+_cdb_cache_fid(struct cdb_cache *cache)
+{
+  unsigned fid;
+  pthread_mutex_lock(&cache->lock);
+  if (!(fid = cache->nextfid++))
+    fid = cache->nextfid++;
+  pthread_mutex_unlock(&cache->lock);
+  return fid;
+}
+
+/* block index in the shard, or NIL */
+static unsigned
+clookup(const struct cdb_cshard *s, unsigned fid, cdbo_t bno, cdbo_t h)
+{
+  unsigned i;
+  for (i = s->head[(h >> 32) & s->hmask]; i != NIL; i = s->next[i])
+    if (s->bno[i] == bno && s->fid[i] == fid)
+      break;
+  return i;
+}
+
+/* take a free block, or evict one */
+static unsigned
+cvictim(struct cdb_cshard *s)
+{
+  unsigned i, *p;
+  if (s->nused < s->nblk)
+    return s->nused++;
+  for (;;) {
+    i = s->hand;
+    if (++s->hand == s->nblk)
+      s->hand = 0;
+    if (!s->ref[i])
+      break;
+    s->ref[i] = 0;
+  }
+  p = &s->head[(cblkhash(s->fid[i], s->bno[i]) >> 32) & s->hmask];
+  while(*p != i)
+    p = &s->next[*p];
+  *p = s->next[i];
+  return i;
+}
+
+/* read len bytes at pos of file fd, retrying after signals; a short
+ * read is a format error, since callers check pos and len first */
+int internal_function
+_cdb_pread(int fd, void *buf, unsigned len, cdbo_t pos)
+{
+  ssize_t l;
+  while(len) {
+    l = pread(fd, buf, len, (off_t)pos);
+    if (l < 0 && errno == EINTR)
+      continue;
+    if (l <= 0)
+      return l < 0 ? -1 : (errno = EPROTO, -1);
+    buf = (char*)buf + l;
+    len -= (unsigned)l;
+    pos += (cdbo_t)l;
+  }
+  return 0;
+}
+
+/* read len bytes at pos of the file with the given id and size via the
+ * cache; a missing block is read without holding the shard's lock */
+int internal_function
+_cdb_cache_read(struct cdb_cache *cache, unsigned fid, int fd, cdbo_t fsize,
+                void *buf, unsigned len, cdbo_t pos)
+{
+  unsigned bsize = cache->bsize, off, n, i;
+  unsigned char *tmp = NULL;
+  struct cdb_cshard *s;
+  cdbo_t bno, h;
+
+  while(len) {
+    bno = pos / bsize;
+    off = (unsigned)(pos % bsize);
+    n = bsize - off < len ? bsize - off : len;
+    h = cblkhash(fid, bno);
+    s = &cache->shards[h & (cache->nshards - 1)];
+    pthread_mutex_lock(&s->lock);
+    if ((i = clookup(s, fid, bno, h)) != NIL) {
+      s->ref[i] = 1;
+      ++s->hits;
+      memcpy(buf, s->mem + (size_t)i * bsize + off, n);
+      pthread_mutex_unlock(&s->lock);
+    }
+    else {
+      unsigned blen = fsize - bno * bsize < bsize ?
+        (unsigned)(fsize - bno * bsize) : bsize;
+      ++s->misses;
+      pthread_mutex_unlock(&s->lock);
+      if (!tmp && !(tmp = (unsigned char*)malloc(bsize)))
+        return errno = ENOMEM, -1;
+      if (_cdb_pread(fd, tmp, blen, bno * bsize) < 0) {
+        free(tmp);
+        return -1;
+      }
+      memcpy(buf, tmp + off, n);
+      pthread_mutex_lock(&s->lock);
+      if (clookup(s, fid, bno, h) == NIL) {	/* not read by others */
+        i = cvictim(s);
+        s->bno[i] = bno;
+        s->fid[i] = fid;
+        s->ref[i] = 0;
+        s->next[i] = s->head[(h >> 32) & s->hmask];
+        s->head[(h >> 32) & s->hmask] = i;
+        memcpy(s->mem + (size_t)i * bsize, tmp, blen);
+      }
+      pthread_mutex_unlock(&s->lock);
+    }
+    buf = (char*)buf + n;
+    pos += n;
+    len -= n;
+  }
+  free(tmp);
+  return 0;
+}
@@ -1,5 +1,5 @@
 /* $Id: cdb_find.c,v 1.8 2003/11/03 16:42:41 mjt Exp $
- * cdb_find routine
+ * cdb_find and cdb_find_r routines
  *
  * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
  * Public domain.
@@ -7,8 +7,150 @@
 
 #include "cdb_int.h"
 
+/* the same as below but for perfect hash index, see cdb_int.h;
+ * h is _cdb_hash64() of the key */
+int internal_function
+_cdb_find_m(const struct cdb *cdbp, const void *key, unsigned klen,
+            cdbo_t h, struct cdb_kv *res)
+{
+  const unsigned char *sp;	/* the slot */
+  cdbo_t pos;
+  unsigned n;
+
+  if (!cdbp->cdb_mkeys)
+    return 0;
+  if (!(sp = _cdb_mslot(cdbp, h)))
+    return errno = EPROTO, -1;
+  if (_cdb_mslotfp(sp) != _cdb_mfp(h))
+    return 0;			/* most misses end here */
+  pos = cdb_unpack(sp) | (cdbo_t)sp[4] << 32;
+  if (pos > cdbp->cdb_dend - 8)
+    return errno = EPROTO, -1;
+  if (cdb_unpack(cdbp->cdb_mem + pos) != klen)
+    return 0;
+  if (cdbp->cdb_dend - klen < pos + 8)
+    return errno = EPROTO, -1;
+  if (memcmp(key, cdbp->cdb_mem + pos + 8, klen) != 0)
+    return 0;
+  n = cdb_unpack(cdbp->cdb_mem + pos + 4);
+  pos += 8;
+  if (cdbp->cdb_dend < n || cdbp->cdb_dend - n < pos + klen)
+    return errno = EPROTO, -1;
+  res->cdb_kpos = pos;
+  res->cdb_klen = klen;
+  res->cdb_vpos = pos + klen;
+  res->cdb_vlen = n;
+  return 1;
+}
+
+/* the same as below but for bucketed index, see cdb_int.h */
+int internal_function
+_cdb_find_b(const struct cdb *cdbp, const void *key, unsigned klen,
+            unsigned hval, struct cdb_kv *res)
+{
+  const unsigned char *bkt;	/* current bucket */
+  const unsigned char *bend;	/* end of buckets */
+  unsigned todo;		/* buckets left to look */
+  unsigned m, i, n;
+  cdbo_t pos;
+
+  bkt = cdbp->cdb_bkt +
+    (cdbo_t)_cdb_bhome(hval, cdbp->cdb_nbkt) * CDBX_BUCKET;
+  bend = cdbp->cdb_bkt + (cdbo_t)cdbp->cdb_nbkt * CDBX_BUCKET;
+
+  for (todo = cdbp->cdb_nbkt; todo; --todo) {
+    m = _cdb_bmatch(bkt, _cdb_btag(hval));
+    for (i = 0; m; ++i, m >>= 1) {
+      if (!(m & 1))
+	continue;
+      pos = _cdb_bpos(bkt, i);
+      if (pos > cdbp->cdb_dend - 8) /* key+val lengths */
+	return errno = EPROTO, -1;
+      if (cdb_unpack(cdbp->cdb_mem + pos) == klen) {
+	if (cdbp->cdb_dend - klen < pos + 8)
+	  return errno = EPROTO, -1;
+	if (memcmp(key, cdbp->cdb_mem + pos + 8, klen) == 0) {
+	  n = cdb_unpack(cdbp->cdb_mem + pos + 4);
+	  pos += 8;
+	  if (cdbp->cdb_dend < n || cdbp->cdb_dend - n < pos + klen)
+	    return errno = EPROTO, -1;
+	  res->cdb_kpos = pos;
+	  res->cdb_klen = klen;
+	  res->cdb_vpos = pos + klen;
+	  res->cdb_vlen = n;
+	  return 1;
+	}
+      }
+    }
+    if (!(bkt[CDBX_BFLAGS] & CDBX_BMORE))
+      return 0;
+    if ((bkt += CDBX_BUCKET) >= bend)
+      bkt = cdbp->cdb_bkt;
+  }
+  return 0;
+}
+
+/* the same as below but for 64-bit format with 12-byte slots */
+static int
+cdb_find_x(const struct cdb *cdbp, const void *key, unsigned klen,
+           unsigned hval, struct cdb_kv *res)
+{
+  const unsigned char *htp;	/* hash table pointer */
+  const unsigned char *htab;	/* hash table */
+  const unsigned char *htend;	/* end of hash table */
+  cdbo_t httodo;		/* ht bytes left to look */
+  cdbo_t pos;
+  unsigned n;
+
+  htp = cdbp->cdb_xtoc + (hval & 255) * CDBX_TOCENT;
+  n = cdb_unpack(htp + 8);	/* table size */
+  if (!n)			/* empty table */
+    return 0;			/* not found */
+  httodo = (cdbo_t)n * CDBX_SLOT;
+  pos = _cdb_unpack64(htp);	/* htab position */
+  if (pos < cdbp->cdb_dend	/* is htab inside data section ? */
+      || pos > cdbp->cdb_fsize	/* htab start within file ? */
+      || httodo > cdbp->cdb_fsize - pos) /* entrie htab within file ? */
+    return errno = EPROTO, -1;
+
+  htab = cdbp->cdb_mem + pos;
+  htend = htab + httodo;
+  htp = htab + ((hval >> 8) % n) * CDBX_SLOT;
+
+  for(;;) {
+    pos = _cdb_unpack64(htp + 4);
+    if (!pos)
+      return 0;
+    if (cdb_unpack(htp) == hval) {
+      if (pos > cdbp->cdb_dend - 8)
+	return errno = EPROTO, -1;
+      if (cdb_unpack(cdbp->cdb_mem + pos) == klen) {
+	if (cdbp->cdb_dend - klen < pos + 8)
+	  return errno = EPROTO, -1;
+	if (memcmp(key, cdbp->cdb_mem + pos + 8, klen) == 0) {
+	  n = cdb_unpack(cdbp->cdb_mem + pos + 4);
+	  pos += 8;
+	  if (cdbp->cdb_dend < n || cdbp->cdb_dend - n < pos + klen)
+	    return errno = EPROTO, -1;
+	  res->cdb_kpos = pos;
+	  res->cdb_klen = klen;
+	  res->cdb_vpos = pos + klen;
+	  res->cdb_vlen = n;
+	  return 1;
+	}
+      }
+    }
+    httodo -= CDBX_SLOT;
+    if (!httodo)
+      return 0;
+    if ((htp += CDBX_SLOT) >= htend)
+      htp = htab;
+  }
+}
+
 int
-cdb_find(struct cdb *cdbp, const void *key, unsigned klen)
+cdb_find_r(const struct cdb *cdbp, const void *key, unsigned klen,
+           struct cdb_kv *res)
 {
   const unsigned char *htp;	/* hash table pointer */
   const unsigned char *htab;	/* hash table */
@@ -21,7 +163,17 @@ cdb_find(struct cdb *cdbp, const void *key, unsigned klen)
   if (klen >= cdbp->cdb_dend)	/* if key size is too large */
     return 0;
 
-  hval = cdb_hash(key, klen);
+  /* perfect hash index does not need cdb_hash() unless there's filter */
+  if (!cdbp->cdb_mph || cdbp->cdb_filter)
+    hval = cdb_hash(key, klen);
+  if (cdbp->cdb_filter && !_cdb_fcheck(cdbp, hval))
+    return 0;			/* most misses end here */
+  if (cdbp->cdb_mph)
+    return _cdb_find_m(cdbp, key, klen, _cdb_hash64(key, klen), res);
+  if (cdbp->cdb_bkt)
+    return _cdb_find_b(cdbp, key, klen, hval, res);
+  if (cdbp->cdb_xtoc)
+    return cdb_find_x(cdbp, key, klen, hval, res);
 
   /* find (pos,n) hash table to use */
   /* first 2048 bytes (toc) are always available */
@@ -58,10 +210,10 @@ cdb_find(struct cdb *cdbp, const void *key, unsigned klen)
 	  pos += 8;
 	  if (cdbp->cdb_dend < n || cdbp->cdb_dend - n < pos + klen)
 	    return errno = EPROTO, -1;
-	  cdbp->cdb_kpos = pos;
-	  cdbp->cdb_klen = klen;
-	  cdbp->cdb_vpos = pos + klen;
-	  cdbp->cdb_vlen = n;
+	  res->cdb_kpos = pos;
+	  res->cdb_klen = klen;
+	  res->cdb_vpos = pos + klen;
+	  res->cdb_vlen = n;
 	  return 1;
 	}
       }
@@ -74,3 +226,13 @@ cdb_find(struct cdb *cdbp, const void *key, unsigned klen)
   }
 
 }
+
+int
+cdb_find(struct cdb *cdbp, const void *key, unsigned klen)
+{
+  struct cdb_kv kv;
+  int r = cdb_find_r(cdbp, key, klen, &kv);
+  if (r > 0)
+    _cdb_setkv(cdbp, &kv);
+  return r;
+}
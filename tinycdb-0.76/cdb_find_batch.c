@@ -0,0 +1,290 @@
+/* cdb_find_batch routine
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+/* Looks up a group of keys at once.  Every step of a lookup (toc entry,
+ * hash slot, record) is a dependent and usually cold memory access, so
+ * instead of completing keys one by one, we walk the whole group through
+ * each step, prefetching what the next step will need.  By the time we
+ * come back to a key, its memory is (hopefully) already in cache.
+ * With a filter, checking it is the first step, so that misses stop
+ * there.  See cdb_find.c for comments on the lookup itself.
+ */
+
+#include "cdb_int.h"
+
+#define GROUP 16	/* lookups in flight */
+
+/* clear results, hash the keys and prefetch their filter blocks;
+ * keys which can't be in the file get NULL in skip[] */
+static void
+filter_hash(const struct cdb *cdbp, const struct cdb_iovec *keys,
+            unsigned m, unsigned *hval, const unsigned char **skip,
+            struct cdb_kv *res)
+{
+  unsigned i;
+  for (i = 0; i < m; ++i) {
+    res[i].cdb_kpos = res[i].cdb_vpos = 0;
+    res[i].cdb_klen = res[i].cdb_vlen = 0;
+    if (keys[i].cdb_iov_len >= cdbp->cdb_dend) {
+      skip[i] = NULL;		/* key size is too large */
+      continue;
+    }
+    skip[i] = cdbp->cdb_mem;	/* anything but NULL */
+    if (cdbp->cdb_mph && !cdbp->cdb_filter)
+      continue;			/* it has its own hash */
+    hval[i] = cdb_hash(keys[i].cdb_iov_base, keys[i].cdb_iov_len);
+    if (cdbp->cdb_filter)
+      _cdb_prefetch(_cdb_fblock(cdbp, hval[i]));
+  }
+  if (cdbp->cdb_filter)
+    for (i = 0; i < m; ++i)
+      if (skip[i] && !_cdb_fcheck(cdbp, hval[i]))
+        skip[i] = NULL;
+}
+
+/* probe hash table starting at htp; slot is the slot size */
+static int
+probe(const struct cdb *cdbp, const void *key, unsigned klen, unsigned hval,
+      const unsigned char *htp, const unsigned char *htab,
+      const unsigned char *htend, cdbo_t httodo, unsigned slot,
+      struct cdb_kv *res)
+{
+  cdbo_t pos;
+  unsigned n;
+
+  for(;;) {
+    pos = slot == 8 ? cdb_unpack(htp + 4) : _cdb_unpack64(htp + 4);
+    if (!pos)
+      return 0;
+    if (cdb_unpack(htp) == hval) {
+      if (pos > cdbp->cdb_dend - 8)
+	return errno = EPROTO, -1;
+      if (cdb_unpack(cdbp->cdb_mem + pos) == klen) {
+	if (cdbp->cdb_dend - klen < pos + 8)
+	  return errno = EPROTO, -1;
+	if (memcmp(key, cdbp->cdb_mem + pos + 8, klen) == 0) {
+	  n = cdb_unpack(cdbp->cdb_mem + pos + 4);
+	  pos += 8;
+	  if (cdbp->cdb_dend < n || cdbp->cdb_dend - n < pos + klen)
+	    return errno = EPROTO, -1;
+	  res->cdb_kpos = pos;
+	  res->cdb_klen = klen;
+	  res->cdb_vpos = pos + klen;
+	  res->cdb_vlen = n;
+	  return 1;
+	}
+      }
+    }
+    httodo -= slot;
+    if (!httodo)
+      return 0;
+    if ((htp += slot) >= htend)
+      htp = htab;
+  }
+}
+
+/* the same for perfect hash index: pilot, then slot, then record */
+static int
+find_batch_m(const struct cdb *cdbp,
+             const struct cdb_iovec *keys, unsigned nkeys,
+             struct cdb_kv *res)
+{
+  cdbo_t h[GROUP];
+  unsigned hval[GROUP];
+  const unsigned char *sp[GROUP];
+  unsigned found = 0;
+  unsigned b, m, i;
+  cdbo_t pos, hs;
+  int r;
+
+  for (b = 0; b < nkeys; b += m, keys += m, res += m) {
+    m = nkeys - b < GROUP ? nkeys - b : GROUP;
+
+    filter_hash(cdbp, keys, m, hval, sp, res);
+    for (i = 0; i < m; ++i) {
+      if (!sp[i] || !cdbp->cdb_mkeys) {
+        sp[i] = NULL;
+        continue;
+      }
+      h[i] = _cdb_hash64(keys[i].cdb_iov_base, keys[i].cdb_iov_len);
+      hs = _cdb_mmix(h[i] ^ cdbp->cdb_mseed);
+      _cdb_prefetch(cdbp->cdb_mph + CDBX_MHDR +
+                    _cdb_mbucket(hs, cdbp->cdb_mnbkt) * 2);
+    }
+
+    for (i = 0; i < m; ++i) {
+      if (!sp[i])
+        continue;
+      if (!(sp[i] = _cdb_mslot(cdbp, h[i])))
+        return errno = EPROTO, -1;
+      _cdb_prefetch(sp[i]);
+    }
+
+    for (i = 0; i < m; ++i) {
+      if (!sp[i])
+        continue;
+      if (_cdb_mslotfp(sp[i]) != _cdb_mfp(h[i]))
+        sp[i] = NULL;		/* not found */
+      else if ((pos = cdb_unpack(sp[i]) | (cdbo_t)sp[i][4] << 32)
+               < cdbp->cdb_dend)
+        _cdb_prefetch(cdbp->cdb_mem + pos);
+    }
+
+    for (i = 0; i < m; ++i) {
+      if (!sp[i])
+        continue;
+      r = _cdb_find_m(cdbp, keys[i].cdb_iov_base, keys[i].cdb_iov_len,
+                      h[i], &res[i]);
+      if (r < 0)
+        return -1;
+      found += r;
+    }
+  }
+
+  return (int)found;
+}
+
+/* the same for bucketed index: the bucket is all the index a lookup
+ * usually needs, so prefetch it, then the first candidate record */
+static int
+find_batch_b(const struct cdb *cdbp,
+             const struct cdb_iovec *keys, unsigned nkeys,
+             struct cdb_kv *res)
+{
+  unsigned hval[GROUP];
+  const unsigned char *bkt[GROUP];
+  unsigned found = 0;
+  unsigned b, m, i, k;
+  cdbo_t pos;
+  int r;
+
+  for (b = 0; b < nkeys; b += m, keys += m, res += m) {
+    m = nkeys - b < GROUP ? nkeys - b : GROUP;
+
+    filter_hash(cdbp, keys, m, hval, bkt, res);
+    for (i = 0; i < m; ++i) {
+      if (!bkt[i])
+        continue;
+      bkt[i] = cdbp->cdb_bkt +
+        (cdbo_t)_cdb_bhome(hval[i], cdbp->cdb_nbkt) * CDBX_BUCKET;
+      _cdb_prefetch(bkt[i]);
+    }
+
+    for (i = 0; i < m; ++i) {
+      if (!bkt[i])
+        continue;
+      if (!(k = _cdb_bmatch(bkt[i], _cdb_btag(hval[i])))) {
+        if (!(bkt[i][CDBX_BFLAGS] & CDBX_BMORE))
+          bkt[i] = NULL;	/* not found */
+        continue;
+      }
+      for (pos = 0; !(k & 1); k >>= 1)
+        ++pos;
+      pos = _cdb_bpos(bkt[i], pos);
+      if (pos < cdbp->cdb_dend)
+        _cdb_prefetch(cdbp->cdb_mem + pos);
+    }
+
+    for (i = 0; i < m; ++i) {
+      if (!bkt[i])
+        continue;
+      r = _cdb_find_b(cdbp, keys[i].cdb_iov_base, keys[i].cdb_iov_len,
+                      hval[i], &res[i]);
+      if (r < 0)
+        return -1;
+      found += r;
+    }
+  }
+
+  return (int)found;
+}
+
+int
+cdb_find_batch(const struct cdb *cdbp,
+               const struct cdb_iovec *keys, unsigned nkeys,
+               struct cdb_kv *res)
+{
+  unsigned hval[GROUP];
+  const unsigned char *htp[GROUP];	/* toc entry, then first slot */
+  const unsigned char *htab[GROUP], *htend[GROUP];
+  unsigned slot = cdbp->cdb_xtoc ? CDBX_SLOT : 8;
+  unsigned found = 0;
+  unsigned b, m, i, n;
+  cdbo_t pos, httodo;
+  int r;
+
+  if (cdbp->cdb_mph)
+    return find_batch_m(cdbp, keys, nkeys, res);
+  if (cdbp->cdb_bkt)
+    return find_batch_b(cdbp, keys, nkeys, res);
+
+  for (b = 0; b < nkeys; b += m, keys += m, res += m) {
+    m = nkeys - b < GROUP ? nkeys - b : GROUP;
+
+    /* stage 1: hash the keys and prefetch their toc entries */
+    filter_hash(cdbp, keys, m, hval, htp, res);
+    for (i = 0; i < m; ++i) {
+      if (!htp[i])
+        continue;
+      htp[i] = cdbp->cdb_xtoc ?
+        cdbp->cdb_xtoc + (hval[i] & 255) * CDBX_TOCENT :
+        cdbp->cdb_mem + ((hval[i] << 3) & 2047);
+      _cdb_prefetch(htp[i]);
+    }
+
+    /* stage 2: locate the hash tables and prefetch the first slots */
+    for (i = 0; i < m; ++i) {
+      if (!htp[i])
+        continue;
+      if (slot == 8) {
+        n = cdb_unpack(htp[i] + 4);
+        pos = cdb_unpack(htp[i]);
+      }
+      else {
+        n = cdb_unpack(htp[i] + 8);
+        pos = _cdb_unpack64(htp[i]);
+      }
+      if (!n) {			/* empty table */
+        htp[i] = NULL;
+        continue;
+      }
+      httodo = (cdbo_t)n * slot;
+      if (pos < cdbp->cdb_dend
+          || pos > cdbp->cdb_fsize
+          || httodo > cdbp->cdb_fsize - pos)
+        return errno = EPROTO, -1;
+      htab[i] = cdbp->cdb_mem + pos;
+      htend[i] = htab[i] + httodo;
+      htp[i] = htab[i] + ((hval[i] >> 8) % n) * slot;
+      _cdb_prefetch(htp[i]);
+    }
+
+    /* stage 3: prefetch records the first slots point to */
+    for (i = 0; i < m; ++i) {
+      if (!htp[i])
+        continue;
+      pos = slot == 8 ? cdb_unpack(htp[i] + 4) : _cdb_unpack64(htp[i] + 4);
+      if (!pos)			/* empty slot, not found */
+        htp[i] = NULL;
+      else if (cdb_unpack(htp[i]) == hval[i] && pos < cdbp->cdb_dend)
+        _cdb_prefetch(cdbp->cdb_mem + pos);
+    }
+
+    /* stage 4: compare keys, probing further on collisions */
+    for (i = 0; i < m; ++i) {
+      if (!htp[i])
+        continue;
+      r = probe(cdbp, keys[i].cdb_iov_base, keys[i].cdb_iov_len, hval[i],
+                htp[i], htab[i], htend[i], (cdbo_t)(htend[i] - htab[i]),
+                slot, &res[i]);
+      if (r < 0)
+        return -1;
+      found += r;
+    }
+  }
+
+  return (int)found;
+}
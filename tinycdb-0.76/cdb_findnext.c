@@ -10,19 +10,62 @@
 #include "cdb_int.h"
 
 int
-cdb_findinit(struct cdb_find *cdbfp, struct cdb *cdbp,
+cdb_findinit(struct cdb_find *cdbfp, const struct cdb *cdbp,
              const void *key, unsigned klen)
 {
-  unsigned n, pos;
+  unsigned n;
+  cdbo_t pos;
 
   cdbfp->cdb_cdbp = cdbp;
   cdbfp->cdb_key = key;
   cdbfp->cdb_klen = klen;
   cdbfp->cdb_hval = cdb_hash(key, klen);
 
+  if (cdbp->cdb_filter && !_cdb_fcheck(cdbp, cdbfp->cdb_hval)) {
+    cdbfp->cdb_httodo = 0;	/* not found */
+    return 0;
+  }
+
+  /* perfect hash index has at most one record per key */
+  if (cdbp->cdb_mph) {
+    cdbfp->cdb_httodo = 1;
+    return 1;
+  }
+
+  /* with bucketed index, cdb_htp is the current bucket, and cdb_httodo
+   * is number of buckets left to look in upper bits and the slots of
+   * the current bucket left to check in lower 16 bits */
+  if (cdbp->cdb_bkt) {
+    cdbfp->cdb_htab = cdbp->cdb_bkt;
+    cdbfp->cdb_htend = cdbp->cdb_bkt + (cdbo_t)cdbp->cdb_nbkt * CDBX_BUCKET;
+    cdbfp->cdb_htp = cdbp->cdb_bkt +
+      (cdbo_t)_cdb_bhome(cdbfp->cdb_hval, cdbp->cdb_nbkt) * CDBX_BUCKET;
+    cdbfp->cdb_httodo = ((cdbo_t)(cdbp->cdb_nbkt - 1) << 16) |
+      _cdb_bmatch(cdbfp->cdb_htp, _cdb_btag(cdbfp->cdb_hval));
+    return 1;
+  }
+
+  if (cdbp->cdb_xtoc) {
+    cdbfp->cdb_htp = cdbp->cdb_xtoc + (cdbfp->cdb_hval & 255) * CDBX_TOCENT;
+    n = cdb_unpack(cdbfp->cdb_htp + 8);
+    cdbfp->cdb_httodo = (cdbo_t)n * CDBX_SLOT;
+    if (!n)
+      return 0;
+    pos = _cdb_unpack64(cdbfp->cdb_htp);
+    if (pos < cdbp->cdb_dend
+        || pos > cdbp->cdb_fsize
+        || cdbfp->cdb_httodo > cdbp->cdb_fsize - pos)
+      return errno = EPROTO, -1;
+    cdbfp->cdb_htab = cdbp->cdb_mem + pos;
+    cdbfp->cdb_htend = cdbfp->cdb_htab + cdbfp->cdb_httodo;
+    cdbfp->cdb_htp = cdbfp->cdb_htab +
+      ((cdbfp->cdb_hval >> 8) % n) * CDBX_SLOT;
+    return 1;
+  }
+
   cdbfp->cdb_htp = cdbp->cdb_mem + ((cdbfp->cdb_hval << 3) & 2047);
   n = cdb_unpack(cdbfp->cdb_htp + 4);
-  cdbfp->cdb_httodo = n << 3;
+  cdbfp->cdb_httodo = (cdbo_t)n << 3;
   if (!n)
     return 0;
   pos = cdb_unpack(cdbfp->cdb_htp);
@@ -39,20 +82,75 @@ cdb_findinit(struct cdb_find *cdbfp, struct cdb *cdbp,
   return 1;
 }
 
+static int
+cdb_findnext_b(struct cdb_find *cdbfp, struct cdb_kv *res) {
+  const struct cdb *cdbp = cdbfp->cdb_cdbp;
+  cdbo_t pos;
+  unsigned n, i;
+  unsigned klen = cdbfp->cdb_klen;
+
+  for(;;) {
+    if (!(cdbfp->cdb_httodo & 0xffff)) {
+      if (cdbfp->cdb_httodo < 0x10000
+          || !(cdbfp->cdb_htp[CDBX_BFLAGS] & CDBX_BMORE))
+        return 0;
+      if ((cdbfp->cdb_htp += CDBX_BUCKET) >= cdbfp->cdb_htend)
+        cdbfp->cdb_htp = cdbfp->cdb_htab;
+      cdbfp->cdb_httodo = (cdbfp->cdb_httodo - 0x10000) |
+        _cdb_bmatch(cdbfp->cdb_htp, _cdb_btag(cdbfp->cdb_hval));
+      continue;
+    }
+    for (i = 0; !(cdbfp->cdb_httodo & (1u << i)); ++i)
+      ;
+    cdbfp->cdb_httodo &= ~(cdbo_t)(1u << i);
+    pos = _cdb_bpos(cdbfp->cdb_htp, i);
+    if (pos > cdbp->cdb_dend - 8)
+      return errno = EPROTO, -1;
+    if (cdb_unpack(cdbp->cdb_mem + pos) == klen) {
+      if (cdbp->cdb_dend - klen < pos + 8)
+	return errno = EPROTO, -1;
+      if (memcmp(cdbfp->cdb_key, cdbp->cdb_mem + pos + 8, klen) == 0) {
+	n = cdb_unpack(cdbp->cdb_mem + pos + 4);
+	pos += 8;
+	if (cdbp->cdb_dend < n || cdbp->cdb_dend - n < pos + klen)
+	  return errno = EPROTO, -1;
+	res->cdb_kpos = pos;
+	res->cdb_klen = klen;
+	res->cdb_vpos = pos + klen;
+	res->cdb_vlen = n;
+	return 1;
+      }
+    }
+  }
+}
+
 int
-cdb_findnext(struct cdb_find *cdbfp) {
-  struct cdb *cdbp = cdbfp->cdb_cdbp;
-  unsigned pos, n;
+cdb_findnext_r(struct cdb_find *cdbfp, struct cdb_kv *res) {
+  const struct cdb *cdbp = cdbfp->cdb_cdbp;
+  cdbo_t pos;
+  unsigned n;
   unsigned klen = cdbfp->cdb_klen;
+  unsigned slot = cdbp->cdb_xtoc ? CDBX_SLOT : 8;
+
+  if (cdbp->cdb_mph) {
+    if (!cdbfp->cdb_httodo)
+      return 0;
+    cdbfp->cdb_httodo = 0;
+    return _cdb_find_m(cdbp, cdbfp->cdb_key, klen,
+                       _cdb_hash64(cdbfp->cdb_key, klen), res);
+  }
+  if (cdbp->cdb_bkt)
+    return cdb_findnext_b(cdbfp, res);
 
   while(cdbfp->cdb_httodo) {
-    pos = cdb_unpack(cdbfp->cdb_htp + 4);
+    pos = slot == 8 ? cdb_unpack(cdbfp->cdb_htp + 4)
+                    : _cdb_unpack64(cdbfp->cdb_htp + 4);
     if (!pos)
       return 0;
     n = cdb_unpack(cdbfp->cdb_htp) == cdbfp->cdb_hval;
-    if ((cdbfp->cdb_htp += 8) >= cdbfp->cdb_htend)
+    if ((cdbfp->cdb_htp += slot) >= cdbfp->cdb_htend)
       cdbfp->cdb_htp = cdbfp->cdb_htab;
-    cdbfp->cdb_httodo -= 8;
+    cdbfp->cdb_httodo -= slot;
     if (n) {
       if (pos > cdbp->cdb_fsize - 8)
 	return errno = EPROTO, -1;
@@ -66,10 +164,10 @@ cdb_findnext(struct cdb_find *cdbfp) {
 	  if (cdbp->cdb_fsize < n ||
               cdbp->cdb_fsize - n < pos + klen)
 	    return errno = EPROTO, -1;
-	  cdbp->cdb_kpos = pos;
-	  cdbp->cdb_klen = klen;
-	  cdbp->cdb_vpos = pos + klen;
-	  cdbp->cdb_vlen = n;
+	  res->cdb_kpos = pos;
+	  res->cdb_klen = klen;
+	  res->cdb_vpos = pos + klen;
+	  res->cdb_vlen = n;
 	  return 1;
 	}
       }
@@ -79,3 +177,14 @@ cdb_findnext(struct cdb_find *cdbfp) {
   return 0;
 
 }
+
+/* struct cdb given to cdb_findinit() is updated here, so it
+ * should not really be const for this routine */
+int
+cdb_findnext(struct cdb_find *cdbfp) {
+  struct cdb_kv kv;
+  int r = cdb_findnext_r(cdbfp, &kv);
+  if (r > 0)
+    _cdb_setkv((struct cdb *)cdbfp->cdb_cdbp, &kv);
+  return r;
+}
@@ -1,11 +1,11 @@
 /* $Id: cdb_hash.c,v 1.5 2003/11/03 16:42:41 mjt Exp $
- * cdb hashing routine
+ * cdb hashing routines
  *
  * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
  * Public domain.
  */
 
-#include "cdb.h"
+#include "cdb_int.h"
 
 unsigned
 cdb_hash(const void *buf, unsigned len)
@@ -17,3 +17,27 @@ cdb_hash(const void *buf, unsigned len)
     hash = (hash + (hash << 5)) ^ *p++;
   return hash;
 }
+
+/* 64-bit hash for the perfect hash index (MurmurHash64A) */
+cdbo_t internal_function
+_cdb_hash64(const void *buf, unsigned len)
+{
+  const unsigned char *p = (const unsigned char *)buf;
+  const cdbo_t m = 0xc6a4a7935bd1e995ULL;
+  cdbo_t h = 0x6364622e6d706821ULL ^ (len * m);
+  cdbo_t k;
+
+  for (; len >= 8; len -= 8, p += 8) {
+    k = (cdbo_t)(p[0] | p[1] << 8 | p[2] << 16 | (unsigned)p[3] << 24) |
+        (cdbo_t)(p[4] | p[5] << 8 | p[6] << 16 | (unsigned)p[7] << 24) << 32;
+    k *= m; k ^= k >> 47; k *= m;
+    h ^= k; h *= m;
+  }
+  if (len) {
+    for (k = 0; len--; )
+      k = k << 8 | p[len];
+    h ^= k; h *= m;
+  }
+  h ^= h >> 47; h *= m; h ^= h >> 47;
+  return h;
+}
@@ -1,5 +1,5 @@
 /* $Id: cdb_init.c,v 1.11 2006/09/03 10:17:45 mjt Exp $
- * cdb_init, cdb_free and cdb_read routines
+ * cdb_init, cdb_init_ex, cdb_free and cdb_read routines
  *
  * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
  * Public domain.
@@ -10,19 +10,214 @@
 # include <windows.h>
 #else
 # include <sys/mman.h>
+# include <unistd.h>
 # ifndef MAP_FAILED
 #  define MAP_FAILED ((void*)-1)
 # endif
+# ifndef MAP_POPULATE
+#  define MAP_POPULATE 0
+# endif
 #endif
 #include <sys/stat.h>
 #include "cdb_int.h"
 
+/* locate data and index sections in an extended format file */
+static int
+cdb_init_x(struct cdb *cdbp)
+{
+  const unsigned char *mem = cdbp->cdb_mem;
+  cdbo_t fsize = cdbp->cdb_fsize;
+  cdbo_t dirpos, pos, len, dend = 0;
+  unsigned cnt, type;
+
+  if (fsize < 2048 + CDBX_TAIL)
+    return errno = EPROTO, -1;
+  dirpos = _cdb_unpack64(mem + fsize - CDBX_TAIL);
+  cnt = cdb_unpack(mem + fsize - CDBX_TAIL + 8);
+  if (cdb_unpack(mem + fsize - CDBX_TAIL + 12) != CDBX_VERSION
+      || dirpos < 2048
+      || dirpos > fsize - CDBX_TAIL
+      || (fsize - CDBX_TAIL - dirpos) / CDBX_DIRENT != cnt
+      || (fsize - CDBX_TAIL - dirpos) % CDBX_DIRENT)
+    return errno = EPROTO, -1;
+
+  cdbp->cdb_xtoc = cdbp->cdb_bkt = cdbp->cdb_mph = cdbp->cdb_filter = NULL;
+  cdbp->cdb_order = cdbp->cdb_tomb = NULL;
+  cdbp->cdb_nbkt = cdbp->cdb_fnblk = 0;
+  cdbp->cdb_ocnt = cdbp->cdb_tcnt = 0;
+  for (mem += dirpos; cnt--; mem += CDBX_DIRENT) {
+    type = cdb_unpack(mem);
+    pos = _cdb_unpack64(mem + 8);
+    len = _cdb_unpack64(mem + 16);
+    if (pos < 2048 || pos > dirpos || len > dirpos - pos)
+      return errno = EPROTO, -1;
+    switch(type) {
+    case CDBX_SEC_DATA:
+      if (pos != 2048)
+        return errno = EPROTO, -1;
+      dend = pos + len;
+      break;
+    case CDBX_SEC_HTOC:
+      if (len != 256 * CDBX_TOCENT)
+        return errno = EPROTO, -1;
+      cdbp->cdb_xtoc = cdbp->cdb_mem + pos;
+      break;
+    case CDBX_SEC_BUCKETS:
+      if (!len || len % CDBX_BUCKET || pos % CDBX_BUCKET
+          || len / CDBX_BUCKET > 0xffffffff)
+        return errno = EPROTO, -1;
+      cdbp->cdb_bkt = cdbp->cdb_mem + pos;
+      cdbp->cdb_nbkt = (unsigned)(len / CDBX_BUCKET);
+      break;
+    case CDBX_SEC_MPH: {
+      const unsigned char *m = cdbp->cdb_mem + pos;
+      cdbo_t seed, nkeys, tsize, nbkt;
+      if (len < CDBX_MHDR)
+        return errno = EPROTO, -1;
+      seed = _cdb_unpack64(m);
+      nkeys = _cdb_unpack64(m + 8);
+      tsize = _cdb_unpack64(m + 16);
+      nbkt = _cdb_unpack64(m + 24);
+      if (nkeys > tsize || tsize > 0xffffffff
+          || !nbkt || nbkt > 0xffffffff
+          || len != CDBX_MHDR + _cdb_pad8(nbkt * 2) +
+                    _cdb_pad8((tsize - nkeys) * 4) + nkeys * CDBX_MSLOT)
+        return errno = EPROTO, -1;
+      cdbp->cdb_mph = m;
+      cdbp->cdb_mseed = seed;
+      cdbp->cdb_mkeys = (unsigned)nkeys;
+      cdbp->cdb_mtsize = (unsigned)tsize;
+      cdbp->cdb_mnbkt = (unsigned)nbkt;
+      break;
+    }
+    case CDBX_SEC_FILTER: {
+      cdbo_t nblk;
+      if (len < CDBX_FHDR)
+        return errno = EPROTO, -1;
+      nblk = _cdb_unpack64(cdbp->cdb_mem + pos);
+      if (!nblk || nblk > 0xffffffff
+          || len != CDBX_FHDR + nblk * CDBX_FBLOCK)
+        return errno = EPROTO, -1;
+      cdbp->cdb_filter = cdbp->cdb_mem + pos;
+      cdbp->cdb_fnblk = (unsigned)nblk;
+      break;
+    }
+    case CDBX_SEC_ORDER: {
+      cdbo_t nent;
+      if (len < CDBX_OHDR)
+        return errno = EPROTO, -1;
+      nent = _cdb_unpack64(cdbp->cdb_mem + pos);
+      if (nent != (len - CDBX_OHDR) / CDBX_OENT
+          || (len - CDBX_OHDR) % CDBX_OENT)
+        return errno = EPROTO, -1;
+      cdbp->cdb_order = cdbp->cdb_mem + pos;
+      cdbp->cdb_ocnt = nent;
+      break;
+    }
+    case CDBX_SEC_TOMB: {
+      cdbo_t nent;
+      if (len < CDBX_THDR)
+        return errno = EPROTO, -1;
+      nent = _cdb_unpack64(cdbp->cdb_mem + pos);
+      if (nent != (len - CDBX_THDR) / 8 || (len - CDBX_THDR) % 8)
+        return errno = EPROTO, -1;
+      cdbp->cdb_tomb = cdbp->cdb_mem + pos;
+      cdbp->cdb_tcnt = nent;
+      break;
+    }
+    default:
+      if (cdb_unpack(mem + 4) & CDBX_SEC_REQUIRED)
+        return errno = EPROTO, -1;
+    }
+  }
+  if (!dend || (!cdbp->cdb_xtoc && !cdbp->cdb_bkt && !cdbp->cdb_mph))
+    return errno = EPROTO, -1;
+  cdbp->cdb_dend = dend;
+  return 0;
+}
+
+#ifndef _WIN32
+
+/* apply madvise() to [from, to) of the file, extended to page bounds;
+ * errors are ignored, as advice is just advice */
+static void
+cdb_advise(const struct cdb *cdbp, cdbo_t from, cdbo_t to, int advice)
+{
+  cdbo_t ps = (cdbo_t)sysconf(_SC_PAGESIZE);
+  from -= from % ps;
+  if (from < to)
+    madvise((void*)(cdbp->cdb_mem + from), (size_t)(to - from), advice);
+}
+
+/* bring the pages of [from, to) in, one read per page */
+static void
+cdb_prefault(const struct cdb *cdbp, cdbo_t from, cdbo_t to)
+{
+  cdbo_t ps = (cdbo_t)sysconf(_SC_PAGESIZE);
+  volatile unsigned char c = 0;
+#ifdef MADV_POPULATE_READ
+  from -= from % ps;
+  if (from >= to ||
+      madvise((void*)(cdbp->cdb_mem + from), (size_t)(to - from),
+              MADV_POPULATE_READ) == 0)
+    return;
+#endif
+  for (from -= from % ps; from < to; from += ps)
+    c ^= cdbp->cdb_mem[from];
+}
+
+/* apply cdb_init_ex() flags to a mapped and checked file.  The index
+ * is the first 2048 bytes (toc or 64-bit format header) and everything
+ * from the end of the data to the end of the file. */
+static int
+cdb_init_flags(const struct cdb *cdbp, unsigned flags)
+{
+  cdbo_t dend = cdbp->cdb_dend, fsize = cdbp->cdb_fsize;
+#ifdef MADV_HUGEPAGE
+  if (flags & CDB_INIT_HUGEPAGE)
+    cdb_advise(cdbp, 0, fsize, MADV_HUGEPAGE);
+#endif
+#ifdef MADV_RANDOM
+  if (flags & CDB_INIT_RANDOM)
+    cdb_advise(cdbp, 2048, dend, MADV_RANDOM);
+#endif
+#ifdef MADV_WILLNEED
+  if (flags & CDB_INIT_WILLNEED) {
+    cdb_advise(cdbp, 0, 2048, MADV_WILLNEED);
+    cdb_advise(cdbp, dend, fsize, MADV_WILLNEED);
+  }
+#endif
+  if ((flags & CDB_INIT_POPULATE) && !MAP_POPULATE)
+    cdb_prefault(cdbp, 0, fsize);
+  else if (flags & CDB_INIT_PREFAULT) {
+    cdb_prefault(cdbp, 0, 2048);
+    cdb_prefault(cdbp, dend, fsize);
+  }
+  if (flags & CDB_INIT_MLOCK) {
+    cdbo_t ps = (cdbo_t)sysconf(_SC_PAGESIZE);
+    if (mlock(cdbp->cdb_mem, 2048) < 0 ||
+        (dend < fsize &&
+         mlock(cdbp->cdb_mem + dend - dend % ps,
+               (size_t)(fsize - dend + dend % ps)) < 0))
+      return -1;
+  }
+  return 0;
+}
+
+#endif /* !_WIN32 */
+
 int
 cdb_init(struct cdb *cdbp, int fd)
+{
+  return cdb_init_ex(cdbp, fd, 0);
+}
+
+int
+cdb_init_ex(struct cdb *cdbp, int fd, unsigned flags)
 {
   struct stat st;
   unsigned char *mem;
-  unsigned fsize, dend;
+  cdbo_t fsize, dend;
 #ifdef _WIN32
   HANDLE hFile, hMapping;
 #endif
@@ -33,7 +228,9 @@ cdb_init(struct cdb *cdbp, int fd)
   /* trivial sanity check: at least toc should be here */
   if (st.st_size < 2048)
     return errno = EPROTO, -1;
-  fsize = (unsigned)(st.st_size & 0xffffffffu);
+  fsize = (cdbo_t)st.st_size;
+  if ((size_t)fsize != fsize)	/* can't map it on this host */
+    return errno = EFBIG, -1;
   /* memory-map file */
 #ifdef _WIN32
   hFile = (HANDLE) _get_osfhandle(fd);
@@ -46,7 +243,10 @@ cdb_init(struct cdb *cdbp, int fd)
   if (!mem)
     return -1;
 #else
-  mem = (unsigned char*)mmap(NULL, fsize, PROT_READ, MAP_SHARED, fd, 0);
+  mem = (unsigned char*)mmap(NULL, (size_t)fsize, PROT_READ,
+                             MAP_SHARED |
+                             (flags & CDB_INIT_POPULATE ? MAP_POPULATE : 0),
+                             fd, 0);
   if (mem == MAP_FAILED)
     return -1;
 #endif /* _WIN32 */
@@ -55,27 +255,34 @@ cdb_init(struct cdb *cdbp, int fd)
   cdbp->cdb_fsize = fsize;
   cdbp->cdb_mem = mem;
 
-#if 0
-  /* XXX don't know well about madvise syscall -- is it legal
-     to set different options for parts of one mmap() region?
-     There is also posix_madvise() exist, with POSIX_MADV_RANDOM etc...
-  */
-#ifdef MADV_RANDOM
-  /* set madvise() parameters. Ignore errors for now if system
-     doesn't support it */
-  madvise(mem, 2048, MADV_WILLNEED);
-  madvise(mem + 2048, cdbp->cdb_fsize - 2048, MADV_RANDOM);
-#endif
-#endif
-
   cdbp->cdb_vpos = cdbp->cdb_vlen = 0;
   cdbp->cdb_kpos = cdbp->cdb_klen = 0;
-  dend = cdb_unpack(mem);
-  if (dend < 2048) dend = 2048;
-  else if (dend >= fsize) dend = fsize;
-  cdbp->cdb_dend = dend;
+  cdbp->cdb_xtoc = cdbp->cdb_bkt = cdbp->cdb_mph = cdbp->cdb_filter = NULL;
+  cdbp->cdb_order = cdbp->cdb_tomb = NULL;
+  cdbp->cdb_nbkt = cdbp->cdb_fnblk = 0;
+  cdbp->cdb_ocnt = cdbp->cdb_tcnt = 0;
+  if (_cdb_isx(mem)) {
+    if (cdb_init_x(cdbp) != 0)
+      goto err;
+  }
+  else {
+    dend = cdb_unpack(mem);
+    if (dend < 2048) dend = 2048;
+    else if (dend >= fsize) dend = fsize;
+    cdbp->cdb_dend = dend;
+  }
+#ifndef _WIN32
+  if (flags && cdb_init_flags(cdbp, flags) != 0)
+    goto err;
+#endif
 
   return 0;
+
+err: {
+    int err = errno;
+    cdb_free(cdbp);
+    return errno = err, -1;
+  }
 }
 
 void
@@ -92,7 +299,7 @@ cdb_free(struct cdb *cdbp)
     UnmapViewOfFile((void*) cdbp->cdb_mem);
     CloseHandle(hMapping);
 #else
-    munmap((void*)cdbp->cdb_mem, cdbp->cdb_fsize);
+    munmap((void*)cdbp->cdb_mem, (size_t)cdbp->cdb_fsize);
 #endif /* _WIN32 */
     cdbp->cdb_mem = NULL;
   }
@@ -100,7 +307,7 @@ cdb_free(struct cdb *cdbp)
 }
 
 const void *
-cdb_get(const struct cdb *cdbp, unsigned len, unsigned pos)
+cdb_get(const struct cdb *cdbp, unsigned len, cdbo_t pos)
 {
   if (pos > cdbp->cdb_fsize || cdbp->cdb_fsize - pos < len) {
     errno = EPROTO;
@@ -110,7 +317,7 @@ cdb_get(const struct cdb *cdbp, unsigned len, unsigned pos)
 }
 
 int
-cdb_read(const struct cdb *cdbp, void *buf, unsigned len, unsigned pos)
+cdb_read(const struct cdb *cdbp, void *buf, unsigned len, cdbo_t pos)
 {
   const void *data = cdb_get(cdbp, len, pos);
   if (!data) return -1;
@@ -8,6 +8,9 @@
 #include "cdb.h"
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #ifndef EPROTO
 # define EPROTO EINVAL
@@ -21,21 +24,412 @@
 # endif
 #endif
 
+/* 64-bit ("extended") file format, see cdb(5).
+ * The first 2048 bytes hold 256 toc entries of (0, CDBX_MAGIC), which
+ * no classic reader accepts; data follows at 2048 as usual.  Hash tables
+ * hold 12-byte slots (hval, rpos64), and a 12-byte-per-entry toc
+ * (pos64, nslots) is written after them.  The file ends with a section
+ * directory of CDBX_DIRENT-sized (type, flags, pos64, len64) entries
+ * followed by a CDBX_TAIL-sized (dirpos64, count, version) trailer.
+ * Since nothing needs to be seeked back to, the format may be streamed.
+ */
+#define CDBX_MAGIC	0x78626463u	/* "cdbx" */
+#define CDBX_VERSION	1
+#define CDBX_SLOT	12
+#define CDBX_TOCENT	12
+#define CDBX_DIRENT	24
+#define CDBX_TAIL	16
+#define CDBX_MAXPOS	((cdbo_t)1 << 62) /* sanity limit for file size */
+
+#define CDBX_SEC_DATA	1	/* data section */
+#define CDBX_SEC_HTOC	2	/* toc of the hash tables */
+#define CDBX_SEC_BUCKETS 3	/* bucketed index, instead of hash tables */
+
+#define CDBX_SEC_REQUIRED 1	/* reader must understand this section */
+
+#define _cdb_unpack64(buf) \
+  ((cdbo_t)cdb_unpack((buf)) | ((cdbo_t)cdb_unpack((buf) + 4) << 32))
+#define _cdb_pack64(num, buf) \
+  (cdb_pack((unsigned)(num), (buf)), cdb_pack((unsigned)((num) >> 32), (buf) + 4))
+
+/* Bucketed index, made with CDB_MAKE_BUCKETS.  It is one table of
+ * 64-byte buckets aligned at 64 bytes in the file, so that a lookup
+ * usually reads one cache line of index.  Every bucket holds up to
+ * CDBX_BSLOTS records: 1-byte tags (low byte of hval) at offset 0,
+ * number of used slots, flags, and 5-byte record positions.  A record
+ * goes to its home bucket (see _cdb_bhome()) or, if that is full, to
+ * the next non-full one, and every full bucket passed by is flagged
+ * with CDBX_BMORE, telling lookups to continue with the next bucket.
+ */
+#define CDBX_BUCKET	64
+#define CDBX_BSLOTS	10
+#define CDBX_BCNT	10	/* offset of number of used slots */
+#define CDBX_BFLAGS	11	/* offset of flags */
+#define CDBX_BPOS	14	/* offset of 5-byte record positions */
+#define CDBX_BMORE	1	/* flag: probe continues in the next bucket */
+#define CDBX_BMAXPOS	((cdbo_t)1 << 40)
+#define CDBX_BFILL	8	/* records per bucket on average when making */
+
+/* home bucket of a hash value: hval is scrambled first since cdb_hash()
+ * of short keys has its upper bits mostly zero */
+#define _cdb_bhome(hval, nb) \
+  ((unsigned)(((cdbo_t)((hval) * 0x9e3779b1u) * (nb)) >> 32))
+#define _cdb_btag(hval) ((hval) & 255)
+#define _cdb_bpos(bkt, i) \
+  ((cdbo_t)cdb_unpack((bkt) + CDBX_BPOS + (i) * 5) | \
+   ((cdbo_t)(bkt)[CDBX_BPOS + (i) * 5 + 4] << 32))
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#ifdef __GNUC__
+# define _cdb_inline static __inline__
+#else
+# define _cdb_inline static
+#endif
+
+/* bitmask of the used slots of a bucket having the given tag */
+_cdb_inline unsigned
+_cdb_bmatch(const unsigned char *bkt, unsigned tag)
+{
+  unsigned n = bkt[CDBX_BCNT], m;
+#ifdef __SSE2__
+  /* all the tags (and a few more bytes) in one compare */
+  __m128i v = _mm_loadu_si128((const __m128i *)bkt);
+  m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)tag)));
+#else
+  unsigned i;
+  for (i = 0, m = 0; i < CDBX_BSLOTS; ++i)
+    if (bkt[i] == tag)
+      m |= 1u << i;
+#endif
+  if (n > CDBX_BSLOTS)
+    n = CDBX_BSLOTS;
+  return m & ((1u << n) - 1);
+}
+
+/* Minimal perfect hash index, made with CDB_MAKE_MPH (PTHash-like).
+ * Keys are hashed with _cdb_hash64(), mixed with a seed, and spread
+ * over nbkt buckets; every bucket has a 16-bit pilot, chosen when
+ * making the file so that keys of all buckets go to distinct positions
+ * of a table of tsize >= nkeys (CDBX_MLOAD percent full).  Positions
+ * past nkeys are remapped to the free ones below via a remap table,
+ * so there is exactly one slot per key.  The section holds a header of
+ * (seed, nkeys, tsize, nbkt), 8 bytes each, then the pilots, 2 bytes
+ * per bucket, remap table, 4 bytes per position past nkeys, and slots
+ * of 5-byte record position and 3-byte fingerprint (low bits of the
+ * hash), each part padded to 8 bytes.  Keys must be unique.
+ */
+#define CDBX_SEC_MPH	4	/* perfect hash index, instead of hash tables */
+#define CDBX_MHDR	32
+#define CDBX_MSLOT	8
+#define CDBX_MLAMBDA	4	/* keys per bucket on average */
+#define CDBX_MLOAD	98	/* table load, percent */
+#define CDBX_MMAXPOS	((cdbo_t)1 << 40)
+
+#define _cdb_pad8(n)	(((n) + 7) & ~(cdbo_t)7)
+#define _cdb_mfp(h)	((unsigned)(h) & 0xffffff)
+/* fingerprint stored in a slot */
+#define _cdb_mslotfp(sp) \
+  ((unsigned)(sp)[5] | (unsigned)(sp)[6] << 8 | (unsigned)(sp)[7] << 16)
+
+/* bucket of a key, given its seeded hash: 60% of keys go to the first
+ * 30% of buckets, so large buckets get their pilots while the table is
+ * still mostly empty */
+#define CDBX_MDENSE(nb)	((cdbo_t)(nb) * 3 / 10)
+#define _cdb_mbucket(h, nb) ((unsigned)((unsigned)(h) < 0x9999999au ? \
+  (((h) >> 32) * CDBX_MDENSE(nb)) >> 32 : \
+  CDBX_MDENSE(nb) + ((((h) >> 32) * ((nb) - CDBX_MDENSE(nb))) >> 32)))
+
+_cdb_inline cdbo_t
+_cdb_mmix(cdbo_t x)
+{
+  x ^= x >> 31; x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 29; x *= 0x94d049bb133111ebULL;
+  return x ^ (x >> 32);
+}
+
+/* position of a key in the table, given its seeded hash and the pilot */
+#define _cdb_mpos(h, pilot, tsize) \
+  ((unsigned)(((_cdb_mmix((h) ^ ((cdbo_t)(pilot) * 0x9e3779b97f4a7c15ULL)) \
+                >> 32) * (tsize)) >> 32))
+
+/* slot of a key with the given _cdb_hash64(), or NULL if the index is
+ * corrupt; nkeys should be checked to be non-zero first */
+_cdb_inline const unsigned char *
+_cdb_mslot(const struct cdb *cdbp, cdbo_t h)
+{
+  const unsigned char *pilot = cdbp->cdb_mph + CDBX_MHDR;
+  const unsigned char *remap = pilot + _cdb_pad8((cdbo_t)cdbp->cdb_mnbkt * 2);
+  const unsigned char *slots = remap +
+    _cdb_pad8((cdbo_t)(cdbp->cdb_mtsize - cdbp->cdb_mkeys) * 4);
+  unsigned p;
+  h = _cdb_mmix(h ^ cdbp->cdb_mseed);
+  pilot += _cdb_mbucket(h, cdbp->cdb_mnbkt) * 2;
+  p = _cdb_mpos(h, pilot[0] | (pilot[1] << 8), cdbp->cdb_mtsize);
+  if (p >= cdbp->cdb_mkeys &&
+      (p = cdb_unpack(remap + (cdbo_t)(p - cdbp->cdb_mkeys) * 4))
+        >= cdbp->cdb_mkeys)
+    return NULL;
+  return slots + (cdbo_t)p * CDBX_MSLOT;
+}
+
+/* Negative lookup filter, made with CDB_MAKE_FILTER: a split block
+ * Bloom filter over cdb_hash() values of all keys.  The section is
+ * aligned at 64 bytes and holds a header of (nblocks, nkeys), 8 bytes
+ * each, padded to CDBX_FHDR, then blocks of 8 32-bit words.  A key sets
+ * (and a lookup checks) one bit in every word of its block, so a miss
+ * usually costs one cache line.  The section is optional: readers which
+ * don't know it just don't use it.
+ */
+#define CDBX_SEC_FILTER	5	/* negative lookup filter */
+#define CDBX_FHDR	64
+#define CDBX_FBLOCK	32
+#define CDBX_FBITS	12	/* filter bits per key */
+
+_cdb_inline unsigned
+_cdb_fmix(unsigned h)
+{
+  h ^= h >> 16; h *= 0x85ebca6bu;
+  h ^= h >> 13; h *= 0xc2b2ae35u;
+  return h ^ (h >> 16);
+}
+
+/* filter block of a key with the given cdb_hash() */
+#define _cdb_fblock(cdbp, hval) ((cdbp)->cdb_filter + CDBX_FHDR + \
+  (((cdbo_t)_cdb_fmix(hval) * (cdbp)->cdb_fnblk) >> 32) * CDBX_FBLOCK)
+
+/* bit to check in word i of the block, fkey = _cdb_fkey(hval) */
+#define _cdb_fkey(hval) _cdb_fmix((hval) ^ 0x9e3779b9u)
+#define _cdb_fbit(fkey, i) (((fkey) * _cdb_fsalt[i]) >> 27)
+
+static const unsigned _cdb_fsalt[8] = {
+  0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+  0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u
+};
+
+/* may a key with the given cdb_hash() be in the file? */
+_cdb_inline int
+_cdb_fcheck(const struct cdb *cdbp, unsigned hval)
+{
+  const unsigned char *blk = _cdb_fblock(cdbp, hval);
+  unsigned k = _cdb_fkey(hval), i, b;
+  for (i = 0; i < 8; ++i) {
+    b = _cdb_fbit(k, i);
+    if (!(blk[i * 4 + (b >> 3)] & (1 << (b & 7))))
+      return 0;
+  }
+  return 1;
+}
+
+/* Ordered key index, made with CDB_MAKE_ORDER: all records sorted by
+ * key (bytewise, a key which is a prefix of another goes first, records
+ * with equal keys are in file order).  The section holds a header of
+ * (nentries, 0), 8 bytes each, then 16-byte entries of the first 8 bytes
+ * of the key, zero-padded, and record position.  Comparing the padded
+ * prefixes gives the same order as comparing the keys unless they are
+ * equal, so a search touches records only near its end.  Optional.
+ */
+#define CDBX_SEC_ORDER	6	/* ordered key index */
+#define CDBX_OHDR	16
+#define CDBX_OENT	16
+
+/* Tombstones, made with cdb_make_tombstone(): records with empty values
+ * which hide their keys in the older layers of a struct cdb_stack.  The
+ * section holds a header of (ntombs, 0), 8 bytes each, then positions
+ * of the tombstone records, 8 bytes each, in ascending order.  Optional:
+ * readers which don't know it see just empty values.
+ */
+#define CDBX_SEC_TOMB	7	/* positions of tombstones */
+#define CDBX_THDR	16
+
+/* tombstones of a file being made, in file order */
+struct cdb_tomb {
+  cdbo_t *pos;
+  cdbo_t cnt, size;		/* used and allocated */
+};
+
+/* section of a 64-bit format file being made */
+struct cdb_xsec {
+  unsigned type, flags;
+  cdbo_t pos, len;
+};
+
+/* is the file (first 8 bytes of it) in extended format? */
+#define _cdb_isx(mem) (cdb_unpack((mem)) == 0 && cdb_unpack((mem) + 4) == CDBX_MAGIC)
+
+/* make record found by a reentrant routine current in struct cdb */
+#define _cdb_setkv(cdbp, kv) \
+  ((cdbp)->cdb_kpos = (kv)->cdb_kpos, (cdbp)->cdb_klen = (kv)->cdb_klen, \
+   (cdbp)->cdb_vpos = (kv)->cdb_vpos, (cdbp)->cdb_vlen = (kv)->cdb_vlen)
+
+#ifdef __GNUC__
+# define _cdb_prefetch(p) __builtin_prefetch((p))
+#else
+# define _cdb_prefetch(p) ((void)0)
+#endif
+
 struct cdb_rec {
   unsigned hval;
-  unsigned rpos;
+  cdbo_t rpos;
 };
 
+/* Record index of a file being made: for every toc entry, a list of
+ * chunks of 8-byte entries, newest chunk first (cdb_make_finish()
+ * reverses the lists), each chunk twice as large as the previous one
+ * up to CDB_RLMAX entries.  An entry holds the upper 24 bits of the hash
+ * value, since the lower 8 are the toc index, and the position of the
+ * record relative to the first record of the chunk, in 40 bits. */
 struct cdb_rl {
   struct cdb_rl *next;
-  unsigned cnt;
-  struct cdb_rec rec[254];
+  unsigned cnt, size;		/* entries used and allocated */
+  cdbo_t base;			/* position of the first record */
+  cdbo_t rec[1];
+};
+
+#define CDB_RLMIN	32
+#define CDB_RLMAX	65536
+#define CDB_RLPOS	(((cdbo_t)1 << 40) - 1)
+#define _cdb_rlent(hval, off) ((cdbo_t)((hval) >> 8) << 40 | (off))
+#define _cdb_rlhval(e, t) ((unsigned)((e) >> 40) << 8 | (t))
+#define _cdb_rlpos(rl, e) ((rl)->base + ((e) & CDB_RLPOS))
+
+/* Index of the records by key for cdb_make_put() and cdb_make_find(),
+ * built on first use: open addressing with linear probing on hash value.
+ * Every entry also has a fingerprint of the key, the upper half of its
+ * _cdb_hash64(), so that a key is read back only if it most likely
+ * matches.  Empty entries have rpos 0, deleted ones rpos 1.
+ * Records removed with CDB_FIND_REMOVE stay in the file as holes until
+ * cdb_make_finish(), which squeezes them out with _cdb_make_compact(). */
+struct cdb_dxent {
+  unsigned hval, fp;
+  cdbo_t rpos;
+};
+
+struct cdb_hole {
+  cdbo_t pos, len;
+};
+
+struct cdb_dx {
+  cdbo_t mask;			/* entries - 1, power of 2 - 1 */
+  cdbo_t used, dead;		/* live and deleted entries */
+  struct cdb_dxent *ent;
+  struct cdb_hole *holes;	/* removed records, in no particular order */
+  cdbo_t nholes, hsize;		/* holes used and allocated */
+};
+
+/* Reclists spilled to a file by cdb_make_memlimit(), see
+ * cdb_make_spill.c.  Run r has table t at off[r*257+t] up to
+ * off[r*257+t+1]: chunks of the reclist, oldest first, each a base and
+ * count (cdbo_t each) followed by the entries. */
+struct cdb_spill {
+  int fd;
+  cdbo_t limit;			/* bytes of reclists to keep in memory */
+  cdbo_t mcnt;			/* records in memory */
+  cdbo_t size;			/* bytes written to fd */
+  cdbo_t *off;			/* 257 offsets of every run */
+  unsigned nruns, rsize;	/* runs written, and room in off */
+  cdbo_t cnt[256];		/* records spilled of every table */
 };
 
+#define spilled(cdbmp) ((cdbmp)->cdb_spill && (cdbmp)->cdb_spill->nruns)
+
+/* count a record added, spilling the reclists if they are over limit */
+#define _cdb_make_spillchk(cdbmp, n) \
+  (!(cdbmp)->cdb_spill || (cdbmp)->cdb_dx || \
+   ((cdbmp)->cdb_spill->mcnt += (n)) * sizeof(cdbo_t) <= \
+     (cdbmp)->cdb_spill->limit ? 0 : _cdb_make_spill(cdbmp))
+
+#define _cdb_keyfp(key, klen) ((unsigned)(_cdb_hash64(key, klen) >> 32))
+
+int _cdb_find_b(const struct cdb *cdbp, const void *key, unsigned klen,
+                unsigned hval, struct cdb_kv *res);
+int _cdb_find_m(const struct cdb *cdbp, const void *key, unsigned klen,
+                cdbo_t h, struct cdb_kv *res);
+cdbo_t _cdb_hash64(const void *buf, unsigned len);
+int _cdb_make_mph(struct cdb_make *cdbmp, struct cdb_xsec *sec);
+int _cdb_make_order(struct cdb_make *cdbmp, struct cdb_xsec *sec);
+cdbo_t *_cdb_make_rposv(struct cdb_make *cdbmp);
+int _cdb_make_readkeys(struct cdb_make *cdbmp, const cdbo_t *rpos, cdbo_t n,
+                       int (*fn)(void *arg, cdbo_t i,
+                                 const unsigned char *key, unsigned klen),
+                       void *arg);
+
+unsigned _cdb_cache_fid(struct cdb_cache *cache);
+int _cdb_cache_read(struct cdb_cache *cache, unsigned fid, int fd,
+                    cdbo_t fsize, void *buf, unsigned len, cdbo_t pos);
+int _cdb_pread(int fd, void *buf, unsigned len, cdbo_t pos);
+int _cdb_pread_htab(const struct cdb_pread *cdbp, unsigned hval,
+                    cdbo_t *htab, unsigned *n);
+
+void _cdb_make_htab(const struct cdb_rl *rl, unsigned t, unsigned len,
+                    unsigned slot, unsigned char *mem);
+int _cdb_make_htabs_mt(struct cdb_make *cdbmp, const unsigned hcnt[256],
+                       cdbo_t hpos[256], unsigned hsize, unsigned slot);
+
 int _cdb_make_write(struct cdb_make *cdbmp,
 		    const unsigned char *ptr, unsigned len);
 int _cdb_make_fullwrite(int fd, const unsigned char *buf, unsigned len);
+struct iovec;
+int _cdb_make_fullwritev(int fd, struct iovec *iov, unsigned n);
 int _cdb_make_flush(struct cdb_make *cdbmp);
+void _cdb_make_wb(struct cdb_make *cdbmp);
 int _cdb_make_add(struct cdb_make *cdbmp, unsigned hval,
                   const void *key, unsigned klen,
                   const void *val, unsigned vlen);
+int _cdb_make_dxadd(struct cdb_make *cdbmp, unsigned hval,
+                    const void *key, unsigned klen, cdbo_t rpos);
+void _cdb_make_dxfree(struct cdb_make *cdbmp);
+int _cdb_make_compact(struct cdb_make *cdbmp);
+int _cdb_make_rladd(struct cdb_rl **rec, unsigned hval, cdbo_t pos);
+int _cdb_make_fullpwrite(int fd, const unsigned char *buf, unsigned len,
+                         cdbo_t pos);
+int _cdb_make_wend(struct cdb_make *cdbmp);
+void _cdb_make_wfree(struct cdb_make *cdbmp);
+int _cdb_make_spill(struct cdb_make *cdbmp);
+int _cdb_make_htabs_spill(struct cdb_make *cdbmp, const unsigned hcnt[256],
+                          cdbo_t hpos[256], unsigned slot);
+void _cdb_make_spillfree(struct cdb_make *cdbmp);
+int _cdb_stack_rec(const struct cdb_stack *stp, unsigned l,
+                   const struct cdb_kv *kv);
+int _cdb_make_tombadd(struct cdb_make *cdbmp, cdbo_t rpos);
+void _cdb_make_tombdel(struct cdb_make *cdbmp, cdbo_t rpos);
+int _cdb_make_tombsec(struct cdb_make *cdbmp, struct cdb_xsec *sec);
+void _cdb_make_tombfree(struct cdb_make *cdbmp);
+void _cdb_make_free(struct cdb_make *cdbmp);
+
+/* sharded sets: the manifest, see cdb_shard.c */
+struct cdb_manifest {
+  unsigned bits, gen;
+  char **names;			/* shard files, 1 << bits of them */
+};
+
+int _cdb_shards_read(const char *manifest, struct cdb_manifest *mp);
+int _cdb_shards_write(const char *manifest, const struct cdb_manifest *mp,
+                      unsigned flags);
+void _cdb_shards_mfree(struct cdb_manifest *mp);
+char *_cdb_shards_path(const char *manifest, const char *name);
+
+/* make the directory entry of a file just created or renamed durable;
+ * inline, since cdb(1) needs it too and may use the shared library */
+_cdb_inline int
+_cdb_syncdir(const char *name)
+{
+  const char *s = strrchr(name, '/');
+  char *dir = NULL;
+  int fd, r;
+  if (s) {
+    if (!(dir = (char*)malloc(s - name + 2)))
+      return errno = ENOMEM, -1;
+    memcpy(dir, name, s - name + 1);
+    dir[s > name ? s - name : 1] = '\0';
+  }
+  fd = open(dir ? dir : ".", O_RDONLY);
+  free(dir);
+  if (fd < 0)
+    return -1;
+  r = fsync(fd);
+  close(fd);
+  return r;
+}
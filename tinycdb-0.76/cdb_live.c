@@ -0,0 +1,228 @@
+/* cdb_live_open, cdb_live_close, cdb_live_get, cdb_live_put and
+ * cdb_live_reload routines: a database which is replaced now and then
+ * by renaming a new file over it
+ *
+ * Every file mapped is a version, and the current one is published by
+ * a pointer.  A reader takes a reference by incrementing the count of
+ * the version it loaded and checking the pointer again, since the
+ * version may have been retired in between, and the reloader retires
+ * a version after publishing the next one: one of the two sees the
+ * other, so a version is unmapped only when nothing references it,
+ * by whoever drops the last reference.  Lookups take no lock, and a
+ * thread may keep its reference over a batch of them.
+ *
+ * Versions are not freed until the handle is closed, only unmapped, so
+ * that a reader which loaded the pointer just before it changed never
+ * touches freed memory; unmapped versions are reused for new files.
+ * A file is known by its device and inode numbers, which stay in use
+ * while it is open, even after it has been replaced.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "cdb_int.h"
+
+#define LV_RETIRED 0x40000000u	/* not current any more */
+#define LV_DEAD	0x80000000u	/* and being, or been, unmapped */
+#define LV_REFS	0x3fffffffu
+
+struct cdb_lversion {
+  struct cdb cdb;		/* first, see cdb_live_put() */
+  unsigned state;		/* references and the bits above */
+  int unmapped;			/* free for reuse */
+  dev_t dev;
+  ino_t ino;
+  struct cdb_lversion *next;	/* all versions, for reuse */
+};
+
+struct cdb_live {
+  struct cdb_lversion *cur;	/* the current version */
+  unsigned interval;		/* of checks for a new file, ms, or 0 */
+  unsigned long long due;	/* time of the next check, ms */
+  char *path;
+  unsigned flags;		/* for cdb_init_ex() */
+  pthread_mutex_t lock;		/* reloads */
+  struct cdb_lversion *all;
+};
+
+static unsigned long long
+now(void)
+{
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* unmap a retired version if nobody references it, once */
+static void
+lvunmap(struct cdb_lversion *v)
+{
+  unsigned s = LV_RETIRED;
+  int fd;
+  if (!__atomic_compare_exchange_n(&v->state, &s, LV_RETIRED | LV_DEAD, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return;
+  fd = cdb_fileno(&v->cdb);
+  cdb_free(&v->cdb);
+  close(fd);
+  __atomic_store_n(&v->unmapped, 1, __ATOMIC_RELEASE);
+}
+
+static void
+lvput(struct cdb_lversion *v)
+{
+  if (__atomic_sub_fetch(&v->state, 1, __ATOMIC_SEQ_CST) == LV_RETIRED)
+    lvunmap(v);
+}
+
+/* map the file at path, if it is not the current one already;
+ * called with the lock held */
+static int
+lvload(struct cdb_live *lp)
+{
+  struct cdb_lversion *v, *old = lp->cur;
+  struct stat st;
+  int fd, err;
+
+  if (stat(lp->path, &st) < 0)
+    return -1;
+  if (old && st.st_dev == old->dev && st.st_ino == old->ino)
+    return 0;
+  if ((fd = open(lp->path, O_RDONLY)) < 0)
+    return -1;
+  /* the file opened, which may be newer than the one stat'ed */
+  if (fstat(fd, &st) < 0) {
+    err = errno;
+    close(fd);
+    return errno = err, -1;
+  }
+  if (old && st.st_dev == old->dev && st.st_ino == old->ino) {
+    close(fd);
+    return 0;
+  }
+  for (v = lp->all; v; v = v->next)
+    if (__atomic_load_n(&v->unmapped, __ATOMIC_ACQUIRE))
+      break;
+  if (!v) {
+    if (!(v = (struct cdb_lversion*)calloc(1, sizeof(*v)))) {
+      close(fd);
+      return errno = ENOMEM, -1;
+    }
+    v->next = lp->all;
+    lp->all = v;
+    v->unmapped = 1;
+  }
+  if (cdb_init_ex(&v->cdb, fd, lp->flags) < 0) {
+    err = errno;
+    close(fd);
+    return errno = err, -1;
+  }
+  v->dev = st.st_dev;
+  v->ino = st.st_ino;
+  v->unmapped = 0;
+  /* readers which loaded the pointer to it while it was retired may
+   * still hold counts they are about to drop: keep them */
+  __atomic_and_fetch(&v->state, LV_REFS, __ATOMIC_SEQ_CST);
+
+  __atomic_store_n(&lp->cur, v, __ATOMIC_SEQ_CST);
+  if (old &&
+      !(__atomic_fetch_or(&old->state, LV_RETIRED, __ATOMIC_SEQ_CST) & LV_REFS))
+    lvunmap(old);
+  return 1;
+}
+
+struct cdb_live *
+cdb_live_open(const char *path, unsigned flags, unsigned interval)
+{
+  struct cdb_live *lp = (struct cdb_live*)calloc(1, sizeof(*lp));
+  int err;
+  if (!lp)
+    return errno = ENOMEM, (struct cdb_live*)NULL;
+  if (!(lp->path = strdup(path))) {
+    free(lp);
+    return errno = ENOMEM, (struct cdb_live*)NULL;
+  }
+  lp->flags = flags;
+  lp->interval = interval;
+  lp->due = now() + interval;
+  pthread_mutex_init(&lp->lock, NULL);
+  if (lvload(lp) < 0) {
+    err = errno;
+    cdb_live_close(lp);
+    return errno = err, (struct cdb_live*)NULL;
+  }
+  return lp;
+}
+
+void
+cdb_live_close(struct cdb_live *lp)
+{
+  struct cdb_lversion *v;
+  int fd;
+  while((v = lp->all)) {
+    lp->all = v->next;
+    if (!v->unmapped) {
+      fd = cdb_fileno(&v->cdb);
+      cdb_free(&v->cdb);
+      close(fd);
+    }
+    free(v);
+  }
+  pthread_mutex_destroy(&lp->lock);
+  free(lp->path);
+  free(lp);
+}
+
+int
+cdb_live_reload(struct cdb_live *lp)
+{
+  int r;
+  pthread_mutex_lock(&lp->lock);
+  r = lvload(lp);
+  pthread_mutex_unlock(&lp->lock);
+  return r;
+}
+
+const struct cdb *
+cdb_live_get(struct cdb_live *lp)
+{
+  struct cdb_lversion *v;
+  unsigned long long t, due;
+
+  /* one of the threads finding a check due does it, unless a reload is
+   * in progress already; errors leave the current file in use */
+  if (lp->interval &&
+      (t = now()) >= (due = __atomic_load_n(&lp->due, __ATOMIC_RELAXED)) &&
+      __atomic_compare_exchange_n(&lp->due, &due, t + lp->interval, 0,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED) &&
+      pthread_mutex_trylock(&lp->lock) == 0) {
+    lvload(lp);
+    pthread_mutex_unlock(&lp->lock);
+  }
+
+  for (;;) {
+    v = __atomic_load_n(&lp->cur, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&v->state, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&lp->cur, __ATOMIC_SEQ_CST) == v)
+      return &v->cdb;
+    lvput(v);
+  }
+}
+
+void
+cdb_live_put(struct cdb_live *lp, const struct cdb *cdbp)
+{
+  (void)lp;
+  lvput((struct cdb_lversion *)cdbp);
+}
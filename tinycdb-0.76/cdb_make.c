@@ -5,11 +5,24 @@
  * Public domain.
  */
 
+#define _GNU_SOURCE	/* sync_file_range() */
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include "cdb_int.h"
 
+#ifndef IOV_MAX
+# define IOV_MAX 1024
+#endif
+#define CDB_MMAPWIN	(32*1024*1024)	/* default window of CDB_MAKE_MMAP */
+#define CDB_WBSTEP	(8*1024*1024)	/* write-behind step of CDB_MAKE_SYNC */
+#define CDB_WBLAG	(64*1024*1024)	/* and how far behind it is waited for */
+
 void
 cdb_pack(unsigned num, unsigned char buf[4])
 {
@@ -19,136 +32,624 @@ cdb_pack(unsigned num, unsigned char buf[4])
   buf[3] = num >> 8;
 }
 
+/* 64-bit format header, the toc no classic reader will accept */
+static void
+cdb_make_xhdr(unsigned char *p)
+{
+  unsigned t;
+  for (t = 0; t < 256; ++t) {
+    cdb_pack(0, p + (t << 3));
+    cdb_pack(CDBX_MAGIC, p + (t << 3) + 4);
+  }
+}
+
 int
-cdb_make_start(struct cdb_make *cdbmp, int fd)
+cdb_make_start_ex(struct cdb_make *cdbmp, int fd, unsigned flags)
 {
   memset(cdbmp, 0, sizeof(*cdbmp));
+  /* perfect hash and ordered index read the keys back from fd */
+  if (flags & CDB_MAKE_STREAM &&
+      flags & (CDB_MAKE_MPH | CDB_MAKE_ORDER | CDB_MAKE_MMAP))
+    return errno = EINVAL, -1;
+  if (flags & (CDB_MAKE_BUCKETS | CDB_MAKE_MPH |
+               CDB_MAKE_FILTER | CDB_MAKE_ORDER | CDB_MAKE_STREAM))
+    flags |= CDB_MAKE_64BIT;
   cdbmp->cdb_fd = fd;
+  cdbmp->cdb_flags = flags;
   cdbmp->cdb_dpos = 2048;
+  cdbmp->cdb_wbuf = cdbmp->cdb_buf;
+  cdbmp->cdb_wsize = flags & CDB_MAKE_MMAP ?
+    CDB_MMAPWIN : (unsigned)sizeof(cdbmp->cdb_buf);
   cdbmp->cdb_bpos = cdbmp->cdb_buf + 2048;
+  /* header of 64-bit format is constant, write it right away */
+  if (flags & CDB_MAKE_64BIT)
+    cdb_make_xhdr(cdbmp->cdb_buf);
   return 0;
 }
 
+void
+cdb_make_threads(struct cdb_make *cdbmp, unsigned nthreads)
+{
+  cdbmp->cdb_nthreads = nthreads;
+}
+
+int
+cdb_make_start(struct cdb_make *cdbmp, int fd)
+{
+  return cdb_make_start_ex(cdbmp, fd, 0);
+}
+
 int internal_function
 _cdb_make_fullwrite(int fd, const unsigned char *buf, unsigned len)
 {
   while(len) {
     int l = (int) write(fd, buf, len);
-    if (l < 0 && errno != EINTR)
+    if (l < 0) {
+      if (errno == EINTR)
+        continue;
       return -1;
+    }
     len -= l;
     buf += l;
   }
   return 0;
 }
 
+int internal_function
+_cdb_make_fullpwrite(int fd, const unsigned char *buf, unsigned len,
+                     cdbo_t pos)
+{
+  ssize_t l;
+  while(len) {
+    l = pwrite(fd, buf, len, (off_t)pos);
+    if (l < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += l;
+    len -= (unsigned)l;
+    pos += (cdbo_t)l;
+  }
+  return 0;
+}
+
+int internal_function
+_cdb_make_fullwritev(int fd, struct iovec *iov, unsigned n)
+{
+  ssize_t l;
+  while(n) {
+    l = writev(fd, iov, n > IOV_MAX ? IOV_MAX : (int)n);
+    if (l < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    for (; n && (size_t)l >= iov->iov_len; ++iov, --n)
+      l -= (ssize_t)iov->iov_len;
+    if (n) {
+      iov->iov_base = (char*)iov->iov_base + l;
+      iov->iov_len -= (size_t)l;
+    }
+  }
+  return 0;
+}
+
+/* With CDB_MAKE_MMAP, data is written to a window of cdb_wsize bytes
+ * mapped at the current position, the file being extended to cover
+ * it.  cdb_wbuf is cdb_buf while no window is mapped; flushing unmaps
+ * the window, so that the rest of the code may use fd as usual. */
+#define mapped(cdbmp) \
+  ((cdbmp)->cdb_flags & CDB_MAKE_MMAP && (cdbmp)->cdb_wbuf != (cdbmp)->cdb_buf)
+
+static int
+cdb_make_map(struct cdb_make *cdbmp)
+{
+  cdbo_t start = cdbmp->cdb_dpos & ~(cdbo_t)(sysconf(_SC_PAGESIZE) - 1);
+  struct stat st;
+  void *p;
+  if (fstat(cdbmp->cdb_fd, &st) < 0)
+    return -1;
+  if ((cdbo_t)st.st_size < start + cdbmp->cdb_wsize &&
+      ftruncate(cdbmp->cdb_fd, (off_t)(start + cdbmp->cdb_wsize)) < 0)
+    return -1;
+  p = mmap(NULL, cdbmp->cdb_wsize, PROT_READ|PROT_WRITE, MAP_SHARED,
+           cdbmp->cdb_fd, (off_t)start);
+  if (p == MAP_FAILED)
+    return -1;
+  cdbmp->cdb_wbuf = (unsigned char*)p;
+  cdbmp->cdb_bpos = cdbmp->cdb_wbuf + (cdbmp->cdb_dpos - start);
+  return 0;
+}
+
+static int
+cdb_make_mwrite(struct cdb_make *cdbmp, const unsigned char *ptr, unsigned len)
+{
+  unsigned l;
+  while(len) {
+    if (!mapped(cdbmp) &&
+        (_cdb_make_flush(cdbmp) < 0 || cdb_make_map(cdbmp) < 0))
+      return -1;
+    l = cdbmp->cdb_wsize - (unsigned)(cdbmp->cdb_bpos - cdbmp->cdb_wbuf);
+    if (!l) {
+      if (_cdb_make_flush(cdbmp) < 0)
+        return -1;
+      continue;
+    }
+    if (l > len)
+      l = len;
+    memcpy(cdbmp->cdb_bpos, ptr, l);
+    cdbmp->cdb_bpos += l;
+    cdbmp->cdb_dpos += l;
+    ptr += l;
+    len -= l;
+  }
+  return 0;
+}
+
+/* With CDB_MAKE_SYNC, writeback of the data is started every CDB_WBSTEP
+ * bytes, and waited for once it is CDB_WBLAG bytes behind, so that
+ * dirty pages do not pile up for the final fdatasync(2), without
+ * waiting for the disk at every step.  Where sync_file_range(2) is
+ * missing or does not work for fd, this does nothing. */
+void internal_function
+_cdb_make_wb(struct cdb_make *cdbmp)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+  cdbo_t pos = cdbmp->cdb_dpos;
+  if (!(cdbmp->cdb_flags & CDB_MAKE_SYNC))
+    return;
+  if (pos < cdbmp->cdb_wbpos)		/* data moved back, see compaction */
+    cdbmp->cdb_wbpos = cdbmp->cdb_wbdone = pos;
+  if (pos - cdbmp->cdb_wbpos < CDB_WBSTEP)
+    return;
+  if (sync_file_range(cdbmp->cdb_fd, (off_t)cdbmp->cdb_wbpos, 0,
+                      SYNC_FILE_RANGE_WRITE) < 0 ||
+      (pos - cdbmp->cdb_wbdone > CDB_WBLAG &&
+       sync_file_range(cdbmp->cdb_fd, (off_t)cdbmp->cdb_wbdone,
+                       (off_t)(pos - CDB_WBLAG - cdbmp->cdb_wbdone),
+                       SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                       SYNC_FILE_RANGE_WAIT_AFTER) < 0))
+    cdbmp->cdb_flags &= ~CDB_MAKE_SYNC;
+  if (pos - cdbmp->cdb_wbdone > CDB_WBLAG)
+    cdbmp->cdb_wbdone = pos - CDB_WBLAG;
+  cdbmp->cdb_wbpos = pos;
+#else
+  (void)cdbmp;
+#endif
+}
+
 int internal_function
 _cdb_make_flush(struct cdb_make *cdbmp) {
-  unsigned len = (unsigned)(cdbmp->cdb_bpos - cdbmp->cdb_buf);
-  if (len) {
-    if (_cdb_make_fullwrite(cdbmp->cdb_fd, cdbmp->cdb_buf, len) < 0)
+  unsigned len = (unsigned)(cdbmp->cdb_bpos - cdbmp->cdb_wbuf);
+  if (mapped(cdbmp)) {
+    /* the data is in the file already */
+    munmap(cdbmp->cdb_wbuf, cdbmp->cdb_wsize);
+    cdbmp->cdb_bpos = cdbmp->cdb_wbuf = cdbmp->cdb_buf;
+    if (lseek(cdbmp->cdb_fd, (off_t)cdbmp->cdb_dpos, SEEK_SET) < 0)
       return -1;
-    cdbmp->cdb_bpos = cdbmp->cdb_buf;
   }
+  else if (len) {
+    if (_cdb_make_fullwrite(cdbmp->cdb_fd, cdbmp->cdb_wbuf, len) < 0)
+      return -1;
+    cdbmp->cdb_bpos = cdbmp->cdb_wbuf;
+  }
+  _cdb_make_wb(cdbmp);
   return 0;
 }
 
 int internal_function
 _cdb_make_write(struct cdb_make *cdbmp, const unsigned char *ptr, unsigned len)
 {
-  unsigned l = (unsigned)(sizeof(cdbmp->cdb_buf) - (cdbmp->cdb_bpos - cdbmp->cdb_buf));
+  unsigned l = cdbmp->cdb_wsize - (unsigned)(cdbmp->cdb_bpos - cdbmp->cdb_wbuf);
+  if (cdbmp->cdb_flags & CDB_MAKE_MMAP)
+    return cdb_make_mwrite(cdbmp, ptr, len);
+  if (len >= cdbmp->cdb_wsize) {
+    /* write out the buffer together with the data, without copying */
+    struct iovec iov[2];
+    iov[0].iov_base = cdbmp->cdb_wbuf;
+    iov[0].iov_len = cdbmp->cdb_bpos - cdbmp->cdb_wbuf;
+    iov[1].iov_base = (void*)ptr;
+    iov[1].iov_len = len;
+    if (_cdb_make_fullwritev(cdbmp->cdb_fd, iov, 2) < 0)
+      return -1;
+    cdbmp->cdb_bpos = cdbmp->cdb_wbuf;
+    cdbmp->cdb_dpos += len;
+    _cdb_make_wb(cdbmp);
+    return 0;
+  }
   cdbmp->cdb_dpos += len;
   if (len > l) {
+    /* keep writes whole buffers, at whole-buffer offsets */
     memcpy(cdbmp->cdb_bpos, ptr, l);
     cdbmp->cdb_bpos += l;
     if (_cdb_make_flush(cdbmp) < 0)
       return -1;
     ptr += l; len -= l;
-    l = len / (unsigned)sizeof(cdbmp->cdb_buf);
-    if (l) {
-      l *= (unsigned)sizeof(cdbmp->cdb_buf);
-      if (_cdb_make_fullwrite(cdbmp->cdb_fd, ptr, l) < 0)
-        return -1;
-      ptr += l; len -= l;
+  }
+  memcpy(cdbmp->cdb_bpos, ptr, len);
+  cdbmp->cdb_bpos += len;
+  return 0;
+}
+
+int
+cdb_make_bufsize(struct cdb_make *cdbmp, unsigned size)
+{
+  unsigned char *b = cdbmp->cdb_buf;
+  unsigned len;
+
+  if (cdbmp->cdb_flags & CDB_MAKE_MMAP) {
+    /* window size, in whole pages; takes effect with the next window */
+    unsigned pg = (unsigned)sysconf(_SC_PAGESIZE);
+    if (size < 2 * pg)
+      size = 2 * pg;
+    if (size > UINT_MAX - pg)
+      return errno = EINVAL, -1;
+    if (_cdb_make_flush(cdbmp) < 0)
+      return -1;
+    cdbmp->cdb_wsize = (size + pg - 1) / pg * pg;
+    return 0;
+  }
+
+  if (size < sizeof(cdbmp->cdb_buf))
+    size = sizeof(cdbmp->cdb_buf);
+  if (cdbmp->cdb_bpos - cdbmp->cdb_wbuf > size &&
+      _cdb_make_flush(cdbmp) < 0)
+    return -1;
+  len = (unsigned)(cdbmp->cdb_bpos - cdbmp->cdb_wbuf);
+  if (size != sizeof(cdbmp->cdb_buf) && !(b = (unsigned char*)malloc(size)))
+    return errno = ENOMEM, -1;
+  if (b != cdbmp->cdb_wbuf) {
+    memcpy(b, cdbmp->cdb_wbuf, len);
+    if (cdbmp->cdb_wbuf != cdbmp->cdb_buf)
+      free(cdbmp->cdb_wbuf);
+  }
+  cdbmp->cdb_wbuf = b;
+  cdbmp->cdb_bpos = b + len;
+  cdbmp->cdb_wsize = size;
+  return 0;
+}
+
+/* build and write negative lookup filter (see cdb_int.h), filling sec */
+static int
+cdb_make_filter(struct cdb_make *cdbmp, struct cdb_xsec *sec)
+{
+  static const unsigned char zero[CDBX_FHDR];
+  unsigned char *flt, *blk;
+  struct cdb_rl *rl;
+  cdbo_t nblk, len;
+  unsigned t, i, j, k, b;
+
+  nblk = (cdbmp->cdb_rcnt * CDBX_FBITS + CDBX_FBLOCK * 8 - 1) /
+    (CDBX_FBLOCK * 8);
+  if (!nblk)
+    nblk = 1;
+  if (nblk > 0xffffffff ||
+      (size_t)(nblk * CDBX_FBLOCK) != nblk * CDBX_FBLOCK)
+    return errno = ENOMEM, -1;
+  flt = (unsigned char*)calloc(CDBX_FHDR + (size_t)nblk * CDBX_FBLOCK, 1);
+  if (!flt)
+    return errno = ENOMEM, -1;
+  _cdb_pack64(nblk, flt);
+  _cdb_pack64(cdbmp->cdb_rcnt, flt + 8);
+
+  for (t = 0; t < 256; ++t)
+    for (rl = cdbmp->cdb_rec[t]; rl; rl = rl->next)
+      for (i = 0; i < rl->cnt; ++i) {
+        unsigned hval = _cdb_rlhval(rl->rec[i], t);
+        blk = flt + CDBX_FHDR +
+          (((cdbo_t)_cdb_fmix(hval) * nblk) >> 32) * CDBX_FBLOCK;
+        k = _cdb_fkey(hval);
+        for (j = 0; j < 8; ++j) {
+          b = _cdb_fbit(k, j);
+          blk[j * 4 + (b >> 3)] |= 1 << (b & 7);
+        }
+      }
+
+  /* align at cache line, so that blocks never cross one */
+  t = (unsigned)(cdbmp->cdb_dpos % CDBX_FHDR);
+  if (t && _cdb_make_write(cdbmp, zero, CDBX_FHDR - t) < 0) {
+    free(flt);
+    return -1;
+  }
+  sec->type = CDBX_SEC_FILTER;
+  sec->flags = 0;
+  sec->pos = cdbmp->cdb_dpos;
+  sec->len = CDBX_FHDR + nblk * CDBX_FBLOCK;
+  for (b = 0, len = 0; len < sec->len; len += b) {
+    b = sec->len - len > 0x40000000 ? 0x40000000 :
+      (unsigned)(sec->len - len);
+    if (_cdb_make_write(cdbmp, flt + len, b) < 0) {
+      free(flt);
+      return -1;
     }
   }
-  if (len) {
-    memcpy(cdbmp->cdb_bpos, ptr, len);
-    cdbmp->cdb_bpos += len;
+  free(flt);
+  return 0;
+}
+
+/* write section directory and trailer of a 64-bit format file,
+ * adding optional sections (filter, ordered index, tombstones) */
+static int
+cdb_make_finish_x(struct cdb_make *cdbmp,
+                  const struct cdb_xsec *sec, unsigned nsec)
+{
+  unsigned char ent[CDBX_DIRENT];
+  struct cdb_xsec opt[3];
+  unsigned nopt = 0;
+  cdbo_t dirpos;
+  unsigned i;
+
+  if (cdbmp->cdb_flags & CDB_MAKE_FILTER &&
+      cdb_make_filter(cdbmp, &opt[nopt++]) < 0)
+    return -1;
+  if (cdbmp->cdb_flags & CDB_MAKE_ORDER &&
+      _cdb_make_order(cdbmp, &opt[nopt++]) < 0)
+    return -1;
+  if (cdbmp->cdb_tomb &&
+      _cdb_make_tombsec(cdbmp, &opt[nopt++]) < 0)
+    return -1;
+  dirpos = cdbmp->cdb_dpos;
+  for (i = 0; i < nsec + nopt; ++i) {
+    const struct cdb_xsec *s = i < nsec ? &sec[i] : &opt[i - nsec];
+    cdb_pack(s->type, ent);
+    cdb_pack(s->flags, ent + 4);
+    _cdb_pack64(s->pos, ent + 8);
+    _cdb_pack64(s->len, ent + 16);
+    if (_cdb_make_write(cdbmp, ent, CDBX_DIRENT) < 0)
+      return -1;
   }
+  _cdb_pack64(dirpos, ent);
+  cdb_pack(i, ent + 8);
+  cdb_pack(CDBX_VERSION, ent + 12);
+  if (_cdb_make_write(cdbmp, ent, CDBX_TAIL) < 0 ||
+      _cdb_make_flush(cdbmp) < 0)
+    return -1;
+
+  /* unless written by cdb_make_start_ex(), we have to seek back */
+  if (cdbmp->cdb_flags & CDB_MAKE_64BIT)
+    return 0;
+  cdb_make_xhdr(cdbmp->cdb_buf);
+  if (lseek(cdbmp->cdb_fd, 0, 0) != 0 ||
+      _cdb_make_fullwrite(cdbmp->cdb_fd, cdbmp->cdb_buf, 2048) != 0)
+    return -1;
+
   return 0;
 }
 
+/* write toc of the hash tables of a 64-bit format file, and finish it */
+static int
+cdb_make_finish_htoc(struct cdb_make *cdbmp,
+                     const cdbo_t hpos[256], const unsigned hcnt[256])
+{
+  struct cdb_xsec sec[2];
+  unsigned char ent[CDBX_TOCENT];
+  unsigned t;
+
+  sec[0].type = CDBX_SEC_DATA;
+  sec[0].flags = CDBX_SEC_REQUIRED;
+  sec[0].pos = 2048;
+  sec[0].len = hpos[0] - 2048;
+  sec[1].type = CDBX_SEC_HTOC;
+  sec[1].flags = CDBX_SEC_REQUIRED;
+  sec[1].pos = cdbmp->cdb_dpos;
+  sec[1].len = 256 * CDBX_TOCENT;
+
+  for (t = 0; t < 256; ++t) {
+    _cdb_pack64(hpos[t], ent);
+    cdb_pack(hcnt[t], ent + 8);
+    if (_cdb_make_write(cdbmp, ent, CDBX_TOCENT) < 0)
+      return -1;
+  }
+
+  return cdb_make_finish_x(cdbmp, sec, 2);
+}
+
+/* build and write bucketed index (see cdb_int.h), and finish the file.
+ * Reclists are expected to be in insertion order already, so that
+ * records with the same key are found in that order. */
+static int
+cdb_make_finish_bkt(struct cdb_make *cdbmp)
+{
+  static const unsigned char zero[CDBX_BUCKET];
+  struct cdb_xsec sec[2];
+  struct cdb_rl *rl;
+  unsigned char *bkt, *p;
+  cdbo_t nb, b, len;
+  unsigned t, i, n;
+
+  nb = (cdbmp->cdb_rcnt + CDBX_BFILL - 1) / CDBX_BFILL;
+  if (!nb)
+    nb = 1;
+  if (nb > 0xffffffff || (size_t)(nb * CDBX_BUCKET) != nb * CDBX_BUCKET)
+    return errno = ENOMEM, -1;
+  bkt = (unsigned char*)calloc((size_t)nb, CDBX_BUCKET);
+  if (!bkt)
+    return errno = ENOMEM, -1;
+
+  for (t = 0; t < 256; ++t)
+    for (rl = cdbmp->cdb_rec[t]; rl; rl = rl->next)
+      for (i = 0; i < rl->cnt; ++i) {
+        unsigned hval = _cdb_rlhval(rl->rec[i], t);
+        cdbo_t rpos = _cdb_rlpos(rl, rl->rec[i]);
+        b = _cdb_bhome(hval, nb);
+        while((p = bkt + b * CDBX_BUCKET)[CDBX_BCNT] == CDBX_BSLOTS) {
+          p[CDBX_BFLAGS] |= CDBX_BMORE;
+          if (++b == nb)
+            b = 0;
+        }
+        n = p[CDBX_BCNT]++;
+        p[n] = (unsigned char)_cdb_btag(hval);
+        p += CDBX_BPOS + n * 5;
+        cdb_pack((unsigned)rpos, p);
+        p[4] = (unsigned char)(rpos >> 32);
+      }
+
+  sec[0].type = CDBX_SEC_DATA;
+  sec[0].flags = CDBX_SEC_REQUIRED;
+  sec[0].pos = 2048;
+  sec[0].len = cdbmp->cdb_dpos - 2048;
+  /* align buckets at cache line */
+  n = (unsigned)(cdbmp->cdb_dpos % CDBX_BUCKET);
+  if (n && _cdb_make_write(cdbmp, zero, CDBX_BUCKET - n) < 0) {
+    free(bkt);
+    return -1;
+  }
+  sec[1].type = CDBX_SEC_BUCKETS;
+  sec[1].flags = CDBX_SEC_REQUIRED;
+  sec[1].pos = cdbmp->cdb_dpos;
+  sec[1].len = nb * CDBX_BUCKET;
+
+  for (b = 0; b < sec[1].len; b += len) {
+    len = sec[1].len - b;
+    if (len > 0x40000000)
+      len = 0x40000000;
+    if (_cdb_make_write(cdbmp, bkt + b, (unsigned)len) < 0) {
+      free(bkt);
+      return -1;
+    }
+  }
+  free(bkt);
+
+  return cdb_make_finish_x(cdbmp, sec, 2);
+}
+
+/* build hash table t of len slots of reclist rl in mem, which has room
+ * for len + 2 records, and pack it at the start of mem */
+void internal_function
+_cdb_make_htab(const struct cdb_rl *rl, unsigned t, unsigned len,
+               unsigned slot, unsigned char *mem)
+{
+  struct cdb_rec *htab = (struct cdb_rec *)mem + 2;
+  unsigned i, hi;
+
+  for (i = 0; i < len; ++i)
+    htab[i].hval = htab[i].rpos = 0;
+  for (; rl; rl = rl->next)
+    for (i = 0; i < rl->cnt; ++i) {
+      hi = (unsigned)(rl->rec[i] >> 40) % len;
+      while(htab[hi].rpos)
+        if (++hi == len)
+          hi = 0;
+      htab[hi].hval = _cdb_rlhval(rl->rec[i], t);
+      htab[hi].rpos = _cdb_rlpos(rl, rl->rec[i]);
+    }
+  /* packed slots are never larger than struct cdb_rec, so this
+   * does not overwrite entries not yet packed */
+  if (slot == 8)
+    for (i = 0; i < len; ++i) {
+      cdb_pack(htab[i].hval, mem + (i << 3));
+      cdb_pack((unsigned)htab[i].rpos, mem + (i << 3) + 4);
+    }
+  else
+    for (i = 0; i < len; ++i) {
+      cdb_pack(htab[i].hval, mem + i * CDBX_SLOT);
+      _cdb_pack64(htab[i].rpos, mem + i * CDBX_SLOT + 4);
+    }
+}
+
 static int
 cdb_make_finish_internal(struct cdb_make *cdbmp)
 {
   unsigned hcnt[256];		/* hash table counts */
-  unsigned hpos[256];		/* hash table positions */
-  struct cdb_rec *htab;
+  cdbo_t hpos[256];		/* hash table positions */
   unsigned char *p;
   struct cdb_rl *rl;
   unsigned hsize;
-  unsigned t, i;
+  unsigned t;
+  unsigned slot;		/* size of hash table slot on disk */
 
-  if (((0xffffffff - cdbmp->cdb_dpos) >> 3) < cdbmp->cdb_rcnt)
-    return errno = ENOMEM, -1;
+  if (_cdb_make_wend(cdbmp) < 0 || _cdb_make_compact(cdbmp) < 0)
+    return -1;
+  /* once spilled, all the records go to the runs */
+  if (spilled(cdbmp) && cdbmp->cdb_spill->mcnt && _cdb_make_spill(cdbmp) < 0)
+    return -1;
+
+  /* switch to 64-bit format if the classic one can't hold the index,
+   * or there are tombstones to list */
+  if (cdbmp->cdb_flags & CDB_MAKE_64BIT || cdbmp->cdb_tomb ||
+      cdbmp->cdb_dpos > 0xffffffff ||
+      ((0xffffffff - cdbmp->cdb_dpos) >> 3) < cdbmp->cdb_rcnt)
+    slot = CDBX_SLOT;
+  else
+    slot = 8;
 
   /* count htab sizes and reorder reclists */
   hsize = 0;
   for (t = 0; t < 256; ++t) {
     struct cdb_rl *rlt = NULL;
-    i = 0;
+    cdbo_t n = spilled(cdbmp) ? cdbmp->cdb_spill->cnt[t] : 0;
     rl = cdbmp->cdb_rec[t];
     while(rl) {
       struct cdb_rl *rln = rl->next;
       rl->next = rlt;
       rlt = rl;
-      i += rl->cnt;
+      n += rl->cnt;
       rl = rln;
     }
     cdbmp->cdb_rec[t] = rlt;
-    if (hsize < (hcnt[t] = i << 1))
+    if (n > (0xffffffff / CDBX_SLOT) >> 1) /* htab size in bytes overflow */
+      return errno = ENOMEM, -1;
+    if (hsize < (hcnt[t] = (unsigned)n << 1))
       hsize = hcnt[t];
   }
 
-  /* allocate memory to hold max htable */
-  htab = (struct cdb_rec*)malloc((hsize + 2) * sizeof(struct cdb_rec));
-  if (!htab)
-    return errno = ENOENT, -1;
-  p = (unsigned char *)htab;
-  htab += 2;
+  if (cdbmp->cdb_flags & CDB_MAKE_MPH) {
+    struct cdb_xsec sec[2];
+    int r;
+    sec[0].type = CDBX_SEC_DATA;
+    sec[0].flags = CDBX_SEC_REQUIRED;
+    sec[0].pos = 2048;
+    sec[0].len = cdbmp->cdb_dpos - 2048;
+    if ((r = _cdb_make_mph(cdbmp, &sec[1])) <= 0)
+      return r < 0 ? r : cdb_make_finish_x(cdbmp, sec, 2);
+    /* keys are not unique, go on with bucketed index */
+  }
 
-  /* build hash tables */
-  for (t = 0; t < 256; ++t) {
-    unsigned len, hi;
-    hpos[t] = cdbmp->cdb_dpos;
-    if ((len = hcnt[t]) == 0)
-      continue;
-    for (i = 0; i < len; ++i)
-      htab[i].hval = htab[i].rpos = 0;
-    for (rl = cdbmp->cdb_rec[t]; rl; rl = rl->next)
-      for (i = 0; i < rl->cnt; ++i) {
-       hi = (rl->rec[i].hval >> 8) % len;
-        while(htab[hi].rpos)
-          if (++hi == len)
-            hi = 0;
-        htab[hi] = rl->rec[i];
-      }
-    for (i = 0; i < len; ++i) {
-      cdb_pack(htab[i].hval, p + (i << 3));
-      cdb_pack(htab[i].rpos, p + (i << 3) + 4);
-    }
-    if (_cdb_make_write(cdbmp, p, len << 3) < 0) {
-      free(p);
+  /* 5-byte positions in buckets; fall back to hash tables if too large */
+  if (cdbmp->cdb_flags & (CDB_MAKE_BUCKETS | CDB_MAKE_MPH) &&
+      cdbmp->cdb_dpos <= CDBX_BMAXPOS)
+    return cdb_make_finish_bkt(cdbmp);
+
+  if (spilled(cdbmp)) {
+    /* build hash tables within the memory limit */
+    if (_cdb_make_htabs_spill(cdbmp, hcnt, hpos, slot) < 0)
+      return -1;
+  }
+  else if (cdbmp->cdb_nthreads > 1 &&
+           !(cdbmp->cdb_flags & CDB_MAKE_STREAM)) {
+    /* build hash tables in parallel */
+    if (_cdb_make_htabs_mt(cdbmp, hcnt, hpos, hsize, slot) < 0)
       return -1;
+  }
+  else {
+    /* allocate memory to hold max htable */
+    p = (unsigned char*)malloc((hsize + 2) * sizeof(struct cdb_rec));
+    if (!p)
+      return errno = ENOENT, -1;
+
+    /* build hash tables */
+    for (t = 0; t < 256; ++t) {
+      hpos[t] = cdbmp->cdb_dpos;
+      if (!hcnt[t])
+        continue;
+      _cdb_make_htab(cdbmp->cdb_rec[t], t, hcnt[t], slot, p);
+      if (_cdb_make_write(cdbmp, p, hcnt[t] * slot) < 0) {
+        free(p);
+        return -1;
+      }
     }
+    free(p);
   }
-  free(p);
+
+  if (slot != 8)
+    return cdb_make_finish_htoc(cdbmp, hpos, hcnt);
+
   if (_cdb_make_flush(cdbmp) < 0)
     return -1;
   p = cdbmp->cdb_buf;
   for (t = 0; t < 256; ++t) {
-    cdb_pack(hpos[t], p + (t << 3));
+    cdb_pack((unsigned)hpos[t], p + (t << 3));
     cdb_pack(hcnt[t], p + (t << 3) + 4);
   }
   if (lseek(cdbmp->cdb_fd, 0, 0) != 0 ||
@@ -158,8 +659,8 @@ cdb_make_finish_internal(struct cdb_make *cdbmp)
   return 0;
 }
 
-static void
-cdb_make_free(struct cdb_make *cdbmp)
+void internal_function
+_cdb_make_free(struct cdb_make *cdbmp)
 {
   unsigned t;
   for(t = 0; t < 256; ++t) {
@@ -170,13 +671,32 @@ cdb_make_free(struct cdb_make *cdbmp)
       free(tm);
     }
   }
+  _cdb_make_dxfree(cdbmp);
+  _cdb_make_wfree(cdbmp);
+  _cdb_make_spillfree(cdbmp);
+  _cdb_make_tombfree(cdbmp);
+  if (mapped(cdbmp))
+    munmap(cdbmp->cdb_wbuf, cdbmp->cdb_wsize);
+  else if (cdbmp->cdb_wbuf != cdbmp->cdb_buf)
+    free(cdbmp->cdb_wbuf);
+  cdbmp->cdb_bpos = cdbmp->cdb_wbuf = cdbmp->cdb_buf;
 }
 
 int
 cdb_make_finish(struct cdb_make *cdbmp)
 {
   int r = cdb_make_finish_internal(cdbmp);
-  cdb_make_free(cdbmp);
+  struct stat st;
+  if (r == 0)
+    r = _cdb_make_flush(cdbmp);
+  /* data removed or truncated during the build, or CDB_MAKE_MMAP, may
+   * leave stale bytes past the end, where the 64-bit format has its
+   * trailer */
+  if (r == 0 && fstat(cdbmp->cdb_fd, &st) == 0 &&
+      (cdbo_t)st.st_size > cdbmp->cdb_dpos &&
+      ftruncate(cdbmp->cdb_fd, (off_t)cdbmp->cdb_dpos) < 0)
+    r = -1;
+  _cdb_make_free(cdbmp);
   return r;
 }
 
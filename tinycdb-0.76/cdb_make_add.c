@@ -11,39 +11,102 @@
 */
 
 #include <stdlib.h> /* for malloc */
+#include <sys/uio.h>
 #include "cdb_int.h"
 
+#define NIOV	16	/* iovecs on stack for cdb_make_addv() */
+
+/* write out the buffer and a record at least as large as the buffer,
+ * passing the caller's memory to writev(2) as it is */
+static int
+_cdb_make_writerec(struct cdb_make *cdbmp, const unsigned char *rlen,
+                   const void *key, unsigned klen,
+                   const struct cdb_iovec *vals, unsigned nvals)
+{
+  struct iovec siov[NIOV], *iov = siov;
+  unsigned i;
+  int r;
+  if (nvals + 3 > NIOV &&
+      !(iov = (struct iovec*)malloc((nvals + 3) * sizeof(*iov))))
+    return errno = ENOMEM, -1;
+  iov[0].iov_base = cdbmp->cdb_wbuf;
+  iov[0].iov_len = cdbmp->cdb_bpos - cdbmp->cdb_wbuf;
+  iov[1].iov_base = (void*)rlen;
+  iov[1].iov_len = 8;
+  iov[2].iov_base = (void*)key;
+  iov[2].iov_len = klen;
+  for (i = 0; i < nvals; ++i) {
+    iov[i + 3].iov_base = (void*)vals[i].cdb_iov_base;
+    iov[i + 3].iov_len = vals[i].cdb_iov_len;
+  }
+  r = _cdb_make_fullwritev(cdbmp->cdb_fd, iov, nvals + 3);
+  if (iov != siov)
+    free(iov);
+  if (r < 0)
+    return -1;
+  cdbmp->cdb_bpos = cdbmp->cdb_wbuf;
+  return 0;
+}
+
+/* append the record at pos to its reclist in rec[] */
+int internal_function
+_cdb_make_rladd(struct cdb_rl **rec, unsigned hval, cdbo_t pos)
+{
+  unsigned i = hval & 255;
+  struct cdb_rl *rl = rec[i];
+  if (!rl || rl->cnt == rl->size || pos - rl->base > CDB_RLPOS) {
+    unsigned size = !rl ? CDB_RLMIN :
+      rl->size < CDB_RLMAX ? rl->size << 1 : CDB_RLMAX;
+    rl = (struct cdb_rl*)malloc(sizeof(struct cdb_rl) +
+                                (size - 1) * sizeof(cdbo_t));
+    if (!rl)
+      return errno = ENOMEM, -1;
+    rl->cnt = 0;
+    rl->size = size;
+    rl->base = pos;
+    rl->next = rec[i];
+    rec[i] = rl;
+  }
+  rl->rec[rl->cnt++] = _cdb_rlent(hval, pos - rl->base);
+  return 0;
+}
+
 static int
 _cdb_make_addv(struct cdb_make *cdbmp, unsigned hval,
                const void *key, unsigned klen,
                const struct cdb_iovec *vals, unsigned nvals)
 {
-  unsigned vlen = 0;
+  cdbo_t vlen = 0;
   unsigned char rlen[8];
-  struct cdb_rl *rl;
   unsigned i;
   
+  /* the data end belongs to the writers while they are in use */
+  if (cdbmp->cdb_mw)
+    return errno = EINVAL, -1;
   for (i=0; i<nvals; i++)
     vlen += vals[i].cdb_iov_len;
-  if (klen > 0xffffffff - (cdbmp->cdb_dpos + 8) ||
-      vlen > 0xffffffff - (cdbmp->cdb_dpos + klen + 8))
+  /* lengths are 32-bit in the record header; positions are 64-bit
+   * (cdb_make_finish() switches to 64-bit format when needed) */
+  if (vlen > 0xffffffff ||
+      (cdbo_t)klen + vlen + 8 > CDBX_MAXPOS - cdbmp->cdb_dpos)
     return errno = ENOMEM, -1;
-  i = hval & 255;
-  rl = cdbmp->cdb_rec[i];
-  if (!rl || rl->cnt >= sizeof(rl->rec)/sizeof(rl->rec[0])) {
-    rl = (struct cdb_rl*)malloc(sizeof(struct cdb_rl));
-    if (!rl)
-      return errno = ENOMEM, -1;
-    rl->cnt = 0;
-    rl->next = cdbmp->cdb_rec[i];
-    cdbmp->cdb_rec[i] = rl;
-  }
-  i = rl->cnt++;
-  rl->rec[i].hval = hval;
-  rl->rec[i].rpos = cdbmp->cdb_dpos;
+  if (cdbmp->cdb_dx &&
+      _cdb_make_dxadd(cdbmp, hval, key, klen, cdbmp->cdb_dpos) < 0)
+    return -1;
+  if (_cdb_make_rladd(cdbmp->cdb_rec, hval, cdbmp->cdb_dpos) < 0 ||
+      _cdb_make_spillchk(cdbmp, 1) < 0)
+    return -1;
   ++cdbmp->cdb_rcnt;
   cdb_pack(klen, rlen);
-  cdb_pack(vlen, rlen + 4);
+  cdb_pack((unsigned)vlen, rlen + 4);
+  if (!(cdbmp->cdb_flags & CDB_MAKE_MMAP) &&
+      8 + klen + vlen >= cdbmp->cdb_wsize) {
+    if (_cdb_make_writerec(cdbmp, rlen, key, klen, vals, nvals) < 0)
+      return -1;
+    cdbmp->cdb_dpos += 8 + klen + vlen;
+    _cdb_make_wb(cdbmp);
+    return 0;
+  }
   if (_cdb_make_write(cdbmp, rlen, 8) < 0 ||
       _cdb_make_write(cdbmp, key, klen) < 0)
     return -1;
@@ -0,0 +1,214 @@
+/* _cdb_make_compact routine: squeeze out records removed with
+ * CDB_FIND_REMOVE, see cdb_make_put.c
+ *
+ * Removing a record used to move the rest of the file and fix up the
+ * positions of all the records after it, every time.  Now removed
+ * records stay in the file as holes, and the live data is moved down
+ * over them here, once, in a single pass, followed by a single fixup.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "cdb_int.h"
+
+#ifdef __linux__
+# include <sys/syscall.h>
+# ifdef __NR_copy_file_range
+#  define COPYRANGE 1
+# endif
+#endif
+
+#define CBUFSZ	(1024*1024)	/* read and write buffers */
+#define CRMIN	(256*1024)	/* shortest run and distance to copy in kernel */
+
+static int
+holecmp(const void *a, const void *b)
+{
+  cdbo_t pa = ((const struct cdb_hole*)a)->pos;
+  cdbo_t pb = ((const struct cdb_hole*)b)->pos;
+  return pa < pb ? -1 : pa > pb;
+}
+
+/* live data is read through ibuf and written through obuf; data is only
+ * moved down, and never written past what has been read already */
+struct cmove {
+  int fd;
+  unsigned char *ibuf, *obuf;
+  cdbo_t ipos, ilen;		/* file window in ibuf */
+  cdbo_t dst;			/* where obuf goes */
+  size_t olen;			/* bytes in obuf */
+  int nocr;			/* copy_file_range does not work here */
+};
+
+static int
+cflush(struct cmove *cm)
+{
+  size_t n = 0;
+  ssize_t w;
+  while(n < cm->olen) {
+    w = pwrite(cm->fd, cm->obuf + n, cm->olen - n, (off_t)(cm->dst + n));
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    n += (size_t)w;
+  }
+  cm->dst += cm->olen;
+  cm->olen = 0;
+  return 0;
+}
+
+#ifdef COPYRANGE
+/* in-kernel copy, which can't overlap within the same file; returns
+ * the number of bytes not copied */
+static cdbo_t
+ccopy(struct cmove *cm, cdbo_t src, cdbo_t len)
+{
+  ssize_t l;
+  size_t n;
+  while(len) {
+    long long in = (long long)src, out = (long long)cm->dst;
+    n = len > src - cm->dst ? (size_t)(src - cm->dst) : (size_t)len;
+    if (n > 0x40000000)
+      n = 0x40000000;
+    l = syscall(__NR_copy_file_range, cm->fd, &in, cm->fd, &out, n, 0);
+    if (l < 0 && errno == EINTR)
+      continue;
+    if (l <= 0) {
+      cm->nocr = 1;		/* copy by hand from now on */
+      break;
+    }
+    src += (cdbo_t)l;
+    cm->dst += (cdbo_t)l;
+    len -= (cdbo_t)l;
+  }
+  return len;
+}
+#endif
+
+/* move len bytes at src down to the current output position */
+static int
+cmove(struct cmove *cm, cdbo_t src, cdbo_t len)
+{
+  ssize_t l;
+  size_t n;
+#ifdef COPYRANGE
+  if (len >= CRMIN && src - (cm->dst + cm->olen) >= CRMIN && !cm->nocr) {
+    cdbo_t left;
+    if (cflush(cm) < 0)
+      return -1;
+    left = ccopy(cm, src, len);
+    src += len - left;
+    len = left;
+  }
+#endif
+  while(len) {
+    if (src < cm->ipos || src >= cm->ipos + cm->ilen) {
+      cm->ipos = src;
+      cm->ilen = 0;
+      while((l = pread(cm->fd, cm->ibuf, CBUFSZ, (off_t)src)) < 0)
+        if (errno != EINTR)
+          return -1;
+      if (!l)
+        return errno = EPROTO, -1;
+      cm->ilen = (cdbo_t)l;
+    }
+    n = (size_t)(cm->ipos + cm->ilen - src);
+    if (n > len)
+      n = (size_t)len;
+    if (n > CBUFSZ - cm->olen)
+      n = CBUFSZ - cm->olen;
+    memcpy(cm->obuf + cm->olen, cm->ibuf + (src - cm->ipos), n);
+    cm->olen += n;
+    src += n;
+    len -= n;
+    if (cm->olen == CBUFSZ && cflush(cm) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* new position of the record at pos: holes[i].len is the total length
+ * of holes 0..i by now */
+static cdbo_t
+newpos(const struct cdb_hole *h, cdbo_t n, cdbo_t pos)
+{
+  cdbo_t lo = 0, hi = n, m;
+  while(lo < hi) {
+    m = lo + (hi - lo) / 2;
+    if (h[m].pos < pos) lo = m + 1;
+    else hi = m;
+  }
+  return lo ? pos - h[lo - 1].len : pos;
+}
+
+/* move live data over the holes, fix up record positions, and leave
+ * the file positioned at the new end of the data; cdb_make_finish()
+ * truncates the rest */
+int internal_function
+_cdb_make_compact(struct cdb_make *cdbmp)
+{
+  struct cdb_dx *dx = cdbmp->cdb_dx;
+  struct cdb_hole *h;
+  struct cdb_rl *rl;
+  struct cmove cm;
+  cdbo_t n, i, src, end, base;
+  unsigned t, j;
+  int r = 0;
+
+  if (!dx || !dx->nholes)
+    return 0;
+  if (_cdb_make_flush(cdbmp) < 0)
+    return -1;
+  h = dx->holes;
+  n = dx->nholes;
+  qsort(h, (size_t)n, sizeof(*h), holecmp);
+
+  memset(&cm, 0, sizeof(cm));
+  cm.fd = cdbmp->cdb_fd;
+  cm.dst = h[0].pos;
+  cm.ibuf = (unsigned char*)malloc(CBUFSZ);
+  cm.obuf = (unsigned char*)malloc(CBUFSZ);
+  if (!cm.ibuf || !cm.obuf) {
+    errno = ENOMEM;
+    r = -1;
+  }
+  for (i = 0; i < n && !r; ++i) {
+    src = h[i].pos + h[i].len;
+    end = i + 1 < n ? h[i + 1].pos : cdbmp->cdb_dpos;
+    if (end > src)
+      r = cmove(&cm, src, end - src);
+    if (i)
+      h[i].len += h[i - 1].len;
+  }
+  if (!r)
+    r = cflush(&cm);
+  free(cm.ibuf);
+  free(cm.obuf);
+  if (r < 0)
+    return -1;
+
+  for (t = 0; t < 256; ++t)
+    for (rl = cdbmp->cdb_rec[t]; rl; rl = rl->next) {
+      base = newpos(h, n, rl->base);
+      for (j = 0; j < rl->cnt; ++j)
+        rl->rec[j] = (rl->rec[j] & ~CDB_RLPOS) |
+          (newpos(h, n, _cdb_rlpos(rl, rl->rec[j])) - base);
+      rl->base = base;
+    }
+  if (cdbmp->cdb_tomb)
+    for (i = 0; i < cdbmp->cdb_tomb->cnt; ++i)
+      cdbmp->cdb_tomb->pos[i] = newpos(h, n, cdbmp->cdb_tomb->pos[i]);
+
+  /* the index is of no use any more, and has old positions */
+  _cdb_make_dxfree(cdbmp);
+  cdbmp->cdb_dpos = cm.dst;
+  if (lseek(cdbmp->cdb_fd, (off_t)cm.dst, SEEK_SET) < 0)
+    return -1;
+  return 0;
+}
@@ -0,0 +1,220 @@
+/* cdb_make_copy_range and cdb_make_merge routines: append records of
+ * existing databases to the one being made
+ *
+ * The records are copied from the data section of the source as they
+ * are, with copy_file_range(2) where possible, so that they don't pass
+ * through user space, and filesystems supporting reflinks may even
+ * share the blocks with the source.  The keys are hashed again right
+ * from the mapping of the source: the records have to be walked
+ * anyway to check the range, and that is cheaper than collecting the
+ * slots of the source hash tables and sorting them in record order
+ * (bucketed and perfect hash indexes don't keep hash values at all).
+ * Records which aren't in the source index, like the ones zeroed by
+ * CDB_PUT_REPLACE0, aren't indexed in the new file either, and
+ * tombstones stay tombstones.
+ *
+ * Merging a stack of databases (see cdb_stack.c) into one copies the
+ * runs of records in effect the same way, so compacting layers which
+ * mostly hold live records costs little more than a file copy.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include "cdb_int.h"
+
+#ifdef __linux__
+# include <sys/syscall.h>
+#endif
+
+/* is [pos, end) a whole number of records? */
+static int
+crecs(const struct cdb *cdbp, cdbo_t pos, cdbo_t end)
+{
+  const unsigned char *mem = cdbp->cdb_mem;
+  cdbo_t l;
+  while(pos < end) {
+    if (end - pos < 8)
+      return errno = EINVAL, -1;
+    l = 8 + (cdbo_t)cdb_unpack(mem + pos) + cdb_unpack(mem + pos + 4);
+    if (l > end - pos)
+      return errno = EINVAL, -1;
+    pos += l;
+  }
+  return 0;
+}
+
+static int
+poscmp(const void *a, const void *b)
+{
+  cdbo_t pa = *(const cdbo_t*)a, pb = *(const cdbo_t*)b;
+  return pa < pb ? -1 : pa > pb;
+}
+
+/* positions of the indexed records with empty keys in [pos, end),
+ * sorted, in *zp; zeroed records are not indexed */
+static int
+czeros(const struct cdb *cdbp, cdbo_t pos, cdbo_t end,
+       cdbo_t **zp, size_t *np)
+{
+  struct cdb_find cdbf;
+  struct cdb_kv kv;
+  cdbo_t *z = NULL, *t;
+  size_t n = 0, size = 0;
+  int r;
+
+  if ((r = cdb_findinit(&cdbf, cdbp, "", 0)) > 0)
+    while((r = cdb_findnext_r(&cdbf, &kv)) > 0) {
+      if (kv.cdb_kpos - 8 < pos || kv.cdb_kpos - 8 >= end)
+        continue;
+      if (n == size) {
+        size = size ? size << 1 : 64;
+        if (!(t = (cdbo_t*)realloc(z, size * sizeof(*z)))) {
+          free(z);
+          return errno = ENOMEM, -1;
+        }
+        z = t;
+      }
+      z[n++] = kv.cdb_kpos - 8;
+    }
+  if (r < 0) {
+    free(z);
+    return -1;
+  }
+  if (n)
+    qsort(z, n, sizeof(*z), poscmp);
+  *zp = z;
+  *np = n;
+  return 0;
+}
+
+/* index the records going to dst, hashing their keys */
+static int
+chash(struct cdb_make *cdbmp, const struct cdb *cdbp,
+      cdbo_t pos, cdbo_t end, cdbo_t dst)
+{
+  const unsigned char *mem = cdbp->cdb_mem;
+  struct cdb_kv kv;
+  unsigned klen, hval;
+  cdbo_t p, *zpos = NULL;
+  size_t nz = 0;
+  int zdone = 0, r = 0;
+
+  for (p = pos; p < end; p += 8 + (cdbo_t)klen + cdb_unpack(mem + p + 4)) {
+    klen = cdb_unpack(mem + p);
+    /* zeroed records have empty keys: is this one in the index?  The
+     * empty keys are looked up once for the whole range */
+    if (!klen) {
+      if (!zdone && czeros(cdbp, pos, end, &zpos, &nz) < 0)
+        return -1;
+      zdone = 1;
+      if (!nz || !bsearch(&p, zpos, nz, sizeof(*zpos), poscmp))
+        continue;
+    }
+    kv.cdb_kpos = p + 8;
+    kv.cdb_vlen = cdb_unpack(mem + p + 4);
+    hval = cdb_hash(mem + p + 8, klen);
+    if ((cdb_tombstone(cdbp, &kv) &&
+         _cdb_make_tombadd(cdbmp, dst + (p - pos)) < 0) ||
+        (cdbmp->cdb_dx &&
+         _cdb_make_dxadd(cdbmp, hval, mem + p + 8, klen,
+                         dst + (p - pos)) < 0) ||
+        _cdb_make_rladd(cdbmp->cdb_rec, hval, dst + (p - pos)) < 0 ||
+        _cdb_make_spillchk(cdbmp, 1) < 0) {
+      r = -1;
+      break;
+    }
+    ++cdbmp->cdb_rcnt;
+  }
+  free(zpos);
+  return r;
+}
+
+/* append len bytes of the source at pos */
+static int
+ccopy(struct cdb_make *cdbmp, const struct cdb *cdbp, cdbo_t pos, cdbo_t len)
+{
+  unsigned l;
+#ifdef __NR_copy_file_range
+  /* small runs go to the write buffer like any other record */
+  if (!(cdbmp->cdb_flags & CDB_MAKE_MMAP) && len >= cdbmp->cdb_wsize) {
+    cdbo_t off = pos;
+    long r = 0;
+    if (_cdb_make_flush(cdbmp) < 0)
+      return -1;
+    while(len) {
+      r = syscall(__NR_copy_file_range, cdbp->cdb_fd, &off, cdbmp->cdb_fd,
+                  NULL, len > 0x40000000 ? 0x40000000 : (size_t)len, 0);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        break;
+      len -= (cdbo_t)r;
+      cdbmp->cdb_dpos += (cdbo_t)r;
+      _cdb_make_wb(cdbmp);
+    }
+    if (!r)			/* the source got shorter */
+      return errno = EPROTO, -1;
+    /* not supported for these files: copy the rest by hand */
+    if (r < 0 && errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+        errno != EOPNOTSUPP && errno != EBADF)
+      return -1;
+    pos = off;
+  }
+#endif
+  for (; len; pos += l, len -= l) {
+    l = len > 0x40000000 ? 0x40000000 : (unsigned)len;
+    if (_cdb_make_write(cdbmp, cdbp->cdb_mem + pos, l) < 0)
+      return -1;
+  }
+  _cdb_make_wb(cdbmp);
+  return 0;
+}
+
+int
+cdb_make_copy_range(struct cdb_make *cdbmp, const struct cdb *cdbp,
+                    cdbo_t pos, cdbo_t end)
+{
+  cdbo_t dst = cdbmp->cdb_dpos;
+
+  if (end > cdbp->cdb_dend)
+    end = cdbp->cdb_dend;
+  if (cdbmp->cdb_mw || pos < 2048 || pos > end)
+    return errno = EINVAL, -1;
+  if (end - pos > CDBX_MAXPOS - dst)
+    return errno = ENOMEM, -1;
+  if (crecs(cdbp, pos, end) < 0 ||
+      chash(cdbmp, cdbp, pos, end, dst) < 0)
+    return -1;
+  return ccopy(cdbmp, cdbp, pos, end - pos);
+}
+
+int
+cdb_make_merge(struct cdb_make *cdbmp, const struct cdb_stack *stp, int tombs)
+{
+  const struct cdb *cdbp;
+  struct cdb_kv kv;
+  cdbo_t pos, run;
+  unsigned l;
+  int r;
+
+  for (l = 0; l < stp->cdb_nlayers; ++l) {
+    cdbp = stp->cdb_layers[l];
+    /* [run, pos) are records to keep */
+    for (run = pos = 2048; (r = cdb_seqnext_r(&pos, cdbp, &kv)) > 0; ) {
+      if ((r = _cdb_stack_rec(stp, l, &kv)) < 0)
+        return -1;
+      if (r == 1 || (r == 2 && !tombs)) {
+        if (run < kv.cdb_kpos - 8 &&
+            cdb_make_copy_range(cdbmp, cdbp, run, kv.cdb_kpos - 8) < 0)
+          return -1;
+        run = pos;
+      }
+    }
+    if (r < 0 || (run < pos && cdb_make_copy_range(cdbmp, cdbp, run, pos) < 0))
+      return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,112 @@
+/* _cdb_make_rposv and _cdb_make_readkeys routines: read back keys of
+ * all the records being written, for indexes which need the keys
+ * themselves, not just their hash values.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include "cdb_int.h"
+
+#define RBUFSZ	65536	/* read buffer */
+
+/* positions of all records, in file order (radix sort, 8 bits a pass);
+ * the array is malloc'ed and has room for one more element */
+cdbo_t internal_function *
+_cdb_make_rposv(struct cdb_make *cdbmp)
+{
+  cdbo_t *a, *b, *t;
+  cdbo_t n = cdbmp->cdb_rcnt, i, j, cnt[256], c;
+  unsigned shift;
+  struct cdb_rl *rl;
+
+  if ((size_t)(n + 1) * sizeof(cdbo_t) / sizeof(cdbo_t) != n + 1)
+    return errno = ENOMEM, (cdbo_t*)NULL;
+  a = (cdbo_t*)malloc((size_t)(n + 1) * sizeof(cdbo_t));
+  b = (cdbo_t*)malloc((size_t)(n + 1) * sizeof(cdbo_t));
+  if (!a || !b) {
+    free(a); free(b);
+    return errno = ENOMEM, (cdbo_t*)NULL;
+  }
+  for (i = 0, j = 0; j < 256; ++j)
+    for (rl = cdbmp->cdb_rec[j]; rl; rl = rl->next)
+      for (c = 0; c < rl->cnt; ++c)
+        a[i++] = _cdb_rlpos(rl, rl->rec[c]);
+  for (shift = 0; n && (cdbmp->cdb_dpos >> shift) != 0; shift += 8) {
+    memset(cnt, 0, sizeof(cnt));
+    for (i = 0; i < n; ++i)
+      ++cnt[(a[i] >> shift) & 255];
+    if (cnt[(a[0] >> shift) & 255] == n)
+      continue;			/* all the same in this digit */
+    for (i = 0, j = 0; i < 256; ++i) {
+      c = cnt[i];
+      cnt[i] = j;
+      j += c;
+    }
+    for (i = 0; i < n; ++i)
+      b[cnt[(a[i] >> shift) & 255]++] = a[i];
+    t = a; a = b; b = t;
+  }
+  free(b);
+  return a;
+}
+
+/* read keys of n records at (sorted) positions rpos, calling fn for
+ * every one; stops if fn returns non-zero, and returns that value.
+ * File position is restored at the end. */
+int internal_function
+_cdb_make_readkeys(struct cdb_make *cdbmp, const cdbo_t *rpos, cdbo_t n,
+                   int (*fn)(void *arg, cdbo_t i,
+                             const unsigned char *key, unsigned klen),
+                   void *arg)
+{
+  unsigned char *buf = NULL;
+  unsigned bsize = 0, blen = 0;
+  cdbo_t bpos = 0, i;
+  unsigned klen = 0, need;
+  int l, r = 0, hdr;
+
+  if (_cdb_make_flush(cdbmp) < 0)
+    return -1;
+  for (i = 0; i < n && !r; ++i) {
+    for (hdr = 1, need = 8; ; hdr = 0, need = 8 + klen) {
+      if (rpos[i] < bpos || rpos[i] + need > bpos + blen) {
+        if (need > bsize) {
+          unsigned char *nb;
+          bsize = need > RBUFSZ ? need : RBUFSZ;
+          if (!(nb = (unsigned char*)realloc(buf, bsize))) {
+            free(buf);
+            return errno = ENOMEM, -1;
+          }
+          buf = nb;
+        }
+        bpos = rpos[i];
+        blen = 0;
+        if (lseek(cdbmp->cdb_fd, (off_t)bpos, SEEK_SET) < 0) {
+          free(buf);
+          return -1;
+        }
+        while(blen < need) {
+          l = (int)read(cdbmp->cdb_fd, buf + blen, bsize - blen);
+          if (l < 0 && errno == EINTR)
+            continue;
+          if (l <= 0) {
+            free(buf);
+            return errno = l < 0 ? errno : EPROTO, -1;
+          }
+          blen += l;
+        }
+      }
+      if (!hdr)
+        break;
+      klen = cdb_unpack(buf + (rpos[i] - bpos));
+    }
+    r = fn(arg, i, buf + (rpos[i] - bpos) + 8, klen);
+  }
+  free(buf);
+  if (lseek(cdbmp->cdb_fd, (off_t)cdbmp->cdb_dpos, SEEK_SET) < 0)
+    return -1;
+  return r;
+}
@@ -0,0 +1,250 @@
+/* _cdb_make_mph routine: build perfect hash index, see cdb_int.h
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdlib.h>
+#include "cdb_int.h"
+
+#define NSEEDS	16	/* seeds to try before giving up */
+
+struct mkey {
+  cdbo_t h;			/* _cdb_hash64() of the key */
+  cdbo_t rpos;			/* record position */
+  unsigned p;			/* position in the table */
+};
+
+static int
+hash_key(void *arg, cdbo_t i, const unsigned char *key, unsigned klen)
+{
+  ((struct mkey *)arg)[i].h = _cdb_hash64(key, klen);
+  return 0;
+}
+
+/* assign table positions to all keys using the given seed;
+ * returns 0 on success, 1 if some pilot does not fit, or 2 if
+ * two keys have the same hash value */
+static int
+place(struct mkey *keys, unsigned n, unsigned tsize, unsigned nbkt,
+      cdbo_t seed, unsigned char *pilots, unsigned char *taken)
+{
+  unsigned *bcnt, *bstart, *bkey, *border, *pos;
+  cdbo_t *bh;
+  unsigned i, j, k, b, maxsz, pilot;
+  int r = 0;
+
+  bcnt = (unsigned*)calloc((size_t)nbkt + 1, sizeof(unsigned));
+  bstart = (unsigned*)malloc(((size_t)nbkt + 1) * sizeof(unsigned));
+  bkey = (unsigned*)malloc(((size_t)n + 1) * sizeof(unsigned));
+  bh = (cdbo_t*)malloc(((size_t)n + 1) * sizeof(cdbo_t));
+  border = (unsigned*)malloc(((size_t)nbkt + 1) * sizeof(unsigned));
+  if (!bcnt || !bstart || !bkey || !bh || !border) {
+    r = -1;
+    goto out;
+  }
+
+  /* group keys (and their seeded hashes) by bucket */
+  for (i = 0; i < n; ++i)
+    ++bcnt[_cdb_mbucket(_cdb_mmix(keys[i].h ^ seed), nbkt)];
+  for (b = 0, j = 0, maxsz = 0; b < nbkt; ++b) {
+    bstart[b] = j;
+    j += bcnt[b];
+    if (maxsz < bcnt[b])
+      maxsz = bcnt[b];
+  }
+  for (i = 0; i < n; ++i) {
+    cdbo_t hs = _cdb_mmix(keys[i].h ^ seed);
+    b = _cdb_mbucket(hs, nbkt);
+    bh[bstart[b]] = hs;
+    bkey[bstart[b]++] = i;
+  }
+  for (b = 0; b < nbkt; ++b)
+    bstart[b] -= bcnt[b];
+
+  /* largest buckets first: counting sort by size */
+  pos = (unsigned*)calloc((size_t)maxsz + 2, sizeof(unsigned));
+  if (!pos) {
+    r = -1;
+    goto out;
+  }
+  for (b = 0; b < nbkt; ++b)
+    ++pos[maxsz - bcnt[b]];
+  for (i = 0, j = 0; i <= maxsz; ++i) {
+    unsigned c = pos[i];
+    pos[i] = j;
+    j += c;
+  }
+  for (b = 0; b < nbkt; ++b)
+    border[pos[maxsz - bcnt[b]]++] = b;
+
+  memset(taken, 0, ((size_t)tsize + 7) >> 3);
+  memset(pilots, 0, (size_t)nbkt * 2);
+  for (i = 0; i < nbkt && bcnt[border[i]]; ++i) {
+    const unsigned *bk;
+    const cdbo_t *hs;
+    b = border[i];
+    bk = bkey + bstart[b];
+    hs = bh + bstart[b];
+    for (j = 1; j < bcnt[b]; ++j)
+      for (k = 0; k < j; ++k)
+        if (hs[k] == hs[j]) {
+          r = 2;
+          goto dup;
+        }
+    for (pilot = 0; pilot < 65536; ++pilot) {
+      for (j = 0; j < bcnt[b]; ++j) {
+        pos[j] = _cdb_mpos(hs[j], pilot, tsize);
+        if (taken[pos[j] >> 3] & (1 << (pos[j] & 7)))
+          break;
+        for (k = 0; k < j && pos[k] != pos[j]; ++k)
+          ;
+        if (k < j)
+          break;
+      }
+      if (j == bcnt[b])
+        break;
+    }
+    if (pilot == 65536) {
+      r = 1;
+      break;
+    }
+    for (j = 0; j < bcnt[b]; ++j) {
+      taken[pos[j] >> 3] |= 1 << (pos[j] & 7);
+      keys[bk[j]].p = pos[j];
+    }
+    pilots[b * 2] = pilot & 255;
+    pilots[b * 2 + 1] = pilot >> 8;
+  }
+dup:
+  free(pos);
+
+out:
+  free(bcnt); free(bstart); free(bkey); free(bh); free(border);
+  return r < 0 ? (errno = ENOMEM, -1) : r;
+}
+
+/* Build perfect hash index over all the records and write it at the
+ * current position, filling in sec.  Returns 1 if it can't be done
+ * (duplicate keys, too many records, or the file is too large), so
+ * the caller should write another kind of index. */
+int internal_function
+_cdb_make_mph(struct cdb_make *cdbmp, struct cdb_xsec *sec)
+{
+  struct mkey *keys;
+  unsigned char *pilots, *taken, *remap, *slots;
+  unsigned n, tsize, nbkt, i, f;
+  cdbo_t seed, len, *rpos;
+  unsigned char hdr[CDBX_MHDR];
+  int r;
+
+  if (cdbmp->cdb_dpos > CDBX_MMAXPOS ||
+      cdbmp->cdb_rcnt > (cdbo_t)0xffffffff / 100 * CDBX_MLOAD)
+    return 1;
+  n = (unsigned)cdbmp->cdb_rcnt;
+  tsize = (unsigned)((cdbo_t)n * 100 / CDBX_MLOAD);
+  if (tsize < n)
+    tsize = n;
+  nbkt = n / CDBX_MLAMBDA + 1;
+
+  if (!(rpos = _cdb_make_rposv(cdbmp)))
+    return -1;
+  if (!(keys = (struct mkey*)malloc(((size_t)n + 1) * sizeof(*keys)))) {
+    free(rpos);
+    return errno = ENOMEM, -1;
+  }
+  for (i = 0; i < n; ++i)
+    keys[i].rpos = rpos[i];
+  r = _cdb_make_readkeys(cdbmp, rpos, n, hash_key, keys);
+  free(rpos);
+  if (r < 0) {
+    free(keys);
+    return -1;
+  }
+
+  pilots = (unsigned char*)malloc((size_t)_cdb_pad8((cdbo_t)nbkt * 2));
+  taken = (unsigned char*)malloc(((size_t)tsize + 8) >> 3);
+  if (!pilots || !taken) {
+    r = -1;
+    errno = ENOMEM;
+    goto out;
+  }
+  r = 1;
+  for (seed = 0, i = 0; r == 1 && i < NSEEDS; ++i) {
+    seed = (cdbo_t)i * 0x9e3779b97f4a7c15ULL;
+    r = place(keys, n, tsize, nbkt, seed, pilots, taken);
+  }
+  if (r != 0) {
+    /* equal hashes are (almost certainly) duplicate keys */
+    r = r < 0 ? -1 : 1;
+    goto out;
+  }
+
+  /* slots, with positions past n remapped to the free ones below */
+  remap = (unsigned char*)calloc((size_t)_cdb_pad8((cdbo_t)(tsize - n) * 4) + 1, 1);
+  slots = (unsigned char*)malloc((size_t)n * CDBX_MSLOT + 1);
+  if (!remap || !slots) {
+    free(remap); free(slots);
+    r = -1;
+    errno = ENOMEM;
+    goto out;
+  }
+  for (i = n, f = 0; i < tsize; ++i)
+    if (taken[i >> 3] & (1 << (i & 7))) {
+      while(taken[f >> 3] & (1 << (f & 7)))
+        ++f;
+      cdb_pack(f++, remap + (cdbo_t)(i - n) * 4);
+    }
+  for (i = 0; i < n; ++i) {
+    unsigned char *sp;
+    f = keys[i].p;
+    if (f >= n)
+      f = cdb_unpack(remap + (cdbo_t)(f - n) * 4);
+    sp = slots + (cdbo_t)f * CDBX_MSLOT;
+    cdb_pack((unsigned)keys[i].rpos, sp);
+    sp[4] = (unsigned char)(keys[i].rpos >> 32);
+    sp[5] = (unsigned char)keys[i].h;
+    sp[6] = (unsigned char)(keys[i].h >> 8);
+    sp[7] = (unsigned char)(keys[i].h >> 16);
+  }
+
+  /* align at cache line, so that slots never cross one */
+  if (cdbmp->cdb_dpos % 64) {
+    static const unsigned char zero[64];
+    if (_cdb_make_write(cdbmp, zero, 64 - cdbmp->cdb_dpos % 64) < 0) {
+      free(remap); free(slots);
+      r = -1;
+      goto out;
+    }
+  }
+
+  sec->type = CDBX_SEC_MPH;
+  sec->flags = CDBX_SEC_REQUIRED;
+  sec->pos = cdbmp->cdb_dpos;
+  sec->len = CDBX_MHDR + _cdb_pad8((cdbo_t)nbkt * 2) +
+    _cdb_pad8((cdbo_t)(tsize - n) * 4) + (cdbo_t)n * CDBX_MSLOT;
+  _cdb_pack64(seed, hdr);
+  _cdb_pack64((cdbo_t)n, hdr + 8);
+  _cdb_pack64((cdbo_t)tsize, hdr + 16);
+  _cdb_pack64((cdbo_t)nbkt, hdr + 24);
+  memset(pilots + (cdbo_t)nbkt * 2, 0,
+         (size_t)(_cdb_pad8((cdbo_t)nbkt * 2) - (cdbo_t)nbkt * 2));
+  r = 0;
+  if (_cdb_make_write(cdbmp, hdr, CDBX_MHDR) < 0 ||
+      _cdb_make_write(cdbmp, pilots,
+                      (unsigned)_cdb_pad8((cdbo_t)nbkt * 2)) < 0 ||
+      _cdb_make_write(cdbmp, remap,
+                      (unsigned)_cdb_pad8((cdbo_t)(tsize - n) * 4)) < 0)
+    r = -1;
+  for (len = 0; !r && len < (cdbo_t)n * CDBX_MSLOT; len += f) {
+    f = (cdbo_t)n * CDBX_MSLOT - len > 0x40000000 ?
+      0x40000000 : (unsigned)((cdbo_t)n * CDBX_MSLOT - len);
+    if (_cdb_make_write(cdbmp, slots + len, f) < 0)
+      r = -1;
+  }
+  free(remap); free(slots);
+
+out:
+  free(keys); free(pilots); free(taken);
+  return r;
+}
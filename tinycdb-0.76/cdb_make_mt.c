@@ -0,0 +1,123 @@
+/* _cdb_make_htabs_mt routine: build the hash tables of cdb_make_finish()
+ * with several threads, see cdb_make_threads()
+ *
+ * The size of every table is known in advance, so are their positions:
+ * threads take tables one by one, build them exactly as the serial code
+ * does, and write them in place with pwrite(2).
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cdb_int.h"
+
+struct mtjob {
+  const struct cdb_make *cdbmp;
+  const unsigned *hcnt;
+  const cdbo_t *hpos;
+  unsigned hsize, slot;
+  pthread_mutex_t lock;
+  unsigned next;		/* next table to build */
+  int err;			/* first error */
+};
+
+static int
+mtpwrite(int fd, const unsigned char *buf, cdbo_t len, cdbo_t pos)
+{
+  ssize_t l;
+  while(len) {
+    l = pwrite(fd, buf, len > 0x40000000 ? 0x40000000 : (size_t)len,
+               (off_t)pos);
+    if (l < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += l;
+    len -= (cdbo_t)l;
+    pos += (cdbo_t)l;
+  }
+  return 0;
+}
+
+static void *
+mtworker(void *arg)
+{
+  struct mtjob *j = (struct mtjob *)arg;
+  unsigned char *mem;
+  unsigned t;
+  int err = 0;
+
+  mem = (unsigned char*)malloc((j->hsize + 2) * sizeof(struct cdb_rec));
+  if (!mem)
+    err = ENOMEM;
+  for (;;) {
+    pthread_mutex_lock(&j->lock);
+    if (err && !j->err)
+      j->err = err;
+    t = j->err ? 256 : j->next++;
+    pthread_mutex_unlock(&j->lock);
+    if (t >= 256)
+      break;
+    if (!j->hcnt[t])
+      continue;
+    _cdb_make_htab(j->cdbmp->cdb_rec[t], t, j->hcnt[t], j->slot, mem);
+    if (mtpwrite(j->cdbmp->cdb_fd, mem,
+                 (cdbo_t)j->hcnt[t] * j->slot, j->hpos[t]) < 0)
+      err = errno;
+  }
+  free(mem);
+  return NULL;
+}
+
+/* build and write all the hash tables at the current position, filling
+ * in hpos, and leave the file positioned after them */
+int internal_function
+_cdb_make_htabs_mt(struct cdb_make *cdbmp, const unsigned hcnt[256],
+                   cdbo_t hpos[256], unsigned hsize, unsigned slot)
+{
+  struct mtjob j;
+  pthread_t *th;
+  unsigned n = cdbmp->cdb_nthreads, i, t;
+  cdbo_t pos = cdbmp->cdb_dpos;
+
+  if (_cdb_make_flush(cdbmp) < 0)
+    return -1;
+  for (t = 0; t < 256; ++t) {
+    hpos[t] = pos;
+    pos += (cdbo_t)hcnt[t] * slot;
+  }
+  if (n > 256)
+    n = 256;
+  if (!(th = (pthread_t*)malloc(n * sizeof(pthread_t))))
+    return errno = ENOMEM, -1;
+  j.cdbmp = cdbmp;
+  j.hcnt = hcnt;
+  j.hpos = hpos;
+  j.hsize = hsize;
+  j.slot = slot;
+  j.next = 0;
+  j.err = 0;
+  pthread_mutex_init(&j.lock, NULL);
+
+  /* this thread is one of them; if some can't be started, the rest
+   * do their share */
+  for (i = 1; i < n; ++i)
+    if (pthread_create(&th[i], NULL, mtworker, &j) != 0)
+      break;
+  mtworker(&j);
+  while(--i)
+    pthread_join(th[i], NULL);
+  pthread_mutex_destroy(&j.lock);
+  free(th);
+
+  if (j.err)
+    return errno = j.err, -1;
+  cdbmp->cdb_dpos = pos;
+  if (lseek(cdbmp->cdb_fd, (off_t)pos, SEEK_SET) < 0)
+    return -1;
+  return 0;
+}
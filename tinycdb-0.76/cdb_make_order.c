@@ -0,0 +1,134 @@
+/* _cdb_make_order routine: build ordered key index, see cdb_int.h
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdlib.h>
+#include "cdb_int.h"
+
+struct okey {
+  cdbo_t pfx;			/* first 8 bytes of the key, big-endian */
+  cdbo_t i;			/* record number in file order */
+};
+
+struct okeys {
+  unsigned char *kbuf;		/* all the keys */
+  cdbo_t klen, ksize;		/* bytes used and allocated in kbuf */
+  cdbo_t *koff;			/* key offsets in kbuf, one more at the end */
+  struct okey *ok;
+};
+
+static int
+save_key(void *arg, cdbo_t i, const unsigned char *key, unsigned klen)
+{
+  struct okeys *oks = (struct okeys *)arg;
+  unsigned j;
+  if (oks->ksize - oks->klen < klen) {
+    unsigned char *nb;
+    cdbo_t ns = oks->ksize ? oks->ksize : 65536;
+    while(ns - oks->klen < klen)
+      ns <<= 1;
+    if ((size_t)ns != ns ||
+        !(nb = (unsigned char*)realloc(oks->kbuf, (size_t)ns)))
+      return errno = ENOMEM, -1;
+    oks->kbuf = nb;
+    oks->ksize = ns;
+  }
+  memcpy(oks->kbuf + oks->klen, key, klen);
+  oks->koff[i] = oks->klen;
+  oks->klen += klen;
+  oks->ok[i].i = i;
+  oks->ok[i].pfx = 0;
+  for (j = 0; j < 8; ++j)
+    oks->ok[i].pfx = oks->ok[i].pfx << 8 | (j < klen ? key[j] : 0);
+  return 0;
+}
+
+static int
+okcmp(const struct okeys *oks, const struct okey *a, const struct okey *b)
+{
+  cdbo_t la, lb;
+  int c;
+  if (a->pfx != b->pfx)
+    return a->pfx < b->pfx ? -1 : 1;
+  la = oks->koff[a->i + 1] - oks->koff[a->i];
+  lb = oks->koff[b->i + 1] - oks->koff[b->i];
+  if (la > 8 || lb > 8 || la != lb) {
+    c = memcmp(oks->kbuf + oks->koff[a->i], oks->kbuf + oks->koff[b->i],
+               (size_t)(la < lb ? la : lb));
+    if (c)
+      return c;
+  }
+  return la < lb ? -1 : la > lb;
+}
+
+/* stable merge sort of n keys, using tmp */
+static void
+osort(const struct okeys *oks, struct okey *ok, struct okey *tmp, cdbo_t n)
+{
+  cdbo_t h = n / 2, i, j, k;
+  if (n < 2)
+    return;
+  osort(oks, ok, tmp, h);
+  osort(oks, ok + h, tmp, n - h);
+  if (okcmp(oks, &ok[h - 1], &ok[h]) <= 0)
+    return;			/* already in order */
+  memcpy(tmp, ok, (size_t)h * sizeof(*ok));
+  for (i = 0, j = h, k = 0; i < h; )
+    if (j < n && okcmp(oks, &ok[j], &tmp[i]) < 0)
+      ok[k++] = ok[j++];
+    else
+      ok[k++] = tmp[i++];
+}
+
+/* Build ordered key index of all the records and write it at the
+ * current position, filling in sec. */
+int internal_function
+_cdb_make_order(struct cdb_make *cdbmp, struct cdb_xsec *sec)
+{
+  struct okeys oks;
+  struct okey *tmp;
+  cdbo_t n = cdbmp->cdb_rcnt, *rpos, i;
+  unsigned char ent[CDBX_OENT];
+  int r;
+
+  if (!(rpos = _cdb_make_rposv(cdbmp)))
+    return -1;
+  memset(&oks, 0, sizeof(oks));
+  oks.koff = (cdbo_t*)malloc((size_t)(n + 1) * sizeof(cdbo_t));
+  oks.ok = (struct okey*)malloc((size_t)(n + 1) * sizeof(struct okey));
+  tmp = (struct okey*)malloc((size_t)(n / 2 + 1) * sizeof(struct okey));
+  if (!oks.koff || !oks.ok || !tmp) {
+    errno = ENOMEM;
+    r = -1;
+    goto out;
+  }
+  if ((r = _cdb_make_readkeys(cdbmp, rpos, n, save_key, &oks)) < 0)
+    goto out;
+  oks.koff[n] = oks.klen;
+  osort(&oks, oks.ok, tmp, n);
+  free(tmp); tmp = NULL;
+  free(oks.kbuf); oks.kbuf = NULL;
+
+  sec->type = CDBX_SEC_ORDER;
+  sec->flags = 0;
+  sec->pos = cdbmp->cdb_dpos;
+  sec->len = CDBX_OHDR + n * CDBX_OENT;
+  _cdb_pack64(n, ent);
+  _cdb_pack64((cdbo_t)0, ent + 8);
+  if ((r = _cdb_make_write(cdbmp, ent, CDBX_OHDR)) < 0)
+    goto out;
+  for (i = 0; i < n; ++i) {
+    unsigned j;
+    for (j = 0; j < 8; ++j)
+      ent[j] = (unsigned char)(oks.ok[i].pfx >> (56 - j * 8));
+    _cdb_pack64(rpos[oks.ok[i].i], ent + 8);
+    if ((r = _cdb_make_write(cdbmp, ent, CDBX_OENT)) < 0)
+      goto out;
+  }
+
+out:
+  free(rpos); free(oks.koff); free(oks.ok); free(oks.kbuf); free(tmp);
+  return r;
+}
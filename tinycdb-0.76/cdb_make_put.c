@@ -7,95 +7,96 @@
 
 #include <stdlib.h>
 #include <unistd.h>
-#include <assert.h>
 #include "cdb_int.h"
 
-static void
-fixup_rpos(struct cdb_make *cdbmp, unsigned rpos, unsigned rlen) {
-  unsigned i;
-  struct cdb_rl *rl;
-  register struct cdb_rec *rp, *rs;
-  for (i = 0; i < 256; ++i) {
-    for (rl = cdbmp->cdb_rec[i]; rl; rl = rl->next)
-      for (rs = rl->rec, rp = rs + rl->cnt; --rp >= rs;)
-        if (rp->rpos <= rpos) goto nexthash;
-        else rp->rpos -= rlen;
-nexthash:;
-  }
-}
-
+/* leave the record in the file until cdb_make_finish() */
 static int
-remove_record(struct cdb_make *cdbmp, unsigned rpos, unsigned rlen) {
-  unsigned pos, len;
-  int r, fd;
-
-  len = cdbmp->cdb_dpos - rpos - rlen;
-  cdbmp->cdb_dpos -= rlen;
-  if (!len)
-    return 0;	/* it was the last record, nothing to do */
-  pos = rpos;
-  fd = cdbmp->cdb_fd;
-  do {
-    r = len > sizeof(cdbmp->cdb_buf) ? (unsigned)sizeof(cdbmp->cdb_buf) : len;
-    if (lseek(fd, pos + rlen, SEEK_SET) < 0 ||
-        (r = (int)read(fd, cdbmp->cdb_buf, r)) <= 0)
-      return -1;
-    if (lseek(fd, pos, SEEK_SET) < 0 ||
-        _cdb_make_fullwrite(fd, cdbmp->cdb_buf, r) < 0)
-      return -1;
-    pos += r;
-    len -= r;
-  } while(len);
-  assert(cdbmp->cdb_dpos == pos);
-  fixup_rpos(cdbmp, rpos, rlen);
+remove_record(struct cdb_make *cdbmp, cdbo_t rpos, cdbo_t rlen) {
+  struct cdb_dx *dx = cdbmp->cdb_dx;
+  if (dx->nholes == dx->hsize) {
+    cdbo_t size = dx->hsize ? dx->hsize << 1 : 1024;
+    struct cdb_hole *h;
+    if ((size_t)size * sizeof(*h) / sizeof(*h) != size ||
+        !(h = (struct cdb_hole*)realloc(dx->holes,
+                                        (size_t)size * sizeof(*h))))
+      return errno = ENOMEM, -1;
+    dx->holes = h;
+    dx->hsize = size;
+  }
+  dx->holes[dx->nholes].pos = rpos;
+  dx->holes[dx->nholes++].len = rlen;
   return 0;
 }
 
 static int
-zerofill_record(struct cdb_make *cdbmp, unsigned rpos, unsigned rlen) {
+zerofill_record(struct cdb_make *cdbmp, cdbo_t rpos, cdbo_t rlen) {
+  unsigned l;
   if (rpos + rlen == cdbmp->cdb_dpos) {
     cdbmp->cdb_dpos = rpos;
     return 0;
   }
-  if (lseek(cdbmp->cdb_fd, rpos, SEEK_SET) < 0)
+  if (lseek(cdbmp->cdb_fd, (off_t)rpos, SEEK_SET) < 0)
     return -1;
   memset(cdbmp->cdb_buf, 0, sizeof(cdbmp->cdb_buf));
-  cdb_pack(rlen - 8, cdbmp->cdb_buf + 4);
+  cdb_pack((unsigned)(rlen - 8), cdbmp->cdb_buf + 4);
   for(;;) {
-    rpos = rlen > sizeof(cdbmp->cdb_buf) ? (unsigned)sizeof(cdbmp->cdb_buf) : rlen;
-    if (_cdb_make_fullwrite(cdbmp->cdb_fd, cdbmp->cdb_buf, rpos) < 0)
+    l = rlen > sizeof(cdbmp->cdb_buf) ? (unsigned)sizeof(cdbmp->cdb_buf) : (unsigned)rlen;
+    if (_cdb_make_fullwrite(cdbmp->cdb_fd, cdbmp->cdb_buf, l) < 0)
       return -1;
-    rlen -= rpos;
+    rlen -= l;
     if (!rlen) return 0;
     memset(cdbmp->cdb_buf + 4, 0, 4);
   }
 }
 
+/* read len bytes at pos of the file being made: from the disk up to
+ * the data not flushed yet, from the write buffer after that */
+static int
+dread(struct cdb_make *cdbmp, unsigned char *buf, unsigned len, cdbo_t pos)
+{
+  cdbo_t bstart = cdbmp->cdb_dpos - (cdbo_t)(cdbmp->cdb_bpos - cdbmp->cdb_wbuf);
+  unsigned l;
+  if (pos < bstart) {
+    l = bstart - pos < len ? (unsigned)(bstart - pos) : len;
+    while(l) {
+      ssize_t r = pread(cdbmp->cdb_fd, buf, l, (off_t)pos);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        return r < 0 ? -1 : (errno = EPROTO, -1);
+      buf += r;
+      pos += (cdbo_t)r;
+      len -= (unsigned)r;
+      l -= (unsigned)r;
+    }
+  }
+  memcpy(buf, cdbmp->cdb_wbuf + (pos - bstart), len);
+  return 0;
+}
+
 /* return: 0 = not found, 1 = error, or record length */
-static unsigned
-match(struct cdb_make *cdbmp, unsigned pos, const char *key, unsigned klen)
+static cdbo_t
+match(struct cdb_make *cdbmp, cdbo_t pos, const char *key, unsigned klen)
 {
-  int len;
-  unsigned rlen;
-  if (lseek(cdbmp->cdb_fd, pos, SEEK_SET) < 0)
-    return 1;
-  if (read(cdbmp->cdb_fd, cdbmp->cdb_buf, 8) != 8)
+  unsigned char buf[1024];
+  unsigned len;
+  cdbo_t rlen;
+  if (dread(cdbmp, buf, 8, pos) < 0)
     return 1;
-  if (cdb_unpack(cdbmp->cdb_buf) != klen)
+  if (cdb_unpack(buf) != klen)
     return 0;
 
   /* record length; check its validity */
-  rlen = cdb_unpack(cdbmp->cdb_buf + 4);
+  rlen = cdb_unpack(buf + 4);
   if (rlen > cdbmp->cdb_dpos - pos - klen - 8)
     return errno = EPROTO, 1;	/* someone changed our file? */
   rlen += klen + 8;
 
-  while(klen) {
-    len = klen > sizeof(cdbmp->cdb_buf) ? (unsigned)sizeof(cdbmp->cdb_buf) : klen;
-    len = (int)read(cdbmp->cdb_fd, cdbmp->cdb_buf, len);
-    if (len <= 0)
+  for (pos += 8; klen; pos += len) {
+    len = klen > sizeof(buf) ? (unsigned)sizeof(buf) : klen;
+    if (dread(cdbmp, buf, len, pos) < 0)
       return 1;
-    if (memcmp(cdbmp->cdb_buf, key, len) != 0)
+    if (memcmp(buf, key, len) != 0)
       return 0;
     key += len;
     klen -= len;
@@ -104,50 +105,193 @@ match(struct cdb_make *cdbmp, unsigned pos, const char *key, unsigned klen)
   return rlen;
 }
 
+static int
+dxgrow(struct cdb_dx *dx)
+{
+  struct cdb_dxent *old = dx->ent, *o, *e;
+  cdbo_t n = old ? dx->mask + 1 : 0, size, i;
+
+  for (size = 1024; size < (dx->used + 1) * 2; size <<= 1)
+    ;
+  if ((size_t)size * sizeof(*e) / sizeof(*e) != size ||
+      !(e = (struct cdb_dxent*)calloc((size_t)size, sizeof(*e))))
+    return errno = ENOMEM, -1;
+  dx->ent = e;
+  dx->mask = size - 1;
+  dx->dead = 0;
+  for (o = old; n; --n, ++o)
+    if (o->rpos > 1) {
+      for (i = _cdb_fmix(o->hval) & dx->mask; e[i].rpos;
+           i = (i + 1) & dx->mask)
+        ;
+      e[i] = *o;
+    }
+  free(old);
+  return 0;
+}
+
+static int
+dxput(struct cdb_dx *dx, unsigned hval, unsigned fp, cdbo_t rpos)
+{
+  struct cdb_dxent *e;
+  cdbo_t i;
+  if ((dx->used + dx->dead + 1) * 4 > (dx->mask + 1) * 3 && dxgrow(dx) < 0)
+    return -1;
+  for (i = _cdb_fmix(hval) & dx->mask; (e = &dx->ent[i])->rpos > 1;
+       i = (i + 1) & dx->mask)
+    ;
+  if (e->rpos)
+    --dx->dead;		/* reuse deleted entry */
+  e->hval = hval;
+  e->fp = fp;
+  e->rpos = rpos;
+  ++dx->used;
+  return 0;
+}
+
+/* index a record being added at rpos */
+int internal_function
+_cdb_make_dxadd(struct cdb_make *cdbmp, unsigned hval,
+                const void *key, unsigned klen, cdbo_t rpos)
+{
+  return dxput(cdbmp->cdb_dx, hval, _cdb_keyfp(key, klen), rpos);
+}
+
+void internal_function
+_cdb_make_dxfree(struct cdb_make *cdbmp)
+{
+  if (cdbmp->cdb_dx) {
+    free(cdbmp->cdb_dx->ent);
+    free(cdbmp->cdb_dx->holes);
+    free(cdbmp->cdb_dx);
+    cdbmp->cdb_dx = NULL;
+  }
+}
+
+struct dxload {
+  struct cdb_dx *dx;
+  const cdbo_t *rpos;
+};
+
+static int
+dxload_key(void *arg, cdbo_t i, const unsigned char *key, unsigned klen)
+{
+  struct dxload *dl = (struct dxload *)arg;
+  return dxput(dl->dx, cdb_hash(key, klen), _cdb_keyfp(key, klen),
+               dl->rpos[i]);
+}
+
+/* build the index of all the records added so far */
+static struct cdb_dx *
+dxbuild(struct cdb_make *cdbmp)
+{
+  struct dxload dl;
+  cdbo_t *rpos;
+  int r = 0;
+
+  /* records spilled by cdb_make_memlimit() can't be indexed, and
+   * streamed ones can't be read back */
+  if (spilled(cdbmp) || cdbmp->cdb_flags & CDB_MAKE_STREAM)
+    return errno = EINVAL, (struct cdb_dx*)NULL;
+  if (!(dl.dx = (struct cdb_dx*)calloc(1, sizeof(struct cdb_dx))))
+    return errno = ENOMEM, (struct cdb_dx*)NULL;
+  cdbmp->cdb_dx = dl.dx;
+  dl.dx->used = cdbmp->cdb_rcnt;	/* size it for all at once */
+  r = dxgrow(dl.dx);
+  dl.dx->used = 0;
+  if (!r && cdbmp->cdb_rcnt) {
+    if (!(rpos = _cdb_make_rposv(cdbmp)))
+      r = -1;
+    else {
+      dl.rpos = rpos;
+      r = _cdb_make_readkeys(cdbmp, rpos, cdbmp->cdb_rcnt, dxload_key, &dl);
+      free(rpos);
+    }
+  }
+  if (r) {
+    _cdb_make_dxfree(cdbmp);
+    return NULL;
+  }
+  return dl.dx;
+}
+
+/* drop the record at rpos from the record list */
+static int
+rl_remove(struct cdb_make *cdbmp, unsigned hval, cdbo_t rpos)
+{
+  struct cdb_rl *rl;
+  cdbo_t *rp, off;
+  unsigned lo, hi, m;
+  for (rl = cdbmp->cdb_rec[hval & 255]; rl && rl->base > rpos; rl = rl->next)
+    ;
+  if (!rl || !rl->cnt)
+    return errno = EPROTO, -1;
+  off = rpos - rl->base;
+  for (lo = 0, hi = rl->cnt; hi - lo > 1; ) {
+    m = (lo + hi) / 2;
+    if ((rl->rec[m] & CDB_RLPOS) <= off) lo = m;
+    else hi = m;
+  }
+  rp = &rl->rec[lo];
+  if ((*rp & CDB_RLPOS) != off)
+    return errno = EPROTO, -1;
+  memmove(rp, rp + 1, (rl->cnt - 1 - lo) * sizeof(*rp));
+  --rl->cnt;
+  return 0;
+}
+
 static int
 findrec(struct cdb_make *cdbmp,
         const void *key, unsigned klen, unsigned hval,
         enum cdb_put_mode mode)
 {
-  struct cdb_rl *rl;
-  struct cdb_rec *rp, *rs;
-  unsigned r;
+  struct cdb_dx *dx = cdbmp->cdb_dx;
+  struct cdb_dxent *e;
+  unsigned fp;
+  cdbo_t i, rpos, r;
   int seeked = 0;
   int ret = 0;
-  for(rl = cdbmp->cdb_rec[hval&255]; rl; rl = rl->next)
-    for(rs = rl->rec, rp = rs + rl->cnt; --rp >= rs;) {
-      if (rp->hval != hval)
-	continue;
-      /*XXX this explicit flush may be unnecessary having
-       * smarter match() that looks into cdb_buf too, but
-       * most of a time here spent in finding hash values
-       * (above), not keys */
+
+  if (cdbmp->cdb_mw)
+    return errno = EINVAL, -1;
+  if (!dx && !(dx = dxbuild(cdbmp)))
+    return -1;
+  fp = _cdb_keyfp(key, klen);
+  for (i = _cdb_fmix(hval) & dx->mask; (rpos = (e = &dx->ent[i])->rpos) != 0;
+       i = (i + 1) & dx->mask) {
+    if (rpos == 1 || e->hval != hval || e->fp != fp)
+      continue;
+    r = match(cdbmp, rpos, key, klen);
+    if (!r)
+      continue;
+    if (r == 1)
+      return -1;
+    ret = 1;
+    switch(mode) {
+    case CDB_FIND_REMOVE:
+      if (remove_record(cdbmp, rpos, r) < 0)
+        return -1;
+      break;
+    case CDB_FIND_FILL0:
+      /* the file gets changed in place, so write out the buffer */
       if (!seeked && _cdb_make_flush(cdbmp) < 0)
         return -1;
       seeked = 1;
-      r = match(cdbmp, rp->rpos, key, klen);
-      if (!r)
-	continue;
-      if (r == 1)
-	return -1;
-      ret = 1;
-      switch(mode) {
-      case CDB_FIND_REMOVE:
-        if (remove_record(cdbmp, rp->rpos, r) < 0)
-          return -1;
-	break;
-      case CDB_FIND_FILL0:
-	if (zerofill_record(cdbmp, rp->rpos, r) < 0)
-          return -1;
-	break;
-      default: goto finish;
-      }
-      memmove(rp, rp + 1, (rs + rl->cnt - 1 - rp) * sizeof(*rp));
-      --rl->cnt;
-      --cdbmp->cdb_rcnt;
+      if (zerofill_record(cdbmp, rpos, r) < 0)
+        return -1;
+      break;
+    default: goto finish;
+    }
+    if (rl_remove(cdbmp, hval, rpos) < 0)
+      return -1;
+    _cdb_make_tombdel(cdbmp, rpos);
+    e->rpos = 1;
+    --dx->used;
+    ++dx->dead;
+    --cdbmp->cdb_rcnt;
   }
 finish:
-  if (seeked && lseek(cdbmp->cdb_fd, cdbmp->cdb_dpos, SEEK_SET) < 0)
+  if (seeked && lseek(cdbmp->cdb_fd, (off_t)cdbmp->cdb_dpos, SEEK_SET) < 0)
     return -1;
   return ret;
 }
@@ -0,0 +1,243 @@
+/* cdb_make_shards_new, cdb_make_shards_add, cdb_make_shards_finish and
+ * cdb_shards_replace routines: build a sharded set of databases, or
+ * replace one of its shards, see cdb_shard.c
+ *
+ * Every shard is made by a cdb_make of its own, with a lock, so that
+ * any number of threads may add records at once, waiting for each other
+ * only when they hit the same shard at the same time, which is rare
+ * with a few times more shards than threads.  The shards are finished
+ * in parallel too.  Shard files are named after the manifest and the
+ * build generation, as in "set.cdb.3.17" for shard 17 of the third
+ * build, so a build never touches the files of the set in use: the new
+ * manifest replaces the old one at once, and the old files are removed
+ * after that (readers having them open keep them until they are done).
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "cdb_int.h"
+
+struct cdb_mshard {
+  pthread_mutex_t lock;
+  struct cdb_make cdbm;
+};
+
+struct cdb_make_shards {
+  char *manifest;
+  unsigned flags;
+  struct cdb_manifest m;	/* the new manifest */
+  struct cdb_manifest old;	/* the one it replaces, if any */
+  struct cdb_mshard *shard;
+  unsigned nstarted;		/* shards with a file and a cdb_make */
+  pthread_mutex_t lock;		/* for cdb_make_shards_finish() */
+  unsigned next;		/* next shard to finish */
+  int err;			/* first error finishing */
+};
+
+/* free everything, removing the new shard files if the build failed;
+ * the shards are finished already unless started is set */
+static void
+sfree(struct cdb_make_shards *smp, int started, int failed)
+{
+  unsigned i;
+  char *path;
+  for (i = 0; i < smp->nstarted; ++i) {
+    if (started) {
+      _cdb_make_free(&smp->shard[i].cdbm);
+      close(smp->shard[i].cdbm.cdb_fd);
+    }
+    pthread_mutex_destroy(&smp->shard[i].lock);
+    if (failed && (path = _cdb_shards_path(smp->manifest, smp->m.names[i]))) {
+      unlink(path);
+      free(path);
+    }
+  }
+  _cdb_shards_mfree(&smp->m);
+  _cdb_shards_mfree(&smp->old);
+  free(smp->shard);
+  free(smp->manifest);
+  free(smp);
+}
+
+struct cdb_make_shards *
+cdb_make_shards_new(const char *manifest, unsigned bits, unsigned flags)
+{
+  struct cdb_make_shards *smp;
+  const char *base = strrchr(manifest, '/');
+  unsigned i, n = 1u << bits;
+  char *path;
+  int fd, err;
+
+  if (bits > CDB_SHARD_MAXBITS)
+    return errno = EINVAL, (struct cdb_make_shards*)NULL;
+  if (!(smp = (struct cdb_make_shards*)calloc(1, sizeof(*smp))))
+    return errno = ENOMEM, (struct cdb_make_shards*)NULL;
+  smp->m.bits = bits;
+  smp->flags = flags;
+  if (!(smp->manifest = strdup(manifest)) ||
+      !(smp->m.names = (char**)calloc(n, sizeof(char*))) ||
+      !(smp->shard = (struct cdb_mshard*)calloc(n, sizeof(*smp->shard)))) {
+    sfree(smp, 1, 1);
+    return errno = ENOMEM, (struct cdb_make_shards*)NULL;
+  }
+  /* a set being replaced has its files removed once the new one is in;
+   * without a readable manifest, there is no set in use */
+  smp->m.gen = _cdb_shards_read(manifest, &smp->old) == 0 ? smp->old.gen + 1 : 1;
+  base = base ? base + 1 : manifest;
+
+  for (i = 0; i < n; ++i) {
+    if (!(smp->m.names[i] = (char*)malloc(strlen(base) + 24)))
+      goto nomem;
+    sprintf(smp->m.names[i], "%s.%u.%u", base, smp->m.gen, i);
+    if (!(path = _cdb_shards_path(manifest, smp->m.names[i])))
+      goto nomem;
+    fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    free(path);
+    if (fd < 0)
+      goto fail;
+    if (cdb_make_start_ex(&smp->shard[i].cdbm, fd, flags) < 0) {
+      err = errno;
+      close(fd);
+      errno = err;
+      goto fail;
+    }
+    pthread_mutex_init(&smp->shard[i].lock, NULL);
+    smp->nstarted = i + 1;
+  }
+  return smp;
+
+nomem:
+  errno = ENOMEM;
+fail:
+  err = errno;
+  /* the file of a shard which failed to start is there but not counted */
+  if (smp->m.names[i] && (path = _cdb_shards_path(manifest, smp->m.names[i]))) {
+    unlink(path);
+    free(path);
+  }
+  sfree(smp, 1, 1);
+  return errno = err, (struct cdb_make_shards*)NULL;
+}
+
+int
+cdb_make_shards_add(struct cdb_make_shards *smp,
+                    const void *key, unsigned klen,
+                    const void *val, unsigned vlen)
+{
+  unsigned hval = cdb_hash(key, klen);
+  struct cdb_mshard *s = &smp->shard[cdb_shard(hval, smp->m.bits)];
+  int r;
+  pthread_mutex_lock(&s->lock);
+  r = _cdb_make_add(&s->cdbm, hval, key, klen, val, vlen);
+  pthread_mutex_unlock(&s->lock);
+  return r;
+}
+
+static void *
+fworker(void *arg)
+{
+  struct cdb_make_shards *smp = (struct cdb_make_shards *)arg;
+  struct cdb_make *cdbmp;
+  unsigned s;
+  int err = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&smp->lock);
+    if (err && !smp->err)
+      smp->err = err;
+    s = smp->next++;
+    pthread_mutex_unlock(&smp->lock);
+    if (s >= smp->nstarted)
+      break;
+    /* every shard is finished, even after an error, to free it */
+    cdbmp = &smp->shard[s].cdbm;
+    err = cdb_make_finish(cdbmp) < 0 ||
+      (smp->flags & CDB_MAKE_SYNC && fdatasync(cdbmp->cdb_fd) < 0) ? errno : 0;
+    if (close(cdbmp->cdb_fd) < 0 && !err)
+      err = errno;
+  }
+  return NULL;
+}
+
+int
+cdb_make_shards_finish(struct cdb_make_shards *smp, unsigned nthreads)
+{
+  pthread_t *th;
+  unsigned i, n = smp->nstarted;
+  char *path;
+  int err;
+
+  if (nthreads > n)
+    nthreads = n;
+  if (!nthreads)
+    nthreads = 1;
+  if (!(th = (pthread_t*)malloc(nthreads * sizeof(pthread_t)))) {
+    sfree(smp, 1, 1);
+    return errno = ENOMEM, -1;
+  }
+  smp->next = 0;
+  smp->err = 0;
+  pthread_mutex_init(&smp->lock, NULL);
+  /* this thread is one of them, as in _cdb_make_htabs_mt() */
+  for (i = 1; i < nthreads; ++i)
+    if (pthread_create(&th[i], NULL, fworker, smp) != 0)
+      break;
+  fworker(smp);
+  while(--i)
+    pthread_join(th[i], NULL);
+  pthread_mutex_destroy(&smp->lock);
+  free(th);
+
+  err = smp->err;
+  if (!err && _cdb_shards_write(smp->manifest, &smp->m, smp->flags) < 0)
+    err = errno;
+  if (err) {
+    sfree(smp, 0, 1);
+    return errno = err, -1;
+  }
+  /* the new set is in: remove the files of the old one */
+  if (smp->old.names)
+    for (i = 0; i < 1u << smp->old.bits; ++i)
+      if ((path = _cdb_shards_path(smp->manifest, smp->old.names[i]))) {
+        unlink(path);
+        free(path);
+      }
+  sfree(smp, 0, 0);
+  return 0;
+}
+
+int
+cdb_shards_replace(const char *manifest, unsigned shard, const char *file,
+                   unsigned flags)
+{
+  struct cdb_manifest m;
+  char *old, *path;
+  int r;
+
+  if (_cdb_shards_read(manifest, &m) < 0)
+    return -1;
+  if (shard >= 1u << m.bits) {
+    _cdb_shards_mfree(&m);
+    return errno = EINVAL, -1;
+  }
+  /* a new generation, so that the next build does not reuse the name
+   * of a file replaced in the meantime */
+  old = m.names[shard];
+  m.names[shard] = (char*)file;
+  ++m.gen;
+  r = _cdb_shards_write(manifest, &m, flags);
+  m.names[shard] = old;
+  if (r == 0 && strcmp(old, file) != 0 &&
+      (path = _cdb_shards_path(manifest, old))) {
+    unlink(path);
+    free(path);
+  }
+  _cdb_shards_mfree(&m);
+  return r;
+}
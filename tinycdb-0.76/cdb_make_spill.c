@@ -0,0 +1,411 @@
+/* cdb_make_memlimit routine: keep the reclists of cdb_make within a
+ * memory limit, spilling them to a file, see cdb_make_finish()
+ *
+ * Every spill writes a run: the reclists of all 256 tables, one after
+ * another, oldest chunk first, and frees them.  cdb_make_finish()
+ * builds every table from its part of all the runs, read in order, so
+ * that records come in insertion order as with the reclists in memory.
+ * A table larger than the limit is built in slices of slots: every
+ * slice is placed from all the records of the table, those whose probe
+ * runs off the end of the slice are carried to the next one, and those
+ * off the end of the table are put in the first free slots of it after
+ * it is written.  With CDB_MAKE_STREAM, such a table is written to the
+ * spill file past the runs first, and copied from there once complete.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include "cdb_int.h"
+
+#define SBUFSZ	(64*1024)	/* spill file buffer */
+#define SMINLIM	4096		/* smallest limit */
+
+int
+cdb_make_memlimit(struct cdb_make *cdbmp, cdbo_t limit, int fd)
+{
+  struct cdb_spill *sp = cdbmp->cdb_spill;
+  /* the other index kinds need all the records in memory */
+  if ((cdbmp->cdb_flags & (CDB_MAKE_BUCKETS | CDB_MAKE_MPH |
+                           CDB_MAKE_FILTER | CDB_MAKE_ORDER)) ||
+      (sp && sp->nruns))
+    return errno = EINVAL, -1;
+  if (!sp) {
+    if (!(sp = (struct cdb_spill*)calloc(1, sizeof(*sp))))
+      return errno = ENOMEM, -1;
+    cdbmp->cdb_spill = sp;
+  }
+  sp->fd = fd;
+  sp->limit = limit < SMINLIM ? SMINLIM : limit;
+  return 0;
+}
+
+void internal_function
+_cdb_make_spillfree(struct cdb_make *cdbmp)
+{
+  if (cdbmp->cdb_spill) {
+    free(cdbmp->cdb_spill->off);
+    free(cdbmp->cdb_spill);
+    cdbmp->cdb_spill = NULL;
+  }
+}
+
+/* buffered I/O of the spill file */
+struct sio {
+  int fd;
+  unsigned char *buf;
+  unsigned len, pos;		/* bytes in buf, and read position */
+  cdbo_t fpos, fend;		/* file position of buf, and end to read */
+};
+
+static int
+sflush(struct sio *s)
+{
+  if (_cdb_make_fullpwrite(s->fd, s->buf, s->len, s->fpos) < 0)
+    return -1;
+  s->fpos += s->len;
+  s->len = 0;
+  return 0;
+}
+
+static int
+sput(struct sio *s, const void *p, unsigned n)
+{
+  unsigned l;
+  while(n) {
+    if (s->len == SBUFSZ && sflush(s) < 0)
+      return -1;
+    l = SBUFSZ - s->len < n ? SBUFSZ - s->len : n;
+    memcpy(s->buf + s->len, p, l);
+    s->len += l;
+    p = (const char*)p + l;
+    n -= l;
+  }
+  return 0;
+}
+
+static int
+sget(struct sio *s, void *p, unsigned n)
+{
+  unsigned l;
+  while(n) {
+    if (s->pos == s->len) {
+      l = s->fend - s->fpos < SBUFSZ ? (unsigned)(s->fend - s->fpos) : SBUFSZ;
+      if (!l)
+        return errno = EPROTO, -1;
+      if (_cdb_pread(s->fd, s->buf, l, s->fpos) < 0)
+        return -1;
+      s->fpos += l;
+      s->len = l;
+      s->pos = 0;
+    }
+    l = s->len - s->pos < n ? s->len - s->pos : n;
+    memcpy(p, s->buf + s->pos, l);
+    s->pos += l;
+    p = (char*)p + l;
+    n -= l;
+  }
+  return 0;
+}
+
+struct schunk { cdbo_t base, cnt; };
+
+/* write out all the reclists as a new run, and free them */
+int internal_function
+_cdb_make_spill(struct cdb_make *cdbmp)
+{
+  struct cdb_spill *sp = cdbmp->cdb_spill;
+  struct cdb_rl *rl, *rlt, *rln;
+  struct schunk ch;
+  struct sio s;
+  cdbo_t *off;
+  unsigned t;
+  int r = 0;
+
+  if (sp->nruns == sp->rsize) {
+    unsigned n = sp->rsize ? sp->rsize << 1 : 16;
+    if (!(off = (cdbo_t*)realloc(sp->off, n * 257 * sizeof(cdbo_t))))
+      return errno = ENOMEM, -1;
+    sp->off = off;
+    sp->rsize = n;
+  }
+  off = sp->off + sp->nruns * 257;
+  memset(&s, 0, sizeof(s));
+  s.fd = sp->fd;
+  s.fpos = sp->size;
+  if (!(s.buf = (unsigned char*)malloc(SBUFSZ)))
+    return errno = ENOMEM, -1;
+  for (t = 0; t < 256; ++t) {
+    off[t] = s.fpos + s.len;
+    for (rlt = NULL, rl = cdbmp->cdb_rec[t]; rl; rl = rln) {
+      rln = rl->next;
+      rl->next = rlt;
+      rlt = rl;
+    }
+    for (rl = rlt; rl; rl = rln) {
+      rln = rl->next;
+      ch.base = rl->base;
+      ch.cnt = rl->cnt;
+      if (!r && (sput(&s, &ch, sizeof(ch)) < 0 ||
+                 sput(&s, rl->rec, rl->cnt * sizeof(cdbo_t)) < 0))
+        r = -1;
+      sp->cnt[t] += rl->cnt;
+      free(rl);
+    }
+    cdbmp->cdb_rec[t] = NULL;
+  }
+  off[256] = s.fpos + s.len;
+  if (!r)
+    r = sflush(&s);
+  free(s.buf);
+  if (r < 0)
+    return -1;
+  sp->size = off[256];
+  ++sp->nruns;
+  sp->mcnt = 0;
+  return 0;
+}
+
+/* records of table t in insertion order, from all the runs */
+struct sit {
+  const struct cdb_spill *sp;
+  struct sio s;
+  unsigned t, run;
+  struct schunk ch;		/* current chunk, cnt counting down */
+};
+
+static void
+sitinit(struct sit *it, unsigned t)
+{
+  it->t = t;
+  it->run = 0;
+  it->ch.cnt = 0;
+  it->s.fpos = it->s.fend = 0;
+  it->s.len = it->s.pos = 0;
+}
+
+static int
+snext(struct sit *it, cdbo_t *e, cdbo_t *rpos)
+{
+  while(!it->ch.cnt) {
+    if (it->s.pos == it->s.len && it->s.fpos == it->s.fend) {
+      const cdbo_t *off;
+      if (it->run == it->sp->nruns)
+        return 0;
+      off = it->sp->off + it->run++ * 257 + it->t;
+      it->s.fpos = off[0];
+      it->s.fend = off[1];
+      it->s.len = it->s.pos = 0;
+      continue;
+    }
+    if (sget(&it->s, &it->ch, sizeof(it->ch)) < 0)
+      return -1;
+  }
+  if (sget(&it->s, e, sizeof(*e)) < 0)
+    return -1;
+  --it->ch.cnt;
+  *rpos = it->ch.base + (*e & CDB_RLPOS);
+  return 1;
+}
+
+struct scarry { cdbo_t seq, e, rpos; };
+
+struct sslice {
+  struct cdb_rec *htab;
+  unsigned a, n, len;		/* first slot, slots, slots in table */
+  int wrap;			/* the slice is the whole table */
+  struct scarry *out;		/* records carried to the next slice */
+  unsigned nout, osize;
+};
+
+/* put a record in the slice, probing from slot i of it */
+static int
+splace(struct sslice *sl, unsigned i, cdbo_t seq, cdbo_t e, cdbo_t rpos,
+       unsigned t)
+{
+  for (;;) {
+    while(i < sl->n && sl->htab[i].rpos)
+      ++i;
+    if (i < sl->n)
+      break;
+    if (sl->wrap) {
+      i = 0;
+      continue;
+    }
+    if (sl->nout == sl->osize) {
+      unsigned n = sl->osize ? sl->osize << 1 : 64;
+      struct scarry *c =
+        (struct scarry*)realloc(sl->out, n * sizeof(*c));
+      if (!c)
+        return errno = ENOMEM, -1;
+      sl->out = c;
+      sl->osize = n;
+    }
+    sl->out[sl->nout].seq = seq;
+    sl->out[sl->nout].e = e;
+    sl->out[sl->nout++].rpos = rpos;
+    return 0;
+  }
+  sl->htab[i].hval = _cdb_rlhval(e, t);
+  sl->htab[i].rpos = rpos;
+  return 0;
+}
+
+/* pack n slots in place, as _cdb_make_htab() does */
+static void
+spack(struct cdb_rec *htab, unsigned n, unsigned slot)
+{
+  unsigned char *mem = (unsigned char *)htab;
+  unsigned i, hval;
+  cdbo_t rpos;
+  for (i = 0; i < n; ++i) {
+    hval = htab[i].hval;
+    rpos = htab[i].rpos;
+    cdb_pack(hval, mem + i * slot);
+    if (slot == 8)
+      cdb_pack((unsigned)rpos, mem + i * slot + 4);
+    else
+      _cdb_pack64(rpos, mem + i * slot + 4);
+  }
+}
+
+/* put records carried off the end of the table written to fd at hpos
+ * in its first free slots */
+static int
+swrap(int fd, const struct scarry *c, unsigned nc,
+      cdbo_t hpos, unsigned len, unsigned slot, unsigned t,
+      unsigned char *mem, unsigned msize)
+{
+  unsigned i, n, j, k;
+  for (i = 0, k = 0; k < nc; i += n) {
+    n = len - i < msize ? len - i : msize;
+    if (!n)
+      return errno = EPROTO, -1;	/* can't happen, the table is half full */
+    if (_cdb_pread(fd, mem, n * slot, hpos + (cdbo_t)i * slot) < 0)
+      return -1;
+    for (j = 0; j < n && k < nc; ++j) {
+      unsigned char *p = mem + j * slot;
+      if (cdb_unpack(p + 4) || (slot != 8 && cdb_unpack(p + 8)))
+        continue;
+      cdb_pack(_cdb_rlhval(c[k].e, t), p);
+      if (slot == 8)
+        cdb_pack((unsigned)c[k].rpos, p + 4);
+      else
+        _cdb_pack64(c[k].rpos, p + 4);
+      ++k;
+    }
+    if (_cdb_make_fullpwrite(fd, mem, n * slot, hpos + (cdbo_t)i * slot) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* copy the table of len slots staged in the spill file to the output */
+static int
+scopy(struct cdb_make *cdbmp, unsigned len, unsigned slot,
+      unsigned char *mem, unsigned msize)
+{
+  const struct cdb_spill *sp = cdbmp->cdb_spill;
+  unsigned i, n;
+  for (i = 0; i < len; i += n) {
+    n = len - i < msize ? len - i : msize;
+    if (_cdb_pread(sp->fd, mem, n * slot, sp->size + (cdbo_t)i * slot) < 0 ||
+        _cdb_make_write(cdbmp, mem, n * slot) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* build and write all the hash tables from the spilled reclists, filling
+ * in hpos */
+int internal_function
+_cdb_make_htabs_spill(struct cdb_make *cdbmp, const unsigned hcnt[256],
+                      cdbo_t hpos[256], unsigned slot)
+{
+  struct cdb_spill *sp = cdbmp->cdb_spill;
+  struct sslice sl;
+  struct scarry *in = NULL;
+  struct sit it;
+  unsigned t, msize, nin, ci;
+  cdbo_t e, rpos, seq, h;
+  int stage;			/* sliced table of a streamed file */
+  int r = 0;
+
+  msize = (unsigned)(sp->limit / sizeof(struct cdb_rec) < 0x10000000 ?
+                     sp->limit / sizeof(struct cdb_rec) : 0x10000000);
+  memset(&sl, 0, sizeof(sl));
+  it.sp = sp;
+  it.s.fd = sp->fd;
+  it.s.buf = (unsigned char*)malloc(SBUFSZ);
+  sl.htab = (struct cdb_rec*)malloc(msize * sizeof(struct cdb_rec));
+  if (!it.s.buf || !sl.htab) {
+    free(it.s.buf);
+    free(sl.htab);
+    return errno = ENOMEM, -1;
+  }
+
+  for (t = 0; t < 256 && !r; ++t) {
+    hpos[t] = cdbmp->cdb_dpos;
+    if (!hcnt[t])
+      continue;
+    sl.len = hcnt[t];
+    sl.wrap = sl.len <= msize;
+    stage = !sl.wrap && cdbmp->cdb_flags & CDB_MAKE_STREAM;
+    nin = 0;
+    for (sl.a = 0; sl.a < sl.len && !r; sl.a += sl.n) {
+      sl.n = sl.len - sl.a < msize ? sl.len - sl.a : msize;
+      memset(sl.htab, 0, sl.n * sizeof(struct cdb_rec));
+      sl.nout = 0;
+      sitinit(&it, t);
+      /* records carried in are placed when their turn comes */
+      for (ci = 0, seq = 0; (r = snext(&it, &e, &rpos)) > 0; ++seq) {
+        for (; r > 0 && ci < nin && in[ci].seq < seq; ++ci)
+          if (splace(&sl, 0, in[ci].seq, in[ci].e, in[ci].rpos, t) < 0)
+            r = -1;
+        h = (e >> 40) % sl.len;
+        if (r > 0 && h >= sl.a && h < sl.a + sl.n &&
+            splace(&sl, (unsigned)(h - sl.a), seq, e, rpos, t) < 0)
+          r = -1;
+        if (r < 0)
+          break;
+      }
+      for (; !r && ci < nin; ++ci)
+        if (splace(&sl, 0, in[ci].seq, in[ci].e, in[ci].rpos, t) < 0)
+          r = -1;
+      if (r < 0)
+        break;
+      spack(sl.htab, sl.n, slot);
+      if (stage ?
+          _cdb_make_fullpwrite(sp->fd, (unsigned char*)sl.htab, sl.n * slot,
+                               sp->size + (cdbo_t)sl.a * slot) < 0 :
+          _cdb_make_write(cdbmp, (unsigned char*)sl.htab, sl.n * slot) < 0) {
+        r = -1;
+        break;
+      }
+      /* what was carried out of this slice goes into the next one */
+      free(in);
+      in = sl.out;
+      nin = sl.nout;
+      sl.out = NULL;
+      sl.osize = sl.nout = 0;
+    }
+    if (!r && nin)
+      r = stage ?
+        swrap(sp->fd, in, nin, sp->size, sl.len, slot, t,
+              (unsigned char*)sl.htab, msize) :
+        _cdb_make_flush(cdbmp) < 0 ? -1 :
+        swrap(cdbmp->cdb_fd, in, nin, hpos[t], sl.len, slot, t,
+              (unsigned char*)sl.htab, msize);
+    if (!r && stage)
+      r = scopy(cdbmp, sl.len, slot, (unsigned char*)sl.htab, msize);
+    free(in);
+    in = NULL;
+  }
+
+  free(sl.out);
+  free(sl.htab);
+  free(it.s.buf);
+  return r;
+}
@@ -0,0 +1,107 @@
+/* cdb_make_tombstone routine: records which hide a key in the older
+ * layers of a stack of databases, see cdb_stack.c
+ *
+ * A tombstone is an ordinary record with an empty value; its position
+ * goes to the tombstone section of the file (see cdb_int.h), so that
+ * readers can tell it from a real empty value.  Positions are kept in
+ * file order as records are added, and are fixed up by the routines
+ * which remove or move records.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdlib.h>
+#include "cdb_int.h"
+
+int internal_function
+_cdb_make_tombadd(struct cdb_make *cdbmp, cdbo_t rpos)
+{
+  struct cdb_tomb *tp = cdbmp->cdb_tomb;
+  if (!tp) {
+    if (!(tp = (struct cdb_tomb*)calloc(1, sizeof(*tp))))
+      return errno = ENOMEM, -1;
+    cdbmp->cdb_tomb = tp;
+  }
+  if (tp->cnt == tp->size) {
+    cdbo_t size = tp->size ? tp->size << 1 : 64;
+    cdbo_t *p;
+    if ((size_t)size * sizeof(*p) / sizeof(*p) != size ||
+        !(p = (cdbo_t*)realloc(tp->pos, (size_t)size * sizeof(*p))))
+      return errno = ENOMEM, -1;
+    tp->pos = p;
+    tp->size = size;
+  }
+  tp->pos[tp->cnt++] = rpos;
+  return 0;
+}
+
+/* forget the record at rpos if it is a tombstone, as it is removed */
+void internal_function
+_cdb_make_tombdel(struct cdb_make *cdbmp, cdbo_t rpos)
+{
+  struct cdb_tomb *tp = cdbmp->cdb_tomb;
+  cdbo_t lo = 0, hi, m;
+  if (!tp)
+    return;
+  for (hi = tp->cnt; lo < hi; ) {
+    m = lo + (hi - lo) / 2;
+    if (tp->pos[m] < rpos) lo = m + 1;
+    else hi = m;
+  }
+  if (lo < tp->cnt && tp->pos[lo] == rpos) {
+    memmove(tp->pos + lo, tp->pos + lo + 1,
+            (size_t)(tp->cnt - lo - 1) * sizeof(cdbo_t));
+    --tp->cnt;
+  }
+}
+
+/* write the tombstone section, filling sec */
+int internal_function
+_cdb_make_tombsec(struct cdb_make *cdbmp, struct cdb_xsec *sec)
+{
+  const struct cdb_tomb *tp = cdbmp->cdb_tomb;
+  unsigned char buf[CDBX_THDR];
+  cdbo_t i;
+
+  sec->type = CDBX_SEC_TOMB;
+  sec->flags = 0;
+  sec->pos = cdbmp->cdb_dpos;
+  sec->len = CDBX_THDR + tp->cnt * 8;
+  memset(buf, 0, sizeof(buf));
+  _cdb_pack64(tp->cnt, buf);
+  if (_cdb_make_write(cdbmp, buf, CDBX_THDR) < 0)
+    return -1;
+  for (i = 0; i < tp->cnt; ++i) {
+    _cdb_pack64(tp->pos[i], buf);
+    if (_cdb_make_write(cdbmp, buf, 8) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+void internal_function
+_cdb_make_tombfree(struct cdb_make *cdbmp)
+{
+  if (cdbmp->cdb_tomb) {
+    free(cdbmp->cdb_tomb->pos);
+    free(cdbmp->cdb_tomb);
+    cdbmp->cdb_tomb = NULL;
+  }
+}
+
+int
+cdb_make_tombstone(struct cdb_make *cdbmp, const void *key, unsigned klen)
+{
+  cdbo_t rpos = cdbmp->cdb_dpos;
+  if (cdbmp->cdb_mw)
+    return errno = EINVAL, -1;
+  /* room for the position first, so that a failure leaves no record */
+  if (_cdb_make_tombadd(cdbmp, rpos) < 0)
+    return -1;
+  if (_cdb_make_add(cdbmp, cdb_hash(key, klen), key, klen, "", 0) < 0) {
+    --cdbmp->cdb_tomb->cnt;
+    return -1;
+  }
+  return 0;
+}
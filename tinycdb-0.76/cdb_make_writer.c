@@ -0,0 +1,268 @@
+/* cdb_make_writer_new, cdb_make_writer_add, cdb_make_writer_addv and
+ * cdb_make_writer_done routines: add records to one database from
+ * several threads, one writer per thread
+ *
+ * A writer collects records in its own buffer, and keeps their
+ * positions in its own reclists.  When the buffer is full, the writer
+ * reserves room for it at the end of the data with an atomic add, and
+ * writes it there with pwrite(2); records larger than the buffer are
+ * written the same way directly.  So the data section is made of the
+ * buffers of all writers in the order they were flushed.  A writer
+ * which is done links its reclists into the ones of cdb_make, which
+ * is the only time it takes a lock.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cdb_int.h"
+
+#define WBUFSZ	(1024*1024)	/* buffer of a writer */
+
+struct cdb_mw {
+  pthread_mutex_t lock;
+  cdbo_t end;			/* end of the data reserved so far */
+  unsigned nw;			/* writers not done yet */
+  int err;			/* first error of a writer */
+};
+
+struct cdb_wrec { unsigned hval, off; };
+
+struct cdb_make_writer {
+  struct cdb_make *cdbmp;
+  unsigned char *buf;
+  unsigned blen;		/* bytes in buf */
+  struct cdb_wrec *wrec;	/* records in buf */
+  unsigned nwrec, wsize;
+  struct cdb_rl *rec[256];	/* reclists of records written out */
+  cdbo_t rcnt;
+  int err;
+};
+
+/* reserve len bytes at the end of the data, returning their position */
+static int
+wreserve(struct cdb_make_writer *cdbwp, cdbo_t len, cdbo_t *pos)
+{
+  *pos = __atomic_fetch_add(&cdbwp->cdbmp->cdb_mw->end, len,
+                            __ATOMIC_RELAXED);
+  if (*pos > CDBX_MAXPOS || len > CDBX_MAXPOS - *pos)
+    return errno = ENOMEM, -1;
+  return 0;
+}
+
+static int
+wpwrite(int fd, const void *buf, cdbo_t len, cdbo_t pos)
+{
+  ssize_t l;
+  while(len) {
+    l = pwrite(fd, buf, len > 0x40000000 ? 0x40000000 : (size_t)len,
+               (off_t)pos);
+    if (l < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf = (const char*)buf + l;
+    len -= (cdbo_t)l;
+    pos += (cdbo_t)l;
+  }
+  return 0;
+}
+
+static int
+wflush(struct cdb_make_writer *cdbwp)
+{
+  cdbo_t pos;
+  unsigned i;
+  if (!cdbwp->blen)
+    return 0;
+  if (wreserve(cdbwp, cdbwp->blen, &pos) < 0 ||
+      wpwrite(cdbwp->cdbmp->cdb_fd, cdbwp->buf, cdbwp->blen, pos) < 0)
+    return -1;
+  for (i = 0; i < cdbwp->nwrec; ++i)
+    if (_cdb_make_rladd(cdbwp->rec, cdbwp->wrec[i].hval,
+                        pos + cdbwp->wrec[i].off) < 0)
+      return -1;
+  cdbwp->blen = cdbwp->nwrec = 0;
+  return 0;
+}
+
+struct cdb_make_writer *
+cdb_make_writer_new(struct cdb_make *cdbmp)
+{
+  struct cdb_make_writer *cdbwp;
+  struct cdb_mw *mw = cdbmp->cdb_mw;
+
+  if (cdbmp->cdb_flags & CDB_MAKE_STREAM)
+    return errno = EINVAL, (struct cdb_make_writer*)NULL;
+  if (!mw) {
+    /* the rest of the data goes after what is written so far */
+    if (_cdb_make_flush(cdbmp) < 0)
+      return NULL;
+    if (!(mw = (struct cdb_mw*)calloc(1, sizeof(*mw))))
+      return errno = ENOMEM, (struct cdb_make_writer*)NULL;
+    pthread_mutex_init(&mw->lock, NULL);
+    mw->end = cdbmp->cdb_dpos;
+    cdbmp->cdb_mw = mw;
+  }
+  if (!(cdbwp = (struct cdb_make_writer*)calloc(1, sizeof(*cdbwp))) ||
+      !(cdbwp->buf = (unsigned char*)malloc(WBUFSZ))) {
+    free(cdbwp);
+    return errno = ENOMEM, (struct cdb_make_writer*)NULL;
+  }
+  cdbwp->cdbmp = cdbmp;
+  pthread_mutex_lock(&mw->lock);
+  ++mw->nw;
+  pthread_mutex_unlock(&mw->lock);
+  return cdbwp;
+}
+
+static int
+waddv(struct cdb_make_writer *cdbwp, const void *key, unsigned klen,
+      const struct cdb_iovec *vals, unsigned nvals)
+{
+  unsigned hval = cdb_hash(key, klen);
+  cdbo_t vlen = 0, rlen, pos;
+  unsigned char *p;
+  unsigned i;
+
+  for (i = 0; i < nvals; ++i)
+    vlen += vals[i].cdb_iov_len;
+  if (vlen > 0xffffffff)
+    return errno = ENOMEM, -1;
+  rlen = 8 + (cdbo_t)klen + vlen;
+
+  if (rlen > WBUFSZ - cdbwp->blen && wflush(cdbwp) < 0)
+    return -1;
+  if (rlen >= WBUFSZ) {
+    /* too large to be buffered */
+    unsigned char hdr[8];
+    int fd = cdbwp->cdbmp->cdb_fd;
+    cdb_pack(klen, hdr);
+    cdb_pack((unsigned)vlen, hdr + 4);
+    if (wreserve(cdbwp, rlen, &pos) < 0 ||
+        _cdb_make_rladd(cdbwp->rec, hval, pos) < 0 ||
+        wpwrite(fd, hdr, 8, pos) < 0 ||
+        wpwrite(fd, key, klen, pos + 8) < 0)
+      return -1;
+    for (pos += 8 + klen, i = 0; i < nvals; pos += vals[i++].cdb_iov_len)
+      if (wpwrite(fd, vals[i].cdb_iov_base, vals[i].cdb_iov_len, pos) < 0)
+        return -1;
+  }
+  else {
+    if (cdbwp->nwrec == cdbwp->wsize) {
+      unsigned n = cdbwp->wsize ? cdbwp->wsize << 1 : 1024;
+      struct cdb_wrec *w =
+        (struct cdb_wrec*)realloc(cdbwp->wrec, n * sizeof(*w));
+      if (!w)
+        return errno = ENOMEM, -1;
+      cdbwp->wrec = w;
+      cdbwp->wsize = n;
+    }
+    cdbwp->wrec[cdbwp->nwrec].hval = hval;
+    cdbwp->wrec[cdbwp->nwrec++].off = cdbwp->blen;
+    p = cdbwp->buf + cdbwp->blen;
+    cdb_pack(klen, p);
+    cdb_pack((unsigned)vlen, p + 4);
+    memcpy(p + 8, key, klen);
+    p += 8 + klen;
+    for (i = 0; i < nvals; ++i) {
+      memcpy(p, vals[i].cdb_iov_base, vals[i].cdb_iov_len);
+      p += vals[i].cdb_iov_len;
+    }
+    cdbwp->blen += (unsigned)rlen;
+  }
+  ++cdbwp->rcnt;
+  return 0;
+}
+
+int
+cdb_make_writer_addv(struct cdb_make_writer *cdbwp,
+                     const void *key, unsigned klen,
+                     const struct cdb_iovec *vals, unsigned nvals)
+{
+  if (cdbwp->err)
+    return errno = cdbwp->err, -1;
+  if (waddv(cdbwp, key, klen, vals, nvals) < 0) {
+    cdbwp->err = errno;
+    return -1;
+  }
+  return 0;
+}
+
+int
+cdb_make_writer_add(struct cdb_make_writer *cdbwp,
+                    const void *key, unsigned klen,
+                    const void *val, unsigned vlen)
+{
+  struct cdb_iovec v;
+  v.cdb_iov_base = val;
+  v.cdb_iov_len = vlen;
+  return cdb_make_writer_addv(cdbwp, key, klen, &v, 1);
+}
+
+int
+cdb_make_writer_done(struct cdb_make_writer *cdbwp)
+{
+  struct cdb_make *cdbmp = cdbwp->cdbmp;
+  struct cdb_mw *mw = cdbmp->cdb_mw;
+  struct cdb_rl *rl, *tl;
+  unsigned t;
+  int err = cdbwp->err;
+
+  if (!err && wflush(cdbwp) < 0)
+    err = errno;
+  pthread_mutex_lock(&mw->lock);
+  for (t = 0; t < 256; ++t) {
+    if (!(rl = cdbwp->rec[t]))
+      continue;
+    for (tl = rl; tl->next; tl = tl->next)
+      ;
+    tl->next = cdbmp->cdb_rec[t];
+    cdbmp->cdb_rec[t] = rl;
+  }
+  cdbmp->cdb_rcnt += cdbwp->rcnt;
+  if (!err && _cdb_make_spillchk(cdbmp, cdbwp->rcnt) < 0)
+    err = errno;
+  if (err && !mw->err)
+    mw->err = err;
+  --mw->nw;
+  pthread_mutex_unlock(&mw->lock);
+
+  free(cdbwp->buf);
+  free(cdbwp->wrec);
+  free(cdbwp);
+  return err ? (errno = err, -1) : 0;
+}
+
+/* called by cdb_make_finish(): all writers must be done by now, and the
+ * data ends where they have written up to */
+int internal_function
+_cdb_make_wend(struct cdb_make *cdbmp)
+{
+  struct cdb_mw *mw = cdbmp->cdb_mw;
+  int err;
+  if (!mw)
+    return 0;
+  err = mw->nw ? EBUSY : mw->err;
+  if (!err) {
+    cdbmp->cdb_dpos = mw->end;
+    if (lseek(cdbmp->cdb_fd, (off_t)mw->end, SEEK_SET) < 0)
+      err = errno;
+  }
+  _cdb_make_wfree(cdbmp);
+  return err ? (errno = err, -1) : 0;
+}
+
+void internal_function
+_cdb_make_wfree(struct cdb_make *cdbmp)
+{
+  if (cdbmp->cdb_mw) {
+    pthread_mutex_destroy(&cdbmp->cdb_mw->lock);
+    free(cdbmp->cdb_mw);
+    cdbmp->cdb_mw = NULL;
+  }
+}
@@ -0,0 +1,517 @@
+/* cdb_pread_* routines: querying cdb files with pread(2) instead of
+ * mmap(2), optionally via a block cache (see cdb_cache.c)
+ *
+ * Only the toc (or the header of a perfect hash index) is kept in
+ * memory; hash slots, buckets and records are read as needed, a run of
+ * hash slots or the lengths and the key of a record in one go.  The
+ * negative lookup filter is not used.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "cdb_int.h"
+
+#define NRUN	8	/* hash slots to read at once */
+
+/* read len bytes at pos, via the cache if any */
+static int
+pr_get(const struct cdb_pread *cdbp, void *buf, unsigned len, cdbo_t pos)
+{
+  if (pos > cdbp->cdb_fsize || cdbp->cdb_fsize - pos < len)
+    return errno = EPROTO, -1;
+  if (cdbp->cdb_cache)
+    return _cdb_cache_read(cdbp->cdb_cache, cdbp->cdb_fid, cdbp->cdb_fd,
+                           cdbp->cdb_fsize, buf, len, pos);
+  return _cdb_pread(cdbp->cdb_fd, buf, len, pos);
+}
+
+/* locate data and index sections in an extended format file */
+static int
+pr_init_x(struct cdb_pread *cdbp)
+{
+  unsigned char tail[CDBX_TAIL], *dir, *ent;
+  cdbo_t fsize = cdbp->cdb_fsize;
+  cdbo_t dirpos, pos, len, dend = 0;
+  unsigned cnt, type;
+
+  if (fsize < 2048 + CDBX_TAIL ||
+      _cdb_pread(cdbp->cdb_fd, tail, CDBX_TAIL, fsize - CDBX_TAIL) < 0)
+    return errno = EPROTO, -1;
+  dirpos = _cdb_unpack64(tail);
+  cnt = cdb_unpack(tail + 8);
+  if (cdb_unpack(tail + 12) != CDBX_VERSION
+      || dirpos < 2048
+      || dirpos > fsize - CDBX_TAIL
+      || (fsize - CDBX_TAIL - dirpos) / CDBX_DIRENT != cnt
+      || (fsize - CDBX_TAIL - dirpos) % CDBX_DIRENT)
+    return errno = EPROTO, -1;
+  if (!(dir = (unsigned char*)malloc((size_t)cnt * CDBX_DIRENT + 1)))
+    return errno = ENOMEM, -1;
+  if (_cdb_pread(cdbp->cdb_fd, dir, cnt * CDBX_DIRENT, dirpos) < 0)
+    goto err;
+
+  for (ent = dir; cnt--; ent += CDBX_DIRENT) {
+    type = cdb_unpack(ent);
+    pos = _cdb_unpack64(ent + 8);
+    len = _cdb_unpack64(ent + 16);
+    if (pos < 2048 || pos > dirpos || len > dirpos - pos)
+      goto eproto;
+    switch(type) {
+    case CDBX_SEC_DATA:
+      if (pos != 2048)
+        goto eproto;
+      dend = pos + len;
+      break;
+    case CDBX_SEC_HTOC:
+      if (len != 256 * CDBX_TOCENT || cdbp->cdb_toc)
+        goto eproto;
+      if (!(cdbp->cdb_toc = (unsigned char*)malloc(256 * CDBX_TOCENT))) {
+        errno = ENOMEM;
+        goto err;
+      }
+      if (_cdb_pread(cdbp->cdb_fd, cdbp->cdb_toc, 256 * CDBX_TOCENT, pos) < 0)
+        goto err;
+      break;
+    case CDBX_SEC_BUCKETS:
+      if (!len || len % CDBX_BUCKET || pos % CDBX_BUCKET
+          || len / CDBX_BUCKET > 0xffffffff)
+        goto eproto;
+      cdbp->cdb_bkt = pos;
+      cdbp->cdb_nbkt = (unsigned)(len / CDBX_BUCKET);
+      break;
+    case CDBX_SEC_MPH: {
+      unsigned char m[CDBX_MHDR];
+      cdbo_t nkeys, tsize, nbkt;
+      if (len < CDBX_MHDR)
+        goto eproto;
+      if (_cdb_pread(cdbp->cdb_fd, m, CDBX_MHDR, pos) < 0)
+        goto err;
+      nkeys = _cdb_unpack64(m + 8);
+      tsize = _cdb_unpack64(m + 16);
+      nbkt = _cdb_unpack64(m + 24);
+      if (nkeys > tsize || tsize > 0xffffffff
+          || !nbkt || nbkt > 0xffffffff
+          || len != CDBX_MHDR + _cdb_pad8(nbkt * 2) +
+                    _cdb_pad8((tsize - nkeys) * 4) + nkeys * CDBX_MSLOT)
+        goto eproto;
+      cdbp->cdb_mph = pos;
+      cdbp->cdb_mseed = _cdb_unpack64(m);
+      cdbp->cdb_mkeys = (unsigned)nkeys;
+      cdbp->cdb_mtsize = (unsigned)tsize;
+      cdbp->cdb_mnbkt = (unsigned)nbkt;
+      break;
+    }
+    default:
+      if (cdb_unpack(ent + 4) & CDBX_SEC_REQUIRED)
+        goto eproto;
+    }
+  }
+  free(dir);
+  if (!dend || (!cdbp->cdb_toc && !cdbp->cdb_bkt && !cdbp->cdb_mph))
+    return errno = EPROTO, -1;
+  cdbp->cdb_dend = dend;
+  cdbp->cdb_x = 1;
+  return 0;
+
+eproto:
+  errno = EPROTO;
+err:
+  free(dir);
+  return -1;
+}
+
+int
+cdb_pread_init(struct cdb_pread *cdbp, int fd, struct cdb_cache *cache)
+{
+  struct stat st;
+  unsigned char toc[2048];
+  cdbo_t dend;
+
+  memset(cdbp, 0, sizeof(*cdbp));
+  if (fstat(fd, &st) < 0)
+    return -1;
+  if (st.st_size < 2048)
+    return errno = EPROTO, -1;
+  cdbp->cdb_fd = fd;
+  cdbp->cdb_fsize = (cdbo_t)st.st_size;
+  if (_cdb_pread(fd, toc, 2048, 0) < 0)
+    return -1;
+
+  if (_cdb_isx(toc)) {
+    if (pr_init_x(cdbp) != 0) {
+      int err = errno;
+      cdb_pread_free(cdbp);
+      return errno = err, -1;
+    }
+  }
+  else {
+    if (!(cdbp->cdb_toc = (unsigned char*)malloc(2048)))
+      return errno = ENOMEM, -1;
+    memcpy(cdbp->cdb_toc, toc, 2048);
+    dend = cdb_unpack(toc);
+    if (dend < 2048) dend = 2048;
+    else if (dend >= cdbp->cdb_fsize) dend = cdbp->cdb_fsize;
+    cdbp->cdb_dend = dend;
+  }
+  if ((cdbp->cdb_cache = cache) != NULL)
+    cdbp->cdb_fid = _cdb_cache_fid(cache);
+  return 0;
+}
+
+void
+cdb_pread_free(struct cdb_pread *cdbp)
+{
+  free(cdbp->cdb_toc);
+  cdbp->cdb_toc = NULL;
+  cdbp->cdb_fsize = 0;
+}
+
+int
+cdb_pread_read(const struct cdb_pread *cdbp, void *buf, unsigned len,
+               cdbo_t pos)
+{
+  return pr_get(cdbp, buf, len, pos);
+}
+
+/* check if the record at pos has the given key: 1 (and res is filled)
+ * if it does, 0 if not, -1 on error */
+static int
+pr_match(const struct cdb_pread *cdbp, cdbo_t pos,
+         const void *key, unsigned klen, struct cdb_kv *res)
+{
+  unsigned char sbuf[256], *buf = sbuf;
+  unsigned n;
+  int r = 0;
+
+  if (pos < 2048 || pos > cdbp->cdb_dend - 8)
+    return errno = EPROTO, -1;
+  /* lengths and the key at once, unless the key can't be there */
+  n = cdbp->cdb_dend - pos - 8 < klen ? 8 : 8 + klen;
+  if (n > sizeof(sbuf) && !(buf = (unsigned char*)malloc(n)))
+    return errno = ENOMEM, -1;
+  if (pr_get(cdbp, buf, n, pos) < 0)
+    r = -1;
+  else if (cdb_unpack(buf) != klen)
+    ;
+  else if (n == 8)
+    r = -1, errno = EPROTO;
+  else if (memcmp(key, buf + 8, klen) == 0) {
+    n = cdb_unpack(buf + 4);
+    pos += 8;
+    if (cdbp->cdb_dend < n || cdbp->cdb_dend - n < pos + klen)
+      r = -1, errno = EPROTO;
+    else {
+      res->cdb_kpos = pos;
+      res->cdb_klen = klen;
+      res->cdb_vpos = pos + klen;
+      res->cdb_vlen = n;
+      r = 1;
+    }
+  }
+  if (buf != sbuf)
+    free(buf);
+  return r;
+}
+
+/* hash table of a hash value: its position and number of slots */
+int internal_function
+_cdb_pread_htab(const struct cdb_pread *cdbp, unsigned hval,
+        cdbo_t *htab, unsigned *n)
+{
+  const unsigned char *te;
+  unsigned slot = cdbp->cdb_x ? CDBX_SLOT : 8;
+  if (cdbp->cdb_x) {
+    te = cdbp->cdb_toc + (hval & 255) * CDBX_TOCENT;
+    *htab = _cdb_unpack64(te);
+    *n = cdb_unpack(te + 8);
+  }
+  else {
+    te = cdbp->cdb_toc + (hval & 255) * 8;
+    *htab = cdb_unpack(te);
+    *n = cdb_unpack(te + 4);
+  }
+  if (*n && (*htab < cdbp->cdb_dend || *htab > cdbp->cdb_fsize ||
+             (cdbo_t)*n * slot > cdbp->cdb_fsize - *htab))
+    return errno = EPROTO, -1;
+  return 0;
+}
+
+static int
+pr_find_h(const struct cdb_pread *cdbp, const void *key, unsigned klen,
+          unsigned hval, struct cdb_kv *res)
+{
+  unsigned char slots[NRUN * CDBX_SLOT], *sp;
+  unsigned slot = cdbp->cdb_x ? CDBX_SLOT : 8;
+  unsigned n, i, m, todo;
+  cdbo_t htab, pos;
+  int r;
+
+  if (_cdb_pread_htab(cdbp, hval, &htab, &n) < 0)
+    return -1;
+  i = (hval >> 8) % (n ? n : 1);
+  for (todo = n; todo; todo -= m) {
+    m = n - i < todo ? n - i : todo;
+    if (m > NRUN)
+      m = NRUN;
+    if (pr_get(cdbp, slots, m * slot, htab + (cdbo_t)i * slot) < 0)
+      return -1;
+    for (sp = slots; sp < slots + m * slot; sp += slot) {
+      pos = slot == 8 ? cdb_unpack(sp + 4) : _cdb_unpack64(sp + 4);
+      if (!pos)
+        return 0;
+      if (cdb_unpack(sp) == hval &&
+          (r = pr_match(cdbp, pos, key, klen, res)) != 0)
+        return r;
+    }
+    if ((i += m) == n)
+      i = 0;
+  }
+  return 0;
+}
+
+static int
+pr_find_b(const struct cdb_pread *cdbp, const void *key, unsigned klen,
+          unsigned hval, struct cdb_kv *res)
+{
+  unsigned char bkt[CDBX_BUCKET];
+  unsigned b = _cdb_bhome(hval, cdbp->cdb_nbkt), todo, m, i;
+  int r;
+
+  for (todo = cdbp->cdb_nbkt; todo; --todo) {
+    if (pr_get(cdbp, bkt, CDBX_BUCKET,
+               cdbp->cdb_bkt + (cdbo_t)b * CDBX_BUCKET) < 0)
+      return -1;
+    m = _cdb_bmatch(bkt, _cdb_btag(hval));
+    for (i = 0; m; ++i, m >>= 1)
+      if ((m & 1) &&
+          (r = pr_match(cdbp, _cdb_bpos(bkt, i), key, klen, res)) != 0)
+        return r;
+    if (!(bkt[CDBX_BFLAGS] & CDBX_BMORE))
+      return 0;
+    if (++b == cdbp->cdb_nbkt)
+      b = 0;
+  }
+  return 0;
+}
+
+/* see _cdb_mslot() */
+static int
+pr_find_m(const struct cdb_pread *cdbp, const void *key, unsigned klen,
+          struct cdb_kv *res)
+{
+  cdbo_t pilots = cdbp->cdb_mph + CDBX_MHDR;
+  cdbo_t remap = pilots + _cdb_pad8((cdbo_t)cdbp->cdb_mnbkt * 2);
+  cdbo_t slots = remap +
+    _cdb_pad8((cdbo_t)(cdbp->cdb_mtsize - cdbp->cdb_mkeys) * 4);
+  unsigned char sp[CDBX_MSLOT];
+  cdbo_t h = _cdb_hash64(key, klen), hs;
+  unsigned p;
+
+  if (!cdbp->cdb_mkeys)
+    return 0;
+  hs = _cdb_mmix(h ^ cdbp->cdb_mseed);
+  if (pr_get(cdbp, sp, 2,
+             pilots + (cdbo_t)_cdb_mbucket(hs, cdbp->cdb_mnbkt) * 2) < 0)
+    return -1;
+  p = _cdb_mpos(hs, sp[0] | (sp[1] << 8), cdbp->cdb_mtsize);
+  if (p >= cdbp->cdb_mkeys) {
+    if (pr_get(cdbp, sp, 4, remap + (cdbo_t)(p - cdbp->cdb_mkeys) * 4) < 0)
+      return -1;
+    if ((p = cdb_unpack(sp)) >= cdbp->cdb_mkeys)
+      return errno = EPROTO, -1;
+  }
+  if (pr_get(cdbp, sp, CDBX_MSLOT, slots + (cdbo_t)p * CDBX_MSLOT) < 0)
+    return -1;
+  if (_cdb_mslotfp(sp) != _cdb_mfp(h))
+    return 0;
+  return pr_match(cdbp, cdb_unpack(sp) | (cdbo_t)sp[4] << 32,
+                  key, klen, res);
+}
+
+int
+cdb_pread_find_r(const struct cdb_pread *cdbp, const void *key, unsigned klen,
+                 struct cdb_kv *res)
+{
+  if (klen >= cdbp->cdb_dend)
+    return 0;
+  if (cdbp->cdb_mph)
+    return pr_find_m(cdbp, key, klen, res);
+  if (cdbp->cdb_bkt)
+    return pr_find_b(cdbp, key, klen, cdb_hash(key, klen), res);
+  return pr_find_h(cdbp, key, klen, cdb_hash(key, klen), res);
+}
+
+int
+cdb_pread_find(struct cdb_pread *cdbp, const void *key, unsigned klen)
+{
+  struct cdb_kv kv;
+  int r = cdb_pread_find_r(cdbp, key, klen, &kv);
+  if (r > 0)
+    _cdb_setkv(cdbp, &kv);
+  return r;
+}
+
+/* Like struct cdb_find, cdb_httodo is the number of slots left to look
+ * at for hash tables, or buckets left in upper bits and slots of the
+ * current bucket in lower 16 bits for bucketed index. */
+int
+cdb_pread_findinit(struct cdb_pread_find *cdbfp, const struct cdb_pread *cdbp,
+                   const void *key, unsigned klen)
+{
+  unsigned char bkt[CDBX_BUCKET];
+  unsigned n;
+
+  cdbfp->cdb_cdbp = cdbp;
+  cdbfp->cdb_key = key;
+  cdbfp->cdb_klen = klen;
+  cdbfp->cdb_hval = cdb_hash(key, klen);
+  cdbfp->cdb_httodo = 0;
+
+  if (cdbp->cdb_mph) {
+    cdbfp->cdb_httodo = 1;
+    return 1;
+  }
+  if (cdbp->cdb_bkt) {
+    cdbfp->cdb_htab = cdbp->cdb_bkt;
+    cdbfp->cdb_hn = cdbp->cdb_nbkt;
+    cdbfp->cdb_hi = _cdb_bhome(cdbfp->cdb_hval, cdbp->cdb_nbkt);
+    if (pr_get(cdbp, bkt, CDBX_BUCKET,
+               cdbfp->cdb_htab + (cdbo_t)cdbfp->cdb_hi * CDBX_BUCKET) < 0)
+      return -1;
+    cdbfp->cdb_httodo = ((cdbo_t)(cdbp->cdb_nbkt - 1) << 16) |
+      _cdb_bmatch(bkt, _cdb_btag(cdbfp->cdb_hval));
+    return 1;
+  }
+  if (_cdb_pread_htab(cdbp, cdbfp->cdb_hval, &cdbfp->cdb_htab, &n) < 0)
+    return -1;
+  if (!n)
+    return 0;
+  cdbfp->cdb_hn = n;
+  cdbfp->cdb_hi = (cdbfp->cdb_hval >> 8) % n;
+  cdbfp->cdb_httodo = n;
+  return 1;
+}
+
+static int
+pr_findnext_b(struct cdb_pread_find *cdbfp, struct cdb_kv *res)
+{
+  const struct cdb_pread *cdbp = cdbfp->cdb_cdbp;
+  unsigned char bkt[CDBX_BUCKET];
+  unsigned i;
+  int r;
+
+  if (!cdbfp->cdb_httodo)
+    return 0;
+  if (pr_get(cdbp, bkt, CDBX_BUCKET,
+             cdbfp->cdb_htab + (cdbo_t)cdbfp->cdb_hi * CDBX_BUCKET) < 0)
+    return -1;
+  for(;;) {
+    if (!(cdbfp->cdb_httodo & 0xffff)) {
+      if (cdbfp->cdb_httodo < 0x10000 || !(bkt[CDBX_BFLAGS] & CDBX_BMORE))
+        break;
+      if (++cdbfp->cdb_hi == cdbfp->cdb_hn)
+        cdbfp->cdb_hi = 0;
+      if (pr_get(cdbp, bkt, CDBX_BUCKET,
+                 cdbfp->cdb_htab + (cdbo_t)cdbfp->cdb_hi * CDBX_BUCKET) < 0)
+        return -1;
+      cdbfp->cdb_httodo = (cdbfp->cdb_httodo - 0x10000) |
+        _cdb_bmatch(bkt, _cdb_btag(cdbfp->cdb_hval));
+      continue;
+    }
+    for (i = 0; !(cdbfp->cdb_httodo & (1u << i)); ++i)
+      ;
+    cdbfp->cdb_httodo &= ~(cdbo_t)(1u << i);
+    if ((r = pr_match(cdbp, _cdb_bpos(bkt, i),
+                      cdbfp->cdb_key, cdbfp->cdb_klen, res)) != 0)
+      return r;
+  }
+  cdbfp->cdb_httodo = 0;
+  return 0;
+}
+
+int
+cdb_pread_findnext_r(struct cdb_pread_find *cdbfp, struct cdb_kv *res)
+{
+  const struct cdb_pread *cdbp = cdbfp->cdb_cdbp;
+  unsigned char sp[CDBX_SLOT];
+  unsigned slot = cdbp->cdb_x ? CDBX_SLOT : 8;
+  cdbo_t pos;
+  int r;
+
+  if (cdbp->cdb_mph) {
+    if (!cdbfp->cdb_httodo)
+      return 0;
+    cdbfp->cdb_httodo = 0;
+    return pr_find_m(cdbp, cdbfp->cdb_key, cdbfp->cdb_klen, res);
+  }
+  if (cdbp->cdb_bkt)
+    return pr_findnext_b(cdbfp, res);
+
+  while(cdbfp->cdb_httodo) {
+    if (pr_get(cdbp, sp, slot,
+               cdbfp->cdb_htab + (cdbo_t)cdbfp->cdb_hi * slot) < 0)
+      return -1;
+    pos = slot == 8 ? cdb_unpack(sp + 4) : _cdb_unpack64(sp + 4);
+    if (!pos)
+      break;
+    if (++cdbfp->cdb_hi == cdbfp->cdb_hn)
+      cdbfp->cdb_hi = 0;
+    --cdbfp->cdb_httodo;
+    if (cdb_unpack(sp) == cdbfp->cdb_hval &&
+        (r = pr_match(cdbp, pos, cdbfp->cdb_key, cdbfp->cdb_klen, res)) != 0)
+      return r;
+  }
+  cdbfp->cdb_httodo = 0;
+  return 0;
+}
+
+/* struct cdb_pread given to cdb_pread_findinit() is updated here */
+int
+cdb_pread_findnext(struct cdb_pread_find *cdbfp)
+{
+  struct cdb_kv kv;
+  int r = cdb_pread_findnext_r(cdbfp, &kv);
+  if (r > 0)
+    _cdb_setkv((struct cdb_pread *)cdbfp->cdb_cdbp, &kv);
+  return r;
+}
+
+int
+cdb_pread_seqnext_r(cdbo_t *cptr, const struct cdb_pread *cdbp,
+                    struct cdb_kv *res)
+{
+  unsigned char buf[8];
+  unsigned klen, vlen;
+  cdbo_t pos = *cptr;
+  cdbo_t dend = cdbp->cdb_dend;
+  if (pos > dend - 8)
+    return 0;
+  if (pr_get(cdbp, buf, 8, pos) < 0)
+    return -1;
+  klen = cdb_unpack(buf);
+  vlen = cdb_unpack(buf + 4);
+  pos += 8;
+  if (dend - klen < pos || dend - vlen < pos + klen)
+    return errno = EPROTO, -1;
+  res->cdb_kpos = pos;
+  res->cdb_klen = klen;
+  res->cdb_vpos = pos + klen;
+  res->cdb_vlen = vlen;
+  *cptr = pos + klen + vlen;
+  return 1;
+}
+
+int
+cdb_pread_seqnext(cdbo_t *cptr, struct cdb_pread *cdbp)
+{
+  struct cdb_kv kv;
+  int r = cdb_pread_seqnext_r(cptr, cdbp, &kv);
+  if (r > 0)
+    _cdb_setkv(cdbp, &kv);
+  return r;
+}
@@ -0,0 +1,127 @@
+/* cdb_range_init, cdb_prefix_init and cdb_range_next routines:
+ * ordered scans using ordered key index, see cdb_int.h
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include "cdb_int.h"
+
+#define _cdb_oent(cdbp, i) ((cdbp)->cdb_order + CDBX_OHDR + (i) * CDBX_OENT)
+
+/* compare key of index entry ent with the given key: -1, 0 or 1, or
+ * -2 on error.  With pfx, only the first klen bytes of the entry's key
+ * are compared, so that all keys starting with key compare equal. */
+static int
+ocmp(const struct cdb *cdbp, const unsigned char *ent,
+     const unsigned char *key, unsigned klen, int pfx)
+{
+  unsigned n = klen < 8 ? klen : 8, elen, i;
+  const unsigned char *ekey;
+  cdbo_t pos;
+  int c;
+
+  if ((c = memcmp(ent, key, n)) != 0)
+    return c < 0 ? -1 : 1;
+  if (n < 8) {
+    /* key is shorter than 8 bytes: all of it matched */
+    for (i = n; i < 8; ++i)
+      if (ent[i])
+        return pfx ? 0 : 1;	/* entry's key is longer */
+    /* entry's key is at least n bytes long unless key has zeros too */
+    if (pfx && !memchr(key, 0, n))
+      return 0;
+  }
+
+  /* the rest can only be told by the record itself */
+  pos = _cdb_unpack64(ent + 8);
+  if (pos < 2048 || pos > cdbp->cdb_dend - 8)
+    return -2;
+  elen = cdb_unpack(cdbp->cdb_mem + pos);
+  if (cdbp->cdb_dend - elen < pos + 8)
+    return -2;
+  ekey = cdbp->cdb_mem + pos + 8;
+  if ((c = memcmp(ekey, key, elen < klen ? elen : klen)) != 0)
+    return c < 0 ? -1 : 1;
+  if (pfx)
+    return elen < klen ? -1 : 0;
+  return elen < klen ? -1 : elen > klen;
+}
+
+/* first entry whose key compares greater (gt) or not less than key */
+static int
+osearch(const struct cdb *cdbp, const void *key, unsigned klen,
+        int pfx, int gt, cdbo_t *ip)
+{
+  cdbo_t lo = 0, hi = cdbp->cdb_ocnt, mid;
+  int c;
+  while(lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    c = ocmp(cdbp, _cdb_oent(cdbp, mid),
+             (const unsigned char *)key, klen, pfx);
+    if (c == -2)
+      return errno = EPROTO, -1;
+    if (c < 0 || (gt && c == 0))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  *ip = lo;
+  return 0;
+}
+
+int
+cdb_range_init(struct cdb_range *cdbrp, const struct cdb *cdbp,
+               const void *lo, unsigned lolen,
+               const void *hi, unsigned hilen)
+{
+  cdbrp->cdb_cdbp = cdbp;
+  cdbrp->cdb_cur = cdbrp->cdb_end = 0;
+  if (!cdbp->cdb_order)
+    return errno = ENOENT, -1;
+  cdbrp->cdb_end = cdbp->cdb_ocnt;
+  if ((lo && osearch(cdbp, lo, lolen, 0, 0, &cdbrp->cdb_cur) < 0) ||
+      (hi && osearch(cdbp, hi, hilen, 0, 0, &cdbrp->cdb_end) < 0))
+    return -1;
+  return cdbrp->cdb_cur < cdbrp->cdb_end;
+}
+
+int
+cdb_prefix_init(struct cdb_range *cdbrp, const struct cdb *cdbp,
+                const void *prefix, unsigned plen)
+{
+  cdbrp->cdb_cdbp = cdbp;
+  cdbrp->cdb_cur = cdbrp->cdb_end = 0;
+  if (!cdbp->cdb_order)
+    return errno = ENOENT, -1;
+  if (osearch(cdbp, prefix, plen, 1, 0, &cdbrp->cdb_cur) < 0 ||
+      osearch(cdbp, prefix, plen, 1, 1, &cdbrp->cdb_end) < 0)
+    return -1;
+  return cdbrp->cdb_cur < cdbrp->cdb_end;
+}
+
+int
+cdb_range_next(struct cdb_range *cdbrp, struct cdb_kv *res)
+{
+  const struct cdb *cdbp = cdbrp->cdb_cdbp;
+  cdbo_t pos;
+  unsigned klen, vlen;
+
+  if (cdbrp->cdb_cur >= cdbrp->cdb_end)
+    return 0;
+  pos = _cdb_unpack64(_cdb_oent(cdbp, cdbrp->cdb_cur) + 8);
+  if (pos < 2048 || pos > cdbp->cdb_dend - 8)
+    return errno = EPROTO, -1;
+  klen = cdb_unpack(cdbp->cdb_mem + pos);
+  vlen = cdb_unpack(cdbp->cdb_mem + pos + 4);
+  pos += 8;
+  if (cdbp->cdb_dend - pos < klen ||
+      cdbp->cdb_dend - pos - klen < vlen)
+    return errno = EPROTO, -1;
+  ++cdbrp->cdb_cur;
+  res->cdb_kpos = pos;
+  res->cdb_klen = klen;
+  res->cdb_vpos = pos + klen;
+  res->cdb_vlen = vlen;
+  return 1;
+}
@@ -57,6 +57,8 @@ cdb_seek(int fd, const void *key, unsigned klen, unsigned *dlenp)
   hti = (hval >> 8) % htsize;	/* start position in hash table */
   httodo = htsize;
   htstart = cdb_unpack(rbuf);
+  if (htstart < 2048)		/* 64-bit format is not supported here */
+    return errno = EPROTO, -1;
 
   for(;;) {
     if (needseek && lseek(fd, htstart + (hti << 3), SEEK_SET) < 0)
@@ -8,10 +8,10 @@
 #include "cdb_int.h"
 
 int
-cdb_seqnext(unsigned *cptr, struct cdb *cdbp) {
+cdb_seqnext_r(cdbo_t *cptr, const struct cdb *cdbp, struct cdb_kv *res) {
   unsigned klen, vlen;
-  unsigned pos = *cptr;
-  unsigned dend = cdbp->cdb_dend;
+  cdbo_t pos = *cptr;
+  cdbo_t dend = cdbp->cdb_dend;
   const unsigned char *mem = cdbp->cdb_mem;
   if (pos > dend - 8)
     return 0;
@@ -20,10 +20,34 @@ cdb_seqnext(unsigned *cptr, struct cdb *cdbp) {
   pos += 8;
   if (dend - klen < pos || dend - vlen < pos + klen)
     return errno = EPROTO, -1;
-  cdbp->cdb_kpos = pos;
-  cdbp->cdb_klen = klen;
-  cdbp->cdb_vpos = pos + klen;
-  cdbp->cdb_vlen = vlen;
+  res->cdb_kpos = pos;
+  res->cdb_klen = klen;
+  res->cdb_vpos = pos + klen;
+  res->cdb_vlen = vlen;
   *cptr = pos + klen + vlen;
   return 1;
 }
+
+int
+cdb_seqnext64(cdbo_t *cptr, struct cdb *cdbp) {
+  struct cdb_kv kv;
+  int r = cdb_seqnext_r(cptr, cdbp, &kv);
+  if (r > 0)
+    _cdb_setkv(cdbp, &kv);
+  return r;
+}
+
+/* a 32-bit cursor can't go past 4 GiB, which only 64-bit files do */
+int
+cdb_seqnext(unsigned *cptr, struct cdb *cdbp) {
+  struct cdb_kv kv;
+  cdbo_t pos = *cptr;
+  int r = cdb_seqnext_r(&pos, cdbp, &kv);
+  if (r > 0) {
+    if (pos > 0xffffffffu)
+      return errno = EOVERFLOW, -1;
+    *cptr = (unsigned)pos;
+    _cdb_setkv(cdbp, &kv);
+  }
+  return r;
+}
@@ -0,0 +1,339 @@
+/* cdb_shards_open, cdb_shards_close, cdb_shards_find and cdb_shards_scan
+ * routines: queries over a sharded set of databases, and the manifest
+ * listing them
+ *
+ * A sharded set spreads its keys over 1 << bits ordinary databases by
+ * cdb_shard() of their hash, so that it is not limited to the size of
+ * one file, can be built on all cores, and one shard can be rebuilt
+ * without the others.  The manifest is itself a small database: "bits"
+ * and "gen" (the build generation) as decimal numbers, and the file of
+ * shard i under the decimal i, relative to the manifest's directory
+ * unless absolute.  A new manifest is written to a temporary file and
+ * renamed over the old one, so readers always see a whole set.
+ *
+ * cdb_shard() routes by bits of the hash above the toc byte, but not
+ * the top ones as they are: (hval >> 8) % n picks the hash table slot,
+ * and keys having the same top bits would crowd a part of every table.
+ * The bits are scrambled first, with a constant of their own, so the
+ * keys of a shard spread over the toc, slots, buckets and filter blocks
+ * like the keys of any database.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "cdb_int.h"
+
+/* path of a shard file named in the manifest */
+char internal_function *
+_cdb_shards_path(const char *manifest, const char *name)
+{
+  const char *s = strrchr(manifest, '/');
+  size_t dl = name[0] == '/' || !s ? 0 : s - manifest + 1;
+  char *path = (char*)malloc(dl + strlen(name) + 1);
+  if (!path)
+    return errno = ENOMEM, (char*)NULL;
+  memcpy(path, manifest, dl);
+  strcpy(path + dl, name);
+  return path;
+}
+
+/* decimal number stored under key, or -1 */
+static long
+mnum(const struct cdb *cdbp, const char *key)
+{
+  struct cdb_kv kv;
+  const char *v;
+  long n = 0;
+  unsigned i;
+  if (cdb_find_r(cdbp, key, (unsigned)strlen(key), &kv) <= 0 ||
+      !kv.cdb_vlen || kv.cdb_vlen > 9 ||
+      !(v = (const char*)cdb_get(cdbp, kv.cdb_vlen, kv.cdb_vpos)))
+    return -1;
+  for (i = 0; i < kv.cdb_vlen; ++i) {
+    if (v[i] < '0' || v[i] > '9')
+      return -1;
+    n = n * 10 + (v[i] - '0');
+  }
+  return n;
+}
+
+int internal_function
+_cdb_shards_read(const char *manifest, struct cdb_manifest *mp)
+{
+  struct cdb c;
+  struct cdb_kv kv;
+  char key[16];
+  const char *v;
+  long bits, gen;
+  unsigned i, n = 0;
+  int fd = open(manifest, O_RDONLY), err = EPROTO;
+
+  memset(mp, 0, sizeof(*mp));
+  if (fd < 0)
+    return -1;
+  if (cdb_init(&c, fd) < 0) {
+    err = errno;
+    close(fd);
+    return errno = err, -1;
+  }
+  bits = mnum(&c, "bits");
+  gen = mnum(&c, "gen");
+  if (bits >= 0 && bits <= CDB_SHARD_MAXBITS && gen >= 0) {
+    n = 1u << bits;
+    mp->bits = (unsigned)bits;
+    mp->gen = (unsigned)gen;
+    if (!(mp->names = (char**)calloc(n, sizeof(char*))))
+      err = ENOMEM;
+    else for (i = 0; i < n; ++i) {
+      if (cdb_find_r(&c, key, (unsigned)sprintf(key, "%u", i), &kv) <= 0 ||
+          !kv.cdb_vlen ||
+          !(v = (const char*)cdb_get(&c, kv.cdb_vlen, kv.cdb_vpos)) ||
+          memchr(v, '\0', kv.cdb_vlen))
+        break;
+      if (!(mp->names[i] = (char*)malloc(kv.cdb_vlen + 1))) {
+        err = ENOMEM;
+        break;
+      }
+      memcpy(mp->names[i], v, kv.cdb_vlen);
+      mp->names[i][kv.cdb_vlen] = '\0';
+    }
+  }
+  cdb_free(&c);
+  close(fd);
+  if (!mp->names || mp->names[n - 1] == NULL) {
+    _cdb_shards_mfree(mp);
+    return errno = err, -1;
+  }
+  return 0;
+}
+
+int internal_function
+_cdb_shards_write(const char *manifest, const struct cdb_manifest *mp,
+                  unsigned flags)
+{
+  struct cdb_make cdbm;
+  char *tmp, key[16], val[16];
+  unsigned i;
+  int fd, err, started = 0;
+
+  if (!(tmp = (char*)malloc(strlen(manifest) + 5)))
+    return errno = ENOMEM, -1;
+  strcat(strcpy(tmp, manifest), ".tmp");
+  if ((fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0) {
+    free(tmp);
+    return -1;
+  }
+  if (cdb_make_start(&cdbm, fd) < 0 ||
+      (started = 1,
+       cdb_make_add(&cdbm, "bits", 4, val,
+                    (unsigned)sprintf(val, "%u", mp->bits))) < 0 ||
+      cdb_make_add(&cdbm, "gen", 3, val,
+                   (unsigned)sprintf(val, "%u", mp->gen)) < 0)
+    goto fail;
+  for (i = 0; i < 1u << mp->bits; ++i)
+    if (cdb_make_add(&cdbm, key, (unsigned)sprintf(key, "%u", i),
+                     mp->names[i], (unsigned)strlen(mp->names[i])) < 0)
+      goto fail;
+  started = 0;
+  if (cdb_make_finish(&cdbm) < 0 ||
+      (flags & CDB_MAKE_SYNC && fsync(fd) < 0))
+    goto fail;
+  if (close(fd) < 0) {
+    fd = -1;
+    goto fail;
+  }
+  if (rename(tmp, manifest) < 0) {
+    fd = -1;
+    goto fail;
+  }
+  free(tmp);
+  if (flags & CDB_MAKE_SYNC && _cdb_syncdir(manifest) < 0)
+    return -1;
+  return 0;
+
+fail:
+  err = errno;
+  if (started)
+    _cdb_make_free(&cdbm);
+  if (fd >= 0)
+    close(fd);
+  unlink(tmp);
+  free(tmp);
+  return errno = err, -1;
+}
+
+void internal_function
+_cdb_shards_mfree(struct cdb_manifest *mp)
+{
+  unsigned i;
+  if (mp->names) {
+    for (i = 0; i < 1u << mp->bits; ++i)
+      free(mp->names[i]);
+    free(mp->names);
+    mp->names = NULL;
+  }
+}
+
+static void
+sclose(struct cdb *shard, unsigned n)
+{
+  while(n--) {
+    int fd = cdb_fileno(&shard[n]);
+    cdb_free(&shard[n]);
+    close(fd);
+  }
+  free(shard);
+}
+
+/* the files of the previous generation are removed right after a new
+ * manifest is renamed over the old one: a shard gone by the time it is
+ * opened sends us back to the manifest, unless it was not replaced */
+int
+cdb_shards_open(struct cdb_shards *shp, const char *manifest, unsigned flags)
+{
+  struct cdb_manifest m;
+  struct cdb *shard;
+  unsigned i, n, gen = 0;
+  int tried = 0;
+  char *path;
+  int fd, err;
+
+  for (;;) {
+    if (_cdb_shards_read(manifest, &m) < 0)
+      return -1;
+    if (tried && m.gen == gen) {
+      _cdb_shards_mfree(&m);
+      return errno = ENOENT, -1;
+    }
+    n = 1u << m.bits;
+    if (!(shard = (struct cdb*)calloc(n, sizeof(struct cdb)))) {
+      _cdb_shards_mfree(&m);
+      return errno = ENOMEM, -1;
+    }
+    for (i = 0; i < n; ++i) {
+      fd = (path = _cdb_shards_path(manifest, m.names[i])) ?
+        open(path, O_RDONLY) : -1;
+      free(path);
+      if (fd < 0 || cdb_init_ex(&shard[i], fd, flags) < 0) {
+        err = errno;
+        if (fd >= 0)
+          close(fd);
+        sclose(shard, i);
+        break;
+      }
+    }
+    if (i == n)
+      break;
+    _cdb_shards_mfree(&m);
+    if (err != ENOENT)
+      return errno = err, -1;
+    gen = m.gen;
+    tried = 1;
+  }
+  _cdb_shards_mfree(&m);
+  shp->cdb_bits = m.bits;
+  shp->cdb_shard = shard;
+  return 0;
+}
+
+void
+cdb_shards_close(struct cdb_shards *shp)
+{
+  if (shp->cdb_shard) {
+    sclose(shp->cdb_shard, 1u << shp->cdb_bits);
+    shp->cdb_shard = NULL;
+  }
+}
+
+int
+cdb_shards_find(const struct cdb_shards *shp, const void *key, unsigned klen,
+                struct cdb_kv *res, const struct cdb **cdbpp)
+{
+  const struct cdb *cdbp = cdb_shards_route(shp, cdb_hash(key, klen));
+  if (cdbpp)
+    *cdbpp = cdbp;
+  return cdb_find_r(cdbp, key, klen, res);
+}
+
+struct scanjob {
+  const struct cdb_shards *shp;
+  int (*fn)(void *arg, const struct cdb *cdbp, const struct cdb_kv *kv);
+  void *arg;
+  pthread_mutex_t lock;
+  unsigned next;		/* next shard to scan */
+  int r, err;			/* first result other than 0, and errno */
+};
+
+static void *
+scanworker(void *arg)
+{
+  struct scanjob *j = (struct scanjob *)arg;
+  unsigned n = 1u << j->shp->cdb_bits, s;
+  const struct cdb *cdbp;
+  struct cdb_kv kv;
+  cdbo_t pos;
+  int r = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&j->lock);
+    if (r && !j->r) {
+      j->err = errno;
+      __atomic_store_n(&j->r, r, __ATOMIC_RELAXED);	/* read unlocked */
+    }
+    s = j->r ? n : j->next++;
+    pthread_mutex_unlock(&j->lock);
+    if (s >= n)
+      break;
+    cdbp = &j->shp->cdb_shard[s];
+    /* stop early once another thread is done */
+    for (pos = 2048; (r = cdb_seqnext_r(&pos, cdbp, &kv)) > 0; )
+      if ((r = j->fn(j->arg, cdbp, &kv)) != 0 ||
+          __atomic_load_n(&j->r, __ATOMIC_RELAXED))
+        break;
+  }
+  return NULL;
+}
+
+int
+cdb_shards_scan(const struct cdb_shards *shp, unsigned nthreads,
+                int (*fn)(void *arg, const struct cdb *cdbp,
+                          const struct cdb_kv *kv),
+                void *arg)
+{
+  struct scanjob j;
+  pthread_t *th;
+  unsigned i;
+
+  if (nthreads > 1u << shp->cdb_bits)
+    nthreads = 1u << shp->cdb_bits;
+  if (!nthreads)
+    nthreads = 1;
+  if (!(th = (pthread_t*)malloc(nthreads * sizeof(pthread_t))))
+    return errno = ENOMEM, -1;
+  j.shp = shp;
+  j.fn = fn;
+  j.arg = arg;
+  j.next = 0;
+  j.r = j.err = 0;
+  pthread_mutex_init(&j.lock, NULL);
+
+  /* this thread is one of them, as in _cdb_make_htabs_mt() */
+  for (i = 1; i < nthreads; ++i)
+    if (pthread_create(&th[i], NULL, scanworker, &j) != 0)
+      break;
+  scanworker(&j);
+  while(--i)
+    pthread_join(th[i], NULL);
+  pthread_mutex_destroy(&j.lock);
+  free(th);
+
+  if (j.r < 0)
+    errno = j.err;
+  return j.r;
+}
@@ -0,0 +1,111 @@
+/* cdb_tombstone, cdb_stack_find and cdb_stack_seqnext routines:
+ * queries over a stack of databases
+ *
+ * A stack is a base database and layers made on top of it, each one
+ * holding just the records changed since the one below, so that an
+ * update costs a small file rather than a rewrite of the whole set.
+ * The first record of a key in the newest layer having the key is the
+ * one in effect, and if it is a tombstone, the key is deleted.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include "cdb_int.h"
+
+int
+cdb_tombstone(const struct cdb *cdbp, const struct cdb_kv *kv)
+{
+  const unsigned char *t = cdbp->cdb_tomb + CDBX_THDR;
+  cdbo_t lo = 0, hi = cdbp->cdb_tcnt, m, p, rpos = kv->cdb_kpos - 8;
+  if (!cdbp->cdb_tomb || kv->cdb_vlen)
+    return 0;
+  while(lo < hi) {
+    m = lo + (hi - lo) / 2;
+    p = _cdb_unpack64(t + m * 8);
+    if (p == rpos)
+      return 1;
+    if (p < rpos) lo = m + 1;
+    else hi = m;
+  }
+  return 0;
+}
+
+int
+cdb_stack_find(const struct cdb_stack *stp, const void *key, unsigned klen,
+               struct cdb_kv *res, const struct cdb **cdbpp)
+{
+  unsigned i = stp->cdb_nlayers;
+  int r;
+  while(i--) {
+    const struct cdb *cdbp = stp->cdb_layers[i];
+    if ((r = cdb_find_r(cdbp, key, klen, res)) < 0)
+      return -1;
+    if (!r)
+      continue;
+    if (cdb_tombstone(cdbp, res))
+      break;
+    if (cdbpp)
+      *cdbpp = cdbp;
+    return 1;
+  }
+  memset(res, 0, sizeof(*res));
+  return 0;
+}
+
+/* what the record of layer l is: in effect (0), hidden by a newer
+ * layer having its key or by a tombstone of its own layer (1), or a
+ * tombstone in effect (2) */
+int internal_function
+_cdb_stack_rec(const struct cdb_stack *stp, unsigned l,
+               const struct cdb_kv *kv)
+{
+  const struct cdb *cdbp = stp->cdb_layers[l];
+  const void *key = cdb_get(cdbp, kv->cdb_klen, kv->cdb_kpos);
+  struct cdb_kv k;
+  int r, tomb = 0;
+  if (!key)
+    return -1;
+  if (cdbp->cdb_tomb) {
+    /* only the first record of a key in a layer may be a tombstone */
+    if ((r = cdb_find_r(cdbp, key, kv->cdb_klen, &k)) < 0)
+      return -1;
+    if (r && cdb_tombstone(cdbp, &k)) {
+      if (k.cdb_kpos != kv->cdb_kpos)
+        return 1;
+      tomb = 1;
+    }
+    else if (cdb_tombstone(cdbp, kv))
+      return 1;
+  }
+  while(++l < stp->cdb_nlayers)
+    if ((r = cdb_find_r(stp->cdb_layers[l], key, kv->cdb_klen, &k)) != 0)
+      return r;
+  return tomb ? 2 : 0;
+}
+
+int
+cdb_stack_seqnext(struct cdb_stack_seq *sp, const struct cdb_stack *stp,
+                  struct cdb_kv *res, const struct cdb **cdbpp)
+{
+  const struct cdb *cdbp;
+  int r;
+  while(sp->cdb_layer < stp->cdb_nlayers) {
+    cdbp = stp->cdb_layers[sp->cdb_layer];
+    if ((r = cdb_seqnext_r(&sp->cdb_pos, cdbp, res)) < 0)
+      return -1;
+    if (!r) {
+      ++sp->cdb_layer;
+      sp->cdb_pos = 2048;
+      continue;
+    }
+    if ((r = _cdb_stack_rec(stp, sp->cdb_layer, res)) < 0)
+      return -1;
+    if (!r) {
+      if (cdbpp)
+        *cdbpp = cdbp;
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -92,15 +92,15 @@ static enum nss_status
 __nss_cdb_dobyname(struct nss_cdb *dbp, const char *key, unsigned len,
                    void *result, char *buf, size_t bufl, int *errnop) {
   int r;
+  struct cdb_kv kv;
 
-  if ((r = cdb_find(&dbp->cdb, key, len)) < 0)
+  if ((r = cdb_find_r(&dbp->cdb, key, len, &kv)) < 0)
     return *errnop = errno, NSS_STATUS_UNAVAIL;
-  len = cdb_datalen(&dbp->cdb);
-  if (!r || len < 2)
+  if (!r || (len = kv.cdb_vlen) < 2)
     return *errnop = ENOENT, NSS_STATUS_NOTFOUND;
   if (len >= bufl)
     return *errnop = ERANGE, NSS_STATUS_TRYAGAIN;
-  if (cdb_read(&dbp->cdb, buf, len, cdb_datapos(&dbp->cdb)) != 0)
+  if (cdb_read(&dbp->cdb, buf, len, kv.cdb_vpos) != 0)
     return *errnop = errno, NSS_STATUS_UNAVAIL;
   buf[len] = '\0';
   if ((r = dbp->parsefn(result, buf, bufl)) < 0)
@@ -135,13 +135,13 @@ __nss_cdb_dobyid(struct nss_cdb *dbp, unsigned long id,
   int r;
   unsigned len;
   const char *data;
+  struct cdb_kv kv;
 
-  if ((r = cdb_find(&dbp->cdb, buf, sprintf(buf, ":%lu", id))) < 0)
+  if ((r = cdb_find_r(&dbp->cdb, buf, sprintf(buf, ":%lu", id), &kv)) < 0)
     return *errnop = errno, NSS_STATUS_UNAVAIL;
-  len = cdb_datalen(&dbp->cdb);
-  if (!r || len < 2)
+  if (!r || (len = kv.cdb_vlen) < 2)
     return *errnop = ENOENT, NSS_STATUS_NOTFOUND;
-  if (!(data = (const char*)cdb_get(&dbp->cdb, len, cdb_datapos(&dbp->cdb))))
+  if (!(data = (const char*)cdb_get(&dbp->cdb, len, kv.cdb_vpos)))
     return *errnop = errno, NSS_STATUS_UNAVAIL;
 
   return __nss_cdb_dobyname(dbp, data, len, result, buf, bufl, errnop);
@@ -169,12 +169,12 @@ static enum nss_status
 __nss_cdb_dogetent(struct nss_cdb *dbp,
                    void *result, char *buf, size_t bufl, int *errnop) {
   int r;
-  unsigned lastpos;
+  cdbo_t lastpos;
 
   if (!isopen(dbp) && !__nss_cdb_dosetent(dbp))
     return *errnop = errno, NSS_STATUS_UNAVAIL;
 
-  while((lastpos = dbp->lastpos, r = cdb_seqnext(&dbp->lastpos, &dbp->cdb)) > 0)
+  while((lastpos = dbp->lastpos, r = cdb_seqnext64(&dbp->lastpos, &dbp->cdb)) > 0)
   {
     if (cdb_keylen(&dbp->cdb) < 2) continue;
     if (((const char *)cdb_getkey(&dbp->cdb))[0] == ':') /* can't fail */
@@ -24,7 +24,7 @@ struct nss_cdb {
   nss_parse_fn *parsefn;
   const char *dbname;
   int keepopen;
-  unsigned lastpos;
+  cdbo_t lastpos;
   struct cdb cdb;
 };
 
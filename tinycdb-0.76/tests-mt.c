@@ -0,0 +1,907 @@
+/* $Id$
+ * multi-threaded stress test for the reentrant cdb query routines:
+ * many threads share one struct cdb and compare results of
+ * cdb_find_r(), cdb_findnext_r() and cdb_seqnext_r() with the
+ * ones obtained by the plain single-threaded routines.  With an
+ * ordered key index, prefix and range scans are checked too.  The
+ * pread-based reader is checked the same way, sharing a block cache
+ * which is too small for the file, and so are asynchronous lookups,
+ * with and without io_uring.  Databases are also built by several
+ * threads with cdb_make_writer_add(), and the time it takes with 1 to
+ * 16 writers is printed, and within a memory limit much smaller than
+ * their index.  Databases are copied from others in runs of records,
+ * and stacked in layers hiding keys of the ones below, or spread over
+ * the shards of a set built by several threads.  Readers of a file
+ * replaced all the time must see one whole file per lookup.
+ *
+ * This file is a part of tinycdb package by Michael Tokarev, mjt@corpit.ru.
+ * Public domain.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "cdb.h"
+
+#define NKEYS	5000	/* distinct keys, key i has up to i%4+1 records */
+#define NMISS	1000	/* keys not in db */
+#define NTHREADS 8
+#define NLOOPS	20
+
+struct rec { cdbo_t kpos, vpos; unsigned klen, vlen; };
+
+static struct cdb cdb;
+static struct rec *first;	/* cdb_find() result for every key */
+static struct rec *all;		/* cdb_findnext() results, NKEYS*4 max */
+static unsigned *nall;		/* number of records for every key */
+static struct rec *seq;		/* cdb_seqnext64() results */
+static unsigned nseq;
+static unsigned npfx[10];	/* number of records with key-<digit> prefix */
+static const char *progname;
+static unsigned iflags;		/* cdb_init_ex() flags */
+static struct cdb_pread pcdb;
+static struct cdb_cache *pcache;
+static unsigned mthreads;	/* cdb_make_threads() */
+static unsigned nwriters;	/* build with cdb_make_writer_add() */
+static unsigned bigrec;		/* and add a record larger than its buffer */
+static cdbo_t memlimit;		/* cdb_make_memlimit() */
+
+static void
+error(const char *msg) {
+  fprintf(stderr, "%s: %s: %s\n", progname, msg, strerror(errno));
+  exit(2);
+}
+
+static unsigned
+mkkey(char *buf, unsigned i) {
+  return sprintf(buf, i < NKEYS ? "key-%u" : "none-%u", i);
+}
+
+/* records in range must come in key order, and there must be n of them */
+static unsigned
+scan(struct cdb_range *cdbrp, int r, unsigned n) {
+  struct cdb_kv kv, pkv;
+  unsigned i = 0, errs = 0, l;
+  int c;
+  if (r < 0)
+    return 1;
+  while((r = cdb_range_next(cdbrp, &kv)) > 0) {
+    if (i++) {
+      l = pkv.cdb_klen < kv.cdb_klen ? pkv.cdb_klen : kv.cdb_klen;
+      c = memcmp(cdb_get(&cdb, pkv.cdb_klen, pkv.cdb_kpos),
+                 cdb_get(&cdb, kv.cdb_klen, kv.cdb_kpos), l);
+      if (c > 0 || (!c && pkv.cdb_klen > kv.cdb_klen))
+        ++errs;
+    }
+    pkv = kv;
+  }
+  return errs + (r < 0 || i != n);
+}
+
+#define same(r, kv) \
+  ((r)->kpos == (kv)->cdb_kpos && (r)->klen == (kv)->cdb_klen && \
+   (r)->vpos == (kv)->cdb_vpos && (r)->vlen == (kv)->cdb_vlen)
+
+static void
+save(struct rec *r, const struct cdb *cdbp) {
+  r->kpos = cdb_keypos(cdbp); r->klen = cdb_keylen(cdbp);
+  r->vpos = cdb_datapos(cdbp); r->vlen = cdb_datalen(cdbp);
+}
+
+static void *
+worker(void *arg) {
+  unsigned t = (unsigned)(size_t)arg;
+  unsigned l, i, n, errs = 0;
+  char key[32];
+  struct cdb_kv kv;
+  struct cdb_find cdbf;
+  struct cdb_pread_find pcdbf;
+  struct cdb_range cdbr;
+  cdbo_t pos;
+
+  for(l = 0; l < NLOOPS; ++l) {
+    if (cdb.cdb_order) {
+      n = sprintf(key, "key-%u", (t + l) % 10);
+      errs += scan(&cdbr, cdb_prefix_init(&cdbr, &cdb, key, n),
+                   npfx[(t + l) % 10]);
+      errs += scan(&cdbr, cdb_range_init(&cdbr, &cdb, "key-", 4, "key.", 4),
+                   nseq);
+    }
+    for(i = 0; i < NKEYS + NMISS; ++i) {
+      unsigned k = (i * 7919 + t * 131 + l) % (NKEYS + NMISS);
+      unsigned klen = mkkey(key, k);
+      int r = cdb_find_r(&cdb, key, klen, &kv);
+      if (k < NKEYS ? r != 1 || !same(&first[k], &kv) : r != 0)
+        ++errs;
+      if ((k + l) % 2 == 0) {
+        r = cdb_pread_find_r(&pcdb, key, klen, &kv);
+        if (k < NKEYS ? r != 1 || !same(&first[k], &kv) : r != 0)
+          ++errs;
+      }
+      if (k >= NKEYS || (k + l) % 8)
+        continue;
+      if (cdb_findinit(&cdbf, &cdb, key, klen) < 0)
+        ++errs;
+      for(n = 0; (r = cdb_findnext_r(&cdbf, &kv)) > 0; ++n)
+        if (n >= nall[k] || !same(&all[k * 4 + n], &kv))
+          ++errs;
+      if (r < 0 || n != nall[k])
+        ++errs;
+      if (cdb_pread_findinit(&pcdbf, &pcdb, key, klen) < 0)
+        ++errs;
+      for(n = 0; (r = cdb_pread_findnext_r(&pcdbf, &kv)) > 0; ++n)
+        if (n >= nall[k] || !same(&all[k * 4 + n], &kv))
+          ++errs;
+      if (r < 0 || n != nall[k])
+        ++errs;
+    }
+    cdb_seqinit(&pos, &cdb);
+    for(n = 0; cdb_seqnext_r(&pos, &cdb, &kv) > 0; ++n)
+      if (n >= nseq || !same(&seq[n], &kv))
+        ++errs;
+    if (n != nseq)
+      ++errs;
+    if ((t + l) % 4)
+      continue;
+    cdb_seqinit(&pos, &pcdb);
+    for(n = 0; cdb_pread_seqnext_r(&pos, &pcdb, &kv) > 0; ++n)
+      if (n >= nseq || !same(&seq[n], &kv))
+        ++errs;
+    if (n != nseq)
+      ++errs;
+  }
+  return (void*)(size_t)errs;
+}
+
+static unsigned aerrs;		/* asynchronous lookup errors */
+
+static void
+acb(void *arg, int r, const struct cdb_kv *kv, const void *val) {
+  unsigned i = (unsigned)(size_t)arg;
+  if (i >= NKEYS)
+    aerrs += r != 0;
+  else if (r != 1 || !same(&first[i], kv))
+    ++aerrs;
+  else if (val && memcmp(val, cdb_get(&cdb, kv->cdb_vlen, kv->cdb_vpos),
+                         kv->cdb_vlen) != 0)
+    ++aerrs;
+}
+
+/* all the keys, in flight depth at a time */
+static unsigned
+atest(unsigned flags, unsigned depth) {
+  struct cdb_async *ap = cdb_async_new(&pcdb, depth, 16, flags, acb);
+  char key[32];
+  unsigned i;
+  int r;
+  if (!ap)
+    error("cdb_async_new");
+  aerrs = 0;
+  for(i = 0; i < NKEYS + NMISS; ++i)
+    while(cdb_async_submit(ap, key, mkkey(key, i), (void*)(size_t)i) < 0)
+      if (errno != EAGAIN || cdb_async_wait(ap, 1) < 0)
+        error("cdb_async_submit");
+  while((r = cdb_async_wait(ap, ~0u)) > 0)
+    ;
+  if (r < 0)
+    error("cdb_async_wait");
+  cdb_async_free(ap);
+  return aerrs;
+}
+
+struct wjob {
+  struct cdb_make_writer *cdbwp;
+  unsigned w, nkeys, ndup;
+  int err;
+};
+
+/* keys i with i % nwriters == w; duplicates of a key are added by the
+ * same writer, so they keep their order */
+static void *
+wworker(void *arg) {
+  struct wjob *j = (struct wjob *)arg;
+  char key[32], val[64];
+  unsigned i, n;
+  j->err = 0;
+  for(n = 0; n < j->ndup && !j->err; ++n)
+    for(i = j->w; i < j->nkeys; i += nwriters)
+      if (n <= i % 4 &&
+          cdb_make_writer_add(j->cdbwp, key, mkkey(key, i),
+                              val, sprintf(val, "value-%u-%u", i, n)) < 0) {
+        j->err = errno;
+        break;
+      }
+  if (bigrec && j->w == 0 && !j->err) {
+    char *big = calloc(1, 3 << 19);
+    if (!big || cdb_make_writer_add(j->cdbwp, "big", 3, big, 3 << 19) < 0)
+      j->err = big ? errno : ENOMEM;
+    free(big);
+  }
+  if (cdb_make_writer_done(j->cdbwp) < 0 && !j->err)
+    j->err = errno;
+  return NULL;
+}
+
+static void
+mkdb_n(const char *dbname, unsigned flags, unsigned ndup, unsigned nkeys) {
+  struct cdb_make cdbm;
+  char key[32], val[64];
+  unsigned i, n;
+  FILE *sf = NULL;
+  int fd = open(dbname, O_RDWR|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0 || cdb_make_start_ex(&cdbm, fd, flags) < 0)
+    error(dbname);
+  cdb_make_threads(&cdbm, mthreads);
+  if (memlimit &&
+      (!(sf = tmpfile()) ||
+       cdb_make_memlimit(&cdbm, memlimit, fileno(sf)) < 0))
+    error("cdb_make_memlimit");
+  if (nwriters) {
+    pthread_t th[16];
+    struct wjob j[16];
+    for(i = 0; i < nwriters; ++i) {
+      j[i].w = i;
+      j[i].nkeys = nkeys;
+      j[i].ndup = ndup;
+      if (!(j[i].cdbwp = cdb_make_writer_new(&cdbm)))
+        error("cdb_make_writer_new");
+    }
+    /* the handle is the writers' now */
+    if (cdb_make_add(&cdbm, "k", 1, "v", 1) == 0 || errno != EINVAL ||
+        cdb_make_exists(&cdbm, "k", 1) == 0 || errno != EINVAL)
+      error("cdb_make_add with writers");
+    for(i = 0; i < nwriters; ++i)
+      if ((errno = pthread_create(&th[i], NULL, wworker, &j[i])))
+        error("pthread_create");
+    for(i = 0; i < nwriters; ++i)
+      pthread_join(th[i], NULL);
+    for(i = 0; i < nwriters; ++i)
+      if ((errno = j[i].err))
+        error("cdb_make_writer_add");
+  }
+  else
+    /* interleave duplicates so they land at different positions */
+    for(n = 0; n < ndup; ++n)
+      for(i = 0; i < nkeys; ++i)
+        if (n <= i % 4 &&
+            cdb_make_add(&cdbm, key, mkkey(key, i),
+                         val, sprintf(val, "value-%u-%u", i, n)) < 0)
+          error(dbname);
+  if (cdb_make_finish(&cdbm) < 0 || close(fd) < 0)
+    error(dbname);
+  if (sf)
+    fclose(sf);
+}
+
+static void
+mkdb(const char *dbname, unsigned flags, unsigned ndup) {
+  mkdb_n(dbname, flags, ndup, NKEYS);
+}
+
+/* every key must have its records in order, and the big one must be
+ * there if made */
+static unsigned
+check(unsigned nkeys, unsigned ndup) {
+  struct cdb_find cdbf;
+  char key[32], val[64];
+  unsigned i, n, l, errs = 0;
+  for(i = 0; i < nkeys; ++i) {
+    unsigned klen = mkkey(key, i);
+    if (cdb_findinit(&cdbf, &cdb, key, klen) < 0)
+      ++errs;
+    for(n = 0; cdb_findnext(&cdbf) > 0; ++n) {
+      l = sprintf(val, "value-%u-%u", i, n);
+      if (cdb_datalen(&cdb) != l ||
+          memcmp(cdb_get(&cdb, l, cdb_datapos(&cdb)), val, l) != 0)
+        ++errs;
+    }
+    if (n != (ndup < i % 4 + 1 ? ndup : i % 4 + 1))
+      ++errs;
+  }
+  if (bigrec &&
+      (cdb_find(&cdb, "big", 3) != 1 || cdb_datalen(&cdb) != 3 << 19))
+    ++errs;
+  return errs;
+}
+
+/* the same records made by more and more writers */
+static unsigned
+scale(const char *dbname, unsigned nkeys) {
+  struct timespec t0, t1;
+  unsigned errs = 0, e;
+  int fd;
+  bigrec = 1;
+  for(nwriters = 1; nwriters <= 16; nwriters <<= 1) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    mkdb_n(dbname, 0, 2, nkeys);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if ((fd = open(dbname, O_RDONLY)) < 0 || cdb_init(&cdb, fd) < 0)
+      error(dbname);
+    errs += e = check(nkeys, 2);
+    printf("%s: %u keys, %u writers: %.3fs, %u errors\n", dbname, nkeys,
+           nwriters, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9,
+           e);
+    cdb_free(&cdb);
+    close(fd);
+  }
+  nwriters = bigrec = 0;
+  return errs;
+}
+
+/* tables far larger than the memory limit, built in slices */
+static unsigned
+sliced(const char *dbname, unsigned nkeys) {
+  unsigned errs;
+  int fd;
+  memlimit = 4096;
+  mkdb_n(dbname, 0, 2, nkeys);
+  if ((fd = open(dbname, O_RDONLY)) < 0 || cdb_init(&cdb, fd) < 0)
+    error(dbname);
+  errs = check(nkeys, 2);
+  printf("%s: %u keys, memory limit %u: %u errors\n", dbname, nkeys,
+         (unsigned)memlimit, errs);
+  cdb_free(&cdb);
+  close(fd);
+  memlimit = 0;
+  return errs;
+}
+
+/* the same records copied from a database in runs, large and small,
+ * some added one by one instead, with the key index made half way */
+static unsigned
+copied(const char *dbname, unsigned flags) {
+  struct cdb src;
+  struct cdb_make cdbm;
+  struct cdb_kv kv;
+  char cname[256], key[32];
+  cdbo_t pos, run;
+  unsigned k, errs = 0;
+  int sfd, fd;
+
+  mkdb(dbname, flags, 4);
+  snprintf(cname, sizeof(cname), "%s.copy", dbname);
+  if ((sfd = open(dbname, O_RDONLY)) < 0 || cdb_init(&src, sfd) < 0)
+    error(dbname);
+  fd = open(cname, O_RDWR|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0 || cdb_make_start_ex(&cdbm, fd, flags) < 0)
+    error(cname);
+  if (cdb_make_copy_range(&cdbm, &src, 2049, (cdbo_t)-1) == 0 ||
+      errno != EINVAL)
+    ++errs;
+  cdb_seqinit(&pos, &src);
+  for(run = pos, k = 0; cdb_seqnext_r(&pos, &src, &kv) > 0; ++k) {
+    if (k >= 300 && k < 12300)
+      continue;			/* one run over most of the data */
+    if (k % 5 == 0) {
+      if (cdb_make_copy_range(&cdbm, &src, run, kv.cdb_kpos - 8) < 0 ||
+          cdb_make_add(&cdbm, cdb_get(&src, kv.cdb_klen, kv.cdb_kpos),
+                       kv.cdb_klen, cdb_get(&src, kv.cdb_vlen, kv.cdb_vpos),
+                       kv.cdb_vlen) < 0)
+        error(cname);
+      run = pos;
+    }
+    else if (k % 3 == 0) {
+      if (cdb_make_copy_range(&cdbm, &src, run, pos) < 0)
+        error(cname);
+      run = pos;
+    }
+    if (k == 100 && cdb_make_exists(&cdbm, key, mkkey(key, 1)) != 1)
+      ++errs;
+  }
+  if (cdb_make_copy_range(&cdbm, &src, run, (cdbo_t)-1) < 0)
+    error(cname);
+  if (cdb_make_exists(&cdbm, key, mkkey(key, NKEYS - 1)) != 1)
+    ++errs;
+  if (cdb_make_finish(&cdbm) < 0 || close(fd) < 0)
+    error(cname);
+  cdb_free(&src);
+  close(sfd);
+  if ((fd = open(cname, O_RDONLY)) < 0 || cdb_init(&cdb, fd) < 0)
+    error(cname);
+  errs += check(NKEYS, 4);
+  printf("%s: %u records copied in runs: %u errors\n", cname, k, errs);
+  cdb_free(&cdb);
+  close(fd);
+  unlink(cname);
+  return errs;
+}
+
+/* value of key i in the stack made by stacked(), NULL if deleted */
+static const char *
+stackval(char *buf, unsigned i) {
+  if (i >= NKEYS)		/* none-*, added by layer 1 */
+    return i - NKEYS < 10 ? NULL : (sprintf(buf, "new-%u", i), buf);
+  if (i % 22 == 0)
+    return sprintf(buf, "again-%u", i), buf;
+  if (i % 13 == 0 || i % 11 == 0)
+    return NULL;
+  if (i % 7 == 0)
+    return sprintf(buf, "new-%u", i), buf;
+  if (i % 17 == 0)
+    return NULL;
+  return sprintf(buf, "value-%u-0", i), buf;
+}
+
+/* a base and two layers of changes, the second one with records
+ * removed before a tombstone, a copy of it, and the layers merged */
+static unsigned
+stacked(const char *dbname, unsigned flags) {
+  struct cdb c[3], cc, mc[2];
+  const struct cdb *layers[3], *ls[3], *cdbp;
+  struct cdb_stack st;
+  struct cdb_stack_seq ss;
+  struct cdb_make cdbm;
+  struct cdb_kv kv;
+  char lname[3][256], cname[256], mname[2][256], key[32], val[64];
+  const char *v;
+  unsigned i, l, n, pass, nlive = 0, ntomb = 0, errs = 0;
+  int fd[3], cfd, mfd[2];
+
+  mkdb(dbname, flags, 1);
+  for(l = 1; l < 3; ++l) {
+    snprintf(lname[l], sizeof(lname[l]), "%s.%u", dbname, l);
+    fd[l] = open(lname[l], O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (fd[l] < 0 || cdb_make_start_ex(&cdbm, fd[l], flags) < 0)
+      error(lname[l]);
+    if (l == 2 && cdb_make_add(&cdbm, "junk", 4, "x", 1) < 0)
+      error(lname[l]);
+    for(i = 0; i < NKEYS + 100; ++i) {
+      unsigned klen = mkkey(key, i);
+      int r = 0;
+      if (l == 1 && i >= NKEYS)
+        r = cdb_make_add(&cdbm, key, klen, val, sprintf(val, "new-%u", i));
+      else if (l == 2 && i >= NKEYS) {
+        if (i - NKEYS < 10)
+          r = (++ntomb, cdb_make_tombstone(&cdbm, key, klen));
+      }
+      else if (l == 1 && i % 11 == 0)
+        r = cdb_make_tombstone(&cdbm, key, klen);
+      else if (l == 1 && i % 7 == 0)
+        r = cdb_make_add(&cdbm, key, klen, val, sprintf(val, "new-%u", i));
+      else if (l == 1 && i % 17 == 0)	/* the tombstone goes first */
+        r = cdb_make_tombstone(&cdbm, key, klen) < 0 ? -1 :
+          cdb_make_add(&cdbm, key, klen, "zombie", 6);
+      else if (l == 2 && i % 22 == 0)
+        r = cdb_make_add(&cdbm, key, klen, val, sprintf(val, "again-%u", i));
+      else if (l == 2 && i % 13 == 0)
+        r = (++ntomb, cdb_make_tombstone(&cdbm, key, klen));
+      if (r < 0)
+        error(lname[l]);
+    }
+    if (l == 2 &&
+        (cdb_make_tombstone(&cdbm, "ghost", 5) < 0 ||
+         cdb_make_find(&cdbm, "ghost", 5, CDB_FIND_REMOVE) != 1 ||
+         cdb_make_find(&cdbm, "junk", 4, CDB_FIND_REMOVE) != 1))
+      error(lname[l]);
+    if (cdb_make_finish(&cdbm) < 0 || close(fd[l]) < 0)
+      error(lname[l]);
+  }
+
+  for(l = 0; l < 3; ++l) {
+    if ((fd[l] = open(l ? lname[l] : dbname, O_RDONLY)) < 0 ||
+        cdb_init(&c[l], fd[l]) < 0)
+      error(l ? lname[l] : dbname);
+    layers[l] = &c[l];
+  }
+  /* tombstones are empty values to plain lookups */
+  if (cdb_find_r(&c[1], key, mkkey(key, 11), &kv) != 1 || kv.cdb_vlen ||
+      !cdb_tombstone(&c[1], &kv) || c[2].cdb_tcnt != ntomb ||
+      cdb_find_r(&c[2], "ghost", 5, &kv) != 0)
+    ++errs;
+  /* the same with the last layer copied, tombstones and all */
+  snprintf(cname, sizeof(cname), "%s.copy", dbname);
+  if ((cfd = open(cname, O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0 ||
+      cdb_make_start_ex(&cdbm, cfd, flags) < 0 ||
+      cdb_make_copy_range(&cdbm, &c[2], 2048, (cdbo_t)-1) < 0 ||
+      cdb_make_finish(&cdbm) < 0 || cdb_init(&cc, cfd) < 0)
+    error(cname);
+  /* the two layers merged, keeping tombstones for the base below, and
+   * all of it merged down to one database without them */
+  for(l = 0; l < 2; ++l) {
+    snprintf(mname[l], sizeof(mname[l]), "%s.merge%u", dbname, l);
+    cdb_stack_init(&st, l ? layers : layers + 1, l ? 3 : 2);
+    if ((mfd[l] = open(mname[l], O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0 ||
+        cdb_make_start_ex(&cdbm, mfd[l], flags) < 0 ||
+        cdb_make_merge(&cdbm, &st, !l) < 0 ||
+        cdb_make_finish(&cdbm) < 0 || cdb_init(&mc[l], mfd[l]) < 0)
+      error(mname[l]);
+  }
+  if (!mc[0].cdb_tcnt || mc[1].cdb_tcnt)
+    ++errs;
+  for(pass = 0; pass < 4; ++pass) {
+    ls[0] = pass < 3 ? &c[0] : &mc[1];
+    ls[1] = pass < 2 ? &c[1] : &mc[0];
+    ls[2] = pass ? &cc : &c[2];
+    cdb_stack_init(&st, ls, pass < 2 ? 3 : pass < 3 ? 2 : 1);
+    for(i = 0, nlive = 0; i < NKEYS + 100; ++i) {
+      unsigned klen = mkkey(key, i);
+      int r = cdb_stack_find(&st, key, klen, &kv, &cdbp);
+      if (!(v = stackval(val, i)) ? r != 0 :
+          r != 1 || kv.cdb_vlen != strlen(v) ||
+          memcmp(cdb_get(cdbp, kv.cdb_vlen, kv.cdb_vpos), v, kv.cdb_vlen))
+        ++errs;
+      if (v)
+        ++nlive;
+    }
+    /* every live key once, with its value */
+    cdb_stack_seqinit(&ss, &st);
+    for(n = 0; cdb_stack_seqnext(&ss, &st, &kv, &cdbp) > 0; ++n) {
+      const char *k = cdb_get(cdbp, kv.cdb_klen, kv.cdb_kpos);
+      i = (unsigned)atoi(k + (k[0] == 'k' ? 4 : 5));
+      if (!(v = stackval(val, i)) || kv.cdb_vlen != strlen(v) ||
+          memcmp(cdb_get(cdbp, kv.cdb_vlen, kv.cdb_vpos), v, kv.cdb_vlen))
+        ++errs;
+    }
+    if (n != nlive)
+      ++errs;
+  }
+  printf("%s: %u keys in 3 layers, %u live: %u errors\n",
+         dbname, NKEYS + 100, n, errs);
+  for(l = 0; l < 3; ++l) {
+    cdb_free(&c[l]);
+    close(fd[l]);
+    if (l)
+      unlink(lname[l]);
+  }
+  cdb_free(&cc);
+  close(cfd);
+  unlink(cname);
+  for(l = 0; l < 2; ++l) {
+    cdb_free(&mc[l]);
+    close(mfd[l]);
+    unlink(mname[l]);
+  }
+  return errs;
+}
+
+/* sharded sets, filled by several threads */
+struct sfill { struct cdb_make_shards *smp; unsigned t, gen; };
+
+static void *
+sfiller(void *arg) {
+  struct sfill *f = (struct sfill *)arg;
+  char key[32], val[32];
+  unsigned i;
+  for(i = f->t; i < NKEYS; i += 4)
+    if (cdb_make_shards_add(f->smp, key, mkkey(key, i),
+                            val, sprintf(val, "val-%u-%u", f->gen, i)) < 0)
+      return (void*)1;
+  return NULL;
+}
+
+struct sscan { const struct cdb_shards *sh; unsigned n, errs, stop; };
+
+/* every record must be in the shard it routes to */
+static int
+sscanfn(void *arg, const struct cdb *cdbp, const struct cdb_kv *kv) {
+  struct sscan *s = (struct sscan *)arg;
+  const void *k = cdb_get(cdbp, kv->cdb_klen, kv->cdb_kpos);
+  if (cdb_shards_route(s->sh, cdb_hash(k, kv->cdb_klen)) != cdbp)
+    __atomic_add_fetch(&s->errs, 1, __ATOMIC_RELAXED);
+  if (__atomic_add_fetch(&s->n, 1, __ATOMIC_RELAXED) == s->stop)
+    return 5;
+  return 0;
+}
+
+static unsigned
+sharded(const char *dbname, unsigned bits, unsigned flags) {
+  struct cdb_shards sh;
+  struct cdb_make cdbm;
+  struct cdb_kv kv;
+  const struct cdb *cdbp;
+  struct sscan ss;
+  struct sfill f[4];
+  pthread_t th[4];
+  char mname[200], fname[2][256], rname[256], key[32], val[32];
+  unsigned i, t, gen, s = 3 % (1u << bits), errs = 0;
+  void *r;
+  int fd;
+
+  snprintf(mname, sizeof(mname), "%s.set", dbname);
+  unlink(mname);
+  /* two builds, the second one replacing the files of the first */
+  for(gen = 1; gen <= 2; ++gen) {
+    if (!(f[0].smp = cdb_make_shards_new(mname, bits, flags)))
+      error(mname);
+    for(t = 0; t < 4; ++t) {
+      f[t].smp = f[0].smp; f[t].t = t; f[t].gen = gen;
+      if (pthread_create(&th[t], NULL, sfiller, &f[t]) != 0)
+        error("pthread_create");
+    }
+    for(t = 0; t < 4; ++t)
+      if (pthread_join(th[t], &r) != 0 || r)
+        error(mname);
+    if (cdb_make_shards_finish(f[0].smp, 4) < 0)
+      error(mname);
+    snprintf(fname[gen - 1], sizeof(fname[0]), "%s.%u.%u", mname, gen, s);
+  }
+  if (access(fname[0], F_OK) == 0)
+    ++errs;
+
+  /* one shard rebuilt on its own, with other values */
+  snprintf(rname, sizeof(rname), "%s.rebuilt", mname);
+  if ((fd = open(rname, O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0 ||
+      cdb_make_start_ex(&cdbm, fd, flags) < 0)
+    error(rname);
+  for(i = 0; i < NKEYS; ++i) {
+    unsigned klen = mkkey(key, i);
+    if (cdb_shard(cdb_hash(key, klen), bits) == s &&
+        cdb_make_add(&cdbm, key, klen, val, sprintf(val, "new-%u", i)) < 0)
+      error(rname);
+  }
+  if (cdb_make_finish(&cdbm) < 0 || close(fd) < 0 ||
+      cdb_shards_replace(mname, s, strrchr(rname, '/') ?
+                         strrchr(rname, '/') + 1 : rname, flags) < 0)
+    error(rname);
+  if (access(fname[1], F_OK) == 0)
+    ++errs;
+
+  if (cdb_shards_open(&sh, mname, 0) < 0)
+    error(mname);
+  for(i = 0; i < NKEYS + NMISS; ++i) {
+    unsigned klen = mkkey(key, i);
+    int rr = cdb_shards_find(&sh, key, klen, &kv, &cdbp);
+    unsigned vlen = cdb_shard(cdb_hash(key, klen), bits) == s ?
+      sprintf(val, "new-%u", i) : sprintf(val, "val-2-%u", i);
+    if (i < NKEYS ? rr != 1 || kv.cdb_vlen != vlen ||
+        memcmp(cdb_get(cdbp, vlen, kv.cdb_vpos), val, vlen) : rr != 0)
+      ++errs;
+  }
+  /* the whole set, and a scan stopped early */
+  ss.sh = &sh; ss.n = ss.errs = 0; ss.stop = 0;
+  if (cdb_shards_scan(&sh, 4, sscanfn, &ss) != 0 || ss.n != NKEYS)
+    ++errs;
+  errs += ss.errs;
+  ss.n = 0; ss.stop = NKEYS / 2;
+  if (cdb_shards_scan(&sh, 4, sscanfn, &ss) != 5 || ss.n >= NKEYS)
+    ++errs;
+  printf("%s: %u keys in %u shards: %u errors\n",
+         mname, NKEYS, 1u << bits, errs);
+  cdb_shards_close(&sh);
+
+  for(i = 0; i < 1u << bits; ++i) {
+    snprintf(fname[0], sizeof(fname[0]), "%s.2.%u", mname, i);
+    unlink(fname[0]);
+  }
+  unlink(rname);
+  unlink(mname);
+  return errs;
+}
+
+/* a database replaced over and over while threads read it */
+#define NLIVE	200	/* keys, all with the value of the generation */
+
+struct lread { struct cdb_live *lp; unsigned stop, errs, gets; };
+
+static void
+mklive(const char *dbname, unsigned gen) {
+  struct cdb_make cdbm;
+  char tmp[280], key[32], val[32];
+  unsigned i, vlen = sprintf(val, "%u", gen);
+  int fd;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", dbname);
+  if ((fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0 ||
+      cdb_make_start(&cdbm, fd) < 0)
+    error(tmp);
+  for(i = 0; i < NLIVE; ++i)
+    if (cdb_make_add(&cdbm, key, mkkey(key, i), val, vlen) < 0)
+      error(tmp);
+  if (cdb_make_finish(&cdbm) < 0 || close(fd) < 0 || rename(tmp, dbname) < 0)
+    error(tmp);
+}
+
+/* the value of key i, or 0 */
+static unsigned
+liveval(const struct cdb *cdbp, unsigned i) {
+  struct cdb_kv kv;
+  char key[32], val[32];
+  if (cdb_find_r(cdbp, key, mkkey(key, i), &kv) != 1 || kv.cdb_vlen > 30)
+    return 0;
+  memcpy(val, cdb_get(cdbp, kv.cdb_vlen, kv.cdb_vpos), kv.cdb_vlen);
+  val[kv.cdb_vlen] = '\0';
+  return (unsigned)atoi(val);
+}
+
+/* all keys of a file come with the same generation, never older than
+ * the one seen before */
+static void *
+lreader(void *arg) {
+  struct lread *l = (struct lread *)arg;
+  const struct cdb *cdbp;
+  unsigned i, g, last = 0, errs = 0, n = 0;
+  while(!__atomic_load_n(&l->stop, __ATOMIC_ACQUIRE)) {
+    cdbp = cdb_live_get(l->lp);
+    if ((g = liveval(cdbp, n % NLIVE)) < last)
+      ++errs;
+    for(i = n % 7; i < NLIVE; i += 7)
+      if (liveval(cdbp, i) != g)
+        ++errs;
+    cdb_live_put(l->lp, cdbp);
+    last = g;
+    ++n;
+  }
+  __atomic_add_fetch(&l->errs, errs, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&l->gets, n, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static unsigned
+live(const char *dbname) {
+  struct lread l;
+  pthread_t th[4];
+  const struct cdb *cdbp;
+  unsigned gen, t, errs = 0;
+
+  mklive(dbname, 1);
+  if (!(l.lp = cdb_live_open(dbname, 0, 1)))
+    error(dbname);
+  l.stop = l.errs = l.gets = 0;
+  for(t = 0; t < 4; ++t)
+    if (pthread_create(&th[t], NULL, lreader, &l) != 0)
+      error("pthread_create");
+  /* replaced files are noticed by the readers, or reloaded here */
+  for(gen = 2; gen <= 100; ++gen) {
+    mklive(dbname, gen);
+    if (gen % 3 == 0 && cdb_live_reload(l.lp) < 0)
+      error(dbname);
+    usleep(1000);
+  }
+  /* the file in use stays while referenced, readers noticing the new
+   * one or not */
+  if (cdb_live_reload(l.lp) < 0)
+    error(dbname);
+  cdbp = cdb_live_get(l.lp);
+  mklive(dbname, gen);
+  if (cdb_live_reload(l.lp) < 0 || liveval(cdbp, 0) != gen - 1)
+    ++errs;
+  cdb_live_put(l.lp, cdbp);
+  __atomic_store_n(&l.stop, 1, __ATOMIC_RELEASE);
+  for(t = 0; t < 4; ++t)
+    pthread_join(th[t], NULL);
+  cdbp = cdb_live_get(l.lp);
+  if (cdb_live_reload(l.lp) != 0 || liveval(cdbp, NLIVE - 1) != gen)
+    ++errs;
+  cdb_live_put(l.lp, cdbp);
+  errs += l.errs;
+  printf("%s: replaced %u times during %u reads: %u errors\n",
+         dbname, gen - 1, l.gets, errs);
+  cdb_live_close(l.lp);
+  return errs;
+}
+
+static unsigned
+test(const char *dbname) {
+  pthread_t th[NTHREADS];
+  unsigned i, n, errs = 0;
+  char key[32];
+  struct cdb_find cdbf;
+  cdbo_t pos;
+  void *r;
+  int fd = open(dbname, O_RDONLY);
+
+  if (fd < 0 || cdb_init_ex(&cdb, fd, iflags) < 0 ||
+      cdb_pread_init(&pcdb, fd, pcache) < 0)
+    error(dbname);
+
+  /* expected results, using the plain routines */
+  first = malloc(NKEYS * sizeof(*first));
+  all = malloc(NKEYS * 4 * sizeof(*all));
+  nall = malloc(NKEYS * sizeof(*nall));
+  seq = malloc(NKEYS * 4 * sizeof(*seq));
+  if (!first || !all || !nall || !seq)
+    error("malloc");
+  for(i = 0; i < NKEYS; ++i) {
+    unsigned klen = mkkey(key, i);
+    if (cdb_find(&cdb, key, klen) != 1)
+      error("cdb_find");
+    save(&first[i], &cdb);
+    cdb_findinit(&cdbf, &cdb, key, klen);
+    for(n = 0; cdb_findnext(&cdbf) > 0; ++n)
+      save(&all[i * 4 + n], &cdb);
+    nall[i] = n;
+  }
+  if (nwriters)
+    errs += check(NKEYS, 4);
+  cdb_seqinit(&pos, &cdb);
+  memset(npfx, 0, sizeof(npfx));
+  for(nseq = 0; cdb_seqnext64(&pos, &cdb) > 0; ++nseq) {
+    save(&seq[nseq], &cdb);
+    ++npfx[((const char*)cdb_getkey(&cdb))[4] - '0'];
+  }
+
+  for(i = 0; i < NTHREADS; ++i)
+    if ((errno = pthread_create(&th[i], NULL, worker, (void*)(size_t)i)))
+      error("pthread_create");
+  for(i = 0; i < NTHREADS; ++i) {
+    pthread_join(th[i], &r);
+    errs += (unsigned)(size_t)r;
+  }
+  errs += atest(0, 64);
+  errs += atest(CDB_ASYNC_NOURING, 7);
+  printf("%s: %u records, %u threads: %u errors\n",
+         dbname, nseq, NTHREADS, errs);
+
+  cdb_free(&cdb);
+  cdb_pread_free(&pcdb);
+  close(fd);
+  free(first); free(all); free(nall); free(seq);
+  return errs;
+}
+
+int
+main(int argc, char **argv) {
+  const char *dbname = argc > 1 ? argv[1] : "tests-mt.cdb";
+  unsigned errs;
+
+  progname = argv[0];
+  if (!(pcache = cdb_cache_new(128 * 1024, 1024, 4)))
+    error("cdb_cache_new");
+  mkdb(dbname, 0, 4);
+  errs = test(dbname);
+  mkdb(dbname, CDB_MAKE_64BIT, 4);
+  errs += test(dbname);
+  mkdb(dbname, CDB_MAKE_BUCKETS, 4);
+  errs += test(dbname);
+  mkdb(dbname, CDB_MAKE_MPH, 1);	/* unique keys: perfect hash */
+  errs += test(dbname);
+  mkdb(dbname, CDB_MAKE_MPH, 4);	/* duplicates: falls back */
+  errs += test(dbname);
+  mkdb(dbname, CDB_MAKE_FILTER, 4);
+  errs += test(dbname);
+  mkdb(dbname, CDB_MAKE_BUCKETS | CDB_MAKE_FILTER, 4);
+  errs += test(dbname);
+  mkdb(dbname, CDB_MAKE_MPH | CDB_MAKE_FILTER, 1);
+  errs += test(dbname);
+  mkdb(dbname, CDB_MAKE_ORDER, 4);
+  errs += test(dbname);
+  mkdb(dbname, CDB_MAKE_MPH | CDB_MAKE_ORDER, 1);
+  errs += test(dbname);
+  mkdb(dbname, 0, 4);
+  iflags = CDB_INIT_POPULATE | CDB_INIT_RANDOM | CDB_INIT_HUGEPAGE;
+  errs += test(dbname);
+  mkdb(dbname, CDB_MAKE_BUCKETS, 4);
+  iflags = CDB_INIT_PREFAULT | CDB_INIT_WILLNEED | CDB_INIT_RANDOM;
+  errs += test(dbname);
+  iflags = 0;
+  mthreads = 4;
+  mkdb(dbname, 0, 4);
+  errs += test(dbname);
+  mkdb(dbname, CDB_MAKE_64BIT | CDB_MAKE_FILTER, 4);
+  errs += test(dbname);
+  mthreads = 0;
+  nwriters = 5;
+  mkdb(dbname, 0, 4);
+  errs += test(dbname);
+  mkdb(dbname, CDB_MAKE_BUCKETS | CDB_MAKE_ORDER, 4);
+  errs += test(dbname);
+  nwriters = 0;
+  errs += scale(dbname, 200000);
+  memlimit = 4096;
+  mkdb(dbname, 0, 4);
+  errs += test(dbname);
+  nwriters = 5;
+  mkdb(dbname, CDB_MAKE_64BIT, 4);
+  errs += test(dbname);
+  nwriters = 0;
+  errs += sliced(dbname, 200000);
+  errs += copied(dbname, 0);
+  errs += copied(dbname, CDB_MAKE_64BIT);
+  errs += copied(dbname, CDB_MAKE_BUCKETS);
+  errs += stacked(dbname, 0);
+  errs += stacked(dbname, CDB_MAKE_BUCKETS);
+  errs += stacked(dbname, CDB_MAKE_FILTER | CDB_MAKE_ORDER);
+  errs += sharded(dbname, 0, 0);
+  errs += sharded(dbname, 4, CDB_MAKE_BUCKETS | CDB_MAKE_SYNC);
+  errs += live(dbname);
+  cdb_cache_free(pcache);
+  pcache = NULL;		/* pread reader without cache */
+  mkdb(dbname, CDB_MAKE_64BIT, 4);
+  errs += test(dbname);
+  unlink(dbname);
+  return errs ? 1 : 0;
+}
@@ -70,6 +70,11 @@ $cdb -q 1.cdb b
 echo "
 "$?
 
+echo Querying several keys
+$cdb -q 1.cdb b a b
+echo "
+"$?
+
 echo Dumping and re-creating db
 $cdb -d 1.cdb | $cdb -c 1a.cdb
 echo $?
@@ -121,6 +126,333 @@ echo Handling file size limits
  echo $?
 )
 
+echo Create simple 64-bit db
+echo "+3,4:one->here
++1,1:a->b
++1,3:b->abc
++3,4:one->also
+
+" | $cdb -c -x 1.cdb
+echo $?
+do_csum 1.cdb
+
+echo Dump simple 64-bit db
+$cdb -d 1.cdb
+echo $?
+
+echo Stats for simple 64-bit db
+$cdb -s 1.cdb
+echo $?
+
+echo "Query simple 64-bit db (two records match)"
+$cdb -q 1.cdb one
+echo "
+$?"
+
+echo Query 64-bit db for non-existed key
+$cdb -q 1.cdb none
+echo $?
+
+echo Querying several keys in 64-bit db
+$cdb -q -m 1.cdb b none one a
+echo $?
+
+echo Dumping and re-creating 64-bit db
+$cdb -d - < 1.cdb | $cdb -c -x 1a.cdb
+echo $?
+cmp 1.cdb 1a.cdb
+
+echo Create db with bucketed index
+echo "+3,4:one->here
++1,1:a->b
++1,3:b->abc
++3,4:one->also
+
+" | $cdb -c -b 1.cdb
+echo $?
+do_csum 1.cdb
+
+echo Stats for db with bucketed index
+$cdb -s 1.cdb
+echo $?
+
+echo "Query db with bucketed index (two records match)"
+$cdb -q 1.cdb one
+echo "
+$?"
+$cdb -q -n 2 1.cdb one
+echo "
+$?"
+
+echo Querying several keys in db with bucketed index
+$cdb -q -m 1.cdb b none one a
+echo $?
+
+echo Dumping and re-creating db with bucketed index
+$cdb -d 1.cdb | $cdb -c -b 1a.cdb
+echo $?
+cmp 1.cdb 1a.cdb
+
+echo Create db with perfect hash index
+echo "+3,4:one->here
++1,1:a->b
++1,3:b->abc
++3,4:two->also
+
+" | $cdb -c -P 1.cdb
+echo $?
+do_csum 1.cdb
+
+echo Stats for db with perfect hash index
+$cdb -s 1.cdb
+echo $?
+
+echo Querying several keys in db with perfect hash index
+$cdb -q -m 1.cdb b none one two a
+echo $?
+
+echo Dumping and re-creating db with perfect hash index
+$cdb -d 1.cdb | $cdb -c -P 1a.cdb
+echo $?
+cmp 1.cdb 1a.cdb
+
+echo "Perfect hash index with duplicate keys (bucketed index used)"
+echo "+3,4:one->here
++3,4:one->also
+
+" | $cdb -c -P 1.cdb
+echo $?
+$cdb -s 1.cdb | sed -n 4p
+$cdb -q -n 2 1.cdb one
+echo "
+$?"
+
+echo Create db with negative lookup filter
+echo "+3,4:one->here
++1,1:a->b
++1,3:b->abc
++3,4:one->also
+
+" | $cdb -c -F 1.cdb
+echo $?
+do_csum 1.cdb
+
+echo Stats for db with negative lookup filter
+$cdb -s 1.cdb | sed -n '1,6p'
+echo $?
+
+echo "Query db with negative lookup filter (two records match)"
+$cdb -q -n 2 1.cdb one
+echo "
+$?"
+$cdb -q 1.cdb none
+echo $?
+
+echo Querying several keys in db with filter and bucketed index
+$cdb -d 1.cdb | $cdb -c -b -F 1a.cdb
+$cdb -q -m 1a.cdb b none one a
+echo $?
+
+echo Querying several keys in db with filter and perfect hash index
+$cdb -d 1.cdb | $cdb -c -u -P -F 1a.cdb
+$cdb -q -m 1a.cdb b none one a
+echo $?
+
+echo Dumping and re-creating db with negative lookup filter
+$cdb -d 1.cdb | $cdb -c -F 1a.cdb
+echo $?
+cmp 1.cdb 1a.cdb
+
+echo Create db with ordered key index
+echo "+3,4:one->here
++1,1:a->b
++1,3:b->abc
++3,4:one->also
++0,5:->empty
++2,3:on->two
++9,4:onesmorea->nine
++8,5:onesmore->eight
+
+" | $cdb -c -O 1.cdb
+echo $?
+do_csum 1.cdb
+
+echo Stats for db with ordered key index
+$cdb -s 1.cdb | sed -n '1,4p'
+echo $?
+
+echo Prefix query in db with ordered key index
+$cdb -q --prefix 1.cdb on
+echo $?
+
+echo Prefix query in map format
+$cdb -q --prefix -m 1.cdb onesmore
+echo $?
+
+echo Empty prefix query lists all records in key order
+$cdb -q --prefix -m 1.cdb ""
+echo $?
+
+echo Prefix query with no match
+$cdb -q --prefix 1.cdb none
+echo $?
+
+echo Dumping and re-creating db with ordered key index
+$cdb -d 1.cdb | $cdb -c -O 1a.cdb
+echo $?
+cmp 1.cdb 1a.cdb
+
+echo Prefix query in db with ordered index and perfect hash index
+$cdb -d 1.cdb | $cdb -c -u -P -F -O 1a.cdb
+$cdb -q --prefix -m 1a.cdb one
+echo $?
+$cdb -q -m 1a.cdb b none one a
+echo $?
+
+echo Prefix query in db without ordered key index
+echo | $cdb -c -b 1a.cdb
+$cdb -q --prefix 1a.cdb on
+echo $?
+
+echo Building hash tables with several threads
+$cdb -d 1.cdb | $cdb -c -j 4 1a.cdb
+$cdb -d 1.cdb | $cdb -c 1b.cdb
+cmp 1a.cdb 1b.cdb
+echo $?
+$cdb -d 1.cdb | $cdb -c -x -j 3 1a.cdb
+$cdb -d 1.cdb | $cdb -c -x 1b.cdb
+cmp 1a.cdb 1b.cdb
+echo $?
+$cdb -c -j 0 1a.cdb </dev/null
+echo $?
+
+echo Creating db with repeated keys
+dupin() {
+ for i in 0 1 2 3 4 5 6 7 8 9 ; do
+  for j in 0 1 2 3 4 5 6 7 8 9 ; do
+   for k in 0 1 2 3 4 5 6 7 8 9 ; do
+    echo "+2,4:k$k->v$i$j$k"
+    echo "+3,4:k$j$k->w$i$j$k"
+   done
+  done
+ done
+ echo
+}
+for m in -r -0 -u -w ; do
+ echo "mode $m"
+ dupin | $cdb -c $m 1.cdb 2>/dev/null
+ echo $?
+ do_csum 1.cdb
+ $cdb -q 1.cdb k7 k42 k7
+ echo "
+"$?
+done
+dupin | $cdb -c -e 1.cdb
+echo $?
+
+echo Replacing last record with a shorter one in 64-bit db
+v=; i=0
+while [ $i -lt 500 ]; do v=${v}0123456789; i=`expr $i + 1`; done
+for m in -r -0 ; do
+ echo "+1,5000:a->$v
++1,1:a->x
+" | $cdb -c -x $m 1.cdb
+ $cdb -q 1.cdb a
+ echo " $?"
+done
+
+echo Writing with other buffer sizes and through mmap
+dupin | $cdb -c -r 1b.cdb
+for o in "-B 4096" "-B 5000" "-M" "-M -B 8192" ; do
+ dupin | $cdb -c -r $o 1a.cdb
+ cmp 1a.cdb 1b.cdb
+ echo "$o $?"
+done
+echo "+1,5000:a->$v
++1,1:b->x
+" > 1.cdb.in
+$cdb -c -x 1b.cdb < 1.cdb.in
+for o in "-B 4096" "-B 1024" "-M" "-M -B 1" ; do
+ $cdb -c -x $o 1a.cdb < 1.cdb.in
+ cmp 1a.cdb 1b.cdb
+ echo "$o $?"
+done
+$cdb -c -B 0 1a.cdb < /dev/null
+echo $?
+
+echo Creating db within a memory limit
+dupin | $cdb -c 1b.cdb
+for o in "-L 4096" "-L 64k" "-x -L 4096" ; do
+ dupin | $cdb -c $o 1a.cdb
+ $cdb -d 1a.cdb | $cdb -c 1.cdb
+ cmp 1b.cdb 1.cdb
+ echo "$o $?"
+done
+dupin | $cdb -c -L 4096 1a.cdb
+cmp 1a.cdb 1b.cdb
+echo $?
+$cdb -q 1a.cdb k7 k42
+echo " $?"
+dupin | $cdb -c -r -L 4096 1a.cdb
+echo $?
+dupin | $cdb -c -b -L 4096 1a.cdb
+echo $?
+$cdb -c -L 0 1a.cdb < /dev/null
+echo $?
+
+echo Streaming db to a pipe
+for o in "" "-b" "-F" "-L 4096" ; do
+ dupin | $cdb -c -x $o 1b.cdb
+ dupin | $cdb -c -o - $o | cat > 1a.cdb
+ cmp 1a.cdb 1b.cdb
+ echo "$o $?"
+done
+$cdb -q 1a.cdb k7 k42
+echo " $?"
+dupin > 1.cdb.in
+$cdb -c -o 1a.cdb 1.cdb.in 1.cdb.in
+$cdb -c -x 1b.cdb 1.cdb.in 1.cdb.in
+cmp 1a.cdb 1b.cdb
+echo $?
+$cdb -c -o - -r 1.cdb.in
+echo $?
+$cdb -c -o - -O 1.cdb.in
+echo $?
+
+echo Creating db durably
+dupin | $cdb -c 1b.cdb
+dupin | $cdb -c -D 1a.cdb 2>&1 | sed 's/[0-9][0-9.]*s/Ns/g'
+cmp 1a.cdb 1b.cdb
+echo $?
+dupin | $cdb -c -D -t - 1a.cdb 2>/dev/null
+cmp 1a.cdb 1b.cdb
+echo $?
+dupin | $cdb -c -x 1b.cdb
+dupin | $cdb -c -D -o - 2>/dev/null | cat > 1a.cdb
+cmp 1a.cdb 1b.cdb
+echo $?
+
+echo Copying records of an existing db
+for o in "" "-x" "-b" "-0" "-B 4k" ; do
+ dupin | $cdb -c $o 1b.cdb 2>/dev/null
+ echo | $cdb -c $o -C 1b.cdb 1a.cdb
+ cmp 1a.cdb 1b.cdb
+ echo "$o $?"
+done
+$cdb -q 1a.cdb ""
+echo $?
+dupin | $cdb -c -x 1b.cdb
+echo | $cdb -c -o - -C 1b.cdb | cat > 1a.cdb
+cmp 1a.cdb 1b.cdb
+echo $?
+printf '+2,1:k7->x\n+3,1:k42->y\n\n' | $cdb -c -r -B 4k -C 1b.cdb 1a.cdb
+$cdb -q 1a.cdb k7 k42 k3
+echo " $?"
+$cdb -q -n 2 1a.cdb k7
+echo $?
+$cdb -c -C 1.cdb.nonexistent 1a.cdb < /dev/null
+echo $?
+
 if false ; then # does not work for now, bugs in libc
 echo Handling oom condition
 (
@@ -140,5 +472,5 @@ echo Handling oom condition
 echo $?
 fi
 
-rm -rf 1.cdb 1a.cdb 1.cdb.tmp
+rm -rf 1.cdb 1a.cdb 1b.cdb 1.cdb.tmp 1.cdb.in
 exit 0